@@ -98,25 +98,36 @@ class TranslateLocally(Client):
     async def list_models(self, *, include_remote=False):
         return await self.request("ListModels", {"includeRemote": bool(include_remote)})
 
-    async def translate(self, text, src=None, trg=None, *, model=None, pivot=None, html=False):
+    @staticmethod
+    def _model_spec(src, trg, model, pivot):
         if src and trg:
             if model or pivot:
                 raise InvalidArgumentException("Cannot combine src + trg and model + pivot arguments")
-            spec = {"src": str(src), "trg": str(trg)}
+            return {"src": str(src), "trg": str(trg)}
         elif model:
             if pivot:
-                spec = {"model": str(model), "pivot": str(pivot)}
+                return {"model": str(model), "pivot": str(pivot)}
             else:
-                spec = {"model": str(model)}
+                return {"model": str(model)}
         else:
             raise InvalidArgumentException("Missing src + trg or model argument")
 
+    async def translate(self, text, src=None, trg=None, *, model=None, pivot=None, html=False):
+        spec = self._model_spec(src, trg, model, pivot)
         result = await self.request("Translate", {**spec, "text": str(text), "html": bool(html)})
         return result["target"]["text"]
 
+    async def translate_batch(self, texts, src=None, trg=None, *, model=None, pivot=None, html=False):
+        spec = self._model_spec(src, trg, model, pivot)
+        result = await self.request("TranslateBatch", {**spec, "texts": [str(text) for text in texts], "html": bool(html)})
+        return [target["text"] for target in result["target"]]
+
     async def download_model(self, model_id, *, update=lambda data: None):
         return await self.request("DownloadModel", {"modelID": str(model_id)}, update=update)
 
+    async def stats(self):
+        return await self.request("Stats", {})
+
 
 def first(iterable, *default):
     """Returns the first value of anything iterable, or throws StopIteration
@@ -216,6 +227,15 @@ async def test():
             "Dies wird der letzte Satz des Tages sein.",
         ]
 
+        # Batch translation should give the same results as separate requests
+        batch = await tl.translate_batch([
+            "Hello world!",
+            "Let's translate another sentence to German.",
+            "This will be the last sentence of the day.",
+        ], "en", "de")
+
+        assert batch == [translations[0], translations[1], translations[5]]
+
         # Test bad input
         try:
             await tl.translate("This is impossible to translate", "en", "xx")
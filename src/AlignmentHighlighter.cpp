@@ -1,6 +1,15 @@
 #include "AlignmentHighlighter.h"
 #include "Translation.h"
 #include <QTextBlock>
+#include <algorithm>
+
+namespace {
+
+// Number of different highlight intensities. Nobody can tell apart more than
+// this many shades anyway.
+const int constexpr kProbabilityBuckets = 16;
+
+} // Anonymous namespace
 
 AlignmentHighlighter::AlignmentHighlighter(QObject *parent)
 : QObject(parent)
@@ -15,9 +24,26 @@ AlignmentHighlighter::~AlignmentHighlighter() {
 
 void AlignmentHighlighter::setColor(QColor color) {
 	color_ = color;
+	formats_.clear();
 	highlight(alignments_);
 }
 
+QTextCharFormat const &AlignmentHighlighter::format(float prob) {
+	if (formats_.empty()) {
+		for (int i = 0; i < kProbabilityBuckets; ++i) {
+			QColor color(color_);
+			color.setAlphaF(.5f * i / (kProbabilityBuckets - 1));
+
+			QTextCharFormat format;
+			format.setBackground(QBrush(color));
+			formats_.append(format);
+		}
+	}
+
+	int bucket = qRound(qBound(0.f, prob, 1.f) * (kProbabilityBuckets - 1));
+	return formats_[bucket];
+}
+
 void AlignmentHighlighter::setDocument(QTextDocument *document) {
 	// no-op if this is already the current document
 	if (document == document_.data())
@@ -33,27 +59,40 @@ void AlignmentHighlighter::highlight(QVector<WordAlignment> alignments) {
 }
 
 void AlignmentHighlighter::render(QVector<WordAlignment> alignments) {
-	if (!document_)
+	if (!document_) {
+		formatted_.clear();
 		return;
+	}
 
-	QTextBlock block = document_->end();
-
-	auto alignment = alignments.cbegin();
-
-	// Find first block to touch based on old alignments (we touch them to clear
-	// the old formatting)
-	if (!alignments_.empty())
-		block = document_->findBlock(alignments_.first().begin);
+	// Walk through the alignments in document order. Translation::alignments()
+	// already returns them like that, but stable so the order is kept for those
+	// that start at the same position.
+	std::stable_sort(alignments.begin(), alignments.end(), [](WordAlignment const &a, WordAlignment const &b) {
+		return a.begin < b.begin;
+	});
+
+	// Only the blocks with a highlight, old or new, can change: the old ones
+	// to clear their formatting, the new ones to add it. Everything else in the
+	// document is left alone, so this costs the same however long it is. Old
+	// blocks that were removed from the document since are no longer valid.
+	QVector<QTextBlock> blocks;
+	for (QTextBlock const &block : formatted_)
+		if (block.isValid())
+			blocks.append(block);
+
+	formatted_.clear();
+	for (WordAlignment const &alignment : alignments) {
+		QTextBlock block = document_->findBlock(alignment.begin);
+		if (block.isValid()) {
+			blocks.append(block);
+			formatted_.append(block);
+		}
+	}
 
-	// Find the first block according to new alignments. See which one is earlier.
-	if (alignment != alignments.cend())
-		if (!block.isValid() || alignment->begin < block.position())
-			block = document_->findBlock(alignment->begin);
+	std::sort(blocks.begin(), blocks.end());
+	blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
 
-	// Move through all blocks until the end of the document to figure out whether
-	// alignments fall inside them.
-	// TODO: early stopping based on max(alignments_.last().end alignments.last().end)
-	for (; block != document_->end(); block = block.next()) {
+	for (QTextBlock const &block : blocks) {
 		QTextLayout *layout = block.layout();
 		bool dirty = false;
 
@@ -63,18 +102,15 @@ void AlignmentHighlighter::render(QVector<WordAlignment> alignments) {
 		if (!layout->formats().empty())
 				dirty = true;
 
-		// If we're out of alignments, or ff this block is behind the current
-		// alignment iterator, stop and move to the next block iteration.
+		// The alignments that start inside this block.
 		// Note: assumes a single WordAlignment never spans across QTextBlock.
-		for (; alignment != alignments.cend() && alignment->begin < block.position() + block.length(); ++alignment) {
-			QColor color(color_);
-			color.setAlphaF(.5f * alignment->prob);
-
-			QTextCharFormat format;
-			format.setBackground(QBrush(color));
+		auto alignment = std::lower_bound(alignments.cbegin(), alignments.cend(), static_cast<std::size_t>(block.position()), [](WordAlignment const &alignment, std::size_t position) {
+			return alignment.begin < position;
+		});
 
+		for (; alignment != alignments.cend() && alignment->begin < static_cast<std::size_t>(block.position() + block.length()); ++alignment) {
 			QTextLayout::FormatRange range;
-			range.format = format;
+			range.format = format(alignment->prob);
 			range.start = alignment->begin - block.position();
 			range.length = alignment->end - alignment->begin;
 
@@ -86,7 +122,4 @@ void AlignmentHighlighter::render(QVector<WordAlignment> alignments) {
 				document_->markContentsDirty(block.position(), block.length());
 		}
 	}
-
-	// Note: Not necessarily a bug! e.g. empty document on initialisation.
-	// assert(alignment == alignments.cend());
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "Translation.h"
+#include <QTextBlock>
 #include <QTextDocument>
+#include <QTextCharFormat>
 #include <QColor>
 #include <QPointer>
 
@@ -12,6 +14,14 @@ private:
 	QColor color_;
 	QVector<WordAlignment> alignments_;
 
+	// Blocks that render() gave highlights, so it can clear them again. Their
+	// positions don't do for that, as they change when the document does.
+	QVector<QTextBlock> formatted_;
+
+	// Highlight formats by probability, so we don't create a new format for
+	// every highlighted word. See format().
+	QVector<QTextCharFormat> formats_;
+
 public:
 	AlignmentHighlighter(QObject *parent = nullptr);
 	~AlignmentHighlighter();
@@ -21,4 +31,5 @@ public:
 	void highlight(QVector<WordAlignment> alignment);
 private:
 	void render(QVector<WordAlignment> alignment);
+	QTextCharFormat const &format(float prob);
 };
@@ -1,9 +1,20 @@
 #include "AlignmentWorker.h"
 #include <QMutexLocker>
 
+namespace {
+
+// Number of word spans to remember, per direction. A few lines worth of
+// cursor movement.
+const int constexpr kCacheSize = 256;
+
+} // Anonymous namespace
+
 AlignmentWorker::AlignmentWorker(QObject *parent)
 : QObject(parent)
 , pendingRequest_(nullptr) {
+	for (auto &cache : cache_)
+		cache.setMaxCost(kCacheSize);
+
 	worker_ = std::thread([&]() {
 		while (true) {
 			std::unique_ptr<Request> request;
@@ -18,12 +29,11 @@ AlignmentWorker::AlignmentWorker(QObject *parent)
 			if (!request)
 					break;
 
-			QVector<WordAlignment> alignments;
+			emit ready(lookup(*request), request->direction);
 
-			if (request->translation)
-				alignments = request->translation.alignments(request->direction, request->begin, request->end);
-			
-			emit ready(alignments, request->direction);
+			// While the user hasn't moved on yet, look up where the cursor
+			// is likely to go next.
+			prefetch(*request);
 		}
 	});
 }
@@ -48,3 +58,60 @@ void AlignmentWorker::query(Translation const &translation, Translation::Directi
 	if (!request)
 		commandIssued_.release();
 }
+
+QVector<WordAlignment> AlignmentWorker::lookup(Request const &request) {
+	if (!request.translation)
+		return QVector<WordAlignment>();
+
+	// Cached alignments are only valid for the translation they came from.
+	if (request.translation != translation_) {
+		translation_ = request.translation;
+		for (auto &cache : cache_)
+			cache.clear();
+	}
+
+	// Moving the cursor inside a word, or selecting part of it, is the same
+	// query as far as alignments are concerned.
+	QPair<int,int> span;
+	if (!translation_.wordSpan(request.direction, request.begin, request.end, span.first, span.second))
+		return QVector<WordAlignment>();
+
+	auto &cache = cache_[request.direction];
+	if (QVector<WordAlignment> *alignments = cache.object(span))
+		return *alignments;
+
+	QVector<WordAlignment> alignments = translation_.alignments(request.direction, request.begin, request.end);
+	cache.insert(span, new QVector<WordAlignment>(alignments));
+	return alignments;
+}
+
+void AlignmentWorker::prefetch(Request const &request) {
+	// Only for a cursor, selections are not likely to be made word by word.
+	if (!request.translation || request.begin != request.end)
+		return;
+
+	QPair<int,int> span;
+	if (!translation_.wordSpan(request.direction, request.begin, request.end, span.first, span.second))
+		return;
+
+	// The words just before and after the one under the cursor: where the
+	// cursor ends up when it leaves this word by moving one character, or
+	// (most of the time) one word. The word that ends at span.first is the
+	// one under the cursor itself, so look one before that.
+	QVector<int> positions;
+	if (span.first > 0)
+		positions.append(span.first - 1);
+	positions.append(span.second + 1);
+
+	for (int pos : positions) {
+		if (interrupted())
+			break;
+
+		lookup(Request{request.translation, request.direction, pos, pos});
+	}
+}
+
+bool AlignmentWorker::interrupted() {
+	QMutexLocker locker(&lock_);
+	return pendingRequest_ != nullptr;
+}
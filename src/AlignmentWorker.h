@@ -1,6 +1,8 @@
 #pragma once
 #include <QObject>
+#include <QCache>
 #include <QMutex>
+#include <QPair>
 #include <QSemaphore>
 #include <memory>
 #include <thread>
@@ -21,8 +23,17 @@ private:
 	QSemaphore commandIssued_;
 	QMutex lock_;
 
+	// Only touched by the worker thread: alignments already looked up in
+	// translation_, per direction, by Translation::wordSpan().
+	Translation translation_;
+	QCache<QPair<int,int>, QVector<WordAlignment>> cache_[2];
+
 	std::thread worker_;
 
+	QVector<WordAlignment> lookup(Request const &request);
+	void prefetch(Request const &request);
+	bool interrupted();
+
 public:
 	AlignmentWorker(QObject *parent = nullptr);
 	~AlignmentWorker();
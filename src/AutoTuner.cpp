@@ -0,0 +1,210 @@
+#include "AutoTuner.h"
+#include "MarianInterface.h"
+#include "WordCount.h"
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+#include "3rd_party/bergamot-translator/src/translator/response.h"
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Only take a setting if it is at least this much faster than the best so
+// far. Anything less is likely noise, and then we'd rather keep the default.
+const double constexpr kMinImprovement = 1.03;
+
+// Number of times the text is repeated, to get a measurement that's long
+// enough to not be noise. The translation cache is off, so every repetition
+// is translated.
+const int constexpr kRepetitions = 3;
+
+const std::vector<std::size_t> kMiniBatchWords{250, 500, 1000, 2000};
+const std::vector<std::size_t> kWorkspace{128, 256, 512};
+
+// The text doesn't have to be in the model's source language: how long it
+// takes depends mostly on the number of tokens, not on whether they make sense.
+// A mix of short and long sentences, as batching depends on their lengths.
+char const * const kText[] = {
+    "The meeting has been moved to Thursday afternoon.",
+    "Please read the attached document before you reply.",
+    "Thank you!",
+    "The library will be closed for renovation from the first of July until the end of September, but books can still be returned at the front desk of the town hall.",
+    "She had never seen so many birds in one place.",
+    "If the problem persists after restarting the device, contact our support team and include the serial number printed on the back.",
+    "Where is the nearest train station?",
+    "Prices for fresh vegetables rose sharply last month after an unusually dry summer reduced harvests across much of the south of the country.",
+    "He opened the window, looked at the empty street for a while, and then went back to his desk to finish the letter he had started that morning.",
+    "The results are shown in the table below.",
+    "Our new opening hours are Monday to Friday from nine to five.",
+    "Researchers found that children who read for pleasure every day did better at school, even when the researchers accounted for the income and education of their parents.",
+    "Can you recommend a good restaurant near the hotel?",
+    "The bridge, which was built more than two hundred years ago, is one of the oldest stone bridges in the region that is still used by cars.",
+    "Turn left at the second traffic light.",
+    "Do not leave your luggage unattended.",
+    "After months of negotiations, both parties agreed on a contract that guarantees the workers a higher wage and more paid holidays over the next three years.",
+    "The weather forecast predicts heavy rain and strong winds for the coming weekend.",
+    "We apologise for any inconvenience this may cause.",
+    "Although the film received mixed reviews from critics, it quickly became one of the most watched films of the year.",
+    "Add the flour and the sugar, and stir until the mixture is smooth.",
+    "Your order has been shipped and should arrive within three to five working days.",
+    "The museum offers free guided tours in several languages every Sunday morning.",
+    "Nobody knew exactly how the old clock in the tower still managed to keep time after all those years without any maintenance.",
+};
+
+std::string makeText() {
+    std::string text;
+    for (int i = 0; i < kRepetitions; ++i) {
+        for (char const *line : kText) {
+            text.append(line);
+            text.push_back('\n');
+        }
+    }
+    return text;
+}
+
+void translate(marian::bergamot::AsyncService &service, std::shared_ptr<marian::bergamot::TranslationModel> model, std::string text) {
+    std::promise<void> done;
+    service.translate(model, std::move(text), [&done](marian::bergamot::Response &&) {
+        done.set_value();
+    }, marian::bergamot::ResponseOptions{});
+    done.get_future().wait();
+}
+
+/**
+ * Words per second with `settings`. Loads the model, translates a bit to warm
+ * up, and then times the translation of the whole text.
+ */
+double measure(QString const &modelPath, translateLocally::marianSettings const &settings, std::string const &text) {
+    marian::bergamot::AsyncService::Config config;
+    config.numWorkers = settings.cpu_threads;
+    config.cacheSize = 0;
+    marian::bergamot::AsyncService service(config);
+
+    auto model = makeTranslationModel(makeOptions(modelPath.toStdString(), settings), settings.cpu_threads);
+
+    translate(service, model, kText[0]);
+
+    auto start = std::chrono::steady_clock::now();
+    translate(service, model, text);
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+    return countWords(text) / seconds.count();
+}
+
+/**
+ * Thread counts to try: all hardware threads, and fewer to leave out SMT
+ * siblings or slower cores. From most to least, as more is the default.
+ */
+std::vector<std::size_t> threadCandidates() {
+    std::size_t hardware = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    std::vector<std::size_t> candidates;
+    for (std::size_t threads = hardware; threads > 0; threads /= 2) {
+        candidates.push_back(threads);
+        if (threads == 1 || candidates.size() == 3)
+            break;
+    }
+    return candidates;
+}
+
+} // Anonymous namespace
+
+AutoTuner::AutoTuner(QObject *parent)
+: QObject(parent)
+, cancelled_(false) {
+    //
+}
+
+AutoTuner::~AutoTuner() {
+    cancel();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+void AutoTuner::start(QString modelPath, translateLocally::marianSettings base) {
+    cancel();
+    if (worker_.joinable())
+        worker_.join();
+
+    cancelled_ = false;
+    worker_ = std::thread(&AutoTuner::tune, this, modelPath, base);
+}
+
+void AutoTuner::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+}
+
+template <typename Signal, typename... Args>
+bool AutoTuner::report(Signal signal, Args&&... args) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_)
+        return false;
+    emit (this->*signal)(std::forward<Args>(args)...);
+    return true;
+}
+
+void AutoTuner::tune(QString modelPath, translateLocally::marianSettings base) {
+    try {
+        std::string text = makeText();
+        std::vector<std::size_t> threads = threadCandidates();
+
+        int total = threads.size() + kMiniBatchWords.size() + kWorkspace.size();
+        int done = 0;
+
+        translateLocally::marianSettings best = base;
+        best.translation_cache = false;
+        best.cpu_threads = threads.front();
+        best.mini_batch_words = 1000;
+        best.workspace = 128;
+        double bestSpeed = 0;
+
+        // Tries `values` for one of the settings, keeping the fastest.
+        auto tryAll = [&](std::vector<std::size_t> const &values, std::size_t translateLocally::marianSettings::*setting) {
+            translateLocally::marianSettings tuned = best;
+            for (std::size_t value : values) {
+                if (cancelled_)
+                    return false;
+
+                // Measured already with the previous setting
+                if (value == best.*setting && bestSpeed > 0) {
+                    if (!report(&AutoTuner::progress, ++done, total))
+                        return false;
+                    continue;
+                }
+
+                translateLocally::marianSettings candidate = tuned;
+                candidate.*setting = value;
+                double speed = measure(modelPath, candidate, text);
+
+                // Cancelled while measuring
+                if (cancelled_)
+                    return false;
+
+                if (speed > bestSpeed * kMinImprovement) {
+                    best = candidate;
+                    bestSpeed = speed;
+                }
+
+                if (!report(&AutoTuner::progress, ++done, total))
+                    return false;
+            }
+            return true;
+        };
+
+        if (!report(&AutoTuner::progress, done, total))
+            return;
+
+        if (!tryAll(threads, &translateLocally::marianSettings::cpu_threads)
+            || !tryAll(kMiniBatchWords, &translateLocally::marianSettings::mini_batch_words)
+            || !tryAll(kWorkspace, &translateLocally::marianSettings::workspace))
+            return;
+
+        best.translation_cache = base.translation_cache;
+        report(&AutoTuner::finished, best, bestSpeed);
+    } catch (const std::runtime_error &e) {
+        report(&AutoTuner::error, QString::fromStdString(e.what()));
+    }
+}
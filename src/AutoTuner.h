@@ -0,0 +1,57 @@
+#ifndef AUTOTUNER_H
+#define AUTOTUNER_H
+#include <QObject>
+#include <QString>
+#include "types.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+/**
+ * Finds the fastest cpu_threads, mini_batch_words and workspace for a model
+ * on this machine, by timing the translation of a short built-in text with
+ * different settings. The defaults are a guess: the thread count includes SMT
+ * siblings and efficiency cores, and the best batch size depends on the cache
+ * sizes of the CPU.
+ *
+ * The settings are tuned one after the other, each starting from the best of
+ * the previous one, so it only takes a handful of runs instead of all
+ * combinations. Runs on its own thread; a run loads the model, so tuning
+ * takes from several seconds to a minute.
+ */
+class AutoTuner : public QObject {
+    Q_OBJECT
+public:
+    explicit AutoTuner(QObject *parent = nullptr);
+    ~AutoTuner();
+
+    /**
+     * @brief Starts tuning the model in `modelPath`. Settings that are not
+     * tuned, such as the translation cache, are taken from `base`.
+     */
+    void start(QString modelPath, translateLocally::marianSettings base);
+
+    /**
+     * @brief Stops tuning. A run that is in progress can't be interrupted,
+     * but its result is dropped: nothing is emitted once this returns.
+     */
+    void cancel();
+
+signals:
+    void progress(int done, int total);
+    void finished(translateLocally::marianSettings settings, double wordsPerSecond);
+    void error(QString message);
+
+private:
+    std::thread worker_;
+    std::atomic<bool> cancelled_;
+    std::mutex mutex_; // Held while checking cancelled_ and emitting
+
+    // Emits `signal` with `args`, unless cancelled. Returns whether it did.
+    template <typename Signal, typename... Args>
+    bool report(Signal signal, Args&&... args);
+
+    void tune(QString modelPath, translateLocally::marianSettings base);
+};
+
+#endif // AUTOTUNER_H
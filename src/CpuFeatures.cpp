@@ -0,0 +1,111 @@
+#include "CpuFeatures.h"
+#include <QtGlobal>
+#include <cstdint>
+
+#if defined(Q_PROCESSOR_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace cpu {
+
+namespace {
+
+#if defined(Q_PROCESSOR_X86)
+
+struct Registers {
+    std::uint32_t eax, ebx, ecx, edx;
+};
+
+Registers cpuid(std::uint32_t leaf, std::uint32_t subleaf = 0) {
+    Registers regs{0, 0, 0, 0};
+#if defined(_MSC_VER)
+    int out[4];
+    __cpuidex(out, leaf, subleaf);
+    regs = Registers{static_cast<std::uint32_t>(out[0]), static_cast<std::uint32_t>(out[1]), static_cast<std::uint32_t>(out[2]), static_cast<std::uint32_t>(out[3])};
+#else
+    if (leaf > __get_cpuid_max(0, nullptr))
+        return regs;
+    __cpuid_count(leaf, subleaf, regs.eax, regs.ebx, regs.ecx, regs.edx);
+#endif
+    return regs;
+}
+
+// Which register state the operating system saves on context switches. The
+// CPU supporting AVX doesn't help if the OS doesn't save the wider registers.
+std::uint64_t xgetbv() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    std::uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<std::uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+Feature detectOnce() {
+    Registers leaf1 = cpuid(1);
+    bool osxsave = leaf1.ecx & (1u << 27);
+    bool avx = leaf1.ecx & (1u << 28);
+    if (!osxsave || !avx)
+        return Feature::SSE42;
+
+    std::uint64_t xcr0 = xgetbv();
+    bool ymm = (xcr0 & 0x6) == 0x6; // SSE and AVX state
+    bool zmm = (xcr0 & 0xe6) == 0xe6; // and opmask and upper ZMM state
+    if (!ymm)
+        return Feature::SSE42;
+
+    Registers leaf7 = cpuid(7);
+    bool avx2 = leaf7.ebx & (1u << 5);
+    bool avx512f = leaf7.ebx & (1u << 16);
+    bool avx512bw = leaf7.ebx & (1u << 30);
+    bool avx512vnni = leaf7.ecx & (1u << 11);
+
+    if (zmm && avx512f && avx512bw)
+        return avx512vnni ? Feature::AVX512VNNI : Feature::AVX512;
+    if (avx2)
+        return Feature::AVX2;
+    return Feature::SSE42;
+}
+
+#else
+
+Feature detectOnce() {
+    return Feature::SSE42;
+}
+
+#endif
+
+} // Anonymous namespace
+
+Feature detect() {
+    static const Feature feature = detectOnce();
+    return feature;
+}
+
+QString name(Feature feature) {
+    switch (feature) {
+        case Feature::SSE42:
+            return "sse42";
+        case Feature::AVX2:
+            return "avx2";
+        case Feature::AVX512:
+            return "avx512";
+        case Feature::AVX512VNNI:
+            return "avx512vnni";
+    }
+    return QString();
+}
+
+QStringList supported(Feature feature) {
+    QStringList names;
+    for (int level = static_cast<int>(feature); level >= 0; --level)
+        names.append(name(static_cast<Feature>(level)));
+    return names;
+}
+
+} // namespace cpu
@@ -0,0 +1,37 @@
+#pragma once
+#include <QString>
+#include <QStringList>
+
+/**
+ * What the CPU we're running on can do, as far as the matrix multiplication
+ * kernels are concerned. intgemm picks its kernels by itself at runtime; this
+ * is for the choices we make, like which variant of a model to load, and for
+ * telling users what they've got.
+ */
+namespace cpu {
+
+// Ordered: every level includes the ones before it.
+enum class Feature {
+    SSE42,
+    AVX2,
+    AVX512,     // AVX512BW, what intgemm needs for its AVX-512 kernels
+    AVX512VNNI,
+};
+
+/**
+ * @brief The best Feature this CPU and operating system support. Detected
+ * once with CPUID, and cached. SSE42 on anything that isn't x86.
+ */
+Feature detect();
+
+/**
+ * @brief Lower case name of a feature, e.g. "avx512vnni".
+ */
+QString name(Feature feature);
+
+/**
+ * @brief Names of `feature` and every level below it, best first.
+ */
+QStringList supported(Feature feature = detect());
+
+} // namespace cpu
@@ -0,0 +1,434 @@
+#include "Download.h"
+#include "Network.h"
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkReply>
+#include <QSaveFile>
+#include <QTimer>
+#include <algorithm>
+
+namespace {
+    // How many segments are fetched at the same time, at most.
+    constexpr qint64 kSegments = 4;
+
+    // Smaller segments aren't worth the extra request.
+    constexpr qint64 kMinSegmentSize = 4 << 20;
+
+    // How often a segment may fail without making progress before we give up.
+    constexpr int kRetries = 3;
+
+    // How much is downloaded before the state file is updated again.
+    constexpr qint64 kSaveInterval = 1 << 20;
+
+    // How much is read back at once from the partial file for write().
+    constexpr qint64 kFeedChunkSize = 1 << 20;
+}
+
+Download::Download(Network *network, QUrl url, Writer write, Completer complete, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata, QString partialPath)
+: QObject(network)
+, network_(network)
+, url_(url)
+, write_(std::move(write))
+, complete_(std::move(complete))
+, hasher_(algorithm)
+, hash_(hash)
+, extradata_(extradata)
+, partialPath_(partialPath)
+, partial_(partialPath)
+, size_(-1)
+, fed_(0)
+, unsaved_(0)
+, stopped_(false) {
+    //
+}
+
+Download::~Download() {
+    if (!stopped_)
+        stop();
+}
+
+void Download::start() {
+    if (partialPath_.isEmpty())
+        return startSingle();
+
+    if (loadState())
+        return startSegments();
+
+    probe();
+}
+
+void Download::abort() {
+    if (!stopped_)
+        finish();
+}
+
+qint64 Download::received() const {
+    qint64 received = 0;
+    for (Segment const &segment : segments_)
+        received += segment.done;
+    return received;
+}
+
+QString Download::statePath() const {
+    return partialPath_ + ".json";
+}
+
+bool Download::loadState() {
+    QFile file(statePath());
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QJsonObject state = QJsonDocument::fromJson(file.readAll()).object();
+
+    // Only resume exactly the same download.
+    if (state["url"].toString() != url_.toString() || state["hash"].toString() != QString(hash_.toHex()))
+        return false;
+
+    qint64 size = static_cast<qint64>(state["size"].toDouble());
+    if (size <= 0 || QFileInfo(partialPath_).size() != size)
+        return false;
+
+    QList<Segment> segments;
+    qint64 expected = 0;
+    for (QJsonValue const &value : state["segments"].toArray()) {
+        QJsonObject obj = value.toObject();
+        Segment segment{static_cast<qint64>(obj["start"].toDouble()),
+                        static_cast<qint64>(obj["end"].toDouble()),
+                        static_cast<qint64>(obj["done"].toDouble()),
+                        0,
+                        nullptr};
+
+        // Segments have to cover the file from start to end, in order.
+        if (segment.start != expected || segment.end <= segment.start || segment.done < 0 || segment.start + segment.done > segment.end)
+            return false;
+
+        expected = segment.end;
+        segments.append(segment);
+    }
+
+    if (expected != size)
+        return false;
+
+    size_ = size;
+    segments_ = segments;
+    return true;
+}
+
+void Download::saveState() {
+    if (segments_.isEmpty() || !partial_.isOpen())
+        return;
+
+    // Never claim more than has actually been written.
+    partial_.flush();
+
+    QJsonArray segments;
+    for (Segment const &segment : segments_) {
+        segments.append(QJsonObject{
+            {"start", static_cast<double>(segment.start)},
+            {"end", static_cast<double>(segment.end)},
+            {"done", static_cast<double>(segment.done)}
+        });
+    }
+
+    QJsonObject state{
+        {"url", url_.toString()},
+        {"hash", QString(hash_.toHex())},
+        {"size", static_cast<double>(size_)},
+        {"segments", segments}
+    };
+
+    QSaveFile file(statePath());
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+        file.commit();
+    }
+
+    unsaved_ = 0;
+}
+
+void Download::removePartial() {
+    partial_.close();
+    partial_.remove();
+    QFile::remove(statePath());
+    segments_.clear();
+}
+
+void Download::probe() {
+    // Ask for the size, and whether we can ask for parts of it.
+    QNetworkReply *reply = network_->head(QNetworkRequest(url_));
+    single_ = reply;
+
+    connect(reply, &QNetworkReply::finished, this, [=] {
+        reply->deleteLater();
+        single_ = nullptr;
+
+        qint64 size = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+        bool ranges = reply->rawHeader("Accept-Ranges").trimmed() == "bytes";
+
+        // Not every server answers HEAD requests, or supports ranges. That
+        // just means we can't do better than a normal download.
+        if (reply->error() != QNetworkReply::NoError || !ranges || size <= 0)
+            return startSingle();
+
+        if (!partial_.open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered) || !partial_.resize(size))
+            return finish(tr("An error occurred while writing the downloaded data to disk: %1").arg(partial_.errorString()));
+
+        qint64 count = std::min(std::max<qint64>(size / kMinSegmentSize, 1), kSegments);
+        size_ = size;
+        segments_.clear();
+        for (qint64 i = 0; i < count; ++i)
+            segments_.append(Segment{size * i / count, size * (i + 1) / count, 0, 0, nullptr});
+
+        saveState();
+        startSegments();
+    });
+}
+
+void Download::startSegments() {
+    if (!partial_.isOpen() && !partial_.open(QIODevice::ReadWrite | QIODevice::Unbuffered))
+        return finish(tr("Cannot open file for downloading."));
+
+    emit progress(received(), size_);
+
+    // Catch up on what we might already have from a previous attempt.
+    if (!feed())
+        return;
+
+    bool complete = true;
+    for (int i = 0; i < segments_.size(); ++i) {
+        if (segments_[i].start + segments_[i].done < segments_[i].end) {
+            fetch(i);
+            complete = false;
+        }
+    }
+
+    // Everything was downloaded before, we just didn't get to finish.
+    if (complete)
+        this->complete();
+}
+
+void Download::fetch(int index) {
+    Segment &segment = segments_[index];
+
+    QNetworkRequest request(url_);
+    request.setRawHeader("Range", QString("bytes=%1-%2").arg(segment.start + segment.done).arg(segment.end - 1).toLatin1());
+
+    QNetworkReply *reply = network_->get(request);
+    segment.reply = reply;
+
+    connect(reply, &QIODevice::readyRead, this, [=] {
+        onSegmentData(index);
+    });
+
+    connect(reply, &QNetworkReply::finished, this, [=] {
+        onSegmentFinished(index);
+    });
+}
+
+void Download::onSegmentData(int index) {
+    Segment &segment = segments_[index];
+    QNetworkReply *reply = segment.reply;
+
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    // 200 instead of 206 Partial Content: we're getting the whole file.
+    if (status == 200) {
+        stop();
+        removePartial();
+
+        if (fed_ > 0)
+            return finish(tr("The server stopped supporting resumed downloads of %1. Please try again.").arg(url_.toString()));
+
+        stopped_ = false;
+        return startSingle();
+    }
+
+    // An error page, onSegmentFinished() will deal with it.
+    if (status != 206)
+        return;
+
+    // Never write past the end of the segment, whatever the server sends.
+    QByteArray buffer = reply->read(segment.end - segment.start - segment.done);
+    if (buffer.isEmpty())
+        return;
+
+    if (!partial_.seek(segment.start + segment.done) || partial_.write(buffer) != buffer.size())
+        return finish(tr("An error occurred while writing the downloaded data to disk: %1").arg(partial_.errorString()));
+
+    segment.done += buffer.size();
+    segment.attempts = 0; // It is making progress
+    unsaved_ += buffer.size();
+
+    emit progress(received(), size_);
+
+    if (unsaved_ >= kSaveInterval)
+        saveState();
+
+    feed();
+}
+
+void Download::onSegmentFinished(int index) {
+    QNetworkReply *reply = segments_[index].reply;
+    reply->deleteLater();
+
+    // Anything still buffered in the reply
+    if (reply->bytesAvailable() > 0)
+        onSegmentData(index);
+
+    // Which might have made us stop, or fall back to a single request.
+    if (stopped_ || index >= segments_.size() || segments_[index].reply != reply)
+        return;
+
+    Segment &segment = segments_[index];
+    segment.reply = nullptr;
+
+    if (segment.start + segment.done == segment.end) {
+        saveState();
+
+        bool complete = std::all_of(segments_.begin(), segments_.end(), [](Segment const &segment) {
+            return segment.start + segment.done == segment.end;
+        });
+
+        if (complete)
+            this->complete();
+        return;
+    }
+
+    // The connection dropped or timed out. Try again from where it stopped.
+    if (++segment.attempts > kRetries)
+        return finish(tr("An error occurred while downloading %1: %2").arg(url_.toString(), reply->errorString()));
+
+    saveState();
+    QTimer::singleShot(1000 * segment.attempts, this, [=] {
+        if (!stopped_)
+            fetch(index);
+    });
+}
+
+void Download::startSingle() {
+    QNetworkReply *reply = network_->get(QNetworkRequest(url_));
+    single_ = reply;
+
+    // While chunks come in, hand them over
+    connect(reply, &QIODevice::readyRead, this, [=] {
+        QByteArray buffer = reply->readAll();
+
+        hasher_.addData(buffer);
+        fed_ += buffer.size();
+
+        QString err = write_(buffer);
+        if (!err.isEmpty())
+            finish(err);
+    });
+
+    connect(reply, &QNetworkReply::downloadProgress, this, &Download::progress);
+
+    // When finished, check the hash and call complete
+    connect(reply, &QNetworkReply::finished, this, [=] {
+        reply->deleteLater();
+
+        if (stopped_)
+            return;
+
+        single_ = nullptr;
+
+        switch (reply->error()) {
+            case QNetworkReply::NoError:
+                complete();
+                break;
+
+            case QNetworkReply::OperationCanceledError:
+                // ignore, it was intentional.
+                finish();
+                break;
+
+            default:
+                finish(tr("An error occurred while downloading %1: %2").arg(url_.toString(), reply->errorString()));
+                break;
+        }
+    });
+}
+
+bool Download::feed() {
+    // Everything up to the first segment that isn't complete yet.
+    qint64 contiguous = 0;
+    for (Segment const &segment : segments_) {
+        contiguous = segment.start + segment.done;
+        if (contiguous < segment.end)
+            break;
+    }
+
+    while (fed_ < contiguous) {
+        QByteArray chunk;
+        if (partial_.seek(fed_))
+            chunk = partial_.read(std::min(kFeedChunkSize, contiguous - fed_));
+
+        if (chunk.isEmpty()) {
+            finish(tr("An error occurred while reading back the downloaded data: %1").arg(partial_.errorString()));
+            return false;
+        }
+
+        hasher_.addData(chunk);
+        fed_ += chunk.size();
+
+        QString err = write_(chunk);
+        if (!err.isEmpty()) {
+            finish(err);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Download::complete() {
+    if (!segments_.isEmpty() && !feed())
+        return;
+
+    // If we're checking the hash, now is the time as all data is downloaded.
+    if (!hash_.isEmpty() && hasher_.result() != hash_) {
+        QString err = tr("The cryptographic hash of %1 does not match the provided hash.\nExpected: %2\nActual: %3\nFile size: %4").arg(url_.toString(),
+                                                                                                                                 QString(hash_.toHex()),
+                                                                                                                                 QString(hasher_.result().toHex()),
+                                                                                                                                 QString::number(fed_));
+        // Resuming won't make it any better
+        removePartial();
+        return finish(err);
+    }
+
+    QString err = complete_(url_.fileName());
+    removePartial();
+    finish(err);
+}
+
+void Download::stop() {
+    stopped_ = true;
+
+    auto cancel = [this](QNetworkReply *reply) {
+        if (!reply)
+            return;
+        reply->disconnect(this);
+        reply->abort();
+        reply->deleteLater();
+    };
+
+    cancel(single_);
+    for (Segment &segment : segments_)
+        cancel(segment.reply);
+
+    saveState();
+    partial_.close();
+}
+
+void Download::finish(QString err) {
+    if (!stopped_)
+        stop();
+
+    if (!err.isEmpty())
+        emit error(err, extradata_);
+
+    emit finished();
+    deleteLater();
+}
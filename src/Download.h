@@ -0,0 +1,114 @@
+#pragma once
+#include <QObject>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QList>
+#include <QPointer>
+#include <QUrl>
+#include <QVariant>
+#include <functional>
+#include <memory>
+
+class Network;
+class QNetworkReply;
+
+/**
+ * A download started by Network::download(). If the server supports HTTP
+ * range requests and a path for the partial download is given, the file is
+ * fetched in several segments at once, and what has been downloaded is kept
+ * in that file so the download can pick up where it left off: after a
+ * connection drops, but also after the program restarts. Without those, it
+ * falls back to a single request.
+ *
+ * Either way, the data is handed to `write` in order, and `complete` is only
+ * called once all of it is in and matches the hash. Deletes itself after
+ * emitting finished().
+ */
+class Download : public QObject {
+    Q_OBJECT
+public:
+    using Writer = std::function<QString(QByteArray const &)>;
+    using Completer = std::function<QString(QString)>;
+
+    Download(Network *network, QUrl url, Writer write, Completer complete, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata, QString partialPath);
+
+    ~Download();
+
+    /**
+     * @brief Starts downloading. Network::download() calls this from the event
+     * loop, so there's time to connect to the signals first.
+     */
+    void start();
+
+public slots:
+    /**
+     * @brief Stops downloading, without emitting error(). A partial download
+     * is kept, so starting the same download later on resumes it.
+     */
+    void abort();
+
+signals:
+    /**
+     * @brief Bytes received so far over all segments, and the total size (or
+     * -1 while unknown).
+     */
+    void progress(qint64 received, qint64 total);
+
+    /**
+     * @brief The download stopped, because it is complete, failed or was
+     * aborted.
+     */
+    void finished();
+
+    void error(QString err, QVariant extradata);
+
+private:
+    struct Segment {
+        qint64 start;
+        qint64 end; // exclusive
+        qint64 done; // bytes of this segment written to the partial file
+        int attempts;
+        QPointer<QNetworkReply> reply;
+    };
+
+    Network *network_;
+    QUrl url_;
+    Writer write_;
+    Completer complete_;
+    QCryptographicHash hasher_;
+    QByteArray hash_;
+    QVariant extradata_;
+
+    QString partialPath_;
+    QFile partial_;
+    qint64 size_;
+    qint64 fed_; // bytes handed to write_ so far
+    qint64 unsaved_; // bytes written since the state file was last saved
+    QList<Segment> segments_;
+    QPointer<QNetworkReply> single_;
+    bool stopped_;
+
+    qint64 received() const;
+    QString statePath() const;
+    bool loadState();
+    void saveState();
+    void removePartial();
+
+    void probe();
+    void startSegments();
+    void fetch(int index);
+    void onSegmentData(int index);
+    void onSegmentFinished(int index);
+
+    void startSingle();
+
+    // Hands the data that is now contiguous from the start to write_.
+    bool feed();
+    void complete();
+
+    // Stops all requests, keeping what was downloaded for a next attempt.
+    void stop();
+
+    // Stops, and reports `err` if there is one.
+    void finish(QString err = QString());
+};
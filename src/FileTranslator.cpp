@@ -0,0 +1,166 @@
+#include "FileTranslator.h"
+#include "MarianInterface.h"
+#include "PersistentCache.h"
+#include "ShardedService.h"
+#include "WordCount.h"
+#include "cli/BatchTranslator.h"
+#include "cli/ChunkReader.h"
+#include "cli/HtmlChunker.h"
+#include <QFile>
+#include <QSaveFile>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+
+// bergamot-translator
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+
+namespace {
+
+// Like the command line: enough chunks queued that the workers always have
+// something to batch, while we write out the ones that are done.
+constexpr std::size_t kChunksInFlightPerThread = 2;
+
+} // Anonymous namespace
+
+FileTranslator::FileTranslator(QObject *parent)
+: QObject(parent)
+, running_(false)
+, cancelled_(false) {
+    //
+}
+
+FileTranslator::~FileTranslator() {
+    cancel();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+bool FileTranslator::isRunning() const {
+    return running_;
+}
+
+void FileTranslator::start(Job job) {
+    if (running_)
+        return;
+
+    // The previous job is done, but its thread might not have quite returned.
+    if (worker_.joinable())
+        worker_.join();
+
+    running_ = true;
+    cancelled_ = false;
+    worker_ = std::thread(&FileTranslator::run, this, std::move(job));
+}
+
+void FileTranslator::cancel() {
+    cancelled_ = true;
+}
+
+void FileTranslator::run(Job job) {
+    try {
+        QFile infile(job.input);
+        if (!infile.open(QIODevice::ReadOnly))
+            throw std::runtime_error(tr("Could not open %1: %2").arg(job.input, infile.errorString()).toStdString());
+
+        // Written to a temporary file, which only replaces the output once
+        // it is complete.
+        QSaveFile outfile(job.output);
+        if (!outfile.open(QIODevice::WriteOnly))
+            throw std::runtime_error(tr("Could not open %1 for writing: %2").arg(job.output, outfile.errorString()).toStdString());
+
+        std::size_t cacheSize = job.settings.translation_cache ? job.settings.translation_cache_size : 0;
+        auto service = std::make_shared<ShardedService>(ShardedService::Config{job.settings.cpu_threads, cacheSize, false});
+        auto options = makeOptions(job.modelPath.toStdString(), job.settings);
+        auto model = service->loadModel(options);
+
+        BatchTranslator translator(service, model, job.HTML, kChunksInFlightPerThread * job.settings.cpu_threads);
+
+        // Same conditions as on the command line, see CommandLineIface::doTranslation().
+        bool independentLines = !job.HTML && options->get<std::string>("ssplit-mode", "paragraph") != "wrapped_text";
+        translator.setDeduplicate(independentLines);
+
+        std::shared_ptr<PersistentCache> cache;
+        if (job.persistentCacheSize > 0 && independentLines) {
+            cache = std::make_shared<PersistentCache>(PersistentCache::defaultPath(), job.persistentCacheSize);
+            if (cache->isOpen())
+                translator.setCache(cache, PersistentCache::modelKey(job.modelPath));
+        }
+
+        ChunkReader reader(infile);
+        HtmlChunker htmlChunker(reader);
+
+        // What we need to know about the chunks in flight once their
+        // translation comes back, in order.
+        struct Chunk {
+            std::size_t opened; // Tags HtmlChunker added
+            std::size_t closed;
+            qint64 bytes;
+            std::size_t words;
+        };
+        std::deque<Chunk> inFlight;
+
+        qint64 total = infile.size();
+        qint64 done = 0;
+        std::size_t words = 0;
+        auto started = std::chrono::steady_clock::now();
+
+        translator.run([&](std::string &chunk) {
+            if (cancelled_)
+                return false;
+
+            if (!(job.HTML ? htmlChunker.next(chunk, job.settings.mini_batch_words) : reader.next(chunk, job.settings.mini_batch_words)))
+                return false;
+
+            inFlight.push_back(Chunk{
+                job.HTML ? htmlChunker.openedTags() : 0,
+                job.HTML ? htmlChunker.closedTags() : 0,
+                static_cast<qint64>(chunk.size()),
+                countWords(chunk)
+            });
+            return true;
+        }, [&](std::string &&translation) {
+            Chunk chunk = inFlight.front();
+            inFlight.pop_front();
+
+            // Nobody is going to read it.
+            if (cancelled_)
+                return;
+
+            if (job.HTML)
+                HtmlChunker::strip(translation, chunk.opened, chunk.closed);
+
+            outfile.write(translation.data(), translation.size());
+
+            done += chunk.bytes;
+            words += chunk.words;
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+            int wordsPerSecond = elapsed.count() > 0 ? static_cast<int>(words / elapsed.count()) : 0;
+            emit progress(std::min(done, total), total, wordsPerSecond);
+        });
+
+        if (cancelled_) {
+            outfile.cancelWriting();
+            running_ = false;
+            emit cancelled();
+            return;
+        }
+
+        if (!outfile.commit())
+            throw std::runtime_error(tr("Could not write %1: %2").arg(job.output, outfile.errorString()).toStdString());
+
+        running_ = false;
+        emit finished(job.output);
+    } catch (const std::exception &e) {
+        // Not only our own errors: whatever loading the model or translating
+        // throws would otherwise end the program, as this is its own thread.
+        running_ = false;
+        emit error(QString::fromStdString(e.what()));
+    } catch (...) {
+        running_ = false;
+        emit error(tr("Could not translate %1.").arg(job.input));
+    }
+}
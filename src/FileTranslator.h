@@ -0,0 +1,70 @@
+#pragma once
+#include <QObject>
+#include <QString>
+#include "types.h"
+#include <atomic>
+#include <thread>
+
+/**
+ * Translates a whole file in the background, through the same pipeline as
+ * the command line: the input is read in chunks, several of which are in
+ * flight at the same time, and the translations are written to the output
+ * file as they come in. So neither the document nor its translation ever has
+ * to be in memory, let alone in a text widget.
+ *
+ * The job loads its own copy of the model, in its own service, so it doesn't
+ * get in the way of translating in the main window. One job at a time.
+ */
+class FileTranslator : public QObject {
+    Q_OBJECT
+public:
+    struct Job {
+        QString modelPath;
+        translateLocally::marianSettings settings;
+        QString input;
+        QString output;
+        bool HTML;
+        qint64 persistentCacheSize; // In bytes, 0 to not use the persistent cache
+    };
+
+    explicit FileTranslator(QObject *parent = nullptr);
+    ~FileTranslator();
+
+    bool isRunning() const;
+
+    /**
+     * @brief Starts translating `job.input` into `job.output`. The output file
+     * only replaces an existing file once the whole translation is written.
+     * Does nothing if a job is already running.
+     */
+    void start(Job job);
+
+public slots:
+    /**
+     * @brief Stops the job after the chunks already in flight, and emits
+     * cancelled(). The output file is left untouched.
+     */
+    void cancel();
+
+signals:
+    /**
+     * @brief Emitted after each chunk is written.
+     * @param done bytes of input translated so far
+     * @param total size of the input in bytes
+     * @param wordsPerSecond source words translated per second so far
+     */
+    void progress(qint64 done, qint64 total, int wordsPerSecond);
+
+    void finished(QString output);
+
+    void cancelled();
+
+    void error(QString message);
+
+private:
+    std::thread worker_;
+    std::atomic<bool> running_;
+    std::atomic<bool> cancelled_;
+
+    void run(Job job);
+};
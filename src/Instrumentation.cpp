@@ -0,0 +1,197 @@
+#include "Instrumentation.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace instrumentation {
+
+namespace {
+
+// Durations are counted in logarithmic buckets, kBucketsPerOctave per
+// doubling, up to 2^32 microseconds (over an hour). That keeps the memory
+// and the cost of recording constant, at the price of percentiles only being
+// as precise as a bucket is wide.
+const int constexpr kBucketsPerOctave = 4;
+const int constexpr kBuckets = 32 * kBucketsPerOctave;
+
+const std::array<char const *, 5> kStageNames{"modelLoad", "queueWait", "translate", "postprocess", "serialise"};
+const std::array<char const *, 2> kGaugeNames{"queueDepth", "batchFill"};
+
+struct StageData {
+    std::uint64_t count{0};
+    double totalUs{0};
+    double maxUs{0};
+    std::array<std::uint64_t, kBuckets> histogram{};
+
+    void add(double us) {
+        ++count;
+        totalUs += us;
+        maxUs = std::max(maxUs, us);
+        int bucket = static_cast<int>(kBucketsPerOctave * std::log2(1. + us));
+        ++histogram[std::min(std::max(bucket, 0), kBuckets - 1)];
+    }
+
+    // Upper bound of the bucket the p-th percentile falls in, in ms.
+    double percentile(double p) const {
+        std::uint64_t rank = std::ceil(p / 100. * count);
+        std::uint64_t seen = 0;
+        for (int bucket = 0; bucket < kBuckets; ++bucket) {
+            seen += histogram[bucket];
+            if (seen >= rank && seen > 0)
+                return std::min(std::exp2((bucket + 1.) / kBucketsPerOctave) - 1., maxUs) / 1000.;
+        }
+        return maxUs / 1000.;
+    }
+};
+
+struct GaugeData {
+    std::uint64_t count{0};
+    double last{0};
+    double max{0};
+    double total{0};
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::array<StageData, kStageNames.size()> stages;
+    std::array<GaugeData, kGaugeNames.size()> gauges;
+
+    // Trace file, and what it needs to write events
+    QFile trace;
+    bool firstEvent{true};
+    Clock::time_point epoch{Clock::now()};
+    std::unordered_map<std::thread::id, int> threads;
+
+    ~Registry() {
+        if (trace.isOpen())
+            trace.write("\n]\n");
+    }
+
+    // Small numbers for thread ids, so they're readable in the trace.
+    int thread() {
+        return threads.emplace(std::this_thread::get_id(), threads.size() + 1).first->second;
+    }
+
+    double microseconds(Clock::time_point time) const {
+        return std::chrono::duration<double, std::micro>(time - epoch).count();
+    }
+
+    void writeEvent(QJsonObject event) {
+        event["pid"] = 1;
+        event["tid"] = thread();
+        QByteArray line = (firstEvent ? "\n" : ",\n") + QJsonDocument(event).toJson(QJsonDocument::Compact);
+        trace.write(line); // In one go, as the file is unbuffered
+        firstEvent = false;
+    }
+};
+
+Registry &registry() {
+    static Registry registry;
+    return registry;
+}
+
+} // Anonymous namespace
+
+void record(Stage stage, Clock::time_point begin, Clock::time_point end, int id) {
+    Registry &reg = registry();
+    double us = std::chrono::duration<double, std::micro>(end - begin).count();
+
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.stages[static_cast<std::size_t>(stage)].add(us);
+
+    if (reg.trace.isOpen()) {
+        QJsonObject event{
+            {"name", kStageNames[static_cast<std::size_t>(stage)]},
+            {"cat", "translateLocally"},
+            {"ph", "X"},
+            {"ts", reg.microseconds(begin)},
+            {"dur", us}
+        };
+        if (id >= 0)
+            event["args"] = QJsonObject{{"id", id}};
+        reg.writeEvent(event);
+    }
+}
+
+void set(Gauge gauge, double value) {
+    Registry &reg = registry();
+
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    GaugeData &data = reg.gauges[static_cast<std::size_t>(gauge)];
+    data.max = data.count > 0 ? std::max(data.max, value) : value;
+    data.last = value;
+    data.total += value;
+    ++data.count;
+
+    if (reg.trace.isOpen()) {
+        char const *name = kGaugeNames[static_cast<std::size_t>(gauge)];
+        reg.writeEvent(QJsonObject{
+            {"name", name},
+            {"cat", "translateLocally"},
+            {"ph", "C"},
+            {"ts", reg.microseconds(Clock::now())},
+            {"args", QJsonObject{{name, value}}}
+        });
+    }
+}
+
+QJsonObject stats() {
+    Registry &reg = registry();
+
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    QJsonObject stages;
+    for (std::size_t i = 0; i < kStageNames.size(); ++i) {
+        StageData const &data = reg.stages[i];
+        stages[kStageNames[i]] = QJsonObject{
+            {"count", static_cast<qint64>(data.count)},
+            {"totalMs", data.totalUs / 1000.},
+            {"meanMs", data.count > 0 ? data.totalUs / data.count / 1000. : 0.},
+            {"maxMs", data.maxUs / 1000.},
+            {"p50Ms", data.percentile(50)},
+            {"p99Ms", data.percentile(99)}
+        };
+    }
+
+    QJsonObject gauges;
+    for (std::size_t i = 0; i < kGaugeNames.size(); ++i) {
+        GaugeData const &data = reg.gauges[i];
+        gauges[kGaugeNames[i]] = QJsonObject{
+            {"last", data.last},
+            {"max", data.max},
+            {"mean", data.count > 0 ? data.total / data.count : 0.}
+        };
+    }
+
+    return QJsonObject{
+        {"stages", stages},
+        {"gauges", gauges}
+    };
+}
+
+bool openTrace(QString const &path) {
+    Registry &reg = registry();
+
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    if (reg.trace.isOpen())
+        return false;
+
+    reg.trace.setFileName(path);
+    // Unbuffered, so every event is in the file as soon as it happened, and
+    // not only once the buffer fills up or the process exits.
+    if (!reg.trace.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered))
+        return false;
+
+    // JSON array format. If we don't get to write the closing bracket, e.g.
+    // because we crashed, trace viewers still accept the file.
+    reg.trace.write("[");
+    return true;
+}
+
+} // namespace instrumentation
@@ -0,0 +1,68 @@
+#pragma once
+#include <QJsonObject>
+#include <QString>
+#include <chrono>
+
+/**
+ * Lightweight timers and counters for the stages a translation goes through,
+ * so latency can be attributed to loading, queueing, translating or writing
+ * the reply. Process-wide, and safe to use from any thread: stages are
+ * recorded by the GUI, the command line and native messaging code alike.
+ *
+ * Every recorded stage also goes to the trace file, if one is open. The trace
+ * is in Chrome's trace event format, so it can be opened in chrome://tracing
+ * or https://ui.perfetto.dev.
+ */
+namespace instrumentation {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Stage {
+    ModelLoad,   // Reading and initialising a model
+    QueueWait,   // Waiting in our own queue before being handed to the service
+    Translate,   // In the service: waiting to be batched, and decoding
+    Postprocess, // Turning the response into what was asked for, e.g. alignments
+    Serialise,   // Converting the reply to JSON and writing it out
+};
+
+enum class Gauge {
+    QueueDepth, // Jobs waiting in the RequestQueue
+    BatchFill,  // Words in flight in the service, as fraction of what we allow
+};
+
+/**
+ * @brief Records that `stage` took from `begin` to `end`.
+ * @param id request the stage belongs to, shown in the trace. -1 if none.
+ */
+void record(Stage stage, Clock::time_point begin, Clock::time_point end, int id = -1);
+
+/**
+ * @brief Records the current value of `gauge`.
+ */
+void set(Gauge gauge, double value);
+
+/**
+ * @brief Summary of everything recorded so far:
+ * {
+ *   "stages": {
+ *     "modelLoad": {"count": int, "totalMs": float, "meanMs": float, "maxMs": float, "p50Ms": float, "p99Ms": float},
+ *     ... same for queueWait, translate, postprocess and serialise
+ *   },
+ *   "gauges": {
+ *     "queueDepth": {"last": float, "max": float, "mean": float},
+ *     "batchFill": ... same
+ *   }
+ * }
+ * Percentiles are approximate: within 20% of the actual value.
+ */
+QJsonObject stats();
+
+/**
+ * @brief Starts writing every recorded stage and gauge to a trace file at
+ * `path`. Events are written out as they are recorded, and the file is
+ * finished when the process exits.
+ * @return false if the file could not be opened.
+ */
+bool openTrace(QString const &path);
+
+} // namespace instrumentation
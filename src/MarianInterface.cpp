@@ -1,60 +1,165 @@
 #include "MarianInterface.h"
+#include "CpuFeatures.h"
+#include "Instrumentation.h"
+#include "MemoryUsage.h"
+#include "WordCount.h"
+#include "inventory/PrepackedModel.h"
 #include "3rd_party/bergamot-translator/src/translator/service.h"
 #include "3rd_party/bergamot-translator/src/translator/parser.h"
 #include "3rd_party/bergamot-translator/src/translator/response.h"
-#include <future>
+#include "3rd_party/bergamot-translator/src/translator/byte_array_util.h"
+#include <QFile>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <chrono>
-
-namespace  {
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+std::string modelConfigPath(const std::string &path_to_model_dir) {
+    // Models can come with weights prepared for specific instruction sets,
+    // e.g. config.intgemm8bitalpha.avx512vnni.yml. Use the best one this CPU
+    // can run, and otherwise the one for any CPU.
+    for (QString const &feature : cpu::supported()) {
+        std::string path = path_to_model_dir + "/config.intgemm8bitalpha." + feature.toStdString() + ".yml";
+        if (QFile::exists(QString::fromStdString(path)))
+            return path;
+    }
+    return path_to_model_dir + "/config.intgemm8bitalpha.yml";
+}
 
 std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings) {
-    std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(path_to_model_dir + "/config.intgemm8bitalpha.yml"));
+    std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(modelConfigPath(path_to_model_dir)));
     options->set("cpu-threads", settings.cpu_threads,
                  "workspace", settings.workspace,
-                 "mini-batch-words", 1000,
+                 "mini-batch-words", settings.mini_batch_words,
                  "alignment", "soft",
                  "quiet", true);
+    prepacked::apply(path_to_model_dir, *options);
     return options;
 }
 
-int countWords(std::string input) {
-    const char * str = input.c_str();
+std::shared_ptr<marian::bergamot::TranslationModel> makeTranslationModel(std::shared_ptr<marian::Options> options, size_t replicas) {
+    auto begin = instrumentation::Clock::now();
+    std::shared_ptr<marian::bergamot::TranslationModel> model;
+
+    // Prepacked weights are used straight from memory by every replica,
+    // without any conversion. Anything else, e.g. .npz weights or a text
+    // shortlist, can only be loaded from the files.
+    if (prepacked::isPrepacked(*options)) {
+        marian::bergamot::MemoryBundle memory = marian::bergamot::getMemoryBundleFromConfig(options);
+        model = std::make_shared<marian::bergamot::TranslationModel>(options, std::move(memory), replicas);
+    } else {
+        model = std::make_shared<marian::bergamot::TranslationModel>(options, replicas);
+    }
+
+    instrumentation::record(instrumentation::Stage::ModelLoad, begin, instrumentation::Clock::now());
+    return model;
+}
 
-    bool inSpaces = true;
-    int numWords = 0;
+namespace  {
 
-    while (*str != '\0') {
-        if (std::isspace(static_cast<unsigned char>(*str))) {
-            inSpaces = true;
-        } else if (inSpaces) {
-            numWords++;
-            inSpaces = false;
-        }
-        ++str;
+bool isBlank(std::string const &text) {
+    return std::all_of(text.begin(), text.end(), [](char c) { return std::isspace(static_cast<unsigned char>(c)); });
+}
+
+struct Paragraph {
+    std::string separator; // Blank lines between the previous paragraph and this one
+    std::string text;
+};
+
+/**
+ * Splits text into paragraphs at blank lines. Marian translates paragraphs
+ * independently of each other, so translating them one by one gives the same
+ * result as translating the whole text at once. The last paragraph can be
+ * empty, if the text ends with blank lines.
+ */
+std::vector<Paragraph> splitParagraphs(std::string const &text) {
+    std::vector<Paragraph> paragraphs;
+
+    // Blank lines at the start of the text are the separator of the first
+    // paragraph.
+    std::size_t begin = 0;
+    for (std::size_t i = 0; i < text.size() && std::isspace(static_cast<unsigned char>(text[i])); ++i)
+        if (text[i] == '\n')
+            begin = i + 1;
+
+    std::string separator = text.substr(0, begin);
+
+    for (std::size_t i = begin; i < text.size(); ++i) {
+        if (text[i] != '\n')
+            continue;
+
+        // Find the last newline of the whitespace after this one. If there is
+        // one, there's a blank line here.
+        std::size_t last = i;
+        for (std::size_t j = i + 1; j < text.size() && std::isspace(static_cast<unsigned char>(text[j])); ++j)
+            if (text[j] == '\n')
+                last = j;
+
+        if (last == i)
+            continue;
+
+        paragraphs.push_back(Paragraph{std::move(separator), text.substr(begin, i - begin)});
+        separator = text.substr(i, last + 1 - i);
+        begin = last + 1;
+        i = last;
     }
-    return numWords;
+
+    paragraphs.push_back(Paragraph{std::move(separator), text.substr(begin)});
+    return paragraphs;
 }
 
+/**
+ * Paragraphs being translated for one input. Shared with the callbacks, so it
+ * is still around if one of them comes back after we gave up waiting.
+ */
+struct PendingTranslation {
+    std::mutex mutex;
+    std::vector<Translation::Part> parts;
+    std::size_t remaining; // Number of parts still waiting for the service
+    std::vector<bool> waiting; // Which ones those are
+    std::size_t ready{0}; // Leading parts that are done
+    bool stream{false}; // Emit translationUpdated() as parts are done
+    bool cancelled{false};
+    std::chrono::steady_clock::time_point end;
+    std::chrono::steady_clock::duration postprocess{0}; // Total over all parts
+};
+
 } // Anonymous namespace
 
 struct TranslationInput {
     std::string text;
     marian::bergamot::ResponseOptions options;
+    instrumentation::Clock::time_point submitted;
 };
 
 struct ModelDescription {
     std::string config_file;
     translateLocally::marianSettings settings;
+
+    // Identifies the loaded model: the same model loaded with different
+    // settings for marian is a different model.
+    std::string key() const {
+        return config_file
+            + "|" + std::to_string(settings.cpu_threads)
+            + "|" + std::to_string(settings.workspace)
+            + "|" + std::to_string(settings.mini_batch_words);
+    }
 };
 
 MarianInterface::MarianInterface(QObject *parent)
     : QObject(parent)
     , pendingInput_(nullptr)
     , pendingModel_(nullptr)
-    , pendingShutdown_(false) {
+    , pendingShutdown_(false)
+    , preemptRequested_(false)
+    , idleTimeout_(0)
+    , memoryBudget_(0) {
 
     // This worker is the only thread that can interact with Marian. Right now
     // it basically uses marian::bergamot::Service's non-blocking interface
@@ -70,18 +175,111 @@ MarianInterface::MarianInterface(QObject *parent)
     // request.
     worker_ = std::thread([&]() {
         std::unique_ptr<marian::bergamot::AsyncService> service;
+        marian::bergamot::AsyncService::Config currentServiceConfig;
         std::shared_ptr<marian::bergamot::TranslationModel> model;
+        std::string modelKey;
+
+        // What `model` was loaded from, so it can be loaded again after it
+        // was unloaded for being idle.
+        std::unique_ptr<ModelDescription> modelDescription;
+
+        // The model we used before the current one. Kept loaded so switching
+        // back and forth between two language pairs doesn't reload either.
+        std::shared_ptr<marian::bergamot::TranslationModel> previousModel;
+        std::string previousModelKey;
+
+        // Paragraphs of the last translation, by their source text, so the
+        // next translation can reuse those that didn't change.
+        std::unordered_map<std::string, std::shared_ptr<const Translation::Paragraph>> translatedParagraphs;
+
+        auto switchModel = [&](ModelDescription const &description) {
+            // Only reconstruct the service if cpu_threads or the cache
+            // size changed. Otherwise keep its worker threads, and its
+            // cache, which stays valid for the models we keep around.
+            marian::bergamot::AsyncService::Config serviceConfig;
+            serviceConfig.numWorkers = description.settings.cpu_threads;
+            serviceConfig.cacheSize = description.settings.translation_cache ? description.settings.translation_cache_size : 0;
+
+            if (!service || serviceConfig.numWorkers != currentServiceConfig.numWorkers || serviceConfig.cacheSize != currentServiceConfig.cacheSize) {
+                // Free up old service first (see https://github.com/browsermt/bergamot-translator/issues/290)
+                service.reset();
+
+                service = std::make_unique<marian::bergamot::AsyncService>(serviceConfig);
+                currentServiceConfig = serviceConfig;
+            }
 
-        std::mutex internal_mutex;
+            // Switch models. The old model is not in use anymore by
+            // the service, since all translation requests are
+            // effectively blocking in this thread.
+            translatedParagraphs.clear();
+
+            std::string key = description.key();
+            if (key == previousModelKey) {
+                std::swap(model, previousModel);
+                std::swap(modelKey, previousModelKey);
+            } else if (key != modelKey) {
+                // Make room before loading the new model, so we don't
+                // hold three models in memory at the same time.
+                previousModel.reset();
+                previousModelKey.clear();
+
+                auto modelConfig = makeOptions(description.config_file, description.settings);
+                auto loaded = makeTranslationModel(modelConfig, description.settings.cpu_threads);
+
+                previousModel = std::move(model);
+                previousModelKey = std::move(modelKey);
+                model = std::move(loaded);
+                modelKey = std::move(key);
+            }
+
+            // Over budget: the previous model is the one thing we can do
+            // without.
+            std::size_t budget = memoryBudget_;
+            qint64 resident = budget > 0 ? memory::residentSize() : -1;
+            if (previousModel && resident >= 0 && static_cast<std::size_t>(resident) > budget) {
+                previousModel.reset();
+                previousModelKey.clear();
+                memory::release();
+            }
+        };
 
         while (true) {
             std::unique_ptr<ModelDescription> modelChange;
             std::unique_ptr<TranslationInput> input;
 
             {
-                // Wait for work
+                // Wait for work. With a model loaded, only for so long: then
+                // it's unloaded until the next translation needs it.
                 std::unique_lock<std::mutex> lock(mutex_);
-                cv_.wait(lock, [&]{ return pendingModel_ || pendingInput_ || pendingShutdown_; });
+                auto hasWork = [&]{ return pendingModel_ || pendingInput_ || pendingShutdown_; };
+
+                // Also woken by setIdleTimeout(), to wait again with the new
+                // timeout.
+                auto timeout = idleTimeout_;
+                auto wakeUp = [&]{ return hasWork() || idleTimeout_ != timeout; };
+
+                if (model && timeout.count() > 0) {
+                    if (!cv_.wait_for(lock, timeout, wakeUp)) {
+                        lock.unlock();
+
+                        // The workspaces of the workers belong to the model's
+                        // replicas, so those go as well. The service goes too,
+                        // with its threads and cache.
+                        translatedParagraphs.clear();
+                        previousModel.reset();
+                        previousModelKey.clear();
+                        model.reset();
+                        modelKey.clear();
+                        service.reset();
+                        memory::release();
+                        continue;
+                    }
+                } else {
+                    cv_.wait(lock, wakeUp);
+                }
+
+                if (!hasWork())
+                    continue;
 
                 // First check whether the command is loading a new model
                 if (pendingModel_)
@@ -90,8 +288,10 @@ MarianInterface::MarianInterface(QObject *parent)
                 // Second check whether command is translating something.
                 // Note: else if because we only process one command per
                 // iteration otherwise commandIssued_ would go out of sync.
-                else if (pendingInput_)
+                else if (pendingInput_) {
                     input = std::move(pendingInput_);
+                    preemptRequested_ = false;
+                }
                 
                 // Command without any pending change -> poison.
                 else
@@ -102,56 +302,154 @@ MarianInterface::MarianInterface(QObject *parent)
 
             try {
                 if (modelChange) {
-                    // Reconstruct the service because cpu_threads might have changed.
-                    // @TODO: don't recreate Service if cpu_threads didn't change?
-                    marian::bergamot::AsyncService::Config serviceConfig;
-                    serviceConfig.numWorkers = modelChange->settings.cpu_threads;
-                    serviceConfig.cacheSize = modelChange->settings.translation_cache ? kTranslationCacheSize : 0;
-                    
-                    // Free up old service first (see https://github.com/browsermt/bergamot-translator/issues/290)
-                    // Calling clear to remove any pending translations so we
-                    // do not have to wait for those when AsyncService is destroyed.
-                    service.reset();
-
-                    service = std::make_unique<marian::bergamot::AsyncService>(serviceConfig);
-
-                    // Initialise a new model. Old model will be released if
-                    // service is done with it, which it is since all translation
-                    // requests are effectively blocking in this thread.
-                    auto modelConfig = makeOptions(modelChange->config_file, modelChange->settings);
-                    model = std::make_shared<marian::bergamot::TranslationModel>(modelConfig, modelChange->settings.cpu_threads);
+                    switchModel(*modelChange);
+                    modelDescription = std::move(modelChange);
                 } else if (input) {
+                    // Unloaded for being idle? Then load it again first.
+                    if (!model && modelDescription)
+                        switchModel(*modelDescription);
+
                     if (model) {
-                        std::future<int> wordCount = std::async(countWords, input->text); // @TODO we're doing an "unnecessary" string copy here (necessary because we std::move input into service->translate)
+                        // Plain text is translated paragraph by paragraph, and
+                        // paragraphs that were in the previous input are taken
+                        // from its translation. So when editing a long text,
+                        // only the paragraph that changed is translated again.
+                        // HTML can't be split up like that, so that's always
+                        // translated as a whole.
+                        std::vector<Paragraph> paragraphs;
+                        if (input->options.HTML)
+                            paragraphs.push_back(Paragraph{std::string(), std::move(input->text)});
+                        else
+                            paragraphs = splitParagraphs(input->text);
+
+                        auto pending = std::make_shared<PendingTranslation>();
+                        pending->parts.resize(paragraphs.size());
+                        pending->waiting.resize(paragraphs.size(), false);
+                        pending->remaining = 0;
 
-                        Translation translation;
+                        // Showing the first paragraphs of a new text early
+                        // beats waiting for all of them. When editing, the rest
+                        // of the previous translation is still on screen, and
+                        // shouldn't be cut off.
+                        pending->stream = std::none_of(paragraphs.begin(), paragraphs.end(), [&](Paragraph const &paragraph) {
+                            return translatedParagraphs.count(paragraph.text) > 0;
+                        });
+
+                        int words = 0;
 
                         // Measure the time it takes to queue and respond to the
-                        // translation request
+                        // translation requests
                         auto start = std::chrono::steady_clock::now(); // Time the translation
-                        service->translate(model, std::move(input->text), [&] (auto &&val) {
-                            auto end = std::chrono::steady_clock::now();
+                        pending->end = start;
+                        instrumentation::record(instrumentation::Stage::QueueWait, input->submitted, start);
+
+                        for (std::size_t i = 0; i < paragraphs.size(); ++i) {
+                            Translation::Part &part = pending->parts[i];
+                            part.separator = std::move(paragraphs[i].separator);
+
+                            if (isBlank(paragraphs[i].text)) {
+                                part.separator += paragraphs[i].text;
+                                continue;
+                            }
+
+                            if (!input->options.HTML) {
+                                auto it = translatedParagraphs.find(paragraphs[i].text);
+                                if (it != translatedParagraphs.end()) {
+                                    part.paragraph = it->second;
+                                    continue;
+                                }
+                            }
+
+                            words += countWords(paragraphs[i].text);
+
+                            {
+                                std::unique_lock<std::mutex> lock(pending->mutex);
+                                ++pending->remaining;
+                                pending->waiting[i] = true;
+                            }
+
+                            service->translate(model, std::move(paragraphs[i].text), [this, pending, i] (marian::bergamot::Response &&val) {
+                                auto begin = std::chrono::steady_clock::now();
+                                auto paragraph = Translation::makeParagraph(std::move(val));
+                                auto end = std::chrono::steady_clock::now();
+                                instrumentation::record(instrumentation::Stage::Postprocess, begin, end);
+
+                                {
+                                    std::unique_lock<std::mutex> lock(pending->mutex);
+                                    pending->postprocess += end - begin;
+                                    pending->parts[i].paragraph = std::move(paragraph);
+                                    pending->waiting[i] = false;
+                                    if (--pending->remaining == 0) {
+                                        pending->end = std::chrono::steady_clock::now();
+                                    } else {
+                                        if (pending->stream && !pending->cancelled) {
+                                            std::size_t ready = pending->ready;
+                                            while (!pending->waiting[pending->ready])
+                                                ++pending->ready;
+                                            if (pending->ready > ready)
+                                                emit translationUpdated(Translation(std::vector<Translation::Part>(pending->parts.begin(), pending->parts.begin() + pending->ready), 0));
+                                        }
+                                        return;
+                                    }
+                                }
+
+                                // The worker waits under mutex_, so taking it
+                                // makes sure it's either still to check, or
+                                // already waiting for this notification.
+                                std::unique_lock<std::mutex> lock(mutex_);
+                                cv_.notify_one();
+                            }, input->options);
+                        }
+
+                        // Wait for either all paragraphs to be translated, or a reason to cancel.
+                        // Under mutex_, like everything that changes those reasons.
+                        {
+                            auto finished = [&] {
+                                std::unique_lock<std::mutex> lock(pending->mutex);
+                                return pending->remaining == 0;
+                            };
+                            std::unique_lock<std::mutex> lock(mutex_);
+                            cv_.wait(lock, [&] { return finished() || pendingShutdown_ || pendingModel_ || preemptRequested_; });
+                        }
+
+                        std::unique_lock<std::mutex> lock(pending->mutex);
+
+                        if (pending->remaining == 0) {
                             // Calculate translation speed in terms of words per second
-                            double words = wordCount.get();
-                            std::chrono::duration<double> elapsedSeconds = end - start;
-                            int translationSpeed = std::ceil(words / elapsedSeconds.count());
-                            
-                            std::unique_lock<std::mutex> lock(internal_mutex);
-                            translation = Translation(std::move(val), translationSpeed);
-                            cv_.notify_one();
-                        }, input->options);
-                        
-                        
-                        // Wait for either translate lambda to call back, or a reason to cancel
-                        std::unique_lock<std::mutex> lock(internal_mutex);
-                        cv_.wait(lock, [&] { return translation || pendingShutdown_ || pendingModel_; });
-                        
-                        if (translation)
-                            emit translationReady(translation);
-                        else
+                            std::chrono::duration<double> elapsedSeconds = pending->end - start;
+                            int translationSpeed = words > 0 ? std::ceil(words / elapsedSeconds.count()) : 0;
+                            instrumentation::record(instrumentation::Stage::Translate, start, pending->end);
+
+                            using Milliseconds = std::chrono::duration<double, std::milli>;
+                            Translation::Timings timings;
+                            timings.queue = Milliseconds(start - input->submitted).count();
+                            timings.translate = Milliseconds(pending->end - start).count();
+                            timings.postprocess = Milliseconds(pending->postprocess).count();
+
+                            // Remember the paragraphs of this translation for
+                            // the next one. Only these, so what we keep around
+                            // doesn't grow beyond the size of the input.
+                            if (!input->options.HTML) {
+                                translatedParagraphs.clear();
+                                for (Translation::Part const &part : pending->parts)
+                                    if (part.paragraph)
+                                        translatedParagraphs.emplace(Translation::source(*part.paragraph), part.paragraph);
+                            }
+
+                            emit translationReady(Translation(pending->parts, translationSpeed, timings));
+                        } else {
+                            pending->cancelled = true;
                             service->clear(); // translation was interrupted. Clear pending batches
                                               // now to free any references to things that will go
                                               // out of scope.
+
+                            // Paragraphs that did finish are likely still in
+                            // the next input.
+                            if (!input->options.HTML)
+                                for (Translation::Part const &part : pending->parts)
+                                    if (part.paragraph)
+                                        translatedParagraphs.emplace(Translation::source(*part.paragraph), part.paragraph);
+                        }
                     } else {
                         // TODO: What? Raise error? Set model_ to ""?
                     }
@@ -186,7 +484,7 @@ void MarianInterface::setModel(QString path_to_model_dir, const translateLocally
     cv_.notify_one();
 }
 
-void MarianInterface::translate(QString in, bool HTML) {
+void MarianInterface::translate(QString in, bool HTML, bool preempt) {
     // If we don't have a model yet (loaded, or queued to be loaded, doesn't matter)
     // then don't bother trying to translate something.
     if (model_.isEmpty())
@@ -196,12 +494,26 @@ void MarianInterface::translate(QString in, bool HTML) {
     std::unique_ptr<TranslationInput> input(new TranslationInput{in.toStdString(), marian::bergamot::ResponseOptions{}});
     input->options.alignment = true;
     input->options.HTML = HTML;
+    input->submitted = instrumentation::Clock::now();
 
     std::swap(pendingInput_, input);
+
+    if (preempt)
+        preemptRequested_ = true;
     
     cv_.notify_one();
 }
 
+void MarianInterface::setIdleTimeout(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idleTimeout_ = timeout;
+    cv_.notify_one();
+}
+
+void MarianInterface::setMemoryBudget(std::size_t bytes) {
+    memoryBudget_ = bytes;
+}
+
 MarianInterface::~MarianInterface() {
     // Remove all pending changes and unlock worker (which will then break.)
     {
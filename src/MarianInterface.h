@@ -5,6 +5,8 @@
 #include <QObject>
 #include "types.h"
 #include "Translation.h"
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -13,7 +15,35 @@
 struct ModelDescription;
 struct TranslationInput;
 
-constexpr const size_t kTranslationCacheSize = 1 << 16;
+namespace marian {
+    class Options;
+    namespace bergamot {
+    class TranslationModel;
+    }
+}
+
+/**
+ * Path to the config of the model variant to load: the one with weights for
+ * the best instruction set this CPU supports, if the model comes with those,
+ * e.g. config.intgemm8bitalpha.avx2.yml, else config.intgemm8bitalpha.yml.
+ */
+std::string modelConfigPath(const std::string &path_to_model_dir);
+
+/**
+ * Reads the model's config (see modelConfigPath()) and overrides the options that
+ * translateLocally controls through its settings. Points them at the model's
+ * prepacked files if it has those. Shared by the GUI, the CLI
+ * and the native messaging interface so they all load models the same way.
+ */
+std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings);
+
+/**
+ * Loads a model with one replica per translation thread. If makeOptions()
+ * found prepacked files for it (see PrepackedModel.h), those are read into
+ * memory once and all replicas use that single copy. Otherwise each replica
+ * loads the model's own files.
+ */
+std::shared_ptr<marian::bergamot::TranslationModel> makeTranslationModel(std::shared_ptr<marian::Options> options, size_t replicas);
 
 class MarianInterface : public QObject {
     Q_OBJECT
@@ -22,6 +52,18 @@ private:
     std::unique_ptr<ModelDescription> pendingModel_;
     bool pendingShutdown_;
 
+    // Set by translate(..., preempt=true) to make the worker give up on the
+    // translation it is waiting for. Guarded by mutex_, like the two above.
+    bool preemptRequested_;
+
+    // How long the worker keeps a model loaded without anything to translate.
+    // Zero keeps it loaded. Guarded by mutex_.
+    std::chrono::milliseconds idleTimeout_;
+
+    // Resident set size in bytes above which the worker stops keeping the
+    // previous model around. Zero for no limit.
+    std::atomic<std::size_t> memoryBudget_;
+
     std::mutex mutex_;
     std::condition_variable cv_;
 
@@ -32,9 +74,36 @@ public:
     ~MarianInterface();
     QString const &model() const;
     void setModel(QString path_to_model_dir, const translateLocally::marianSettings& settings);
-    void translate(QString in, bool HTML=false);
+    /**
+     * @brief Translates `in`, once the translation that's in progress (if
+     * any) is done, unless `preempt` is set, in which case the translation in
+     * progress is abandoned. Paragraphs of it that were already translated
+     * are still reused.
+     */
+    void translate(QString in, bool HTML=false, bool preempt=false);
+
+    /**
+     * @brief Unloads the model, and returns its memory to the operating
+     * system, after `timeout` without translating anything. The next
+     * translation loads it again. Zero keeps models loaded.
+     */
+    void setIdleTimeout(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Once the process takes more than `bytes`, the model used before
+     * the current one is no longer kept loaded. Zero for no limit.
+     */
+    void setMemoryBudget(std::size_t bytes);
 signals:
     void translationReady(Translation translation);
+
+    /**
+     * @brief Emitted while a text is translated from scratch, each time more
+     * of its paragraphs are done, with the paragraphs translated so far from
+     * the start, up to the first that isn't. translationReady() follows with
+     * the whole translation.
+     */
+    void translationUpdated(Translation partial);
     void pendingChanged(bool isBusy); // Disables issuing another translation while we are busy.
     void error(QString message);
 };
@@ -0,0 +1,41 @@
+#include "MemoryCache.h"
+#include <QCryptographicHash>
+#include <algorithm>
+#include <limits>
+
+MemoryCache::MemoryCache(std::size_t maxBytes)
+: cache_(static_cast<int>(std::min<std::size_t>(maxBytes, std::numeric_limits<int>::max()))) {
+    //
+}
+
+std::optional<std::string> MemoryCache::find(std::string const &model, std::string const &options, std::string const &source) {
+    QByteArray key = hash(model, options, source);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (std::string *target = cache_.object(key))
+        return *target;
+    return std::nullopt;
+}
+
+void MemoryCache::insert(std::string const &model, std::string const &options, std::string const &source, std::string const &target) {
+    QByteArray key = hash(model, options, source);
+    int cost = static_cast<int>(std::min<std::size_t>(key.size() + target.size(), std::numeric_limits<int>::max()));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_.insert(key, new std::string(target), cost); // Takes ownership, also if it's too big to keep
+}
+
+void MemoryCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_.clear();
+}
+
+QByteArray MemoryCache::hash(std::string const &model, std::string const &options, std::string const &source) const {
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(model.data(), static_cast<int>(model.size()));
+    hash.addData("\0", 1);
+    hash.addData(options.data(), static_cast<int>(options.size()));
+    hash.addData("\0", 1);
+    hash.addData(source.data(), static_cast<int>(source.size()));
+    return hash.result();
+}
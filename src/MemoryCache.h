@@ -0,0 +1,45 @@
+#pragma once
+#include <QByteArray>
+#include <QCache>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+
+/**
+ * Translations kept in memory for as long as this process runs, for text
+ * that is likely to come by again soon, like the first leg of a page that is
+ * pivoted into several languages. Same keys as PersistentCache, but nothing
+ * is written to disk. Once it holds `maxBytes` of translations, the least
+ * recently used ones make room.
+ *
+ * Thread-safe.
+ */
+class MemoryCache {
+public:
+    explicit MemoryCache(std::size_t maxBytes);
+
+    MemoryCache(const MemoryCache &) = delete;
+    MemoryCache &operator=(const MemoryCache &) = delete;
+
+    /**
+     * @brief find looks up a translation. See PersistentCache::find().
+     */
+    std::optional<std::string> find(std::string const &model, std::string const &options, std::string const &source);
+
+    /**
+     * @brief insert adds a translation. See PersistentCache::insert().
+     */
+    void insert(std::string const &model, std::string const &options, std::string const &source, std::string const &target);
+
+    /**
+     * @brief clear drops all translations, e.g. to make room for a model.
+     */
+    void clear();
+
+private:
+    std::mutex mutex_; // QCache updates its order even when just looking
+    QCache<QByteArray, std::string> cache_;
+
+    QByteArray hash(std::string const &model, std::string const &options, std::string const &source) const;
+};
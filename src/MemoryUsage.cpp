@@ -0,0 +1,60 @@
+#include "MemoryUsage.h"
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
+#elif defined(Q_OS_MACOS)
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#else
+#include <unistd.h>
+#include <cstdio>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#endif
+
+namespace memory {
+
+qint64 residentSize() {
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return -1;
+    return counters.WorkingSetSize;
+#elif defined(Q_OS_MACOS)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+        return -1;
+    return info.resident_size;
+#elif defined(Q_OS_LINUX)
+    // Second field is the resident set, in pages
+    FILE *file = std::fopen("/proc/self/statm", "r");
+    if (!file)
+        return -1;
+
+    long long size = 0, resident = 0;
+    int fields = std::fscanf(file, "%lld %lld", &size, &resident);
+    std::fclose(file);
+
+    if (fields != 2)
+        return -1;
+    return static_cast<qint64>(resident) * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
+
+void release() {
+#if defined(Q_OS_WIN)
+    _heapmin();
+#elif defined(Q_OS_MACOS)
+    malloc_zone_pressure_relief(nullptr, 0);
+#elif defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+} // namespace memory
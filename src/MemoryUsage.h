@@ -0,0 +1,25 @@
+#pragma once
+#include <QtGlobal>
+
+/**
+ * What this process takes from the operating system, for keeping within the
+ * memory_budget setting, and giving back what we don't need after unloading
+ * models.
+ */
+namespace memory {
+
+/**
+ * @brief Resident set size of this process in bytes, or -1 if the platform
+ * doesn't tell us.
+ */
+qint64 residentSize();
+
+/**
+ * @brief Returns memory that was freed, but that the allocator is holding on
+ * to, to the operating system. Freeing a model's weights and workspaces
+ * doesn't make the process any smaller by itself: glibc in particular keeps
+ * freed memory in its arenas, one for each thread that ever allocated.
+ */
+void release();
+
+} // namespace memory
@@ -0,0 +1,96 @@
+#include "ModelPool.h"
+#include <QDirIterator>
+#include <QFileInfo>
+
+// bergamot-translator
+#include "translator/translation_model.h"
+
+ModelPool::ModelPool(std::size_t budget)
+: budget_(budget)
+, used_(0) {
+    //
+}
+
+std::shared_ptr<marian::bergamot::TranslationModel> ModelPool::get(QString const &id) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->id == id) {
+            entries_.splice(entries_.begin(), entries_, it);
+            return it->model;
+        }
+    }
+
+    // Not in the pool, but maybe it is still in use by some translation? Then
+    // it is back in the pool.
+    auto evicted = evicted_.find(id);
+    if (evicted == evicted_.end())
+        return nullptr;
+
+    std::shared_ptr<marian::bergamot::TranslationModel> model = evicted->model.lock();
+    std::size_t size = evicted->size;
+    evicted_.erase(evicted);
+
+    if (model)
+        insert(id, model, size);
+
+    return model;
+}
+
+void ModelPool::insert(QString const &id, std::shared_ptr<marian::bergamot::TranslationModel> model, std::size_t size) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->id == id) {
+            used_ -= it->size;
+            entries_.erase(it);
+            break;
+        }
+    }
+
+    evicted_.remove(id);
+    entries_.push_front(Entry{id, std::move(model), size});
+    used_ += size;
+    evict();
+}
+
+void ModelPool::setBudget(std::size_t budget) {
+    budget_ = budget;
+    evict();
+}
+
+void ModelPool::clear() {
+    entries_.clear();
+    evicted_.clear();
+    used_ = 0;
+}
+
+void ModelPool::trim() {
+    std::size_t budget = budget_;
+    budget_ = 0;
+    evict();
+    budget_ = budget;
+}
+
+void ModelPool::evict() {
+    while (used_ > budget_ && entries_.size() > 1) {
+        Entry &entry = entries_.back();
+        used_ -= entry.size;
+        evicted_.insert(entry.id, EvictedEntry{entry.model, entry.size});
+        entries_.pop_back();
+    }
+
+    // Forget about evicted models that are really gone.
+    for (auto it = evicted_.begin(); it != evicted_.end();) {
+        if (it->model.expired())
+            it = evicted_.erase(it);
+        else
+            ++it;
+    }
+}
+
+std::size_t ModelPool::estimateSize(QString const &path) {
+    std::size_t size = 0;
+    QDirIterator it(path, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        size += it.fileInfo().size();
+    }
+    return size;
+}
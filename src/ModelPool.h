@@ -0,0 +1,102 @@
+#pragma once
+#include <QHash>
+#include <QString>
+#include <cstddef>
+#include <list>
+#include <memory>
+
+// If we include the actual header, we break QT compilation.
+namespace marian {
+    namespace bergamot {
+    class TranslationModel;
+    }
+}
+
+/**
+ * Keeps a number of loaded translation models around, keyed by model id, so
+ * switching back and forth between language pairs doesn't reload them from
+ * disk every time. When the models together take more memory than the budget,
+ * the least recently used ones are dropped.
+ *
+ * Models are shared pointers, so a model that was evicted but is still used by
+ * a queued translation stays alive until that translation finishes. The pool
+ * remembers those through a weak pointer, and hands them out again if asked
+ * for in the mean time instead of loading a second copy.
+ *
+ * Not thread-safe.
+ */
+class ModelPool {
+public:
+    /**
+     * @brief ModelPool
+     * @param budget memory budget in bytes for all models together.
+     */
+    explicit ModelPool(std::size_t budget);
+
+    /**
+     * @brief get looks up a loaded model and marks it as most recently used.
+     * @param id model id, as returned by Model::id().
+     * @return the model, or nullptr if it is not loaded.
+     */
+    std::shared_ptr<marian::bergamot::TranslationModel> get(QString const &id);
+
+    /**
+     * @brief insert adds a freshly loaded model as most recently used, and
+     * evicts the least recently used models if we're now over budget. The
+     * model just inserted is never evicted, even if it is over budget on its
+     * own.
+     * @param id model id
+     * @param model the loaded model
+     * @param size estimated memory use in bytes, see estimateSize().
+     */
+    void insert(QString const &id, std::shared_ptr<marian::bergamot::TranslationModel> model, std::size_t size);
+
+    /**
+     * @brief setBudget changes the memory budget, evicting models if needed.
+     */
+    void setBudget(std::size_t budget);
+
+    /**
+     * @brief clear drops all models, e.g. because the settings they were
+     * loaded with changed.
+     */
+    void clear();
+
+    /**
+     * @brief trim drops all models but the most recently used one, to make
+     * room when the process as a whole is over its memory budget.
+     */
+    void trim();
+
+    /**
+     * @brief estimateSize estimates the memory a model will take once loaded
+     * from the total size of the files in its directory. The weights, vocab and
+     * shortlist are loaded more or less as is, so this is close enough.
+     * @param path path to the model directory
+     */
+    static std::size_t estimateSize(QString const &path);
+
+private:
+    struct Entry {
+        QString id;
+        std::shared_ptr<marian::bergamot::TranslationModel> model;
+        std::size_t size;
+    };
+
+    std::size_t budget_;
+    std::size_t used_;
+
+    // Loaded models, most recently used first.
+    std::list<Entry> entries_;
+
+    struct EvictedEntry {
+        std::weak_ptr<marian::bergamot::TranslationModel> model;
+        std::size_t size;
+    };
+
+    // Models we evicted, but that might still be alive because a translation
+    // holds on to them.
+    QHash<QString, EvictedEntry> evicted_;
+
+    void evict();
+};
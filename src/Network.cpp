@@ -3,6 +3,7 @@
 #include <QTemporaryFile>
 #include <QSharedPointer>
 #include <QCoreApplication>
+#include <QTimer>
 
 Network::Network(QObject *parent)
     : QObject(parent)
@@ -18,9 +19,25 @@ QNetworkReply* Network::get(QNetworkRequest request) {
     return nam_->get(request);
 }
 
-QNetworkReply* Network::downloadFile(QUrl url, QFile *dest, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata) {
-    QNetworkReply *reply = get(QNetworkRequest(url));
+QNetworkReply* Network::head(QNetworkRequest request) {
+    request.setRawHeader("User-Agent", QString("%1/%2")
+        .arg(QCoreApplication::applicationName(), QCoreApplication::applicationVersion()).toUtf8());
+    return nam_->head(request);
+}
+
+Download* Network::download(QUrl url, Download::Writer write, Download::Completer complete, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata, QString partialPath) {
+    Download *download = new Download(this, url, write, complete, algorithm, hash, extradata, partialPath);
+    connect(download, &Download::error, this, &Network::error);
+    connect(download, &Download::progress, this, &Network::progressBar);
+
+    // Start from the event loop, so the caller can connect to its signals
+    // before anything happens.
+    QTimer::singleShot(0, download, &Download::start);
+
+    return download;
+}
 
+Download* Network::downloadFile(QUrl url, QFile *dest, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata) {
     // Open in read/write so we can easily read the data when handling the
     // downloadComplete signal.
     if (!dest->open(QIODevice::ReadWrite)) {
@@ -28,57 +45,22 @@ QNetworkReply* Network::downloadFile(QUrl url, QFile *dest, QCryptographicHash::
         return nullptr;
     }
 
-    // We have a hasher that hashes the download as it comes in and
-    // compares it against the provided hash when the download completes.
-    auto hasher = QSharedPointer<QCryptographicHash>::create(algorithm);
-    
     // While chunks come in, write them to the temp file
-    connect(reply, &QIODevice::readyRead, this, [=] {
-        QByteArray buffer = reply->readAll();
-
-        if (dest->write(buffer) == -1) {
-            emit error(tr("An error occurred while writing the downloaded data to disk: %1").arg(dest->errorString()), extradata);
-            reply->abort();
-        }
-
-        hasher->addData(buffer);
-    });
+    auto write = [=](QByteArray const &buffer) {
+        if (dest->write(buffer) == -1)
+            return tr("An error occurred while writing the downloaded data to disk: %1").arg(dest->errorString());
+        return QString();
+    };
 
     // When finished, emit downloadComplete(QFile*,QString)
-    connect(reply, &QNetworkReply::finished, this, [=] {
-        switch (reply->error()) {
-            case QNetworkReply::NoError: // Success
-                dest->flush(); // Flush the last downloaded data
-                dest->seek(0); // Rewind the file
-
-                // If we're checking the hash, now is the time as all data is downloaded.
-                if (!hash.isEmpty() && hasher->result() != hash) {
-                    emit error(tr("The cryptographic hash of %1 does not match the provided hash.\nExpected: %2\nActual: %3\nFile size: %4").arg(url.toString(),
-                                                                                                                                  QString(hash.toHex()),
-                                                                                                                                  QString(hasher->result().toHex()),
-                                                                                                                                  QString::number(dest->size())), extradata);
-                    break;
-                }
-                
-                emit downloadComplete(dest, reply->url().fileName(), extradata);
-                break;
-
-            case QNetworkReply::OperationCanceledError:
-                // ignore, it was intentional.
-                break;
-            
-            default:
-                emit error(tr("An error occurred while downloading %1: %2").arg(url.toString(), reply->errorString()), extradata);
-                break;
-        }
-
-        // In all cases, delete the reply next event loop.
-        reply->deleteLater();
-    });
-    
-    connect(reply, &QNetworkReply::downloadProgress, this, &Network::progressBar);
+    auto complete = [=](QString filename) {
+        dest->flush(); // Flush the last downloaded data
+        dest->seek(0); // Rewind the file
+        emit downloadComplete(dest, filename, extradata);
+        return QString();
+    };
 
-    return reply;
+    return download(url, write, complete, algorithm, hash, extradata);
 }
 
 /**
@@ -86,15 +68,15 @@ QNetworkReply* Network::downloadFile(QUrl url, QFile *dest, QCryptographicHash::
  * do not change the parent of the QTemporaryFile, it will be deleted
  * automatically after the downloadComplete(QFile*,QString) signal is handled.
  */
-QNetworkReply* Network::downloadFile(QUrl url, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata) {
+Download* Network::downloadFile(QUrl url, QCryptographicHash::Algorithm algorithm, QByteArray hash, QVariant extradata) {
     QTemporaryFile *dest = new QTemporaryFile();
-    QNetworkReply *reply = downloadFile(url, dest, algorithm, hash, extradata);
+    Download *download = downloadFile(url, dest, algorithm, hash, extradata);
     
-    // Make the lifetime of the temporary as long as the reply object itself
-    if (reply != nullptr)
-        dest->setParent(reply);
+    // Make the lifetime of the temporary as long as the download object itself
+    if (download != nullptr)
+        dest->setParent(download);
     else
         delete dest;
 
-    return reply;
+    return download;
 }
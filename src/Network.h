@@ -3,7 +3,9 @@
 #include <QObject>
 #include <QNetworkAccessManager>
 #include <QCryptographicHash>
+#include <functional>
 #include <memory>
+#include "Download.h"
 
 class QFile;
 
@@ -18,21 +20,42 @@ public:
      */
     QNetworkReply *get(QNetworkRequest request);
 
+    /**
+     * Same as get(), but for HEAD requests.
+     */
+    QNetworkReply *head(QNetworkRequest request);
+
+    /**
+     * Download a file and hand it to `write` chunk by chunk, in order, e.g. to
+     * process it while it is still downloading. When all data is in and
+     * matches `hash` (if given), `complete` is called with the suggested
+     * filename. Both return an error message, or an empty string if all is
+     * well. On an error from either of them, from the network, or if the hash
+     * doesn't match, the `error(QString,QVariant)` signal is emitted and the
+     * download is stopped. During download the `progressBar(qint64,qint64)`
+     * signal is emitted.
+     *
+     * If `partialPath` is given, the download is kept there while it is in
+     * progress, so it can be fetched in parallel segments and resumed if it
+     * is interrupted, even by a restart. See Download.
+     */
+    Download *download(QUrl url, Download::Writer write, Download::Completer complete, QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha256, QByteArray hash = QByteArray(), QVariant extradata = QVariant(), QString partialPath = QString());
+
     /**
      * Download a file to a destination on disk. Useful for skipping loading the
      * file in memory. The `downloadComplete(QFile,QString)` signal is emitted
      * with a pointer to the file and suggested filename. During download the
      * `progressBar(qint64,qint64)` signal is emitted.
      */ 
-    QNetworkReply *downloadFile(QUrl url, QFile* dest, QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha256, QByteArray hash = QByteArray(), QVariant extradata = QVariant());
+    Download *downloadFile(QUrl url, QFile* dest, QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha256, QByteArray hash = QByteArray(), QVariant extradata = QVariant());
 
     /**
      * Overloaded version of `downloadFile(QUrl,QFile)` that downloads to a
      * `QTemporaryFile`. The file will be deleted when the returned 
-     * `QNetworkReply` object is destroyed. But you can change this by changing
+     * `Download` object is destroyed. But you can change this by changing
      * the file's parent.
      */
-    QNetworkReply *downloadFile(QUrl url, QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha256, QByteArray hash = QByteArray(), QVariant extradata = QVariant());
+    Download *downloadFile(QUrl url, QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha256, QByteArray hash = QByteArray(), QVariant extradata = QVariant());
     
 private:
     std::unique_ptr<QNetworkAccessManager> nam_;
@@ -0,0 +1,413 @@
+#include "PersistentCache.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtEndian>
+#include <QDebug>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#if defined(Q_OS_UNIX)
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+// File starts with this. Bump the version if the record format changes, old
+// files are then discarded.
+constexpr char kFileMagic[] = "TLCACHE1";
+constexpr qint64 kFileMagicSize = sizeof(kFileMagic) - 1;
+
+// Every record starts with this, followed by the length of the translation as
+// little-endian uint32, the 16 byte key, and then the translation itself.
+constexpr char kRecordMagic[] = "TLCR";
+constexpr qint64 kRecordMagicSize = sizeof(kRecordMagic) - 1;
+constexpr qint64 kKeySize = 16; // MD5
+constexpr qint64 kRecordHeaderSize = kRecordMagicSize + 4 + kKeySize;
+
+// Translations are short, anything longer than this means we're reading garbage.
+constexpr quint32 kMaxRecordLength = 64 * 1024 * 1024;
+
+// How long to wait for another process to be done with the file.
+constexpr int kLockTimeout = 2000; // ms
+
+// How long the writer collects inserts before appending them in one go.
+constexpr std::chrono::milliseconds kFlushDelay(500);
+
+QByteArray makeRecord(QByteArray const &key, std::string const &target) {
+    QByteArray record;
+    record.reserve(kRecordHeaderSize + target.size());
+    record.append(kRecordMagic, kRecordMagicSize);
+
+    char length[4];
+    qToLittleEndian<quint32>(static_cast<quint32>(target.size()), length);
+    record.append(length, 4);
+
+    record.append(key);
+    record.append(target.data(), static_cast<int>(target.size()));
+    return record;
+}
+
+} // Anonymous namespace
+
+PersistentCache::PersistentCache(QString path, qint64 maxSize)
+: path_(std::move(path))
+, maxSize_(maxSize)
+, lockFile_(path_ + ".lock")
+, mapped_(nullptr)
+, mappedSize_(0)
+, scanned_(0)
+, hits_(0)
+, misses_(0)
+, evictions_(0)
+, broken_(false)
+, inserts_(0)
+, stopping_(false) {
+    // Compacting a large cache may take longer than any fixed time. A lock
+    // left behind by a process that died is still taken over.
+    lockFile_.setStaleLockTime(0);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        QDir().mkpath(QFileInfo(path_).absolutePath());
+        if (!lockFile_.tryLock(kLockTimeout)) {
+            qDebug() << "Could not lock translation cache" << path_;
+            return;
+        }
+        if (!open())
+            qDebug() << "Could not open translation cache" << path_ << ":" << file_.errorString();
+        lockFile_.unlock();
+    }
+
+    // Without a file there's nothing to write to, so don't collect inserts.
+    if (file_.isOpen())
+        writer_ = std::thread(&PersistentCache::writeLoop, this);
+    else
+        stopping_ = true;
+}
+
+PersistentCache::~PersistentCache() {
+    // The writer writes what's left before it stops.
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        stopping_ = true;
+    }
+    pendingCV_.notify_one();
+    if (writer_.joinable())
+        writer_.join();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    close();
+}
+
+QString PersistentCache::defaultPath() {
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("translations.cache");
+}
+
+std::string PersistentCache::modelKey(QString const &modelPath) {
+    QFileInfo info(modelPath);
+    return QString("%1@%2")
+        .arg(info.canonicalFilePath())
+        .arg(info.lastModified().toMSecsSinceEpoch())
+        .toStdString();
+}
+
+bool PersistentCache::isOpen() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return file_.isOpen();
+}
+
+PersistentCache::Stats PersistentCache::stats() const {
+    std::size_t inserts, pending;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        inserts = inserts_;
+        pending = pending_.size();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Stats{
+        hits_,
+        misses_,
+        inserts,
+        evictions_,
+        static_cast<std::size_t>(index_.size()) + pending,
+        file_.isOpen() ? file_.size() : 0
+    };
+}
+
+bool PersistentCache::open() {
+    file_.setFileName(path_);
+
+    // Unbuffered and in append mode, so each record ends up in a single write
+    // at the end of the file, even if other processes are appending too.
+    if (!file_.open(QIODevice::ReadWrite | QIODevice::Append | QIODevice::Unbuffered))
+        return false;
+
+    char magic[kFileMagicSize];
+    if (file_.size() < kFileMagicSize || !read(0, magic, kFileMagicSize) || std::memcmp(magic, kFileMagic, kFileMagicSize) != 0) {
+        // Empty, or not a file we can read. Start over.
+        if (!file_.resize(0) || file_.write(kFileMagic, kFileMagicSize) != kFileMagicSize) {
+            file_.close();
+            return false;
+        }
+    }
+
+    mappedSize_ = file_.size();
+    mapped_ = file_.map(0, mappedSize_);
+    if (!mapped_)
+        mappedSize_ = 0; // We'll just read() instead.
+
+    scanned_ = kFileMagicSize;
+    broken_ = false;
+    scan();
+    return true;
+}
+
+bool PersistentCache::reopen() {
+    close();
+    return open();
+}
+
+bool PersistentCache::replaced() const {
+#if defined(Q_OS_UNIX)
+    // Compacting puts a new file in place, which has a new inode. A file that
+    // was removed altogether counts as replaced too.
+    struct stat onDisk, ours;
+    if (::stat(QFile::encodeName(path_).constData(), &onDisk) != 0 || ::fstat(file_.handle(), &ours) != 0)
+        return true;
+    return onDisk.st_dev != ours.st_dev || onDisk.st_ino != ours.st_ino;
+#else
+    // Windows doesn't replace a file someone has open, see compact().
+    return false;
+#endif
+}
+
+void PersistentCache::close() {
+    if (mapped_)
+        file_.unmap(mapped_);
+    mapped_ = nullptr;
+    mappedSize_ = 0;
+    file_.close();
+    index_.clear();
+    scanned_ = 0;
+}
+
+bool PersistentCache::read(qint64 offset, char *data, qint64 length) {
+    if (offset + length <= mappedSize_) {
+        std::memcpy(data, mapped_ + offset, length);
+        return true;
+    }
+
+    return file_.seek(offset) && file_.read(data, length) == length;
+}
+
+void PersistentCache::scan() {
+    qint64 size = file_.size();
+    char header[kRecordHeaderSize];
+
+    while (scanned_ + kRecordHeaderSize <= size) {
+        if (!read(scanned_, header, kRecordHeaderSize))
+            break;
+
+        quint32 length = qFromLittleEndian<quint32>(header + kRecordMagicSize);
+        if (std::memcmp(header, kRecordMagic, kRecordMagicSize) != 0 || length > kMaxRecordLength) {
+            qDebug() << "Translation cache" << path_ << "is damaged at offset" << scanned_ << ", not adding to it anymore.";
+            broken_ = true;
+            break;
+        }
+
+        // Record not (completely) written yet. Try again next time.
+        if (scanned_ + kRecordHeaderSize + length > size)
+            break;
+
+        QByteArray key(header + kRecordMagicSize + 4, kKeySize);
+        index_.insert(key, Location{scanned_ + kRecordHeaderSize, length});
+        scanned_ += kRecordHeaderSize + length;
+    }
+}
+
+QByteArray PersistentCache::hash(std::string const &model, std::string const &options, std::string const &source) const {
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(model.data(), static_cast<int>(model.size()));
+    hash.addData("\0", 1);
+    hash.addData(options.data(), static_cast<int>(options.size()));
+    hash.addData("\0", 1);
+    hash.addData(source.data(), static_cast<int>(source.size()));
+    return hash.result();
+}
+
+std::optional<std::string> PersistentCache::find(std::string const &model, std::string const &options, std::string const &source) {
+    QByteArray key = hash(model, options, source);
+
+    // Inserted, but still waiting for the writer.
+    std::optional<std::string> pending;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        auto it = pending_.constFind(key);
+        if (it != pending_.constEnd())
+            pending = *it;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending) {
+        ++hits_;
+        return pending;
+    }
+
+    if (!file_.isOpen())
+        return std::nullopt;
+
+    // A hit in a file that was replaced in the meantime is still a valid
+    // translation, we have the old file open. So only misses need to check.
+    auto it = index_.constFind(key);
+    if (it == index_.constEnd()) {
+        if (replaced()) {
+            // Another process compacted the file.
+            if (!lockFile_.tryLock(kLockTimeout)) {
+                ++misses_;
+                return std::nullopt;
+            }
+            reopen();
+            lockFile_.unlock();
+        } else if (file_.size() > scanned_) {
+            // Or maybe it added the translation we're looking for.
+            scan();
+        }
+
+        it = index_.constFind(key);
+        if (it == index_.constEnd()) {
+            ++misses_;
+            return std::nullopt;
+        }
+    }
+
+    std::string target(it->length, '\0');
+    if (!read(it->offset, &target[0], it->length)) {
+        ++misses_;
+        return std::nullopt;
+    }
+
+    ++hits_;
+    return target;
+}
+
+void PersistentCache::insert(std::string const &model, std::string const &options, std::string const &source, std::string const &target) {
+    if (target.size() > kMaxRecordLength)
+        return;
+
+    QByteArray key = hash(model, options, source);
+
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        if (stopping_)
+            return;
+        pending_.insert(key, target);
+        ++inserts_;
+    }
+    pendingCV_.notify_one();
+}
+
+void PersistentCache::writeLoop() {
+    std::unique_lock<std::mutex> lock(pendingMutex_);
+    while (true) {
+        pendingCV_.wait(lock, [&] { return stopping_ || !pending_.isEmpty(); });
+        if (pending_.isEmpty())
+            return; // Stopping, and nothing left to write
+
+        // Give the inserts of the chunks and requests still in flight a moment
+        // to come in, so they're written together.
+        pendingCV_.wait_for(lock, kFlushDelay, [&] { return stopping_; });
+
+        QHash<QByteArray, std::string> records;
+        records.swap(pending_);
+        lock.unlock();
+        flush(records);
+        lock.lock();
+    }
+}
+
+void PersistentCache::flush(QHash<QByteArray, std::string> const &records) {
+    QByteArray data;
+    for (auto it = records.constBegin(); it != records.constEnd(); ++it)
+        data.append(makeRecord(it.key(), it.value()));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_.isOpen() || broken_)
+        return;
+
+    // Nobody can replace the file while we hold the lock, so once we've made
+    // sure we have the current file open, what we append isn't lost.
+    if (!lockFile_.tryLock(kLockTimeout))
+        return;
+
+    if (!replaced() || reopen()) {
+        // One write at the end of the file, as it's unbuffered and in append
+        // mode. We don't know where exactly our records ended up since other
+        // processes might have appended as well. Scanning will find them.
+        if (!broken_ && file_.write(data) == data.size()) {
+            scan();
+            if (file_.size() > maxSize_)
+                compact();
+        }
+    }
+
+    lockFile_.unlock();
+}
+
+void PersistentCache::compact() {
+    // Keep the most recently added records, i.e. those at the end of the file,
+    // until we fill half of the budget. That leaves room to grow before we
+    // need to do this again.
+    std::vector<std::pair<QByteArray, Location>> records;
+    records.reserve(index_.size());
+    for (auto it = index_.constBegin(); it != index_.constEnd(); ++it)
+        records.emplace_back(it.key(), it.value());
+
+    std::sort(records.begin(), records.end(), [](auto const &a, auto const &b) {
+        return a.second.offset > b.second.offset;
+    });
+
+    qint64 budget = maxSize_ / 2;
+    qint64 size = kFileMagicSize;
+    std::size_t keep = 0;
+    while (keep < records.size() && size + kRecordHeaderSize + records[keep].second.length <= budget)
+        size += kRecordHeaderSize + records[keep++].second.length;
+
+    QSaveFile out(path_);
+    if (!out.open(QIODevice::WriteOnly)) {
+        broken_ = true; // So we don't try again on every insert.
+        return;
+    }
+
+    out.write(kFileMagic, kFileMagicSize);
+
+    // Write oldest first, so what we keep stays in the same order.
+    std::string target;
+    for (std::size_t i = keep; i-- > 0;) {
+        target.resize(records[i].second.length);
+        if (!read(records[i].second.offset, &target[0], records[i].second.length)) {
+            out.cancelWriting();
+            broken_ = true;
+            return;
+        }
+        out.write(makeRecord(records[i].first, target));
+    }
+
+    // Fails e.g. on Windows if another process has the cache open. We'll just
+    // stop adding to it for now.
+    if (!out.commit()) {
+        broken_ = true;
+        return;
+    }
+
+    evictions_ += records.size() - keep;
+
+    close();
+    open();
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <QFile>
+#include <QHash>
+#include <QLockFile>
+#include <QString>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+/**
+ * Translation cache on disk, so translations survive restarts of the
+ * application and are shared between all translateLocally processes of the
+ * user (command line runs and the native messaging host.)
+ *
+ * The cache is a single append-only file of records, each holding the
+ * translation of a piece of text, keyed by an MD5 hash of the model, the
+ * options that affect the translation, and the source text. The part of the
+ * file that exists when the cache is opened is memory mapped; records other
+ * processes append later are picked up when we miss. Once the file grows past
+ * its size limit, it is compacted into a new file with only the most recently
+ * added half of the records.
+ *
+ * insert() doesn't touch the disk: records are collected and appended by a
+ * writer thread of the cache's own, so the translation threads that insert
+ * from their callbacks never wait for I/O.
+ *
+ * Opening, appending and compacting happen while holding a lock file next to
+ * the cache, so processes never append to a file that another one is
+ * replacing. A process that still has the old file open after another one
+ * compacted it keeps reading the old records, and notices the new file (by
+ * its inode) when it misses or appends.
+ *
+ * Thread-safe.
+ */
+class PersistentCache {
+public:
+    /**
+     * @brief PersistentCache opens (or creates) the cache file.
+     * @param path path to the cache file
+     * @param maxSize size in bytes the file is allowed to grow to before it is
+     * compacted.
+     */
+    PersistentCache(QString path, qint64 maxSize);
+    ~PersistentCache();
+
+    PersistentCache(const PersistentCache &) = delete;
+    PersistentCache &operator=(const PersistentCache &) = delete;
+
+    /**
+     * @brief defaultPath where translateLocally keeps its cache file.
+     */
+    static QString defaultPath();
+
+    /**
+     * @brief modelKey identifies a model for use as key. Based on where the
+     * model lives and when it was last changed, so an updated model does not
+     * reuse translations of its previous version.
+     * @param modelPath path to the model directory
+     */
+    static std::string modelKey(QString const &modelPath);
+
+    /**
+     * @brief isOpen whether we could open the cache file. If not, find() never
+     * finds anything and insert() does nothing.
+     */
+    bool isOpen() const;
+
+    /**
+     * @brief find looks up a translation.
+     * @param model key of the model, see modelKey()
+     * @param options anything other than the model and source text that
+     * affects the translation, e.g. whether the input is HTML.
+     * @param source text that was translated
+     * @return the translation, or std::nullopt if it isn't in the cache.
+     */
+    std::optional<std::string> find(std::string const &model, std::string const &options, std::string const &source);
+
+    /**
+     * @brief insert adds a translation to the cache. See find() for the
+     * arguments. It's written to the file shortly after, in the background.
+     */
+    void insert(std::string const &model, std::string const &options, std::string const &source, std::string const &target);
+
+    /**
+     * Counters since this cache was opened, plus what's currently in it
+     * (including what other processes added.)
+     */
+    struct Stats {
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t inserts;
+        std::size_t evictions; // Records dropped when compacting
+        std::size_t entries;
+        qint64 bytes; // Size of the cache file
+    };
+
+    Stats stats() const;
+
+private:
+    struct Location {
+        qint64 offset; // of the translation in the file
+        quint32 length;
+    };
+
+    QString path_;
+    qint64 maxSize_;
+
+    // Held by whichever process is opening, appending to or compacting the
+    // file. Only used while holding mutex_.
+    QLockFile lockFile_;
+
+    mutable std::mutex mutex_;
+    QFile file_;
+    uchar *mapped_;
+    qint64 mappedSize_;
+
+    // Where each translation is, and up to where we have read the file.
+    QHash<QByteArray, Location> index_;
+    qint64 scanned_;
+
+    std::size_t hits_;
+    std::size_t misses_;
+    std::size_t evictions_;
+
+    // Set if we find something in the file that we don't understand. We then
+    // stop adding to it, to not make matters worse.
+    bool broken_;
+
+    // Inserted but not written yet, for writer_. Guarded by pendingMutex_,
+    // which is never held together with mutex_.
+    mutable std::mutex pendingMutex_;
+    std::condition_variable pendingCV_;
+    QHash<QByteArray, std::string> pending_;
+    std::size_t inserts_;
+    bool stopping_;
+    std::thread writer_;
+
+    // These expect the caller to hold mutex_, and the ones that write to the
+    // file lockFile_ too.
+    bool open();
+    void close();
+    bool reopen();
+    bool replaced() const;
+    void scan();
+    void compact();
+
+    // Runs on writer_, takes the locks itself.
+    void writeLoop();
+    void flush(QHash<QByteArray, std::string> const &records);
+    bool read(qint64 offset, char *data, qint64 length);
+    QByteArray hash(std::string const &model, std::string const &options, std::string const &source) const;
+};
@@ -0,0 +1,247 @@
+#include "ShardedService.h"
+#include "MarianInterface.h"
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+#include "3rd_party/bergamot-translator/src/translator/response.h"
+#include <QFile>
+#include <QStringList>
+#include <QtGlobal>
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+#if defined(Q_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+/**
+ * Parses the CPU (or node) list format of the Linux kernel, e.g. "0-3,8-11".
+ */
+QList<int> parseList(QString const &list) {
+    QList<int> values;
+    for (QString const &range : list.trimmed().split(",")) {
+        if (range.isEmpty())
+            continue;
+        QStringList bounds = range.split("-");
+        int first = bounds.first().toInt();
+        int last = bounds.last().toInt();
+        for (int value = first; value <= last; ++value)
+            values.append(value);
+    }
+    return values;
+}
+
+QString readFile(QString const &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return QString();
+    return QString::fromLatin1(file.readAll());
+}
+
+/**
+ * Runs work(i) for every shard, each on a thread pinned to the CPUs of that
+ * shard, and waits for all of them. Threads started by the work, such as a
+ * service's workers, inherit the pinning. Memory is allocated on the node of
+ * the CPU that first touches it, so what the work allocates ends up on its
+ * shard's node too. Rethrows the first exception thrown by any of the work.
+ */
+template <typename Work>
+void runPinned(QList<QList<int>> const &cpus, Work work) {
+    std::vector<std::exception_ptr> errors(cpus.size());
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < cpus.size(); ++i) {
+        threads.emplace_back([&, i] {
+#if defined(Q_OS_LINUX)
+            if (!cpus[i].isEmpty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : cpus[i])
+                    if (cpu < CPU_SETSIZE)
+                        CPU_SET(cpu, &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            }
+#endif
+            try {
+                work(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (std::exception_ptr const &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+} // Anonymous namespace
+
+QList<QList<int>> ShardedService::numaNodes() {
+    QList<QList<int>> nodes;
+#if defined(Q_OS_LINUX)
+    for (int node : parseList(readFile("/sys/devices/system/node/online"))) {
+        // Nodes with only memory and no CPUs have nothing to run a shard on
+        QList<int> cpus = parseList(readFile(QString("/sys/devices/system/node/node%1/cpulist").arg(node)));
+        if (!cpus.isEmpty())
+            nodes.append(cpus);
+    }
+#endif
+    if (nodes.size() < 2)
+        nodes.clear();
+    return nodes;
+}
+
+ShardedService::ShardedService(Config const &config) {
+    QList<QList<int>> cpus = config.numa ? numaNodes() : QList<QList<int>>();
+    if (cpus.isEmpty())
+        cpus.append(QList<int>()); // One shard, not pinned
+
+    // Divide the threads over the shards, but no more per shard than the
+    // smallest node has CPUs: more would only get in each other's way.
+    workersPerShard_ = std::max<std::size_t>(config.numWorkers / cpus.size(), 1);
+    for (QList<int> const &node : cpus)
+        if (!node.isEmpty())
+            workersPerShard_ = std::min<std::size_t>(workersPerShard_, node.size());
+
+    for (QList<int> const &node : cpus) {
+        shards_.emplace_back(new Shard());
+        shards_.back()->cpus = node;
+    }
+
+    marian::bergamot::AsyncService::Config serviceConfig;
+    serviceConfig.numWorkers = workersPerShard_;
+    serviceConfig.cacheSize = config.cacheSize;
+
+    if (shards_.size() == 1) {
+        shards_.front()->service = std::make_shared<marian::bergamot::AsyncService>(serviceConfig);
+        return;
+    }
+
+    runPinned(cpus, [&](int i) {
+        shards_[i]->service = std::make_shared<marian::bergamot::AsyncService>(serviceConfig);
+    });
+}
+
+ShardedService::~ShardedService() {
+    // Stop the services before anything their callbacks might use goes away
+    for (auto &shard : shards_)
+        shard->service.reset();
+}
+
+std::size_t ShardedService::shards() const {
+    return shards_.size();
+}
+
+std::size_t ShardedService::workersPerShard() const {
+    return workersPerShard_;
+}
+
+std::shared_ptr<marian::bergamot::TranslationModel> ShardedService::loadModel(std::shared_ptr<marian::Options> options) {
+    if (shards_.size() == 1)
+        return makeTranslationModel(options, workersPerShard_);
+
+    // Options aren't meant to be read from several threads at once, so every
+    // shard gets its own copy.
+    std::vector<std::shared_ptr<marian::Options>> shardOptions{options};
+    while (shardOptions.size() < shards_.size())
+        shardOptions.push_back(options->clone());
+
+    auto copies = std::make_shared<Copies>();
+    copies->models.resize(shards_.size());
+
+    QList<QList<int>> cpus;
+    for (auto const &shard : shards_)
+        cpus.append(shard->cpus);
+
+    runPinned(cpus, [&](int i) {
+        copies->models[i] = makeTranslationModel(shardOptions[i], workersPerShard_);
+    });
+
+    // The first shard's copy, but sharing ownership of all of them.
+    std::shared_ptr<marian::bergamot::TranslationModel> model(copies, copies->models.front().get());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = copies_.begin(); it != copies_.end();) {
+        if (it->second.expired())
+            it = copies_.erase(it);
+        else
+            ++it;
+    }
+    copies_[model.get()] = copies;
+
+    return model;
+}
+
+void ShardedService::translate(std::shared_ptr<marian::bergamot::TranslationModel> model, std::string &&source, Callback callback, marian::bergamot::ResponseOptions const &options) {
+    std::size_t bytes = source.size();
+    std::size_t shard = pick(bytes);
+    try {
+        shards_[shard]->service->translate(copy(model, shard), std::move(source), release(shard, bytes, std::move(callback)), options);
+    } catch (...) {
+        shards_[shard]->inFlight -= bytes;
+        throw;
+    }
+}
+
+void ShardedService::pivot(std::shared_ptr<marian::bergamot::TranslationModel> first, std::shared_ptr<marian::bergamot::TranslationModel> second, std::string &&source, Callback callback, marian::bergamot::ResponseOptions const &options) {
+    std::size_t bytes = source.size();
+    std::size_t shard = pick(bytes);
+    try {
+        shards_[shard]->service->pivot(copy(first, shard), copy(second, shard), std::move(source), release(shard, bytes, std::move(callback)), options);
+    } catch (...) {
+        shards_[shard]->inFlight -= bytes;
+        throw;
+    }
+}
+
+void ShardedService::clear() {
+    for (auto &shard : shards_)
+        shard->service->clear();
+}
+
+ShardedService::CacheStats ShardedService::cacheStats() const {
+    CacheStats total{0, 0};
+    for (auto const &shard : shards_) {
+        auto stats = shard->service->cacheStats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+    }
+    return total;
+}
+
+std::size_t ShardedService::pick(std::size_t bytes) {
+    std::size_t best = 0;
+    for (std::size_t i = 1; i < shards_.size(); ++i)
+        if (shards_[i]->inFlight < shards_[best]->inFlight)
+            best = i;
+
+    shards_[best]->inFlight += bytes;
+    return best;
+}
+
+std::shared_ptr<marian::bergamot::TranslationModel> ShardedService::copy(std::shared_ptr<marian::bergamot::TranslationModel> const &model, std::size_t shard) const {
+    if (shard == 0)
+        return model;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = copies_.find(model.get());
+    if (it != copies_.end())
+        if (auto copies = it->second.lock())
+            return copies->models[shard];
+
+    // Not loaded through us: it works, just not from local memory.
+    return model;
+}
+
+ShardedService::Callback ShardedService::release(std::size_t shard, std::size_t bytes, Callback callback) {
+    return [inFlight = &shards_[shard]->inFlight, bytes, callback = std::move(callback)](marian::bergamot::Response &&response) {
+        *inFlight -= bytes;
+        callback(std::move(response));
+    };
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <QList>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// If we include the actual header, we break QT compilation.
+namespace marian {
+    class Options;
+    namespace bergamot {
+    class AsyncService;
+    class TranslationModel;
+    class Response;
+    struct ResponseOptions;
+    }
+}
+
+/**
+ * One or more bergamot AsyncServices behind the same interface as a single
+ * one. On a machine with several NUMA nodes (e.g. a multi-socket server) it
+ * can run a shard per node: a service whose workers are pinned to the CPUs of
+ * that node, with its own copy of every model in that node's memory. That
+ * way no worker reads weights across the interconnect. Each translation goes
+ * to the shard with the least work in flight.
+ *
+ * With a single shard, which is what you get on anything but a NUMA machine,
+ * this is a plain AsyncService.
+ */
+class ShardedService {
+public:
+    using Callback = std::function<void(marian::bergamot::Response &&)>;
+
+    struct Config {
+        std::size_t numWorkers; // In total, divided over the shards
+        std::size_t cacheSize; // Per shard, 0 disables the translation cache
+        bool numa; // One shard per NUMA node, if there are multiple
+    };
+
+    struct CacheStats {
+        std::size_t hits;
+        std::size_t misses;
+    };
+
+    explicit ShardedService(Config const &config);
+    ~ShardedService();
+
+    /**
+     * @brief CPUs of each NUMA node. Empty if the platform doesn't tell us,
+     * or there is only one node. Only implemented for Linux.
+     */
+    static QList<QList<int>> numaNodes();
+
+    std::size_t shards() const;
+
+    /**
+     * @brief Worker threads per shard. Models need one replica per worker.
+     */
+    std::size_t workersPerShard() const;
+
+    /**
+     * @brief Loads a model for every shard, each on its own node. Returns the
+     * copy of the first shard, which stands for all of them: pass it to
+     * translate() and pivot(), and the copies are released together with it.
+     */
+    std::shared_ptr<marian::bergamot::TranslationModel> loadModel(std::shared_ptr<marian::Options> options);
+
+    void translate(std::shared_ptr<marian::bergamot::TranslationModel> model, std::string &&source, Callback callback, marian::bergamot::ResponseOptions const &options);
+
+    void pivot(std::shared_ptr<marian::bergamot::TranslationModel> first, std::shared_ptr<marian::bergamot::TranslationModel> second, std::string &&source, Callback callback, marian::bergamot::ResponseOptions const &options);
+
+    /**
+     * @brief Drops all requests that haven't been translated yet, on all shards.
+     */
+    void clear();
+
+    /**
+     * @brief Translation cache statistics, summed over all shards.
+     */
+    CacheStats cacheStats() const;
+
+private:
+    struct Shard {
+        QList<int> cpus; // Empty if not pinned
+        std::atomic<std::size_t> inFlight{0}; // Bytes of source text
+        std::shared_ptr<marian::bergamot::AsyncService> service;
+    };
+
+    // A model as loaded for each shard. Owned by the model loadModel()
+    // returned, so they're all released together.
+    struct Copies {
+        std::vector<std::shared_ptr<marian::bergamot::TranslationModel>> models;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::size_t workersPerShard_;
+
+    mutable std::mutex mutex_;
+    std::map<marian::bergamot::TranslationModel const *, std::weak_ptr<Copies>> copies_;
+
+    // Picks the least busy shard, and counts `bytes` as in flight there.
+    std::size_t pick(std::size_t bytes);
+
+    // `model` as loaded for `shard`.
+    std::shared_ptr<marian::bergamot::TranslationModel> copy(std::shared_ptr<marian::bergamot::TranslationModel> const &model, std::size_t shard) const;
+
+    // Wraps `callback` to take the work off the shard's count once it's done.
+    Callback release(std::size_t shard, std::size_t bytes, Callback callback);
+};
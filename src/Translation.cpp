@@ -1,57 +1,87 @@
 #include "Translation.h"
 #include "3rd_party/bergamot-translator/src/translator/response.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <vector>
 
 namespace {
 
 /**
- * Finds sentence and word index for a given byte offset in an annotated
- * string. These come out of marian::bergamot::Service.translate().
+ * Lookup tables for one annotated string, so that converting between UTF-16
+ * positions and byte offsets, and finding the word at a byte offset, don't
+ * have to scan the text from the start every time.
  */
-bool findWordByByteOffset(marian::bergamot::Annotation const &annotation, std::size_t pos, std::size_t &sentenceIdx, std::size_t &wordIdx) {
-    for (sentenceIdx = 0; sentenceIdx < annotation.numSentences(); ++sentenceIdx)
-        if (annotation.sentence(sentenceIdx).end >= pos)
-            break;
+class TextIndex {
+public:
+    TextIndex() = default;
 
-    if (sentenceIdx == annotation.numSentences())
-        return false;
-    
-    for (wordIdx = 0; wordIdx < annotation.numWords(sentenceIdx); ++wordIdx)
-        if (annotation.word(sentenceIdx, wordIdx).end >= pos)
-            break;
+    explicit TextIndex(marian::bergamot::AnnotatedText const &text) {
+        // Byte offset of every UTF-16 code unit. Characters outside the BMP
+        // are two code units in UTF-16, both pointing to the start of the
+        // character.
+        offsets_.reserve(text.text.size() + 1);
+        for (std::size_t i = 0; i < text.text.size(); ++i) {
+            unsigned char c = text.text[i];
+            if ((c & 0xc0) == 0x80) // utf-8 continuation character
+                continue;
+            offsets_.push_back(i);
+            if ((c & 0xf8) == 0xf0) // start of a four byte character
+                offsets_.push_back(i);
+        }
+        offsets_.push_back(text.text.size());
 
-    return wordIdx < annotation.numWords(sentenceIdx);
-}
+        // Sentence and word ends, with the words of all sentences in one list
+        // and the index of the first word of each sentence.
+        for (std::size_t sentenceIdx = 0; sentenceIdx < text.annotation.numSentences(); ++sentenceIdx) {
+            sentenceEnds_.push_back(text.annotation.sentence(sentenceIdx).end);
+            firstWords_.push_back(wordEnds_.size());
+            for (std::size_t wordIdx = 0; wordIdx < text.annotation.numWords(sentenceIdx); ++wordIdx)
+                wordEnds_.push_back(text.annotation.word(sentenceIdx, wordIdx).end);
+        }
+        firstWords_.push_back(wordEnds_.size());
+    }
 
-/**
- * Converts byte offset into utf-8 aware character position.
- * Unicode checking blatantly stolen from https://stackoverflow.com/a/
- */
-int offsetToPosition(std::string const &text, std::size_t offset) {
-    // if offset is never bigger than text.size(), and we iterate based on
-    // offset, *p will always be within [c_str(), c_str() + size())
-    if (offset > text.size())
-        offset = text.size();
-
-    std::size_t pos = 0;
-    for (char const *p = text.c_str(); offset > 0; --offset, p++) {
-        if ((*p & 0xc0) != 0x80) // if is not utf-8 continuation character
-            ++pos;
+    /**
+     * Converts a UTF-16 position into a byte offset.
+     */
+    std::size_t positionToOffset(int pos) const {
+        if (pos <= 0)
+            return 0;
+        if (static_cast<std::size_t>(pos) >= offsets_.size())
+            return offsets_.back();
+        return offsets_[pos];
     }
-    return pos;
-}
 
-/**
- * Other way around: converts utf-8 character position into a byte offset.
- */
-std::size_t positionToOffset(std::string const &text, int pos) {
-    char const *p = text.c_str(), *end = text.c_str() + text.size();
-    // Continue for-loop while pos > 0 or while we're in a multibyte utf-8 char
-    for (; p != end && (pos > 0 || (*p & 0xc0) == 0x80); p++) {
-        if ((*p & 0xc0) != 0x80)
-            --pos;
+    /**
+     * Other way around: converts a byte offset into a UTF-16 position.
+     */
+    int offsetToPosition(std::size_t offset) const {
+        return std::lower_bound(offsets_.begin(), offsets_.end(), offset) - offsets_.begin();
     }
-    return p - text.c_str();
-}
+
+    /**
+     * Finds sentence and word index for a given byte offset: the first word
+     * that ends at or after it.
+     */
+    bool findWordByByteOffset(std::size_t pos, std::size_t &sentenceIdx, std::size_t &wordIdx) const {
+        sentenceIdx = std::lower_bound(sentenceEnds_.begin(), sentenceEnds_.end(), pos) - sentenceEnds_.begin();
+        if (sentenceIdx == sentenceEnds_.size())
+            return false;
+
+        auto first = wordEnds_.begin() + firstWords_[sentenceIdx];
+        auto last = wordEnds_.begin() + firstWords_[sentenceIdx + 1];
+        wordIdx = std::lower_bound(first, last, pos) - first;
+        return first + wordIdx != last;
+    }
+
+private:
+    std::vector<std::size_t> offsets_;
+    std::vector<std::size_t> sentenceEnds_;
+    std::vector<std::size_t> wordEnds_;
+    std::vector<std::size_t> firstWords_;
+};
 
 marian::bergamot::AnnotatedText const &_source(marian::bergamot::Response const &response, Translation::Direction direction) {
     if (direction == Translation::source_to_translation)
@@ -60,99 +90,281 @@ marian::bergamot::AnnotatedText const &_source(marian::bergamot::Response const
         return response.target;
 }
 
-marian::bergamot::AnnotatedText const &_target(marian::bergamot::Response const &response, Translation::Direction direction) {
-    if (direction == Translation::source_to_translation)
-        return response.target;
-    else
-        return response.source;
-}
+// Alignments with a lower probability are never shown, so not worth keeping.
+const float constexpr kMinAlignment = 0.1f; // TODO top N or something?
 
 } // Anonymous namespace
 
-Translation::Translation()
-: response_(nullptr)
-, speed_(-1) {
-    //
+class Translation::Paragraph {
+public:
+    explicit Paragraph(marian::bergamot::Response &&response);
+
+    /**
+     * Adds the alignments for the words between char pos `sourcePosFirst` and
+     * `sourcePosLast` to `alignments`, moved by `targetShift` characters for
+     * where the paragraph starts in the whole translation.
+     */
+    void appendAlignments(Translation::Direction direction, int sourcePosFirst, int sourcePosLast, int targetShift, QVector<WordAlignment> &alignments) const;
+
+    /**
+     * Finds the word that appendAlignments() would start or end at for char
+     * pos `pos`, and its char positions in the paragraph.
+     */
+    bool findWord(Translation::Direction direction, int pos, int &begin, int &end) const;
+
+    // The response, without its alignment matrices.
+    marian::bergamot::Response response;
+
+    // Length of source and target text in UTF-16 code units
+    int sourceLength;
+    int targetLength;
+
+private:
+    struct Link {
+        std::uint32_t target; // word index in the target sentence
+        std::uint32_t source; // word index in the source sentence
+        float prob;
+    };
+
+    // Alignments of at least kMinAlignment, sentence by sentence, ordered by
+    // target word and then source word. Those of sentence `s` are in
+    // links_[sentenceLinks_[s]] up to links_[sentenceLinks_[s + 1]].
+    std::vector<Link> links_;
+    std::vector<std::size_t> sentenceLinks_;
+
+    // Lookup tables, built the first time alignments are looked up in this
+    // paragraph. That might happen on any thread that has a translation with
+    // this paragraph, hence call_once.
+    mutable std::once_flag indexed_;
+    mutable TextIndex sourceIndex_;
+    mutable TextIndex targetIndex_;
+
+    void buildIndex() const;
+};
+
+Translation::Paragraph::Paragraph(marian::bergamot::Response &&val)
+: response(std::move(val))
+, sourceLength(QString::fromStdString(response.source.text).size())
+, targetLength(QString::fromStdString(response.target.text).size()) {
+    // Format:
+    // response.alignments[sentence:size_t][target token:size_t][source token:size_t] = probability:float
+    for (std::size_t sentenceIdx = 0; sentenceIdx < response.alignments.size(); ++sentenceIdx) {
+        sentenceLinks_.push_back(links_.size());
+        auto const &matrix = response.alignments[sentenceIdx];
+        for (std::size_t t = 0; t < matrix.size(); ++t)
+            for (std::size_t s = 0; s < matrix[t].size(); ++s)
+                if (matrix[t][s] >= kMinAlignment)
+                    links_.push_back(Link{static_cast<std::uint32_t>(t), static_cast<std::uint32_t>(s), matrix[t][s]});
+    }
+    sentenceLinks_.push_back(links_.size());
+    links_.shrink_to_fit();
+
+    // The dense matrices are by far the largest part of a response.
+    decltype(response.alignments)().swap(response.alignments);
 }
 
-Translation::Translation(marian::bergamot::Response &&response, int speed)
-: response_(std::make_shared<marian::bergamot::Response>(std::move(response)))
-, speed_(speed) {
-    //
+void Translation::Paragraph::buildIndex() const {
+    std::call_once(indexed_, [this]() {
+        sourceIndex_ = TextIndex(response.source);
+        targetIndex_ = TextIndex(response.target);
+    });
 }
 
-QString Translation::translation() const {
-    return QString::fromStdString(response_->target.text);
+bool Translation::Paragraph::findWord(Translation::Direction direction, int pos, int &begin, int &end) const {
+    buildIndex();
+
+    TextIndex const &sourceIndex = direction == Translation::source_to_translation ? sourceIndex_ : targetIndex_;
+
+    std::size_t sentenceIdx, wordIdx;
+    if (!sourceIndex.findWordByByteOffset(sourceIndex.positionToOffset(pos), sentenceIdx, wordIdx))
+        return false;
+
+    marian::bergamot::ByteRange span = ::_source(response, direction).wordAsByteRange(sentenceIdx, wordIdx);
+    begin = sourceIndex.offsetToPosition(span.begin);
+    end = sourceIndex.offsetToPosition(span.end);
+    return true;
 }
 
-QVector<WordAlignment> Translation::alignments(Direction direction, int sourcePosFirst, int sourcePosLast) const {
-    QVector<WordAlignment> alignments;
-    std::size_t sentenceIdxFirst, sentenceIdxLast, wordIdxFirst, wordIdxLast;
+void Translation::Paragraph::appendAlignments(Translation::Direction direction, int sourcePosFirst, int sourcePosLast, int targetShift, QVector<WordAlignment> &alignments) const {
+    buildIndex();
 
-    if (!response_)
-        return alignments;
+    TextIndex const &sourceIndex = direction == Translation::source_to_translation ? sourceIndex_ : targetIndex_;
+    TextIndex const &targetIndex = direction == Translation::source_to_translation ? targetIndex_ : sourceIndex_;
 
-    if (sourcePosFirst > sourcePosLast)
-        std::swap(sourcePosFirst, sourcePosLast);
+    std::size_t sentenceIdxFirst, sentenceIdxLast, wordIdxFirst, wordIdxLast;
 
-    std::size_t sourceOffsetFirst = ::positionToOffset(::_source(*response_, direction).text, sourcePosFirst);
-    if (!::findWordByByteOffset(::_source(*response_, direction).annotation, sourceOffsetFirst, sentenceIdxFirst, wordIdxFirst))
-        return alignments;
+    std::size_t sourceOffsetFirst = sourceIndex.positionToOffset(sourcePosFirst);
+    if (!sourceIndex.findWordByByteOffset(sourceOffsetFirst, sentenceIdxFirst, wordIdxFirst))
+        return;
 
-    std::size_t sourceOffsetLast = ::positionToOffset(::_source(*response_, direction).text, sourcePosLast);
-    if (!::findWordByByteOffset(::_source(*response_, direction).annotation, sourceOffsetLast, sentenceIdxLast, wordIdxLast))
-        return alignments;
+    std::size_t sourceOffsetLast = sourceIndex.positionToOffset(sourcePosLast);
+    if (!sourceIndex.findWordByByteOffset(sourceOffsetLast, sentenceIdxLast, wordIdxLast))
+        return;
 
     assert(sentenceIdxFirst <= sentenceIdxLast);
     assert(sentenceIdxFirst != sentenceIdxLast || wordIdxFirst <= wordIdxLast);
-    assert(sentenceIdxLast < response_->alignments.size());
-
-    // Format:
-    // response_->alignments[sentence:size_t][target token:size_t][source token:size_t] = probability:float
+    assert(sentenceIdxLast + 1 < sentenceLinks_.size());
 
     auto append = [&](marian::bergamot::ByteRange const &span, float prob) {
         WordAlignment alignment;
-        alignment.begin = ::offsetToPosition(::_target(*response_, direction).text, span.begin);
-        alignment.end = ::offsetToPosition(::_target(*response_, direction).text, span.end);
+        alignment.begin = targetShift + targetIndex.offsetToPosition(span.begin);
+        alignment.end = targetShift + targetIndex.offsetToPosition(span.end);
         alignment.prob = prob;
         alignments.append(alignment);
     };
 
     for (std::size_t sentenceIdx = sentenceIdxFirst; sentenceIdx <= sentenceIdxLast; ++sentenceIdx) {
-        assert(sentenceIdx < response_->alignments.size());
         std::size_t firstWord = sentenceIdx == sentenceIdxFirst ? wordIdxFirst : 0;
-        std::size_t lastWord = sentenceIdx == sentenceIdxLast ? wordIdxLast : ::_source(*response_, direction).numWords(sentenceIdx) - 1;
-        
-        // If no alignments were provided by the model, this array will be empty
-        if (response_->alignments[sentenceIdx].empty())
-            continue;
+        std::size_t lastWord = sentenceIdx == sentenceIdxLast ? wordIdxLast : ::_source(response, direction).numWords(sentenceIdx) - 1;
 
-        if (direction == Translation::source_to_translation) {
-            assert(firstWord < response_->source.numWords(sentenceIdx));
-            assert(lastWord <= response_->source.numWords(sentenceIdx));
-
-            for (size_t t = 0; t < response_->target.numWords(sentenceIdx); ++t) {
-                for (size_t s = firstWord; s <= lastWord; ++s) {
-                    if (response_->alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
-                        append(response_->target.wordAsByteRange(sentenceIdx, t), response_->alignments[sentenceIdx][t][s]);
-                }
-            }
-        } else {
-            assert(firstWord < response_->target.numWords(sentenceIdx));
-            assert(lastWord < response_->target.numWords(sentenceIdx));
-
-            for (size_t t = firstWord; t <= lastWord; ++t) {
-                for (size_t s = 0; s < response_->source.numWords(sentenceIdx); ++s) {
-                    if (response_->alignments[sentenceIdx][t][s] >= 0.1f) // TODO top N or something?
-                        append(response_->source.wordAsByteRange(sentenceIdx, s), response_->alignments[sentenceIdx][t][s]);
-                }
+        // If no alignments were provided by the model, there are no links
+        for (std::size_t i = sentenceLinks_[sentenceIdx]; i < sentenceLinks_[sentenceIdx + 1]; ++i) {
+            Link const &link = links_[i];
+            if (direction == Translation::source_to_translation) {
+                if (link.source >= firstWord && link.source <= lastWord)
+                    append(response.target.wordAsByteRange(sentenceIdx, link.target), link.prob);
+            } else {
+                if (link.target >= firstWord && link.target <= lastWord)
+                    append(response.source.wordAsByteRange(sentenceIdx, link.source), link.prob);
             }
         }
     }
+}
+
+std::shared_ptr<const Translation::Paragraph> Translation::makeParagraph(marian::bergamot::Response &&response) {
+    return std::make_shared<const Paragraph>(std::move(response));
+}
+
+std::string const &Translation::source(Paragraph const &paragraph) {
+    return paragraph.response.source.text;
+}
+
+Translation::Translation()
+: valid_(false)
+, speed_(-1) {
+    //
+}
+
+Translation::Translation(marian::bergamot::Response &&response, int speed)
+: Translation(std::vector<Part>{Part{std::string(), makeParagraph(std::move(response))}}, speed) {
+    //
+}
+
+Translation::Translation(std::vector<Part> const &parts, int speed, Timings timings)
+: valid_(true)
+, speed_(speed)
+, timings_(timings) {
+    int sourcePos = 0;
+    int targetPos = 0;
+
+    for (Part const &part : parts) {
+        // The separator is copied as is, so it's the same length on both sides.
+        QString separator = QString::fromStdString(part.separator);
+        sourcePos += separator.size();
+        targetPos += separator.size();
+        translation_ += separator;
+
+        if (!part.paragraph)
+            continue;
+
+        segments_.append(Segment{part.paragraph, sourcePos, targetPos});
+
+        sourcePos += part.paragraph->sourceLength;
+        targetPos += part.paragraph->targetLength;
+        translation_ += QString::fromStdString(part.paragraph->response.target.text);
+    }
+}
+
+QString Translation::translation() const {
+    return translation_;
+}
+
+bool Translation::operator==(Translation const &other) const {
+    if (valid_ != other.valid_ || segments_.size() != other.segments_.size())
+        return false;
+
+    for (int i = 0; i < segments_.size(); ++i)
+        if (segments_[i].paragraph != other.segments_[i].paragraph
+            || segments_[i].sourceBegin != other.segments_[i].sourceBegin
+            || segments_[i].targetBegin != other.segments_[i].targetBegin)
+            return false;
+
+    return true;
+}
+
+int Translation::begin(Segment const &segment, Direction direction) {
+    return direction == source_to_translation ? segment.sourceBegin : segment.targetBegin;
+}
+
+int Translation::length(Segment const &segment, Direction direction) {
+    return direction == source_to_translation ? segment.paragraph->sourceLength : segment.paragraph->targetLength;
+}
+
+QVector<Translation::Segment>::const_iterator Translation::firstSegment(Direction direction, int pos) const {
+    // Segments are in order on both sides, so find the first one that
+    // doesn't end before `pos`.
+    return std::lower_bound(segments_.cbegin(), segments_.cend(), pos, [direction](Segment const &segment, int position) {
+        return begin(segment, direction) + length(segment, direction) < position;
+    });
+}
+
+bool Translation::wordSpan(Direction direction, int sourcePosFirst, int sourcePosLast, int &spanBegin, int &spanEnd) const {
+    if (!valid_)
+        return false;
+
+    if (sourcePosFirst > sourcePosLast)
+        std::swap(sourcePosFirst, sourcePosLast);
+
+    // The same segments alignments() looks at.
+    auto first = firstSegment(direction, sourcePosFirst);
+    auto last = std::upper_bound(first, segments_.cend(), sourcePosLast, [direction](int pos, Segment const &segment) {
+        return pos < begin(segment, direction);
+    });
+
+    if (first == last)
+        return false;
+
+    --last;
+
+    // Outside any word, e.g. in whitespace at the end of a paragraph, use the
+    // position itself. That's not as good a key, but still a correct one.
+    int wordBegin, wordEnd;
+    if (first->paragraph->findWord(direction, std::max(sourcePosFirst - begin(*first, direction), 0), wordBegin, wordEnd))
+        spanBegin = begin(*first, direction) + wordBegin;
+    else
+        spanBegin = sourcePosFirst;
+
+    if (last->paragraph->findWord(direction, std::min(sourcePosLast - begin(*last, direction), length(*last, direction)), wordBegin, wordEnd))
+        spanEnd = begin(*last, direction) + wordEnd;
+    else
+        spanEnd = sourcePosLast;
+
+    return true;
+}
+
+QVector<WordAlignment> Translation::alignments(Direction direction, int sourcePosFirst, int sourcePosLast) const {
+    QVector<WordAlignment> alignments;
+
+    if (!valid_)
+        return alignments;
+
+    if (sourcePosFirst > sourcePosLast)
+        std::swap(sourcePosFirst, sourcePosLast);
+
+    // Stop at the first segment that starts after the selection.
+    for (auto it = firstSegment(direction, sourcePosFirst); it != segments_.cend() && begin(*it, direction) <= sourcePosLast; ++it) {
+        Segment const &segment = *it;
+        int targetShift = direction == source_to_translation ? segment.targetBegin : segment.sourceBegin;
+
+        segment.paragraph->appendAlignments(direction,
+                                            std::max(sourcePosFirst - begin(segment, direction), 0),
+                                            std::min(sourcePosLast - begin(segment, direction), length(segment, direction)),
+                                            targetShift, alignments);
+    }
 
     // Sort by position (left to right), highest probability first.
     std::sort(alignments.begin(), alignments.end(), [](WordAlignment const &a, WordAlignment const &b) {
-        return a.begin <= b.begin && a.prob > b.prob;
+        return a.begin < b.begin || (a.begin == b.begin && a.prob > b.prob);
     });
 
     return alignments;
@@ -3,6 +3,8 @@
 #include <QString>
 #include <QVector>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace marian {
     namespace bergamot {
@@ -22,35 +24,100 @@ struct WordAlignment {
 };
 
 /**
- * Wrapper around a translation response from the bergamot service. Hides that
+ * Wrapper around translation responses from the bergamot service. Hides that
  * interface from the rest of the Qt code, and provides utility functions to
  * access alignment information with character offsets instead of byte offsets.
+ *
+ * A translation can be made up of several responses, one per paragraph, so
+ * paragraphs that didn't change can be reused from an earlier translation.
+ * To the outside it looks like a single translation of the whole text.
  */
 class Translation {
+public:
+    /**
+     * A translated paragraph: a response from the service, with its alignments
+     * in a compact form instead of the dense matrices of the response. Opaque
+     * outside Translation.cpp, see makeParagraph().
+     */
+    class Paragraph;
+
+    /**
+     * Converts a response into a Paragraph. Does the work of compacting the
+     * alignments, so best called on the thread that got the response.
+     */
+    static std::shared_ptr<const Paragraph> makeParagraph(marian::bergamot::Response &&response);
+
+    /**
+     * The text that was translated into `paragraph`.
+     */
+    static std::string const &source(Paragraph const &paragraph);
+
+    /**
+     * A translated paragraph, and the text in between the previous paragraph
+     * and this one (e.g. blank lines), which is not translated but copied as
+     * is. `paragraph` is nullptr for a part that has only separator, e.g.
+     * whitespace at the end of the text.
+     */
+    struct Part {
+        std::string separator;
+        std::shared_ptr<const Paragraph> paragraph;
+    };
+
+    /**
+     * Where the time went for this translation, in milliseconds. The
+     * translation itself includes waiting to be batched in the service.
+     * Postprocessing (compacting alignments) happens in parallel for the
+     * paragraphs, this is the total over all of them.
+     */
+    struct Timings {
+        double queue{0}; // From MarianInterface::translate() until it was handed to the service
+        double translate{0}; // In the service
+        double postprocess{0}; // Turning the responses into paragraphs
+    };
+
 private:
-    // Note: I would have liked unique_ptr, but that does not go well with
-    // passing Translation objects through Qt signals/slots.
-    std::shared_ptr<marian::bergamot::Response> response_;
+    struct Segment {
+        // Note: I would have liked unique_ptr, but that does not go well with
+        // passing Translation objects through Qt signals/slots. Also shared
+        // with later translations that reuse the paragraph.
+        std::shared_ptr<const Paragraph> paragraph;
+
+        // Where this paragraph's source and translation start in the whole
+        // text, in UTF-16 code units like QString.
+        int sourceBegin;
+        int targetBegin;
+    };
+
+    QVector<Segment> segments_;
+    QString translation_;
+    bool valid_;
 
     // Words per second as measured by runtime/word count in MarianInterface
     // @TODO this could probably be part of marian::bergamot::Response in the future
     int speed_;
+
+    Timings timings_;
 public:
     Translation();
     Translation(marian::bergamot::Response &&response, int speed);
+    Translation(std::vector<Part> const &parts, int speed, Timings timings = Timings());
 
     /**
      * Bool operator to check whether this is an initialised translation or just
      * an empty object.
      */
     inline operator bool() const {
-        return !!response_;
+        return valid_;
     }
 
     inline std::size_t wordsPerSecond() const {
         return speed_;
     }
 
+    inline Timings const &timings() const {
+        return timings_;
+    }
+
     /**
      * Translation result
      */
@@ -61,9 +128,35 @@ public:
     /**
      * Looks up a list of character ranges and probability scores for words
      * aligning with the word at char pos `pos` in the source sentence. Returns
-     * an empty list on failure.
+     * an empty list on failure. Positions are QString positions (i.e. UTF-16
+     * code units), like those of QTextCursor.
      */
     QVector<WordAlignment> alignments(Direction direction, int begin, int end) const;
+
+    /**
+     * Finds the words alignments() would look at for the same arguments, and
+     * gives the char positions from the start of the first one up to the end
+     * of the last one. All `begin` and `end` with the same span have the same
+     * alignments. Returns false if there are no words there.
+     */
+    bool wordSpan(Direction direction, int begin, int end, int &spanBegin, int &spanEnd) const;
+
+    /**
+     * Whether both are made of the same translated paragraphs, and thus
+     * have the same alignments.
+     */
+    bool operator==(Translation const &other) const;
+
+    inline bool operator!=(Translation const &other) const {
+        return !(*this == other);
+    }
+
+private:
+    static int begin(Segment const &segment, Direction direction);
+    static int length(Segment const &segment, Direction direction);
+
+    // First segment that doesn't end before char pos `pos`
+    QVector<Segment>::const_iterator firstSegment(Direction direction, int pos) const;
 };
 
 Q_DECLARE_METATYPE(Translation)
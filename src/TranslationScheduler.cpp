@@ -0,0 +1,83 @@
+#include "TranslationScheduler.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// Never wait longer than this after the last key press
+const int constexpr kMaxDelay = 750; // ms
+
+// Weight of a new measurement in the moving averages
+const double constexpr kSmoothing = 0.3;
+
+// Give up on a translation in flight once the input has changed this much
+// since it was started. A word or two: less than that, and the translation
+// that is nearly done is worth more than starting over.
+const int constexpr kPreemptChanges = 8; // key presses
+const int constexpr kPreemptCharacters = 16; // e.g. by pasting
+
+} // Anonymous namespace
+
+TranslationScheduler::TranslationScheduler(QObject *parent)
+: QObject(parent)
+, typingInterval_(kMaxDelay)
+, latency_(0)
+, inFlight_(false)
+, changesSinceTranslate_(0)
+, lengthAtTranslate_(0)
+, length_(0) {
+    timer_.setSingleShot(true);
+    connect(&timer_, &QTimer::timeout, this, &TranslationScheduler::onTimeout);
+}
+
+void TranslationScheduler::inputChanged(int length) {
+    // Pauses longer than kMaxDelay aren't typing, but the user thinking or
+    // reading. Counting them as kMaxDelay keeps the average meaningful.
+    qint64 interval = sinceLastChange_.isValid() ? std::min<qint64>(sinceLastChange_.restart(), kMaxDelay) : kMaxDelay;
+    if (!sinceLastChange_.isValid())
+        sinceLastChange_.start();
+
+    typingInterval_ += kSmoothing * (interval - typingInterval_);
+
+    length_ = length;
+    ++changesSinceTranslate_;
+
+    // If the translation is likely done before the next key press, nothing is
+    // wasted by starting it right away. Otherwise wait for a pause that's
+    // clearly longer than the user's usual pace.
+    int delay = 0;
+    if (latency_ > typingInterval_)
+        delay = std::min<int>(1.5 * typingInterval_, kMaxDelay);
+
+    timer_.start(delay);
+}
+
+void TranslationScheduler::onTimeout() {
+    bool preempt = inFlight_
+        && (changesSinceTranslate_ >= kPreemptChanges
+            || std::abs(length_ - lengthAtTranslate_) >= kPreemptCharacters);
+
+    // Input that arrives while a translation is running is coalesced with it
+    // rather than translated on its own, so the time until it finishes still
+    // counts from when it was started.
+    if (!inFlight_)
+        sinceTranslate_.start();
+
+    inFlight_ = true;
+    changesSinceTranslate_ = 0;
+    lengthAtTranslate_ = length_;
+
+    emit translate(preempt);
+}
+
+void TranslationScheduler::translationFinished() {
+    if (!inFlight_)
+        return;
+
+    inFlight_ = false;
+    latency_ += kSmoothing * (sinceTranslate_.elapsed() - latency_);
+}
+
+void TranslationScheduler::cancel() {
+    timer_.stop();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+/**
+ * Decides when to translate while the user is typing in "translate
+ * immediately" mode. Translating on every key press keeps the translation
+ * threads busy with text the user has already changed by the time it is
+ * translated. Instead, if translating takes longer than the time between two
+ * key presses, this waits until the user pauses typing.
+ *
+ * The translation time is measured from translate() until
+ * translationFinished(). The typing rate is measured from inputChanged(). If
+ * a translation is still running when enough new input has arrived, the next
+ * translate() asks for that one to be given up.
+ */
+class TranslationScheduler : public QObject {
+    Q_OBJECT
+public:
+    explicit TranslationScheduler(QObject *parent = nullptr);
+
+    /**
+     * @brief Call on every change of the input.
+     * @param length length of the input in characters.
+     */
+    void inputChanged(int length);
+
+    /**
+     * @brief Call whenever a translation is ready, or failed.
+     */
+    void translationFinished();
+
+    /**
+     * @brief Forget about any scheduled translation, e.g. because the input
+     * was translated some other way.
+     */
+    void cancel();
+
+signals:
+    /**
+     * @brief Time to translate the input.
+     * @param preempt whether to give up on the translation that is still
+     * running, because the input changed a lot since it was started.
+     */
+    void translate(bool preempt);
+
+private:
+    QTimer timer_;
+    QElapsedTimer sinceLastChange_;
+    QElapsedTimer sinceTranslate_;
+
+    // Moving averages, in milliseconds
+    double typingInterval_;
+    double latency_;
+
+    // State of the translation that was started last
+    bool inFlight_;
+    int changesSinceTranslate_;
+    int lengthAtTranslate_;
+    int length_;
+
+    void onTimeout();
+};
@@ -0,0 +1,40 @@
+#include "WordCount.h"
+#include <type_traits>
+
+namespace {
+
+// std::isspace() in the "C" locale, for UTF-8 bytes and UTF-16 code units.
+bool isSpace(unsigned int c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+template <typename Unit>
+std::size_t count(const Unit *begin, const Unit *end) {
+    bool inSpaces = true;
+    std::size_t numWords = 0;
+
+    for (const Unit *str = begin; str != end; ++str) {
+        if (isSpace(static_cast<std::make_unsigned_t<Unit>>(*str))) {
+            inSpaces = true;
+        } else if (inSpaces) {
+            numWords++;
+            inSpaces = false;
+        }
+    }
+
+    return numWords;
+}
+
+} // Anonymous namespace
+
+std::size_t countWords(const char *begin, const char *end) {
+    return count(begin, end);
+}
+
+std::size_t countWords(std::string const &text) {
+    return count(text.data(), text.data() + text.size());
+}
+
+std::size_t countWords(QString const &text) {
+    return count(text.utf16(), text.utf16() + text.size());
+}
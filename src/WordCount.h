@@ -0,0 +1,18 @@
+#pragma once
+#include <QString>
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief Number of whitespace separated words in a text. The one way words
+ * are counted everywhere, for chunk and batch budgets as well as for words
+ * per second, so these all agree with each other. Only ASCII whitespace
+ * separates words, which is all that the bytes of a multi-byte UTF-8
+ * sequence never are, so counting the UTF-8 and the QString of a text gives
+ * the same number.
+ */
+std::size_t countWords(const char *begin, const char *end);
+
+std::size_t countWords(std::string const &text);
+
+std::size_t countWords(QString const &text);
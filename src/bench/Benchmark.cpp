@@ -0,0 +1,301 @@
+/**
+ * translateLocally-bench: measures how fast a model translates through the
+ * same MarianInterface and AsyncService path the GUI uses, for a number of
+ * marian settings, and prints the results as JSON. Meant for comparing
+ * builds, e.g. before and after updating bergamot-translator.
+ *
+ * For every combination of --cpu-threads, --workspace and --mini-batch-words
+ * it loads the model, translates the first --latency-samples lines of the
+ * corpus one by one to measure latency, and then the whole corpus at once to
+ * measure throughput.
+ */
+#include "CpuFeatures.h"
+#include "MarianInterface.h"
+#include "Measurements.h"
+#include "Translation.h"
+#include "types.h"
+#include "WordCount.h"
+#include "version.h"
+#include "3rd_party/bergamot-translator/3rd_party/marian-dev/src/marian.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+/**
+ * Peak resident set size of this process so far, in kilobytes. It never goes
+ * down, so for a run it is the peak of that run and all runs before it.
+ */
+qint64 peakRSS() {
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return -1;
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#if defined(Q_OS_MACOS)
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss; // kilobytes on Linux
+#endif
+#endif
+}
+
+/**
+ * Parses a comma separated list of positive numbers, e.g. "1,2,4".
+ */
+std::vector<std::size_t> parseList(QCommandLineParser const &parser, QString const &option) {
+    std::vector<std::size_t> values;
+    for (QString const &value : parser.value(option).split(",")) {
+        if (value.trimmed().isEmpty())
+            continue;
+        bool ok;
+        uint number = value.trimmed().toUInt(&ok);
+        if (!ok || number == 0)
+            throw std::runtime_error(QString("Invalid value for --%1: %2").arg(option, value).toStdString());
+        values.push_back(number);
+    }
+    return values;
+}
+
+/**
+ * Turns MarianInterface's signals, which are emitted from its worker thread,
+ * into something the benchmark can block on.
+ */
+class Waiter {
+public:
+    explicit Waiter(MarianInterface &iface)
+    : idle_(0)
+    , ready_(0)
+    , errors_(0) {
+        QObject::connect(&iface, &MarianInterface::pendingChanged, &iface, [this](bool busy) {
+            if (!busy)
+                notify([this] { ++idle_; });
+        }, Qt::DirectConnection);
+
+        QObject::connect(&iface, &MarianInterface::translationReady, &iface, [this](Translation) {
+            notify([this] { ++ready_; });
+        }, Qt::DirectConnection);
+
+        QObject::connect(&iface, &MarianInterface::error, &iface, [this](QString message) {
+            notify([this, message] { ++errors_; error_ = message; });
+        }, Qt::DirectConnection);
+    }
+
+    /**
+     * @brief Calls `command`, and waits until MarianInterface is idle again.
+     * @throws std::runtime_error if MarianInterface reported an error.
+     */
+    template <typename Command>
+    void untilIdle(Command command) {
+        wait(command, [this](int idle, int, int) { return idle_ > idle; });
+    }
+
+    /**
+     * @brief Calls `command`, and waits until MarianInterface has a translation.
+     * @throws std::runtime_error if MarianInterface reported an error.
+     */
+    template <typename Command>
+    void untilReady(Command command) {
+        wait(command, [this](int, int ready, int) { return ready_ > ready; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int idle_;
+    int ready_;
+    int errors_;
+    QString error_;
+
+    template <typename Update>
+    void notify(Update update) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        update();
+        cv_.notify_all();
+    }
+
+    template <typename Command, typename Done>
+    void wait(Command command, Done done) {
+        int idle, ready, errors;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            idle = idle_;
+            ready = ready_;
+            errors = errors_;
+        }
+
+        command();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return errors_ > errors || done(idle, ready, errors); });
+        if (errors_ > errors)
+            throw std::runtime_error(error_.toStdString());
+    }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+QJsonObject run(QString const &model, QStringList const &corpus, int words, int latencySamples, translateLocally::marianSettings const &settings) {
+    QTextStream err(stderr);
+    err << "Running with " << settings.cpu_threads << " threads, workspace " << settings.workspace
+        << ", mini-batch-words " << settings.mini_batch_words << "\n";
+    err.flush();
+
+    // A new MarianInterface for each run, so nothing (service, caches,
+    // previous model) carries over from the previous run.
+    MarianInterface iface(nullptr);
+    Waiter waiter(iface);
+
+    auto start = std::chrono::steady_clock::now();
+    waiter.untilIdle([&] { iface.setModel(model, settings); });
+    double loadSeconds = secondsSince(start);
+
+    // Latency: one line at a time, like someone typing in the GUI.
+    std::vector<double> latencies;
+    for (int i = 0; i < latencySamples && i < corpus.size(); ++i) {
+        start = std::chrono::steady_clock::now();
+        waiter.untilReady([&] { iface.translate(corpus[i]); });
+        latencies.push_back(secondsSince(start) * 1000.);
+    }
+
+    // Throughput: the whole corpus in one go, so all threads are kept busy.
+    start = std::chrono::steady_clock::now();
+    waiter.untilReady([&] { iface.translate(corpus.join("\n")); });
+    double seconds = secondsSince(start);
+
+    return QJsonObject{
+        {"cpu_threads", static_cast<int>(settings.cpu_threads)},
+        {"workspace", static_cast<int>(settings.workspace)},
+        {"mini_batch_words", static_cast<int>(settings.mini_batch_words)},
+        {"load_seconds", loadSeconds},
+        {"throughput", QJsonObject{
+            {"seconds", seconds},
+            {"words_per_second", words / seconds},
+            {"sentences_per_second", corpus.size() / seconds}
+        }},
+        {"latency_ms", measurements::summarize(latencies, {50, 95, 99})},
+        {"peak_rss_kb", static_cast<double>(peakRSS())}
+    };
+}
+
+} // Anonymous namespace
+
+int main(int argc, char *argv[]) {
+    // Set marian to throw exceptions instead of std::abort()
+    marian::setThrowExceptionOnAbort(true);
+
+    qRegisterMetaType<Translation>("Translation");
+
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("translateLocally-bench");
+    QCoreApplication::setApplicationVersion(TRANSLATELOCALLY_VERSION_FULL);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures translation speed and latency of a translateLocally model. Prints the results as JSON.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addOption({{"m", "model"}, QObject::tr("Directory of the model to benchmark."), "dir"});
+    parser.addOption({{"i", "input"}, QObject::tr("Corpus to translate, one sentence per line."), "file"});
+    parser.addOption({{"o", "output"}, QObject::tr("Write the results to this file instead of stdout."), "file"});
+    parser.addOption({"cpu-threads", QObject::tr("Comma separated numbers of threads to try."), "list", QString::number(QThread::idealThreadCount())});
+    parser.addOption({"workspace", QObject::tr("Comma separated workspace sizes to try, in MB."), "list", "128"});
+    parser.addOption({"mini-batch-words", QObject::tr("Comma separated mini-batch sizes to try."), "list", "1000"});
+    parser.addOption({"latency-samples", QObject::tr("Number of lines to translate one by one to measure latency."), "lines", "200"});
+    parser.addOption({"debug", QObject::tr("Print debug messages")});
+    parser.process(app);
+
+    if (!parser.isSet("debug"))
+        QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+
+    if (!parser.isSet("model") || !parser.isSet("input")) {
+        qCritical() << "Both --model and --input are required.";
+        return 1;
+    }
+
+    try {
+        QFile input(parser.value("input"));
+        if (!input.open(QIODevice::ReadOnly))
+            throw std::runtime_error(QString("Could not open %1: %2").arg(input.fileName(), input.errorString()).toStdString());
+
+        QStringList corpus;
+        int words = 0;
+        for (QString const &line : QString::fromUtf8(input.readAll()).split("\n")) {
+            if (line.trimmed().isEmpty())
+                continue;
+            corpus.append(line);
+            words += countWords(line);
+        }
+
+        if (corpus.empty())
+            throw std::runtime_error("The corpus is empty");
+
+        int latencySamples = parser.value("latency-samples").toInt();
+
+        QJsonArray runs;
+        for (std::size_t threads : parseList(parser, "cpu-threads"))
+            for (std::size_t workspace : parseList(parser, "workspace"))
+                for (std::size_t miniBatchWords : parseList(parser, "mini-batch-words"))
+                    runs.append(run(parser.value("model"), corpus, words, latencySamples, translateLocally::marianSettings{
+                        threads,
+                        workspace,
+                        false, // No translation cache, we want to know how fast translating is.
+                        0,
+                        miniBatchWords
+                    }));
+
+        QJsonObject results{
+            {"version", TRANSLATELOCALLY_VERSION_FULL},
+            {"model", parser.value("model")},
+            {"cpu", cpu::name(cpu::detect())},
+            {"corpus", QJsonObject{
+                {"file", parser.value("input")},
+                {"sentences", corpus.size()},
+                {"words", words}
+            }},
+            {"runs", runs}
+        };
+
+        QByteArray json = QJsonDocument(results).toJson();
+        if (parser.isSet("output")) {
+            QFile output(parser.value("output"));
+            if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                throw std::runtime_error(QString("Could not open %1: %2").arg(output.fileName(), output.errorString()).toStdString());
+            output.write(json);
+        } else {
+            QTextStream(stdout) << json;
+        }
+    } catch (const std::runtime_error &e) {
+        qCritical().noquote() << e.what();
+        return 1;
+    }
+
+    return 0;
+}
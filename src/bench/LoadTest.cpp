@@ -0,0 +1,373 @@
+/**
+ * translateLocally-loadtest: replays recorded native messaging traffic
+ * against `translateLocally -p`, at the recorded pace or at a fixed rate, and
+ * reports throughput and latency as JSON. With --max-p99 it fails when the
+ * host is too slow, so CI can hold it to a latency budget.
+ *
+ * The traffic file has one message per line, as the browser extension would
+ * send it plus the time (in ms since the start of the recording) it was sent:
+ *
+ *   {"at": 0, "command": "Translate", "data": {"src": "en", "trg": "de", "text": "Hello", "html": false}}
+ *
+ * Message ids are assigned by the load test. See scripts/loadtest.jsonl for
+ * an example.
+ */
+#include "Measurements.h"
+#include "version.h"
+#include "WordCount.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QSet>
+#include <QTextStream>
+#include <QTimer>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+const int constexpr kMaxMessageLength = 10*1024*1024; // Same as the host, see NativeMsgIface.h
+
+struct Message {
+    qint64 at; // ms after the start of the run
+    QJsonObject message;
+    QString model; // Model or language pair the message is for, if any
+    int words;
+};
+
+/**
+ * Which model a request is for, so we can tell when the host has to switch.
+ */
+QString modelOf(QJsonObject const &data) {
+    if (data.contains("model"))
+        return data.value("model").toString() + "|" + data.value("pivot").toString();
+    if (data.contains("src"))
+        return data.value("src").toString() + "-" + data.value("trg").toString();
+    return QString();
+}
+
+int wordsOf(QJsonObject const &data) {
+    std::size_t words = countWords(data.value("text").toString());
+    for (QJsonValue const &text : data.value("texts").toArray())
+        words += countWords(text.toString());
+    return static_cast<int>(words);
+}
+
+std::vector<Message> readTraffic(QString const &path, double speed, double rate, int repeat) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        throw std::runtime_error(QString("Could not open %1: %2").arg(path, file.errorString()).toStdString());
+
+    std::vector<Message> recording;
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine().trimmed();
+        if (line.isEmpty())
+            continue;
+
+        QJsonParseError error;
+        QJsonObject message = QJsonDocument::fromJson(line, &error).object();
+        if (error.error != QJsonParseError::NoError || !message.contains("command"))
+            throw std::runtime_error(QString("Invalid message on line %1 of %2").arg(recording.size() + 1).arg(path).toStdString());
+
+        qint64 at = message.take("at").toDouble() / speed;
+        QJsonObject data = message.value("data").toObject();
+        recording.push_back(Message{at, message, modelOf(data), wordsOf(data)});
+    }
+
+    if (recording.empty())
+        throw std::runtime_error(QString("No messages in %1").arg(path).toStdString());
+
+    // The recording played `repeat` times back to back.
+    qint64 length = recording.back().at + 1;
+    std::vector<Message> traffic;
+    for (int i = 0; i < repeat; ++i) {
+        for (Message message : recording) {
+            message.at = rate > 0 ? traffic.size() * 1000. / rate : message.at + i * length;
+            traffic.push_back(message);
+        }
+    }
+
+    return traffic;
+}
+
+class LoadTest {
+public:
+    LoadTest(std::vector<Message> &&traffic, QString const &host)
+    : traffic_(std::move(traffic))
+    , next_(0)
+    , succeeded_(0)
+    , failed_(0)
+    , maxInFlight_(0)
+    , words_(0)
+    , last_(0)
+    , statsID_(-1)
+    , done_(false) {
+        timer_.setSingleShot(true);
+        QObject::connect(&timer_, &QTimer::timeout, [this] { sendDue(); });
+        QObject::connect(&host_, &QProcess::readyReadStandardOutput, [this] { onReadyRead(); });
+        QObject::connect(&host_, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), [this](int exitCode, QProcess::ExitStatus) {
+            if (!done_)
+                fail(QString("Host exited with code %1 before all replies were in").arg(exitCode));
+        });
+
+        host_.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        host_.start(host, QStringList{"-p"});
+    }
+
+    /**
+     * @brief Runs the test.
+     * @return the results, or an error if the host went away.
+     */
+    QJsonObject run() {
+        if (!host_.waitForStarted())
+            throw std::runtime_error(QString("Could not start %1: %2").arg(host_.program(), host_.errorString()).toStdString());
+
+        clock_.start();
+        sendDue();
+        loop_.exec();
+
+        if (!error_.isEmpty())
+            throw std::runtime_error(error_.toStdString());
+
+        host_.waitForFinished();
+
+        double seconds = last_ / 1000.;
+        return QJsonObject{
+            {"requests", QJsonObject{
+                {"sent", static_cast<int>(traffic_.size())},
+                {"succeeded", succeeded_},
+                {"failed", failed_},
+                {"max_in_flight", maxInFlight_}
+            }},
+            {"seconds", seconds},
+            {"throughput", QJsonObject{
+                {"requests_per_second", succeeded_ / seconds},
+                {"words_per_second", words_ / seconds}
+            }},
+            {"latency_ms", measurements::summarize(latencies_, {50, 99, 99.9})},
+            {"schedule_lag_ms", measurements::summarize(lags_, {50, 99})},
+            {"first_per_model_latency_ms", measurements::summarize(firstLatencies_, {50, 99})},
+            {"model_switch_latency_ms", measurements::summarize(switchLatencies_, {50, 99})},
+            {"host_stats", hostStats_}
+        };
+    }
+
+private:
+    struct Pending {
+        qint64 scheduled;
+        int words;
+        bool first; // First request for its model: includes loading it
+        bool switched; // Previous request was for another model
+    };
+
+    std::vector<Message> traffic_;
+    std::size_t next_;
+
+    QProcess host_;
+    QByteArray buffer_;
+    QTimer timer_;
+    QElapsedTimer clock_;
+    QEventLoop loop_;
+
+    QHash<int, Pending> pending_; // by message id
+    QSet<QString> models_;
+    QString lastModel_;
+
+    // Results
+    std::vector<double> latencies_;
+    std::vector<double> lags_;
+    std::vector<double> firstLatencies_;
+    std::vector<double> switchLatencies_;
+    int succeeded_;
+    int failed_;
+    int maxInFlight_;
+    qint64 words_;
+    qint64 last_; // ms after the start of the run of the last reply
+    int statsID_;
+    QJsonObject hostStats_;
+    bool done_;
+    QString error_;
+
+    void write(int id, QJsonObject message) {
+        message["id"] = id;
+        QByteArray arr = QJsonDocument(message).toJson(QJsonDocument::Compact);
+        quint32 size = arr.size();
+        char header[4];
+        std::memcpy(header, &size, 4);
+        host_.write(header, 4);
+        host_.write(arr);
+    }
+
+    void sendDue() {
+        qint64 now = clock_.elapsed();
+
+        for (; next_ < traffic_.size() && traffic_[next_].at <= now; ++next_) {
+            Message const &message = traffic_[next_];
+            int id = next_;
+
+            // How far behind schedule we are sending this. If that goes up,
+            // the numbers say more about the load test than about the host.
+            lags_.push_back(now - message.at);
+
+            bool first = !message.model.isEmpty() && !models_.contains(message.model);
+            bool switched = !message.model.isEmpty() && !lastModel_.isEmpty() && message.model != lastModel_;
+            if (!message.model.isEmpty()) {
+                models_.insert(message.model);
+                lastModel_ = message.model;
+            }
+
+            // Latency counts from when the message should have been sent, so
+            // a slow host isn't hidden by us sending late.
+            pending_.insert(id, Pending{message.at, message.words, first, switched});
+            maxInFlight_ = std::max(maxInFlight_, static_cast<int>(pending_.size()));
+            write(id, message.message);
+        }
+
+        if (next_ < traffic_.size())
+            timer_.start(static_cast<int>(traffic_[next_].at - now));
+    }
+
+    void onReadyRead() {
+        buffer_.append(host_.readAllStandardOutput());
+
+        while (buffer_.size() >= 4) {
+            quint32 size;
+            std::memcpy(&size, buffer_.constData(), 4);
+            if (size >= kMaxMessageLength)
+                return fail("Invalid message size from host");
+            if (static_cast<quint32>(buffer_.size()) - 4 < size)
+                return;
+
+            QJsonObject reply = QJsonDocument::fromJson(buffer_.mid(4, size)).object();
+            buffer_.remove(0, 4 + size);
+            onReply(reply);
+        }
+    }
+
+    void onReply(QJsonObject const &reply) {
+        if (reply.value("update").toBool())
+            return; // e.g. download progress
+
+        int id = reply.value("id").toInt(-1);
+
+        if (id == statsID_) {
+            hostStats_ = reply.value("data").toObject();
+            done_ = true;
+            host_.closeWriteChannel();
+            loop_.quit();
+            return;
+        }
+
+        auto it = pending_.find(id);
+        if (it == pending_.end())
+            return;
+
+        qint64 now = clock_.elapsed();
+        double latency = now - it->scheduled;
+
+        if (reply.value("success").toBool()) {
+            ++succeeded_;
+            words_ += it->words;
+            latencies_.push_back(latency);
+            if (it->first)
+                firstLatencies_.push_back(latency);
+            else if (it->switched)
+                switchLatencies_.push_back(latency);
+        } else {
+            ++failed_;
+            qWarning().noquote() << "Request" << id << "failed:" << reply.value("error").toString();
+        }
+
+        pending_.erase(it);
+        last_ = now;
+
+        // All in: ask the host for its own numbers, and stop.
+        if (next_ == traffic_.size() && pending_.empty()) {
+            statsID_ = traffic_.size();
+            write(statsID_, QJsonObject{{"command", "Stats"}, {"data", QJsonObject()}});
+        }
+    }
+
+    void fail(QString const &message) {
+        error_ = message;
+        loop_.quit();
+    }
+};
+
+} // Anonymous namespace
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("translateLocally-loadtest");
+    QCoreApplication::setApplicationVersion(TRANSLATELOCALLY_VERSION_FULL);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays native messaging traffic against translateLocally -p and reports latency and throughput as JSON.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addOption({{"i", "input"}, QObject::tr("Traffic to replay, one JSON message per line."), "file"});
+    parser.addOption({{"o", "output"}, QObject::tr("Write the results to this file instead of stdout."), "file"});
+    parser.addOption({"host", QObject::tr("translateLocally executable to test. Defaults to the one next to this executable."), "path"});
+    parser.addOption({"speed", QObject::tr("Replay this many times faster than recorded."), "factor", "1"});
+    parser.addOption({"rate", QObject::tr("Ignore the recorded times and send this many messages per second."), "messages", "0"});
+    parser.addOption({"repeat", QObject::tr("Replay the traffic this many times."), "times", "1"});
+    parser.addOption({"max-p99", QObject::tr("Exit with an error if the 99th percentile latency is higher than this."), "ms"});
+    parser.process(app);
+
+    if (!parser.isSet("input")) {
+        qCritical() << "--input is required.";
+        return 1;
+    }
+
+    QString host = parser.value("host");
+    if (host.isEmpty()) {
+#if defined(Q_OS_WIN)
+        host = QDir(QCoreApplication::applicationDirPath()).filePath("translateLocally.exe");
+#else
+        host = QDir(QCoreApplication::applicationDirPath()).filePath("translateLocally");
+#endif
+    }
+
+    try {
+        double speed = parser.value("speed").toDouble();
+        if (speed <= 0)
+            throw std::runtime_error("--speed has to be larger than 0");
+
+        LoadTest test(readTraffic(parser.value("input"), speed, parser.value("rate").toDouble(), std::max(parser.value("repeat").toInt(), 1)), host);
+        QJsonObject results = test.run();
+
+        QByteArray json = QJsonDocument(results).toJson();
+        if (parser.isSet("output")) {
+            QFile output(parser.value("output"));
+            if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                throw std::runtime_error(QString("Could not open %1: %2").arg(output.fileName(), output.errorString()).toStdString());
+            output.write(json);
+        } else {
+            QTextStream(stdout) << json;
+        }
+
+        if (parser.isSet("max-p99")) {
+            double p99 = results["latency_ms"].toObject()["p99"].toDouble();
+            if (p99 > parser.value("max-p99").toDouble()) {
+                qCritical().noquote() << "p99 latency of" << p99 << "ms is over the budget of" << parser.value("max-p99") << "ms";
+                return 2;
+            }
+        }
+    } catch (const std::runtime_error &e) {
+        qCritical().noquote() << e.what();
+        return 1;
+    }
+
+    return 0;
+}
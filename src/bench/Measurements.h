@@ -0,0 +1,49 @@
+#pragma once
+#include <QJsonObject>
+#include <QString>
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <vector>
+
+/**
+ * Helpers shared by the benchmark tools in src/bench to summarise
+ * what they measure the same way.
+ */
+namespace measurements {
+
+/**
+ * Value at percentile `p` (0-100) of `samples`, which must be sorted.
+ * Nearest rank, so it is always one of the measurements.
+ */
+inline double percentile(std::vector<double> const &samples, double p) {
+    if (samples.empty())
+        return 0;
+    std::size_t rank = std::ceil(p / 100. * samples.size());
+    return samples[std::min(std::max<std::size_t>(rank, 1), samples.size()) - 1];
+}
+
+/**
+ * Number of samples, mean, max, and the given percentiles of `samples`, as
+ * e.g. {"samples": 200, "mean": 12.5, "max": 40.1, "p50": 11.2, "p999": 39.8}.
+ */
+inline QJsonObject summarize(std::vector<double> samples, std::initializer_list<double> percentiles) {
+    std::sort(samples.begin(), samples.end());
+
+    double mean = 0;
+    for (double sample : samples)
+        mean += sample / samples.size();
+
+    QJsonObject summary{
+        {"samples", static_cast<int>(samples.size())},
+        {"mean", mean},
+        {"max", samples.empty() ? 0. : samples.back()}
+    };
+
+    for (double p : percentiles)
+        summary[QString("p%1").arg(p).remove('.')] = percentile(samples, p);
+
+    return summary;
+}
+
+} // namespace measurements
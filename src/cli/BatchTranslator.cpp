@@ -0,0 +1,279 @@
+#include "BatchTranslator.h"
+#include "Instrumentation.h"
+#include "PersistentCache.h"
+#include "ShardedService.h"
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+#include "3rd_party/bergamot-translator/src/translator/response.h"
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/**
+ * State shared between the reading/writing thread and the service's worker
+ * threads. Owned through a shared_ptr by the translation callbacks as well,
+ * so it outlives run() if we bail out while chunks are still in flight.
+ */
+struct PipelineState {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Translations that arrived but are waiting for their turn to be written,
+    // keyed by chunk index.
+    std::map<std::size_t, std::string> finished;
+
+    void deliver(std::size_t index, std::string &&translation) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.emplace(index, std::move(translation));
+        cv.notify_one();
+    }
+};
+
+/**
+ * A chunk that is translated line by line: some lines came from the cache,
+ * and the rest is being translated. With deduplication, every distinct line
+ * is translated once, however often it appears in the chunk.
+ */
+struct LineChunk {
+    std::string source;
+    std::vector<std::string> lines;
+    std::vector<std::optional<std::string>> translations;
+    std::vector<std::vector<std::size_t>> missing; // Lines that are translated together, one entry per line sent
+    bool trailingNewline;
+
+    std::string join() const {
+        std::string out;
+        for (std::size_t i = 0; i < translations.size(); ++i) {
+            if (i > 0)
+                out.push_back('\n');
+            out.append(translations[i] ? *translations[i] : std::string());
+        }
+        if (trailingNewline)
+            out.push_back('\n');
+        return out;
+    }
+};
+
+std::vector<std::string> splitLines(std::string const &text, bool &trailingNewline) {
+    std::vector<std::string> lines;
+    std::size_t begin = 0;
+    for (std::size_t end; (end = text.find('\n', begin)) != std::string::npos; begin = end + 1)
+        lines.emplace_back(text, begin, end - begin);
+
+    trailingNewline = begin == text.size();
+    if (!trailingNewline)
+        lines.emplace_back(text, begin);
+
+    return lines;
+}
+
+bool isBlank(std::string const &line) {
+    return std::all_of(line.begin(), line.end(), [](char c) { return std::isspace(static_cast<unsigned char>(c)); });
+}
+
+const char *const kWhitespace = " \t\r\n\f\v";
+
+// A line without its leading and trailing whitespace, which the model
+// doesn't translate anyway. Lines that only differ in that are duplicates.
+std::string trim(std::string const &line) {
+    std::size_t begin = line.find_first_not_of(kWhitespace);
+    std::size_t end = line.find_last_not_of(kWhitespace);
+    return line.substr(begin, end + 1 - begin);
+}
+
+// The translation of trim(line), with the whitespace around line put back.
+std::string surround(std::string const &line, std::string const &translation) {
+    std::size_t begin = line.find_first_not_of(kWhitespace);
+    std::size_t end = line.find_last_not_of(kWhitespace);
+    return line.substr(0, begin) + translation + line.substr(end + 1);
+}
+
+const std::string kCacheOptions("text"); // Only plain text is cached
+
+} // Anonymous namespace
+
+BatchTranslator::BatchTranslator(std::shared_ptr<ShardedService> service,
+                                 std::shared_ptr<marian::bergamot::TranslationModel> model,
+                                 bool html,
+                                 std::size_t maxChunksInFlight)
+: service_(std::move(service))
+, model_(std::move(model))
+, html_(html)
+, maxChunksInFlight_(std::max<std::size_t>(maxChunksInFlight, 1))
+, deduplicate_(false)
+, duplicates_(0) {
+    //
+}
+
+void BatchTranslator::setDeduplicate(bool deduplicate) {
+    deduplicate_ = deduplicate;
+}
+
+std::size_t BatchTranslator::duplicates() const {
+    return duplicates_;
+}
+
+void BatchTranslator::setCache(std::shared_ptr<PersistentCache> cache, std::string modelKey) {
+    cache_ = std::move(cache);
+    modelKey_ = std::move(modelKey);
+}
+
+void BatchTranslator::run(Reader read, Writer write) {
+    auto state = std::make_shared<PipelineState>();
+
+    marian::bergamot::ResponseOptions options;
+    options.HTML = html_;
+
+    std::size_t submitted = 0; // Number of chunks handed to the service
+    std::size_t written = 0; // Number of chunks written (in order)
+    bool eof = false;
+
+    // The callbacks below get their own copies of everything they need, as
+    // they might still run after we've thrown out of here.
+    auto service = service_;
+    auto model = model_;
+    auto cache = cache_;
+    auto modelKey = modelKey_;
+
+    // Translates a chunk in one go. Only throws when called from this thread,
+    // on worker threads translate() doesn't throw for plain text.
+    auto translate = [service, model, state, options](std::size_t index, std::string &&chunk) {
+        service->translate(model, std::move(chunk), [state, index, started = instrumentation::Clock::now()](marian::bergamot::Response &&response) {
+            instrumentation::record(instrumentation::Stage::Translate, started, instrumentation::Clock::now(), index);
+            state->deliver(index, std::move(response.target.text));
+        }, options);
+    };
+
+    // Looks up each line of the chunk in the cache, if there is one, and only
+    // translates the lines that weren't in there, all together in one
+    // request. When deduplicating, each distinct line only once.
+    bool deduplicate = deduplicate_;
+    auto translateLines = [this, service, model, cache, modelKey, state, options, translate, deduplicate](std::size_t index, std::string &&source) {
+        auto chunk = std::make_shared<LineChunk>();
+        chunk->lines = splitLines(source, chunk->trailingNewline);
+        chunk->translations.resize(chunk->lines.size());
+
+        std::string missing;
+        std::unordered_map<std::string, std::size_t> sent; // Index into chunk->missing, by trimmed line
+
+        for (std::size_t i = 0; i < chunk->lines.size(); ++i) {
+            std::string const &line = chunk->lines[i];
+            if (isBlank(line)) {
+                chunk->translations[i] = line;
+                continue;
+            }
+
+            if (cache) {
+                if (auto translation = cache->find(modelKey, kCacheOptions, line)) {
+                    chunk->translations[i] = std::move(*translation);
+                    continue;
+                }
+            }
+
+            if (!deduplicate) {
+                chunk->missing.push_back({i});
+                missing.append(line);
+                missing.push_back('\n');
+                continue;
+            }
+
+            std::string segment = trim(line);
+            auto it = sent.find(segment);
+            if (it != sent.end()) {
+                chunk->missing[it->second].push_back(i);
+                ++duplicates_;
+                continue;
+            }
+
+            sent.emplace(segment, chunk->missing.size());
+            chunk->missing.push_back({i});
+            missing.append(segment);
+            missing.push_back('\n');
+        }
+
+        if (chunk->missing.empty())
+            return state->deliver(index, chunk->join());
+
+        chunk->source = std::move(source);
+
+        service->translate(model, std::move(missing), [cache, modelKey, state, index, chunk, translate, deduplicate, started = instrumentation::Clock::now()](marian::bergamot::Response &&response) {
+            instrumentation::record(instrumentation::Stage::Translate, started, instrumentation::Clock::now(), index);
+
+            bool trailingNewline;
+            std::vector<std::string> lines = splitLines(response.target.text, trailingNewline);
+
+            // Lines are translated independently, so there should be a line of
+            // translation for every line we sent. If not, we can't tell which
+            // line is which, and translate the chunk as a whole instead.
+            if (lines.size() != chunk->missing.size()) {
+                try {
+                    return translate(index, std::move(chunk->source));
+                } catch (const std::runtime_error &) {
+                    // Best we can do is write out what we've got.
+                }
+            }
+
+            for (std::size_t i = 0; i < lines.size() && i < chunk->missing.size(); ++i) {
+                for (std::size_t line : chunk->missing[i]) {
+                    std::string translation = deduplicate ? surround(chunk->lines[line], lines[i]) : lines[i];
+                    if (cache && lines.size() == chunk->missing.size())
+                        cache->insert(modelKey, kCacheOptions, chunk->lines[line], translation);
+                    chunk->translations[line] = std::move(translation);
+                }
+            }
+
+            state->deliver(index, chunk->join());
+        }, options);
+    };
+
+    while (!eof || written < submitted) {
+        // Reader stage: keep the service topped up with input.
+        while (!eof && submitted - written < maxChunksInFlight_) {
+            std::string chunk;
+            if (!read(chunk) || chunk.empty()) {
+                eof = true;
+                break;
+            }
+
+            std::size_t index = submitted++;
+            try {
+                if (cache_ || deduplicate_)
+                    translateLines(index, std::move(chunk));
+                else
+                    translate(index, std::move(chunk));
+            } catch (const std::runtime_error &) {
+                // Drop whatever is still queued so we don't keep the workers
+                // busy with output nobody is going to read.
+                service_->clear();
+                throw;
+            }
+        }
+
+        if (written == submitted)
+            continue;
+
+        // Writer stage: wait for the oldest outstanding chunk, then write out
+        // everything that's ready in order. Writing happens outside the lock
+        // so the workers can keep delivering results meanwhile.
+        std::vector<std::string> ready;
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->cv.wait(lock, [&]{ return state->finished.count(written) > 0; });
+
+            for (auto it = state->finished.begin(); it != state->finished.end() && it->first == written + ready.size(); it = state->finished.erase(it))
+                ready.push_back(std::move(it->second));
+        }
+
+        for (std::string &translation : ready) {
+            write(std::move(translation));
+            ++written;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+
+class PersistentCache;
+class ShardedService;
+
+// If we include the actual header, we break QT compilation.
+namespace marian {
+    namespace bergamot {
+    class TranslationModel;
+    }
+}
+
+/**
+ * Pipelined translation of a stream of input chunks. Instead of translating
+ * one chunk at a time, the reader stage keeps up to `maxChunksInFlight` chunks
+ * queued in the service so its workers always have something to batch,
+ * while the writer stage hands translations back in input order as soon as the
+ * oldest outstanding chunk is done.
+ */
+class BatchTranslator {
+public:
+    /**
+     * Fills its argument with the next chunk of input. Returns false when
+     * there is no more input.
+     */
+    using Reader = std::function<bool(std::string &)>;
+
+    /**
+     * Receives the translation of each chunk, in the same order as the chunks
+     * were read.
+     */
+    using Writer = std::function<void(std::string &&)>;
+
+    BatchTranslator(std::shared_ptr<ShardedService> service,
+                    std::shared_ptr<marian::bergamot::TranslationModel> model,
+                    bool html,
+                    std::size_t maxChunksInFlight);
+
+    /**
+     * @brief setCache makes the translator look up lines in `cache` before
+     * translating them, and add the lines it did translate. Only valid when
+     * lines are translated independently of each other, i.e. the model does
+     * not use ssplit-mode wrapped_text, and the input isn't HTML.
+     * @param cache the cache, or nullptr to disable caching
+     * @param modelKey key of the model in the cache, see PersistentCache::modelKey()
+     */
+    void setCache(std::shared_ptr<PersistentCache> cache, std::string modelKey);
+
+    /**
+     * @brief setDeduplicate makes the translator translate lines that appear
+     * more than once in a chunk only once, and copy the translation to the
+     * others. Lines that only differ in leading and trailing whitespace count
+     * as the same. Same restrictions as setCache().
+     */
+    void setDeduplicate(bool deduplicate);
+
+    /**
+     * @brief Number of lines that were not translated because they duplicated
+     * a line earlier in their chunk.
+     */
+    std::size_t duplicates() const;
+
+    /**
+     * @brief Reads chunks with `read` until it returns false, translates them,
+     * and passes the results to `write`. Blocks until the last translation has
+     * been written. Reading and writing happen on the calling thread.
+     * Rethrows any std::runtime_error raised while submitting a chunk.
+     */
+    void run(Reader read, Writer write);
+
+private:
+    std::shared_ptr<ShardedService> service_;
+    std::shared_ptr<marian::bergamot::TranslationModel> model_;
+    bool html_;
+    std::size_t maxChunksInFlight_;
+    std::shared_ptr<PersistentCache> cache_;
+    std::string modelKey_;
+    bool deduplicate_;
+    std::size_t duplicates_;
+};
@@ -10,7 +10,8 @@ namespace translateLocally {
 enum AppType {
     CLI,
     GUI,
-    NativeMsg
+    NativeMsg,
+    Daemon
 };
 
 /**
@@ -29,8 +30,9 @@ static void CLIArgumentInit(QAppType& translateLocallyApp, QCommandLineParser& p
     parser.addOption({{"d", "download-model"}, QObject::tr("Connect to the Internet and download a model."), "output", ""});
     parser.addOption({{"r", "remove-model"}, QObject::tr("Remove a model from the local machine. Only works for models managed with translateLocally."), "output", ""});
     parser.addOption({{"m", "model"}, QObject::tr("Select model for translation."), "model", ""});
-    parser.addOption({{"i", "input"}, QObject::tr("Source translation file (or just used stdin)."), "input", ""});
+    parser.addOption({{"i", "input"}, QObject::tr("Source translation file (or just used stdin). With --output-dir, can be given more than once, and can be a directory."), "input", ""});
     parser.addOption({{"o", "output"}, QObject::tr("Target translation file (or just used stdout)."), "output", ""});
+    parser.addOption({"output-dir", QObject::tr("Translate each file given with -i into a file of the same name in this directory, and write a manifest.json with the words per second for each."), "directory", ""});
     parser.addOption({{"p", "plugin"}, QObject::tr("Start native message server to use for a browser plugin.")});
     parser.addOption({"allow-client", QObject::tr("Add a native messaging client id that is allowed to use Native Messaging in the browser.")});
     parser.addOption({"remove-client", QObject::tr("Remove a native messaging client id.")});
@@ -38,6 +40,14 @@ static void CLIArgumentInit(QAppType& translateLocallyApp, QCommandLineParser& p
     parser.addOption({"update-manifests", QObject::tr("Register native messaging clients with user profile.")});
     parser.addOption({"debug", QObject::tr("Print debug messages")});
     parser.addOption({"html", QObject::tr("Input is HTML")});
+    parser.addOption({"cache-size", QObject::tr("Number of translations to keep in the in-memory translation cache. 0 disables it."), "entries", ""});
+    parser.addOption({"stats", QObject::tr("Print translation cache statistics and time spent per stage to stderr when done translating.")});
+    parser.addOption({"daemon", QObject::tr("Start a translation daemon that keeps models loaded. Translations with -m are handed to it while it is running.")});
+    parser.addOption({"no-daemon", QObject::tr("Translate in this process, even if a translation daemon is running.")});
+    parser.addOption({"numa-shards", QObject::tr("Run a translation service on each NUMA node, each with its own copy of the model, for command line translation, the daemon and native messaging (on/off). Helps on multi-socket machines."), "on|off", ""});
+    parser.addOption({"autotune", QObject::tr("Find the fastest number of threads, workspace and mini-batch size on this machine for the model given with -m, and use those from now on.")});
+    parser.addOption({"trace", QObject::tr("Write the time spent in each stage of translating to this file, in Chrome's trace event format. Can also be set with the TRANSLATELOCALLY_TRACE environment variable."), "file", ""});
+    parser.addOption({"chunk-words", QObject::tr("Approximate number of words per chunk of input handed to the translator. Defaults to the mini-batch size. The first chunks are smaller, so the first lines of translation come out sooner."), "words", ""});
     
     parser.process(translateLocallyApp);
 }
@@ -101,8 +111,13 @@ static AppType runType(QCommandLineParser& parser) {
         return NativeMsg;
     }
 
+    // Translation daemon
+    if (parser.isSet("daemon")) {
+        return Daemon;
+    }
+
     // Cli mode
-    QList<QString> cmdonlyflags = {"l", "a", "d", "r", "m", "i", "o", "allow-client", "remove-client", "update-manifests", "list-clients"};
+    QList<QString> cmdonlyflags = {"l", "a", "d", "r", "m", "i", "o", "allow-client", "remove-client", "update-manifests", "list-clients", "autotune", "numa-shards"};
     for (auto&& flag : cmdonlyflags) {
         if (parser.isSet(flag)) {
             return CLI;
@@ -0,0 +1,178 @@
+#include "ChunkReader.h"
+#include "WordCount.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr int kReadBlockSize = 1 << 20; // Read pipes in blocks of up to 1MB
+
+constexpr char kUtf8Bom[] = "\xEF\xBB\xBF";
+constexpr int kUtf8BomSize = sizeof(kUtf8Bom) - 1;
+
+/**
+ * Appends whole lines from [pos, end) to chunk as long as words stays within
+ * wordBudget, and advances pos past them. A trailing line without '\n' is
+ * only taken if atEnd is set, as otherwise the rest of it may still be on its
+ * way. Sets full once the next line would not fit anymore.
+ */
+void takeLines(const char *&pos, const char *end, bool atEnd, std::string &chunk, std::size_t &words, std::size_t wordBudget, bool &full) {
+    while (!full && pos != end) {
+        const char *eol = static_cast<const char *>(std::memchr(pos, '\n', end - pos));
+        if (eol == nullptr) {
+            if (!atEnd)
+                return;
+            eol = end;
+        }
+
+        const char *lineEnd = eol;
+        if (lineEnd != pos && *(lineEnd - 1) == '\r')
+            --lineEnd;
+
+        std::size_t lineWords = std::max<std::size_t>(countWords(pos, lineEnd), 1);
+        if (!chunk.empty() && words + lineWords > wordBudget) {
+            full = true;
+            return;
+        }
+
+        chunk.append(pos, lineEnd - pos);
+        chunk.push_back('\n');
+        words += lineWords;
+        full = words >= wordBudget;
+
+        pos = eol == end ? end : eol + 1;
+    }
+}
+
+/**
+ * Reads up to maxSize bytes from the file descriptor of a pipe or terminal,
+ * returning as soon as there is anything. QFile::read() instead keeps reading
+ * until it has all maxSize bytes or reaches the end, also when the file is
+ * unbuffered, so input arriving line by line would only be translated once
+ * a whole block of it had come in. Returns 0 at the end of the input and -1
+ * on errors, like read(2).
+ */
+qint64 readAvailable(int fd, char *data, int maxSize) {
+    for (;;) {
+#if defined(Q_OS_WIN)
+        int read = ::_read(fd, data, maxSize);
+#else
+        ssize_t read = ::read(fd, data, maxSize);
+#endif
+        if (read >= 0 || errno != EINTR)
+            return read;
+    }
+}
+
+} // Anonymous namespace
+
+ChunkReader::ChunkReader(QFile &file)
+: file_(file)
+, mapped_(nullptr)
+, pos_(nullptr)
+, end_(nullptr)
+, offset_(0)
+, eof_(false)
+, drained_(false)
+, checkedBom_(false) {
+    // Only regular files can be mapped. If mapping fails (e.g. the file is too
+    // large for the address space) we fall back to reading it like a pipe.
+    if (!file_.isSequential() && file_.size() > 0)
+        mapped_ = file_.map(0, file_.size());
+
+    if (mapped_) {
+        pos_ = reinterpret_cast<const char *>(mapped_);
+        end_ = pos_ + file_.size();
+        if (end_ - pos_ >= kUtf8BomSize && std::memcmp(pos_, kUtf8Bom, kUtf8BomSize) == 0)
+            pos_ += kUtf8BomSize;
+        checkedBom_ = true;
+    }
+}
+
+ChunkReader::~ChunkReader() {
+    if (mapped_)
+        file_.unmap(mapped_);
+}
+
+bool ChunkReader::readBlock() {
+    // Drop what we've already handed out before growing the buffer
+    if (offset_ > 0) {
+        buffer_.remove(0, offset_);
+        offset_ = 0;
+    }
+
+    // Regular files that couldn't be mapped go through QFile, which reads
+    // them just as well in full blocks.
+    if (!file_.isSequential() || file_.handle() < 0) {
+        QByteArray block = file_.read(kReadBlockSize);
+        if (block.isEmpty()) {
+            eof_ = true;
+            return false;
+        }
+
+        buffer_.append(block);
+        return true;
+    }
+
+    int size = buffer_.size();
+    buffer_.resize(size + kReadBlockSize);
+    qint64 read = readAvailable(file_.handle(), buffer_.data() + size, kReadBlockSize);
+    buffer_.resize(size + static_cast<int>(std::max<qint64>(read, 0)));
+    drained_ = read < kReadBlockSize;
+    if (read <= 0) {
+        eof_ = true;
+        return false;
+    }
+
+    return true;
+}
+
+bool ChunkReader::next(std::string &chunk, std::size_t wordBudget) {
+    chunk.clear();
+    std::size_t words = 0;
+    bool full = false;
+
+    if (mapped_) {
+        takeLines(pos_, end_, true, chunk, words, wordBudget, full);
+        return !chunk.empty();
+    }
+
+    if (!checkedBom_) {
+        // Only wait for more while it could still be a byte order mark, so
+        // a short first line on a terminal isn't held up.
+        while (!eof_ && buffer_.size() < kUtf8BomSize && QByteArray(kUtf8Bom).startsWith(buffer_))
+            readBlock();
+        if (buffer_.startsWith(kUtf8Bom))
+            offset_ = kUtf8BomSize;
+        checkedBom_ = true;
+    }
+
+    for (;;) {
+        const char *begin = buffer_.constData() + offset_;
+        const char *pos = begin;
+        takeLines(pos, buffer_.constData() + buffer_.size(), eof_, chunk, words, wordBudget, full);
+        offset_ += static_cast<int>(pos - begin);
+
+        if (full || eof_)
+            break;
+
+        // Don't hold on to the lines we have while waiting for more that may
+        // take a while, e.g. when someone is typing them.
+        if (drained_ && !chunk.empty())
+            break;
+
+        // Either we ran out of buffered input or there's a partial line left,
+        // read some more. If that hits the end, the next round will pick up
+        // the final unterminated line.
+        readBlock();
+    }
+
+    return !chunk.empty();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <QByteArray>
+#include <QFile>
+#include <string>
+
+/**
+ * Reads UTF-8 input in chunks of whole lines straight into std::string,
+ * aiming for a roughly fixed number of words per chunk,
+ * without decoding to QString and back. Regular files are memory mapped;
+ * pipes and terminals (e.g. stdin) are read straight from their file
+ * descriptor, taking whatever has arrived, so lines that come in slowly are
+ * translated as they come.
+ *
+ * A leading UTF-8 byte order mark is dropped, "\r\n" line endings are
+ * turned into "\n", and every line in a chunk ends in '\n', including the
+ * last line of the input if it had no line ending.
+ */
+class ChunkReader {
+public:
+    /**
+     * @brief ChunkReader reads from `file`, which should already be open for
+     * reading. The file must outlive the reader.
+     */
+    explicit ChunkReader(QFile &file);
+    ~ChunkReader();
+
+    ChunkReader(const ChunkReader &) = delete;
+    ChunkReader &operator=(const ChunkReader &) = delete;
+
+    /**
+     * @brief next replaces the contents of `chunk` with the next lines of
+     * input, adding lines as long as the chunk stays within `wordBudget`
+     * words. A chunk always holds at least one line, so a single line longer
+     * than the budget becomes a chunk of its own. Empty lines count as one
+     * word so that runs of them don't end up in one enormous chunk. On a pipe,
+     * the chunk may be smaller if no more input has arrived yet.
+     * @return false if there was no more input, in which case `chunk` is empty.
+     */
+    bool next(std::string &chunk, std::size_t wordBudget);
+
+private:
+    QFile &file_;
+
+    // Mapped mode: the whole file is in memory, pos_ walks over it.
+    uchar *mapped_;
+    const char *pos_;
+    const char *end_;
+
+    // Streaming mode: buffer_ holds what we read but haven't returned yet,
+    // starting at offset_.
+    QByteArray buffer_;
+    int offset_;
+    bool eof_;
+    bool drained_; // The last read took all there was at the time
+    bool checkedBom_;
+
+    bool readBlock();
+};
@@ -1,18 +1,95 @@
 #include "CommandLineIface.h"
+#include "AutoTuner.h"
+#include "cli/BatchTranslator.h"
+#include "cli/ChunkReader.h"
+#include "cli/Daemon.h"
+#include "cli/HtmlChunker.h"
 #include "cli/NativeMsgManager.h"
+#include "Instrumentation.h"
+#include "MarianInterface.h"
+#include "PersistentCache.h"
+#include "ShardedService.h"
+#include "WordCount.h"
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
 #include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QProcessEnvironment>
-#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0))
-#include <QTextCodec>
-#endif
+#include <QSaveFile>
+#include <QSet>
+#include <QTextStream>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// bergamot-translator
+#include "3rd_party/bergamot-translator/src/translator/service.h"
+#include "translator/translation_model.h"
 
 // Progress bar taken from https://stackoverflow.com/questions/14539867/how-to-display-a-progress-indicator-in-pure-c-c-cout-printf
 #define PBSTR "############################################################"
 #define PBWIDTH 60
 
 namespace {
+    /**
+     * Prints the time spent per stage, from instrumentation::stats() or the
+     * daemon's Stats reply. Stages that never happened are left out.
+     */
+    void printTimings(QTextStream &err, QJsonObject const &stages, QString const &suffix) {
+        for (QString const &stage : stages.keys()) {
+            QJsonObject data = stages.value(stage).toObject();
+            if (data.value("count").toDouble() == 0)
+                continue;
+            err << "Stage " << stage << suffix << ": " << static_cast<qint64>(data.value("count").toDouble()) << " times, "
+                << "mean " << data.value("meanMs").toDouble() << " ms, "
+                << "p99 " << data.value("p99Ms").toDouble() << " ms, "
+                << "total " << data.value("totalMs").toDouble() << " ms\n";
+        }
+    }
+
+    // Written to the --output-dir, with the words and time per file.
+    const char manifestName[] = "manifest.json";
+
+    // Words in the first chunk of a stream, see ChunkRamp.
+    constexpr std::size_t firstChunkWords = 32;
+
+    /**
+     * Word budgets for the chunks of a stream. The first chunk is small, so
+     * the first lines of translation come out quickly, and every next one is
+     * twice as large up to `chunkWords`, by when there's enough in flight to
+     * keep the batches full.
+     */
+    class ChunkRamp {
+    public:
+        explicit ChunkRamp(std::size_t chunkWords)
+        : max_(chunkWords)
+        , next_(std::min(chunkWords, firstChunkWords)) {
+            //
+        }
+
+        std::size_t next() {
+            std::size_t budget = next_;
+            next_ = std::min(max_, next_ * 2);
+            return budget;
+        }
+
+    private:
+        std::size_t max_;
+        std::size_t next_;
+    };
+
     void checkAppleSandbox(QCommandLineParser const &parser) {
         QProcessEnvironment env(QProcessEnvironment::systemEnvironment());
         if (!env.contains("APP_SANDBOX_CONTAINER_ID"))
@@ -41,23 +118,8 @@ CommandLineIface::CommandLineIface(QObject * parent)
 , eventLoop_(this)
 , network_(this)
 , settings_(this)
-, models_(this, &settings_)
-, translator_(new MarianInterface(this))
-, instream_(stdin)
-, outstream_(stdout) {
-    // Take care of encoding according to https://doc.qt.io/qt-6/qtextstream.html#setAutoDetectUnicode
-#if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0)) // https://github.com/XapaJIaMnu/translateLocally/issues/121#issuecomment-1277762146
-    instream_.setCodec(QTextCodec::codecForName(QByteArray("UTF-8")));
-    outstream_.setCodec(QTextCodec::codecForName(QByteArray("UTF-8")));
-#else
-    instream_.setEncoding(QStringConverter::Encoding::Utf8);
-    outstream_.setEncoding(QStringConverter::Encoding::Utf8);
-#endif
-    instream_.setAutoDetectUnicode(true);
-    outstream_.setAutoDetectUnicode(true);
+, models_(this, &settings_) {
     // Take care of slots and signals
-    connect(translator_, &MarianInterface::error, this, &CommandLineIface::outputError);
-    connect(translator_, &MarianInterface::translationReady, this, &CommandLineIface::outputTranslation);
     connect(&network_, &Network::error, this, &CommandLineIface::outputError);
 }
 
@@ -98,27 +160,58 @@ int CommandLineIface::run(QCommandLineParser const &parser) {
         out << successstr;
         out.flush();
         return 0;
+    } else if (parser.isSet("autotune")) {
+        return autotune(parser.value("m"));
     } else if (parser.isSet("m")) {
-        // Open file as input stream if necessary
-        if (parser.isSet("i")) {
-            infile_.setFileName(parser.value("i"));
-            if (infile_.open(QIODevice::ReadOnly)) {
-                instream_.setDevice(&infile_);
-            } else {
+        // With --output-dir, every -i is a file or a directory of files, each
+        // translated into a file of its own.
+        QList<FileJob> files;
+        QString outputDir = parser.value("output-dir");
+        if (parser.isSet("output-dir")) {
+            if (!parser.isSet("i")) {
+                qCritical() << "--output-dir needs at least one input file or directory given with -i";
+                return 3;
+            }
+            if (parser.isSet("o")) {
+                qCritical() << "-o can't be combined with --output-dir";
+                return 4;
+            }
+            if (!collectFiles(parser.values("i"), outputDir, files)) {
                 checkAppleSandbox(parser);
-                qCritical() << "Couldn't open input file:" + parser.value("i");
                 return 3;
             }
+        } else if (parser.values("i").size() > 1) {
+            qCritical() << "Translating more than one input file needs --output-dir";
+            return 3;
         }
 
-        // Same, but output stream
-        if (parser.isSet("o")) {
-            outfile_.setFileName(parser.value("o"));
-            if (outfile_.open(QIODevice::WriteOnly)) {
-                outstream_.setDevice(&outfile_);
-            } else {
-                checkAppleSandbox(parser);
-                qCritical() << "Couldn't open output file:" + parser.value("o");
+        // Open file as input stream if necessary, otherwise read stdin.
+        // Unbuffered, as ChunkReader reads pipes from the file descriptor
+        // itself, so nothing may be left behind in QFile's buffer. With
+        // --output-dir, each file is opened when its turn comes instead.
+        if (files.isEmpty()) {
+            if (parser.isSet("i")) {
+                infile_.setFileName(parser.value("i"));
+                if (!infile_.open(QIODevice::ReadOnly)) {
+                    checkAppleSandbox(parser);
+                    qCritical() << "Couldn't open input file:" + parser.value("i");
+                    return 3;
+                }
+            } else if (!infile_.open(fileno(stdin), QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+                qCritical() << "Couldn't open stdin for reading";
+                return 3;
+            }
+
+            // Same, but output stream
+            if (parser.isSet("o")) {
+                outfile_.setFileName(parser.value("o"));
+                if (!outfile_.open(QIODevice::WriteOnly)) {
+                    checkAppleSandbox(parser);
+                    qCritical() << "Couldn't open output file:" + parser.value("o");
+                    return 4;
+                }
+            } else if (!outfile_.open(fileno(stdout), QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+                qCritical() << "Couldn't open stdout for writing";
                 return 4;
             }
         }
@@ -127,9 +220,11 @@ int CommandLineIface::run(QCommandLineParser const &parser) {
 
         // Try to find our model in the list of models
         QString modelpath;
+        QString modelID;
         for (auto&& model : models_.getInstalledModels()) {
             if (model.shortName == model_shortname) {
                 modelpath = model.path;
+                modelID = model.id();
             }
         }
         if (modelpath.isEmpty()) {
@@ -137,9 +232,44 @@ int CommandLineIface::run(QCommandLineParser const &parser) {
             return 1;
         }
 
-        // Init the translation model
-        translator_->setModel(modelpath, settings_.marianSettings());
-        doTranslation(parser.isSet("html"));
+        // Aim for chunks of about one mini-batch by default. Chunks are only
+        // split at line boundaries, so they're evenly sized regardless of
+        // whether the input is short strings or long paragraphs.
+        std::size_t chunkWords = settings_.marianSettings(modelpath).mini_batch_words;
+        if (parser.isSet("chunk-words")) {
+            bool ok = false;
+            chunkWords = parser.value("chunk-words").toUInt(&ok);
+            if (!ok || chunkWords == 0) {
+                qCritical() << "Invalid value for --chunk-words:" << parser.value("chunk-words");
+                return 5;
+            }
+        }
+
+        translateLocally::marianSettings settings = settings_.marianSettings(modelpath);
+        if (parser.isSet("cache-size")) {
+            bool ok = false;
+            settings.translation_cache_size = parser.value("cache-size").toUInt(&ok);
+            if (!ok) {
+                qCritical() << "Invalid value for --cache-size:" << parser.value("cache-size");
+                return 5;
+            }
+            settings.translation_cache = settings.translation_cache_size > 0;
+        }
+
+        // Hand the work to the translation daemon if one is running, as it
+        // has the model loaded already. Its service is set up when it starts,
+        // so if we're asked to set it up differently, we do it ourselves.
+        // The daemon translates one stream per connection, so many files are
+        // translated here, with the model loaded once for all of them.
+        if (!parser.isSet("no-daemon") && !parser.isSet("cache-size") && files.isEmpty()) {
+            QLocalSocket daemon;
+            daemon.connectToServer(Daemon::socketName());
+            if (daemon.waitForConnected(daemonConnectTimeout)
+                && doDaemonTranslation(daemon, modelID, chunksInFlightPerThread * settings.cpu_threads, parser.isSet("html"), chunkWords, parser.isSet("stats")))
+                return 0;
+        }
+
+        doTranslation(modelpath, settings, parser.isSet("html"), chunkWords, parser.isSet("stats"), files, outputDir);
         return 0;
     } else if (parser.isSet("allow-client")) {
         return allowNativeMessagingClient(parser.positionalArguments());
@@ -149,6 +279,8 @@ int CommandLineIface::run(QCommandLineParser const &parser) {
         return listNativeMessagingClients();
     } else if (parser.isSet("update-manifests")) {
         return updateNativeMessagingManifests();
+    } else if (parser.isSet("numa-shards")) {
+        return setNumaShards(parser.value("numa-shards"));
     } else {
         qCritical() << "We are in command line mode, but there's nothing for us to do. Some control flow mistake maybe?";
         return 2;
@@ -179,35 +311,500 @@ void CommandLineIface::printRemoteModels() {
 }
 
 /**
- * @brief CommandLineIface::fetchData fetches lines to be translated, batches them for efficiency and sends to the translator. Could be either a file or stdin
- * @param buffer the buffer is where the lines to be translated are stored
- * @return
+ * @brief CommandLineIface::doTranslation Loads the model and translates the input stream. Blocks until all input is
+ *        translated. Several chunks are in flight at the same time so the translation threads are kept busy while we
+ *        read the next chunks and write out the finished ones.
+ * @param modelPath path to the directory of the model to translate with
+ * @param settings settings to load the model and service with
+ * @param HTML whether the input is HTML
+ * @param chunkWords approximate number of words per chunk handed to the service
+ * @param printStats whether to print cache statistics to stderr when done
+ * @param files files to translate instead of the input stream, see translateFiles()
+ * @param outputDir directory the translations of `files` go to
+ */
+void CommandLineIface::doTranslation(QString modelPath, translateLocally::marianSettings const &settings, bool HTML, std::size_t chunkWords, bool printStats, QList<FileJob> const &files, QString const &outputDir) {
+    try {
+        std::size_t cacheSize = settings.translation_cache ? settings.translation_cache_size : 0;
+        auto service = std::make_shared<ShardedService>(ShardedService::Config{settings.cpu_threads, cacheSize, settings_.numaShards()});
+
+        auto options = makeOptions(modelPath.toStdString(), settings);
+        auto model = service->loadModel(options);
+
+        BatchTranslator translator(service, model, HTML, chunksInFlightPerThread * settings.cpu_threads);
+
+        // Lines are cached and deduplicated individually, which only works if
+        // they're translated independently. That's not the case for HTML, nor
+        // when sentences can span multiple lines.
+        bool independentLines = !HTML && options->get<std::string>("ssplit-mode", "paragraph") != "wrapped_text";
+        translator.setDeduplicate(independentLines);
+
+        std::shared_ptr<PersistentCache> cache;
+        if (settings_.persistentCache() && independentLines) {
+            cache = std::make_shared<PersistentCache>(PersistentCache::defaultPath(), static_cast<qint64>(settings_.persistentCacheSize()) * 1024 * 1024);
+            if (cache->isOpen())
+                translator.setCache(cache, PersistentCache::modelKey(modelPath));
+            else
+                cache.reset();
+        }
+
+        if (files.isEmpty()) {
+            // HTML chunks have to end at element boundaries, and have the tags
+            // added to balance them stripped from their translation again.
+            ChunkReader reader(infile_);
+            HtmlChunker htmlChunker(reader);
+            std::deque<std::pair<std::size_t, std::size_t>> added;
+            ChunkRamp ramp(chunkWords);
+
+            translator.run([&](std::string &chunk) {
+                if (!HTML)
+                    return reader.next(chunk, ramp.next());
+
+                if (!htmlChunker.next(chunk, ramp.next()))
+                    return false;
+
+                added.emplace_back(htmlChunker.openedTags(), htmlChunker.closedTags());
+                return true;
+            }, [&](std::string &&translation) {
+                if (HTML) {
+                    HtmlChunker::strip(translation, added.front().first, added.front().second);
+                    added.pop_front();
+                }
+
+                outfile_.write(translation.data(), translation.size());
+                outfile_.flush();
+            });
+        } else {
+            translateFiles(translator, files, outputDir, HTML, chunkWords);
+        }
+
+        if (printStats) {
+            QTextStream err(stderr);
+            if (cacheSize > 0) {
+                auto stats = service->cacheStats();
+                err << "Translation cache: " << stats.hits << " hits, " << stats.misses << " misses (sentences), capacity " << cacheSize * service->shards() << " entries\n";
+            } else {
+                err << "Translation cache: disabled\n";
+            }
+
+            err << "Duplicate lines: " << translator.duplicates() << " translated once\n";
+
+            if (cache) {
+                auto stats = cache->stats();
+                err << "Persistent cache: " << stats.hits << " hits, " << stats.misses << " misses (lines), "
+                    << stats.inserts << " added, " << stats.evictions << " evicted, "
+                    << stats.entries << " entries, " << stats.bytes / (1024 * 1024) << " MB\n";
+            } else {
+                err << "Persistent cache: disabled\n";
+            }
+
+            printTimings(err, instrumentation::stats().value("stages").toObject(), "");
+        }
+    } catch (const std::runtime_error &e) {
+        outputError(QString::fromStdString(e.what()));
+    }
+}
+
+/**
+ * @brief CommandLineIface::collectFiles Lists the files to translate with --output-dir. Each input is either a file,
+ *        which is translated into a file of the same name in `outputDir`, or a directory, all files in which are
+ *        translated into the same place relative to `outputDir`. Prints an error if two files would end up in the same
+ *        place, or if there's nothing to translate.
+ * @return false if there was an error
+ */
+bool CommandLineIface::collectFiles(QStringList const &inputs, QString const &outputDir, QList<FileJob> &files) {
+    QDir output(outputDir);
+    QString outputPath = QFileInfo(outputDir).absoluteFilePath() + '/';
+
+    for (QString const &input : inputs) {
+        QFileInfo info(input);
+        if (info.isDir()) {
+            QDir dir(input);
+            QStringList names;
+            QDirIterator it(input, QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext())
+                names.append(dir.relativeFilePath(it.next()));
+            names.sort(); // Same order every time, so the manifests can be compared
+
+            for (QString const &name : names) {
+                // Don't translate our own output when it's inside the input
+                if (QFileInfo(dir.filePath(name)).absoluteFilePath().startsWith(outputPath))
+                    continue;
+                files.append(FileJob{dir.filePath(name), QDir::cleanPath(output.filePath(name))});
+            }
+        } else if (info.isFile()) {
+            files.append(FileJob{input, QDir::cleanPath(output.filePath(info.fileName()))});
+        } else {
+            qCritical() << "Couldn't open input file:" + input;
+            return false;
+        }
+    }
+
+    if (files.isEmpty()) {
+        qCritical() << "Found no files to translate in:" << inputs.join(", ");
+        return false;
+    }
+
+    QSet<QString> outputs{QDir::cleanPath(output.filePath(manifestName))};
+    for (FileJob const &file : files) {
+        if (outputs.contains(file.output)) {
+            qCritical() << "More than one input would be translated into" << file.output;
+            return false;
+        }
+        if (QFileInfo(file.output).absoluteFilePath() == QFileInfo(file.input).absoluteFilePath()) {
+            qCritical() << "Translating" << file.input << "would overwrite it. Use a different --output-dir.";
+            return false;
+        }
+        outputs.insert(file.output);
+    }
+
+    return true;
+}
+
+/**
+ * @brief CommandLineIface::translateFiles Translates many files with one model and one pipeline. The reader moves on
+ *        to the next file as soon as it has read the last chunk of the previous one, so chunks from several files
+ *        are in flight at the same time and small files fill each other's batches. Translations come back in order,
+ *        so each output file is complete, and replaces any existing file, as soon as the last chunk of its input is
+ *        written. Writes a manifest.json to `outputDir` with the words and time per file when done.
+ * @param translator pipeline to translate with
+ * @param files files to translate, see collectFiles()
+ * @param outputDir directory the manifest goes to
+ * @param HTML whether the input is HTML
+ * @param chunkWords approximate number of words per chunk handed to the service
+ */
+void CommandLineIface::translateFiles(BatchTranslator &translator, QList<FileJob> const &files, QString const &outputDir, bool HTML, std::size_t chunkWords) {
+    using Clock = std::chrono::steady_clock;
+
+    // A file from when we start reading it until its translation is written.
+    struct OpenFile {
+        explicit OpenFile(FileJob const &job)
+        : job(job)
+        , infile(job.input)
+        , outfile(job.output)
+        , eof(false)
+        , pending(0)
+        , words(0)
+        , started(Clock::now()) {
+            //
+        }
+
+        FileJob job;
+        QFile infile;
+        std::unique_ptr<ChunkReader> reader;
+        std::unique_ptr<HtmlChunker> htmlChunker;
+        QSaveFile outfile; // Only replaces the output once it's complete
+        bool eof; // Read all of it
+        std::size_t pending; // Chunks read but not yet written
+        std::size_t words;
+        Clock::time_point started;
+    };
+
+    // The chunks in flight, in order, and the files they came from.
+    struct Chunk {
+        OpenFile *file;
+        std::size_t opened; // Tags HtmlChunker added
+        std::size_t closed;
+        std::size_t words;
+    };
+
+    std::deque<std::unique_ptr<OpenFile>> open; // The one at the back is being read
+    std::deque<Chunk> inFlight;
+    int next = 0; // Index of the next file to open
+    QJsonArray manifest;
+    std::size_t totalWords = 0;
+    Clock::time_point started = Clock::now();
+
+    // Commits all files at the front that are done, in input order.
+    auto commit = [&]() {
+        while (!open.empty() && open.front()->eof && open.front()->pending == 0) {
+            OpenFile &file = *open.front();
+            if (!file.outfile.commit())
+                throw std::runtime_error("Couldn't write output file " + file.job.output.toStdString() + ": " + file.outfile.errorString().toStdString());
+
+            std::chrono::duration<double> elapsed = Clock::now() - file.started;
+            manifest.append(QJsonObject{
+                {"input", file.job.input},
+                {"output", file.job.output},
+                {"words", static_cast<qint64>(file.words)},
+                {"seconds", elapsed.count()},
+                {"wordsPerSecond", elapsed.count() > 0 ? file.words / elapsed.count() : 0.0}
+            });
+            totalWords += file.words;
+            open.pop_front();
+        }
+    };
+
+    translator.run([&](std::string &chunk) {
+        while (true) {
+            if (open.empty() || open.back()->eof) {
+                if (next == files.size())
+                    return false;
+
+                open.push_back(std::make_unique<OpenFile>(files[next++]));
+                OpenFile &file = *open.back();
+                if (!file.infile.open(QIODevice::ReadOnly))
+                    throw std::runtime_error("Couldn't open input file " + file.job.input.toStdString() + ": " + file.infile.errorString().toStdString());
+                if (!QDir().mkpath(QFileInfo(file.job.output).path()) || !file.outfile.open(QIODevice::WriteOnly))
+                    throw std::runtime_error("Couldn't open output file " + file.job.output.toStdString() + ": " + file.outfile.errorString().toStdString());
+                file.reader = std::make_unique<ChunkReader>(file.infile);
+                file.htmlChunker = std::make_unique<HtmlChunker>(*file.reader);
+            }
+
+            OpenFile &file = *open.back();
+            if (HTML ? file.htmlChunker->next(chunk, chunkWords) : file.reader->next(chunk, chunkWords)) {
+                ++file.pending;
+                inFlight.push_back(Chunk{
+                    &file,
+                    HTML ? file.htmlChunker->openedTags() : 0,
+                    HTML ? file.htmlChunker->closedTags() : 0,
+                    countWords(chunk)
+                });
+                return true;
+            }
+
+            // Done reading this one, on to the next. It might be complete
+            // already if it was empty.
+            file.eof = true;
+            file.htmlChunker.reset();
+            file.reader.reset();
+            file.infile.close();
+            commit();
+        }
+    }, [&](std::string &&translation) {
+        Chunk chunk = inFlight.front();
+        inFlight.pop_front();
+
+        if (HTML)
+            HtmlChunker::strip(translation, chunk.opened, chunk.closed);
+
+        chunk.file->outfile.write(translation.data(), translation.size());
+        chunk.file->words += chunk.words;
+        --chunk.file->pending;
+        commit();
+    });
+
+    std::chrono::duration<double> elapsed = Clock::now() - started;
+    QJsonObject summary{
+        {"files", manifest},
+        {"words", static_cast<qint64>(totalWords)},
+        {"seconds", elapsed.count()},
+        {"wordsPerSecond", elapsed.count() > 0 ? totalWords / elapsed.count() : 0.0}
+    };
+
+    QSaveFile manifestFile(QDir(outputDir).filePath(manifestName));
+    if (!manifestFile.open(QIODevice::WriteOnly)
+        || manifestFile.write(QJsonDocument(summary).toJson()) < 0
+        || !manifestFile.commit())
+        throw std::runtime_error("Couldn't write " + manifestFile.fileName().toStdString() + ": " + manifestFile.errorString().toStdString());
+}
+
+/**
+ * @brief CommandLineIface::doDaemonTranslation Translates the input stream with a running translation daemon. Like
+ *        doTranslation(), several chunks are in flight at the same time, each as a Translate request, and the
+ *        translations are written out in order. Blocks until all input is translated.
+ * @param daemon socket connected to the daemon
+ * @param modelID id of the model to translate with
+ * @param maxChunksInFlight number of chunks sent to the daemon ahead of the one we're waiting for
+ * @param HTML whether the input is HTML
+ * @param chunkWords approximate number of words per chunk sent to the daemon
+ * @param printStats whether to print the daemon's cache statistics to stderr when done
+ * @return false if the daemon didn't answer before we sent it any input, in which case the input is still unread and
+ *         should be translated without the daemon.
  */
-QString &CommandLineIface::fetchData(QString &buffer) {
-    int counter = 0;
-    buffer.clear();
-    static QString line;
-    
-    while(counter < prefetchLines && instream_.readLineInto(&line)) {
-        buffer.append(line);
-        buffer.append('\n'); // The new line has no EoL characters
-        counter++;
+bool CommandLineIface::doDaemonTranslation(QLocalSocket &daemon, QString modelID, std::size_t maxChunksInFlight, bool HTML, std::size_t chunkWords, bool printStats) {
+    ChunkReader reader(infile_);
+    HtmlChunker htmlChunker(reader);
+    std::deque<std::pair<std::size_t, std::size_t>> added; // Tags HtmlChunker added to the chunks in flight
+    QByteArray buffer; // Received from the daemon, but not yet parsed
+    std::map<int, QJsonObject> finished; // Replies waiting for their turn, by chunk index
+    ChunkRamp ramp(chunkWords);
+
+    // Blocks until the reply for `id` is in `finished`, or until the daemon
+    // has sent nothing for `timeout` ms.
+    auto wait = [&](int id, int timeout) -> std::optional<QJsonObject> {
+        while (finished.count(id) == 0) {
+            std::optional<QJsonObject> message = Daemon::readMessage(buffer);
+            if (!message) {
+                if (!daemon.waitForReadyRead(timeout)) {
+                    if (daemon.state() == QLocalSocket::ConnectedState)
+                        return std::nullopt;
+                    throw std::runtime_error("Lost connection to the translation daemon: " + daemon.errorString().toStdString());
+                }
+                buffer.append(daemon.readAll());
+                continue;
+            }
+
+            if (message->value("update").toBool())
+                continue;
+
+            if (!message->value("success").toBool())
+                throw std::runtime_error(message->value("error").toString().toStdString());
+
+            finished.emplace(message->value("id").toInt(), message->value("data").toObject());
+        }
+
+        QJsonObject data = std::move(finished[id]);
+        finished.erase(id);
+        return data;
+    };
+
+    // Like wait(), but a daemon that stopped replying is an error.
+    auto reply = [&](int id) {
+        std::optional<QJsonObject> data = wait(id, daemonReplyTimeout);
+        if (!data)
+            throw std::runtime_error("The translation daemon did not reply for " + std::to_string(daemonReplyTimeout / 1000) + " seconds");
+        return *data;
+    };
+
+    // A daemon that's stuck still accepts connections, so see whether it
+    // answers at all before we read any input, which we couldn't give to
+    // doTranslation() anymore after.
+    try {
+        Daemon::writeMessage(daemon, QJsonObject{
+            {"id", -1},
+            {"command", "Stats"},
+            {"data", QJsonObject()}
+        });
+        daemon.flush();
+        if (!wait(-1, daemonProbeTimeout)) {
+            qWarning() << "The translation daemon is not answering, translating without it.";
+            return false;
+        }
+    } catch (const std::runtime_error &e) {
+        qWarning().noquote() << e.what() << "Translating without the daemon.";
+        return false;
     }
 
-    return buffer;
+    try {
+        int submitted = 0;
+        int written = 0;
+        bool eof = false;
+
+        while (!eof || written < submitted) {
+            while (!eof && static_cast<std::size_t>(submitted - written) < maxChunksInFlight) {
+                std::string chunk;
+                std::size_t budget = ramp.next();
+                if (!(HTML ? htmlChunker.next(chunk, budget) : reader.next(chunk, budget))) {
+                    eof = true;
+                    break;
+                }
+
+                if (HTML)
+                    added.emplace_back(htmlChunker.openedTags(), htmlChunker.closedTags());
+
+                Daemon::writeMessage(daemon, QJsonObject{
+                    {"id", submitted++},
+                    {"command", "Translate"},
+                    {"data", QJsonObject{
+                        {"text", QString::fromStdString(chunk)},
+                        {"model", modelID},
+                        {"html", HTML}
+                    }}
+                });
+            }
+            daemon.flush();
+
+            if (written == submitted)
+                continue;
+
+            std::string translation = reply(written++).value("target").toObject().value("text").toString().toStdString();
+            if (HTML) {
+                HtmlChunker::strip(translation, added.front().first, added.front().second);
+                added.pop_front();
+            }
+
+            outfile_.write(translation.data(), translation.size());
+            outfile_.flush();
+        }
+
+        if (printStats) {
+            Daemon::writeMessage(daemon, QJsonObject{
+                {"id", submitted},
+                {"command", "Stats"},
+                {"data", QJsonObject()}
+            });
+            daemon.flush();
+
+            QJsonObject stats = reply(submitted);
+            QJsonObject translationCache = stats.value("translationCache").toObject();
+            QJsonObject persistentCache = stats.value("persistentCache").toObject();
+
+            // JSON numbers are doubles, toInt() would give up on anything
+            // that doesn't fit in an int.
+            auto count = [](QJsonObject const &object, QString const &key) {
+                return static_cast<qint64>(object.value(key).toDouble());
+            };
+
+            QTextStream err(stderr);
+            if (translationCache.value("enabled").toBool()) {
+                err << "Translation cache (daemon): " << count(translationCache, "hits") << " hits, "
+                    << count(translationCache, "misses") << " misses (sentences), capacity "
+                    << count(translationCache, "capacity") << " entries\n";
+            } else {
+                err << "Translation cache (daemon): disabled\n";
+            }
+
+            if (persistentCache.value("enabled").toBool()) {
+                err << "Persistent cache (daemon): " << count(persistentCache, "hits") << " hits, "
+                    << count(persistentCache, "misses") << " misses (texts), "
+                    << count(persistentCache, "inserts") << " added, "
+                    << count(persistentCache, "evictions") << " evicted, "
+                    << count(persistentCache, "entries") << " entries, "
+                    << count(persistentCache, "bytes") / (1024 * 1024) << " MB\n";
+            } else {
+                err << "Persistent cache (daemon): disabled\n";
+            }
+
+            printTimings(err, stats.value("stages").toObject(), " (daemon)");
+        }
+    } catch (const std::runtime_error &e) {
+        outputError(QString::fromStdString(e.what()));
+    }
+    return true;
 }
+
 /**
- * @brief CommandLineIface::doTranslation This function is pseudo blocking, via an event loop. It sends text to be translated by marian.
+ * @brief CommandLineIface::autotune Finds the fastest settings for a model with AutoTuner, and stores them so
+ *        they're used for this model from now on, by the GUI as well.
+ * @param modelName short name of the model, as given with -m
+ * @return exit code
  */
-void CommandLineIface::doTranslation(bool HTML) {
-    QString input;
-    while (!fetchData(input).isEmpty()) {
-        translator_->translate(input, HTML);
-        // Start event loop to block unit translation is ready. Translator
-        // will call outputTranslation or outputError during this call, which
-        // will either unblock this exec() call, or kill the program.
-        eventLoop_.exec();
+int CommandLineIface::autotune(QString modelName) {
+    QString modelPath;
+    for (auto&& model : models_.getInstalledModels())
+        if (model.shortName == modelName)
+            modelPath = model.path;
+
+    if (modelPath.isEmpty()) {
+        qCritical() << "Auto-tuning needs a model, given with -m. Use translateLocally -l to list available models.";
+        return 1;
     }
+
+    QTextStream err(stderr);
+    AutoTuner tuner;
+
+    connect(&tuner, &AutoTuner::progress, this, [&](int done, int total) {
+        err << "\rMeasuring " << done << " of " << total << " settings";
+        err.flush();
+    });
+
+    connect(&tuner, &AutoTuner::finished, this, [&](translateLocally::marianSettings settings, double wordsPerSecond) {
+        settings_.setTunedSettings(modelPath, settings);
+        err << "\nFastest: " << settings.cpu_threads << " threads, workspace " << settings.workspace
+            << ", mini-batch-words " << settings.mini_batch_words << " (" << static_cast<int>(wordsPerSecond) << " words per second)\n";
+        err.flush();
+        eventLoop_.quit();
+    });
+
+    connect(&tuner, &AutoTuner::error, this, [&](QString message) {
+        err << "\n";
+        err.flush();
+        outputError(message);
+    });
+
+    tuner.start(modelPath, settings_.marianSettings());
+    eventLoop_.exec();
+    return 0;
 }
 
 void CommandLineIface::downloadRemoteModel(QString modelID) {
@@ -236,6 +833,8 @@ void CommandLineIface::downloadRemoteModel(QString modelID) {
     out.flush();
     connect(&network_, &Network::progressBar, this, [&](qint64 ist, qint64 max) {
         // taken from https://stackoverflow.com/questions/14539867/how-to-display-a-progress-indicator-in-pure-c-c-cout-printf
+        if (max <= 0) // Size not known (yet)
+            return;
         double percentage = (double)ist/(double)max;
         int val = (int) (percentage * 100);
         int lpad = (int) (percentage * PBWIDTH);
@@ -244,14 +843,13 @@ void CommandLineIface::downloadRemoteModel(QString modelID) {
         fflush(stdout);
     });
     // Download the new model. Use eventloop again to prevent premature exit before download is finished
-    connect(&network_, &Network::downloadComplete, this, [&](QFile *file, QString filename) {
+    connect(&models_, &ModelManager::modelDownloaded, this, [&]() {
         // We use cout here, as QTextStream out gives a warning about being lamda captured.
         std::cout << "\nModel downloaded successfully! You can now invoke it with -m " << modelID.toStdString() << std::endl;
-        models_.writeModel(file, ModelMeta{}, filename); // TODO: ModelMeta
         eventLoop_.exit();
     });
-    QNetworkReply *reply = network_.downloadFile(model.url, QCryptographicHash::Sha256, model.checksum);
-    if (reply == nullptr) {
+    Download *download = models_.downloadModel(&network_, model);
+    if (download == nullptr) {
         outputError("Could not connect to the internet and download: " + model.url);
     }
     eventLoop_.exec();
@@ -262,10 +860,24 @@ void CommandLineIface::outputError(QString error) {
     exit(22);
 }
 
-void CommandLineIface::outputTranslation(Translation output) {
-    outstream_ << output.translation();
-    outstream_.flush();
-    eventLoop_.exit(); // Unblock the main thread
+int CommandLineIface::setNumaShards(QString value) {
+    if (value != "on" && value != "off") {
+        qCritical() << "Invalid value for --numa-shards:" << value << "(expected on or off)";
+        return 5;
+    }
+
+    settings_.numaShards.setValue(value == "on");
+
+    QTextStream out(stdout);
+    QList<QList<int>> nodes = ShardedService::numaNodes();
+    if (value == "off")
+        out << "Using a single translation service.\n";
+    else if (nodes.isEmpty())
+        out << "This machine has a single NUMA node, so there will be a single translation service.\n";
+    else
+        out << "Using a translation service for each of the " << nodes.size() << " NUMA nodes.\n";
+    out.flush();
+    return 0;
 }
 
 int CommandLineIface::allowNativeMessagingClient(QStringList ids) {
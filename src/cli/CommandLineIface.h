@@ -3,14 +3,23 @@
 
 #include <QObject>
 #include <QPointer>
-#include <QTextStream>
 #include <QCommandLineParser>
 #include <QEventLoop>
+#include <QLocalSocket>
 #include "inventory/ModelManager.h"
 #include "settings/Settings.h"
-#include "MarianInterface.h"
-#include "Translation.h"
 #include "Network.h"
+#include <memory>
+
+class BatchTranslator;
+
+// If we include the actual header, we break QT compilation.
+namespace marian {
+    namespace bergamot {
+    class AsyncService;
+    class TranslationModel;
+    }
+}
 
 class CommandLineIface : public QObject {
     Q_OBJECT
@@ -22,26 +31,44 @@ private:
     Network network_;
     Settings settings_;
     ModelManager models_;
-    QPointer<MarianInterface> translator_;
 
-    // do_once file in and file out
+    // do_once file in and file out. These are read and written as raw UTF-8
+    // bytes, either the files given with -i/-o or stdin/stdout.
     QFile infile_;
     QFile outfile_;
-    QTextStream instream_;
-    QTextStream outstream_;
 
-    static const int constexpr prefetchLines = 320;
+    // Input files given with --output-dir, and where their translations go.
+    struct FileJob {
+        QString input;
+        QString output;
+    };
+
+    // Number of chunks per translation thread that we keep queued in the
+    // service so the workers never run dry while we read or write.
+    static const int constexpr chunksInFlightPerThread = 2;
+
+    // How long to wait for a translation daemon to accept our connection.
+    static const int constexpr daemonConnectTimeout = 100; // ms
+
+    // How long a translation daemon has to answer before we translate without
+    // it, and how long it may go without replying once it's translating.
+    static const int constexpr daemonProbeTimeout = 1000; // ms
+    static const int constexpr daemonReplyTimeout = 60000; // ms
 
     // Functions
     void printLocalModels();
-    void doTranslation(bool HTML);
+    void doTranslation(QString modelPath, translateLocally::marianSettings const &settings, bool HTML, std::size_t chunkWords, bool printStats, QList<FileJob> const &files = {}, QString const &outputDir = QString());
+    void translateFiles(BatchTranslator &translator, QList<FileJob> const &files, QString const &outputDir, bool HTML, std::size_t chunkWords);
+    bool collectFiles(QStringList const &inputs, QString const &outputDir, QList<FileJob> &files);
+    bool doDaemonTranslation(QLocalSocket &daemon, QString modelID, std::size_t maxChunksInFlight, bool HTML, std::size_t chunkWords, bool printStats);
     void downloadRemoteModel(QString modelID);
-    inline QString &fetchData(QString &);
+    int autotune(QString modelName);
 
     int allowNativeMessagingClient(QStringList ids);
     int removeNativeMessagingClient(QStringList ids);
     int listNativeMessagingClients();
     int updateNativeMessagingManifests();
+    int setNumaShards(QString value);
 
 public:
     explicit CommandLineIface(QObject * parent = nullptr);
@@ -49,7 +76,6 @@ public:
 
 private slots:
     void outputError(QString error);
-    void outputTranslation(Translation output);
     void printRemoteModels();
 };
 
@@ -0,0 +1,203 @@
+#include "Daemon.h"
+#include "NativeMsgIface.h"
+#include <QDebug>
+#include <QDir>
+#include <QJsonDocument>
+#include <QProcessEnvironment>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// How long to wait for a socket left behind by a daemon to answer, before
+// we decide nobody is listening on it anymore.
+const int constexpr kStaleSocketTimeout = 500; // ms
+
+} // Anonymous namespace
+
+Daemon::Daemon(QObject *parent)
+: QObject(parent)
+, nextID_(0) {
+    // Replies are emitted from the writer thread, so they arrive on the main
+    // thread through a queued connection. Sockets may only be touched there.
+    connect(this, &Daemon::replyReady, this, &Daemon::onReply);
+
+    iface_ = std::make_unique<NativeMsgIface>(nullptr, [this](std::vector<QJsonDocument> &messages) {
+        for (QJsonDocument const &message : messages)
+            emit replyReady(message.object());
+    });
+
+    connect(&server_, &QLocalServer::newConnection, this, &Daemon::onNewConnection);
+}
+
+Daemon::~Daemon() {
+    // Stop translating first, so replyReady() isn't emitted while the rest of
+    // us is being destroyed.
+    iface_.reset();
+}
+
+QString Daemon::socketName() {
+#if defined(Q_OS_WIN)
+    // Named pipe, so the name only has to be unique per user.
+    QString user = QProcessEnvironment::systemEnvironment().value("USERNAME");
+    return QString("translateLocally-%1").arg(user);
+#else
+    // The runtime directory is only accessible to the user that owns it.
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).filePath("translateLocally.sock");
+#endif
+}
+
+bool Daemon::listen() {
+    QString name = socketName();
+
+    server_.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server_.listen(name)) {
+        if (server_.serverError() != QAbstractSocket::AddressInUseError) {
+            qCritical().noquote() << "Could not listen on" << name << ":" << server_.errorString();
+            return false;
+        }
+
+        // Is it used by a daemon that's still running, or left behind by one
+        // that didn't shut down cleanly?
+        QLocalSocket probe;
+        probe.connectToServer(name);
+        if (probe.waitForConnected(kStaleSocketTimeout)) {
+            qCritical().noquote() << "A translateLocally daemon is already running on" << name;
+            return false;
+        }
+
+        QLocalServer::removeServer(name);
+        if (!server_.listen(name)) {
+            qCritical().noquote() << "Could not listen on" << name << ":" << server_.errorString();
+            return false;
+        }
+    }
+
+    QTextStream err(stderr);
+    err << "translateLocally daemon listening on " << server_.fullServerName() << "\n";
+    return true;
+}
+
+void Daemon::writeMessage(QIODevice &device, QJsonObject const &message) {
+    QByteArray arr = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    quint32 size = arr.size();
+    char header[4];
+    std::memcpy(header, &size, 4);
+    device.write(header, 4);
+    device.write(arr);
+}
+
+std::optional<QJsonObject> Daemon::readMessage(QByteArray &buffer) {
+    if (buffer.size() < 4)
+        return std::nullopt;
+
+    quint32 size;
+    std::memcpy(&size, buffer.constData(), 4);
+    if (size >= kMaxInputLength || size < 2) // >= 2 because JSON is at least "{}"
+        throw std::runtime_error("Invalid message size");
+
+    if (static_cast<quint32>(buffer.size()) - 4 < size)
+        return std::nullopt;
+
+    QJsonObject message = QJsonDocument::fromJson(buffer.mid(4, size)).object();
+    buffer.remove(0, 4 + size);
+    return message;
+}
+
+void Daemon::onNewConnection() {
+    while (QLocalSocket *socket = server_.nextPendingConnection()) {
+        clients_.insert(socket, Client());
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { onReadyRead(socket); });
+        connect(socket, &QLocalSocket::disconnected, this, [this, socket]() { onDisconnected(socket); });
+    }
+}
+
+void Daemon::onReadyRead(QLocalSocket *socket) {
+    auto client = clients_.find(socket);
+    if (client == clients_.end())
+        return;
+
+    client->buffer.append(socket->readAll());
+
+    try {
+        while (std::optional<QJsonObject> message = readMessage(client->buffer)) {
+            // Without an id we couldn't route the reply, so answer these
+            // ourselves, the same way NativeMsgIface would.
+            QJsonValue idValue = message->value("id");
+            if (!idValue.isDouble()) {
+                writeMessage(*socket, QJsonObject{
+                    {"success", false},
+                    {"error", "ID field in message cannot be null!"}
+                });
+                continue;
+            }
+
+            // Cancel refers to one of the client's own requests. If the
+            // client doesn't have a request with that id, use an id nobody
+            // uses, so the reply still says that nothing was cancelled.
+            if (message->value("command").toString() == "Cancel") {
+                QJsonObject data = message->value("data").toObject();
+                int requestID = data.value("requestID").toInt(-1);
+                data["requestID"] = client->requests.contains(requestID) ? client->requests.value(requestID) : nextID_++;
+                (*message)["data"] = data;
+            }
+
+            int id = nextID_++;
+            int clientID = idValue.toInt();
+            client->requests.insert(clientID, id);
+            routes_.insert(id, Route{socket, clientID});
+            (*message)["id"] = id;
+
+            iface_->submit(std::move(*message));
+
+            // submit() might have replied already, but those replies are
+            // queued, so client is still valid.
+        }
+    } catch (const std::runtime_error &e) {
+        qCritical().noquote() << "Disconnecting daemon client:" << e.what();
+        socket->disconnectFromServer();
+    }
+}
+
+void Daemon::onDisconnected(QLocalSocket *socket) {
+    Client client = clients_.take(socket);
+
+    // Nobody is waiting for these anymore. The replies to them, and to the
+    // Cancel requests themselves, are not routed anywhere.
+    for (int id : client.requests) {
+        routes_.remove(id);
+        iface_->submit(QJsonObject{
+            {"id", nextID_++},
+            {"command", "Cancel"},
+            {"data", QJsonObject{{"requestID", id}}}
+        });
+    }
+
+    socket->deleteLater();
+}
+
+void Daemon::onReply(QJsonObject message) {
+    auto route = routes_.find(message.value("id").toInt(-1));
+    if (route == routes_.end())
+        return;
+
+    QPointer<QLocalSocket> socket = route->socket;
+    int clientID = route->id;
+
+    // Updates (e.g. download progress) are followed by more messages, any
+    // other reply is the last one for its request.
+    if (!message.value("update").toBool()) {
+        routes_.erase(route);
+        auto client = clients_.find(socket.data());
+        if (client != clients_.end() && client->requests.value(clientID, -1) == message.value("id").toInt())
+            client->requests.remove(clientID);
+    }
+
+    if (!socket)
+        return;
+
+    message["id"] = clientID;
+    writeMessage(*socket, message);
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <QPointer>
+#include <memory>
+#include <optional>
+
+class NativeMsgIface;
+
+/**
+ * Long-lived translation server that keeps the service, the models and the
+ * caches loaded between invocations of the command line interface. It listens
+ * on a local socket (a unix domain socket, or a named pipe on Windows) that
+ * speaks the same length prefixed JSON messages as native messaging, and
+ * hands every request to a NativeMsgIface.
+ *
+ * Any number of clients can be connected at the same time. Each picks its own
+ * message ids, so these are mapped onto ids that are unique for the daemon
+ * before they go to NativeMsgIface, and back to the client's ids in the
+ * replies. When a client disconnects, its outstanding requests are cancelled.
+ */
+class Daemon : public QObject {
+    Q_OBJECT
+
+public:
+    explicit Daemon(QObject *parent = nullptr);
+    ~Daemon();
+
+    /**
+     * @brief Starts listening on socketName().
+     * @return false if another daemon is already running, or the socket
+     * could not be created.
+     */
+    bool listen();
+
+    /**
+     * @brief Name of the socket the daemon listens on. Private to the current
+     * user.
+     */
+    static QString socketName();
+
+    /**
+     * @brief Writes `message` to `device` with the native messaging framing:
+     * its length as a 32 bit unsigned integer, followed by compact JSON.
+     */
+    static void writeMessage(QIODevice &device, QJsonObject const &message);
+
+    /**
+     * @brief Takes the first complete message from the front of `buffer`.
+     * @return the message, or std::nullopt if `buffer` doesn't contain a
+     * complete message yet.
+     * @throws std::runtime_error if the message length makes no sense.
+     */
+    static std::optional<QJsonObject> readMessage(QByteArray &buffer);
+
+signals:
+    /**
+     * @brief Internal signal emitted from NativeMsgIface's writer thread for
+     * every reply, so it's routed to its client on the main thread.
+     */
+    void replyReady(QJsonObject message);
+
+private slots:
+    void onNewConnection();
+    void onReply(QJsonObject message);
+
+private:
+    // Every connected client, with the bytes we've received but not yet
+    // parsed, and its outstanding requests by the ids it picked.
+    struct Client {
+        QByteArray buffer;
+        QHash<int, int> requests; // client id -> daemon id
+    };
+
+    // Where to send the replies for an outstanding request.
+    struct Route {
+        QPointer<QLocalSocket> socket;
+        int id; // id the client picked
+    };
+
+    QLocalServer server_;
+    QHash<QLocalSocket *, Client> clients_;
+    QHash<int, Route> routes_; // daemon id -> client
+    int nextID_;
+
+    // Declared last so it stops, and its writer thread stops emitting
+    // replyReady(), before anything above goes away.
+    std::unique_ptr<NativeMsgIface> iface_;
+
+    void onReadyRead(QLocalSocket *socket);
+    void onDisconnected(QLocalSocket *socket);
+};
@@ -0,0 +1,408 @@
+#include "HtmlChunker.h"
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+// Elements that end a sentence, so a chunk can end before or after them.
+const char *const kBlockElements[] = {
+    "address", "article", "aside", "blockquote", "body", "caption", "dd",
+    "details", "dialog", "div", "dl", "dt", "fieldset", "figcaption", "figure",
+    "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "head", "header",
+    "hgroup", "html", "li", "main", "nav", "ol", "p", "pre", "section",
+    "summary", "table", "tbody", "td", "tfoot", "th", "thead", "tr", "ul",
+};
+
+// Elements that never have a closing tag.
+const char *const kVoidElements[] = {
+    "area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta",
+    "param", "source", "track", "wbr",
+};
+
+// Elements whose content isn't HTML, and can contain anything but their own
+// closing tag.
+const char *const kRawTextElements[] = {
+    "script", "style", "textarea", "title",
+};
+
+// Elements whose opening tag closes an open p element, unless something
+// like a table cell is in between. From the HTML spec's list of when the end
+// tag of p may be left out.
+const char *const kClosesParagraph[] = {
+    "address", "article", "aside", "blockquote", "dd", "details", "dialog",
+    "div", "dl", "dt", "fieldset", "figcaption", "figure", "footer", "form",
+    "h1", "h2", "h3", "h4", "h5", "h6", "header", "hgroup", "hr", "li", "main",
+    "menu", "nav", "ol", "p", "pre", "section", "table", "ul",
+};
+
+// Elements that keep a p outside of them from being closed by the above.
+const char *const kParagraphScope[] = {
+    "button", "caption", "html", "table", "td", "th", "template",
+};
+
+// Other elements whose end tag may be left out: an opening tag of `name`
+// closes the nearest open element named in `closes`, and everything in it,
+// unless one of the elements in `scope` is in between.
+struct ImpliedEnd {
+    const char *name;
+    std::vector<const char *> closes;
+    std::vector<const char *> scope;
+};
+
+const ImpliedEnd kImpliedEnds[] = {
+    {"li", {"li"}, {"ol", "ul", "menu", "table"}},
+    {"dt", {"dt", "dd"}, {"dl", "table"}},
+    {"dd", {"dt", "dd"}, {"dl", "table"}},
+    {"td", {"td", "th"}, {"tr", "table"}},
+    {"th", {"td", "th"}, {"tr", "table"}},
+    {"tr", {"tr"}, {"thead", "tbody", "tfoot", "table"}},
+    {"thead", {"thead", "tbody", "tfoot"}, {"table"}},
+    {"tbody", {"thead", "tbody", "tfoot"}, {"table"}},
+    {"tfoot", {"thead", "tbody", "tfoot"}, {"table"}},
+    {"option", {"option"}, {"select", "datalist", "optgroup"}},
+    {"optgroup", {"option", "optgroup"}, {"select", "datalist"}},
+};
+
+bool contains(std::vector<const char *> const &names, std::string const &name) {
+    return std::any_of(names.begin(), names.end(), [&](const char *element) {
+        return name == element;
+    });
+}
+
+template <std::size_t N>
+bool contains(const char *const (&names)[N], std::string const &name) {
+    return std::any_of(std::begin(names), std::end(names), [&](const char *element) {
+        return name == element;
+    });
+}
+
+bool isSpace(char c) {
+    return std::isspace(static_cast<unsigned char>(c));
+}
+
+// Lower case name of the tag starting at `pos` (just after the '<' or '</').
+std::string tagName(std::string const &text, std::size_t pos) {
+    std::string name;
+    while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '-' || text[pos] == ':'))
+        name.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(text[pos++]))));
+    return name;
+}
+
+// The '>' ending the tag that starts at `pos`, skipping over quoted attribute
+// values. std::string::npos if it isn't there.
+std::size_t findTagEnd(std::string const &text, std::size_t pos) {
+    char quote = 0;
+    for (; pos < text.size(); ++pos) {
+        char c = text[pos];
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '>') {
+            return pos;
+        }
+    }
+    return std::string::npos;
+}
+
+// Case insensitive search for "</name" from `pos`.
+std::size_t findClosingTag(std::string const &text, std::size_t pos, std::string const &name) {
+    for (pos = text.find("</", pos); pos != std::string::npos; pos = text.find("</", pos + 2)) {
+        if (pos + 2 + name.size() > text.size())
+            return std::string::npos;
+        if (tagName(text, pos + 2) == name)
+            return pos;
+    }
+    return std::string::npos;
+}
+
+} // Anonymous namespace
+
+HtmlChunker::HtmlChunker(ChunkReader &reader)
+: reader_(reader)
+, eof_(false)
+, scanned_(0)
+, words_(0)
+, inWord_(false)
+, opened_(0)
+, closed_(0) {
+    //
+}
+
+std::size_t HtmlChunker::openedTags() const {
+    return opened_;
+}
+
+std::size_t HtmlChunker::closedTags() const {
+    return closed_;
+}
+
+bool HtmlChunker::next(std::string &chunk, std::size_t wordBudget) {
+    chunk.clear();
+    opened_ = 0;
+    closed_ = 0;
+
+    for (;;) {
+        scan();
+
+        // Done once we've seen enough text to end at a boundary within the
+        // budget. Or, if there is none, at the first one past it.
+        if (!eof_ && words_ >= wordBudget && !splits_.empty())
+            break;
+
+        if (eof_) {
+            if (pending_.empty())
+                return false;
+            break;
+        }
+
+        std::string lines;
+        if (reader_.next(lines, std::max<std::size_t>(wordBudget - std::min(words_, wordBudget), 1)))
+            pending_ += lines;
+        else
+            eof_ = true;
+    }
+
+    for (Element const &element : context_)
+        chunk += element.tag;
+    opened_ = context_.size();
+
+    // The whole rest of the document
+    if (eof_ && (splits_.empty() || words_ < wordBudget)) {
+        chunk += pending_;
+        pending_.clear();
+        context_.clear();
+        splits_.clear();
+        scanned_ = 0;
+        words_ = 0;
+        return true;
+    }
+
+    // The last boundary within the budget, or else the first one.
+    auto split = splits_.begin();
+    for (auto it = splits_.begin(); it != splits_.end() && it->words <= wordBudget; ++it)
+        split = it;
+
+    chunk.append(pending_, 0, split->offset);
+    for (auto it = split->closed.rbegin(); it != split->closed.rend(); ++it)
+        chunk += "</" + it->name + ">";
+    for (auto it = split->open.rbegin(); it != split->open.rend(); ++it)
+        chunk += "</" + it->name + ">";
+    closed_ = split->closed.size() + split->open.size();
+
+    std::size_t offset = split->offset;
+    std::size_t words = split->words;
+    context_ = std::move(split->open);
+    splits_.erase(splits_.begin(), split + 1);
+
+    pending_.erase(0, offset);
+    scanned_ -= offset;
+    words_ -= words;
+    for (Split &later : splits_) {
+        later.offset -= offset;
+        later.words -= words;
+    }
+
+    return true;
+}
+
+void HtmlChunker::scan() {
+    while (scanned_ < pending_.size()) {
+        char c = pending_[scanned_];
+
+        if (c != '<') {
+            if (isSpace(c)) {
+                inWord_ = false;
+            } else if (!inWord_) {
+                ++words_;
+                inWord_ = true;
+            }
+            ++scanned_;
+            continue;
+        }
+
+        std::size_t end = tokenEnd(scanned_);
+
+        // Not all there yet. At the end of the input it never will be, so
+        // it's just text then.
+        if (end == std::string::npos) {
+            if (!eof_)
+                return;
+            end = scanned_;
+        }
+
+        // A '<' that doesn't start a tag
+        if (end == scanned_) {
+            if (!inWord_) {
+                ++words_;
+                inWord_ = true;
+            }
+            ++scanned_;
+            continue;
+        }
+
+        handleTag(scanned_, end);
+        scanned_ = end;
+    }
+}
+
+std::size_t HtmlChunker::tokenEnd(std::size_t pos) const {
+    if (pos + 1 >= pending_.size())
+        return std::string::npos;
+
+    char c = pending_[pos + 1];
+
+    if (c == '!' || c == '?') {
+        // Comments can contain '>'
+        if (pending_.compare(pos, 4, "<!--") == 0) {
+            std::size_t end = pending_.find("-->", pos + 4);
+            return end == std::string::npos ? end : end + 3;
+        }
+        if (pending_.size() - pos < 4 && std::string("<!--").compare(0, pending_.size() - pos, pending_, pos, std::string::npos) == 0)
+            return std::string::npos; // Might still become a comment
+
+        std::size_t end = pending_.find('>', pos);
+        return end == std::string::npos ? end : end + 1;
+    }
+
+    if (c == '/') {
+        if (pos + 2 >= pending_.size())
+            return std::string::npos;
+        if (!std::isalpha(static_cast<unsigned char>(pending_[pos + 2])))
+            return pos;
+        std::size_t end = pending_.find('>', pos);
+        return end == std::string::npos ? end : end + 1;
+    }
+
+    if (!std::isalpha(static_cast<unsigned char>(c)))
+        return pos;
+
+    std::size_t end = findTagEnd(pending_, pos);
+    if (end == std::string::npos)
+        return end;
+    ++end;
+
+    // Raw text elements are one token up to and including their closing tag,
+    // so nothing in them is mistaken for markup.
+    std::string name = tagName(pending_, pos + 1);
+    if (contains(kRawTextElements, name) && pending_[end - 2] != '/') {
+        std::size_t close = findClosingTag(pending_, end, name);
+        if (close == std::string::npos)
+            return close;
+        end = pending_.find('>', close);
+        return end == std::string::npos ? end : end + 1;
+    }
+
+    return end;
+}
+
+void HtmlChunker::handleTag(std::size_t begin, std::size_t end) {
+    if (pending_[begin + 1] == '!' || pending_[begin + 1] == '?')
+        return;
+
+    if (pending_[begin + 1] == '/') {
+        std::string name = tagName(pending_, begin + 2);
+
+        // Close everything up to the matching element. A closing tag that
+        // matches nothing is left for the translator to deal with.
+        auto open = std::find_if(stack_.rbegin(), stack_.rend(), [&](Element const &element) {
+            return element.name == name;
+        });
+        if (open != stack_.rend())
+            stack_.erase(std::next(open).base(), stack_.end());
+
+        if (contains(kBlockElements, name))
+            addSplit(end);
+        return;
+    }
+
+    std::string name = tagName(pending_, begin + 1);
+
+    // Whatever this tag closes implicitly is still closed at the end of a
+    // chunk that ends before it, but isn't opened again in the next one.
+    std::vector<Element> closed = closeImplied(name);
+
+    if (contains(kBlockElements, name))
+        addSplit(begin, std::move(closed));
+
+    bool selfClosing = pending_[end - 2] == '/';
+    if (selfClosing || contains(kVoidElements, name) || contains(kRawTextElements, name))
+        return;
+
+    stack_.push_back(Element{name, pending_.substr(begin, end - begin)});
+}
+
+std::vector<HtmlChunker::Element> HtmlChunker::closeImplied(std::string const &name) {
+    std::vector<Element> closed;
+
+    // Pops everything down to and including the nearest of `closes`, if
+    // there's one above any of `scope`.
+    auto close = [&](auto const &closes, auto const &scope) {
+        for (auto it = stack_.rbegin(); it != stack_.rend(); ++it) {
+            if (contains(closes, it->name)) {
+                auto from = std::next(it).base();
+                closed.insert(closed.begin(), std::make_move_iterator(from), std::make_move_iterator(stack_.end()));
+                stack_.erase(from, stack_.end());
+                return;
+            }
+            if (contains(scope, it->name))
+                return;
+        }
+    };
+
+    if (contains(kClosesParagraph, name))
+        close(std::vector<const char *>{"p"}, kParagraphScope);
+
+    for (ImpliedEnd const &rule : kImpliedEnds)
+        if (name == rule.name)
+            close(rule.closes, rule.scope);
+
+    return closed;
+}
+
+void HtmlChunker::addSplit(std::size_t offset, std::vector<Element> closed) {
+    // A block boundary also ends a word
+    inWord_ = false;
+
+    // Nothing to end a chunk with yet, or nothing in it to translate.
+    if (offset == 0 || words_ == 0)
+        return;
+
+    if (!splits_.empty() && splits_.back().offset == offset)
+        splits_.pop_back();
+
+    splits_.push_back(Split{offset, words_, stack_, std::move(closed)});
+}
+
+void HtmlChunker::strip(std::string &translation, std::size_t opened, std::size_t closed) {
+    // Opening tags at the start, with nothing but whitespace before them.
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < opened; ++i) {
+        std::size_t begin = translation.find_first_not_of(" \t\r\n", pos);
+        if (begin == std::string::npos || translation[begin] != '<')
+            break;
+
+        std::size_t end = findTagEnd(translation, begin);
+        if (end == std::string::npos)
+            break;
+
+        translation.erase(begin, end + 1 - begin);
+        pos = begin;
+    }
+
+    // Closing tags at the end, with nothing but whitespace after them.
+    for (std::size_t i = 0; i < closed && !translation.empty(); ++i) {
+        std::size_t last = translation.find_last_not_of(" \t\r\n");
+        if (last == std::string::npos || translation[last] != '>')
+            break;
+
+        std::size_t begin = translation.rfind("</", last);
+        if (begin == std::string::npos)
+            break;
+
+        translation.erase(begin, last + 1 - begin);
+    }
+}
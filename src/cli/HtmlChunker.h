@@ -0,0 +1,97 @@
+#pragma once
+#include "ChunkReader.h"
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * Splits an HTML document into chunks for translation, reading it through a
+ * ChunkReader so it never has to be in memory as a whole. Chunks only end at
+ * the boundaries of block-level elements, where sentences end anyway. Every
+ * chunk has to be balanced HTML on its own, so the elements still open where
+ * a chunk ends are closed at its end, and opened again at the start of the
+ * next chunk. strip() removes those tags from the translation again.
+ *
+ * The scanner only knows as much HTML as is needed to find those boundaries:
+ * tags, comments, void elements, the raw text of script and style, and the
+ * elements whose end tag may be left out, like p and li. A
+ * single block with no boundary inside it becomes one chunk, however large.
+ */
+class HtmlChunker {
+public:
+    explicit HtmlChunker(ChunkReader &reader);
+
+    HtmlChunker(const HtmlChunker &) = delete;
+    HtmlChunker &operator=(const HtmlChunker &) = delete;
+
+    /**
+     * @brief next replaces the contents of `chunk` with the next part of the
+     * document, of around `wordBudget` words of text if there is a boundary
+     * to split at before that.
+     * @return false if there was no more input, in which case `chunk` is empty.
+     */
+    bool next(std::string &chunk, std::size_t wordBudget);
+
+    /**
+     * @brief Number of tags next() added to the start of the last chunk.
+     */
+    std::size_t openedTags() const;
+
+    /**
+     * @brief Number of tags next() added to the end of the last chunk.
+     */
+    std::size_t closedTags() const;
+
+    /**
+     * @brief strip removes the tags next() added to a chunk from its
+     * translation: `opened` tags from the start and `closed` tags from the
+     * end, leaving any text and whitespace around them alone.
+     */
+    static void strip(std::string &translation, std::size_t opened, std::size_t closed);
+
+private:
+    struct Element {
+        std::string name; // Lower case
+        std::string tag; // The opening tag, as it was in the input
+    };
+
+    // A place in pending_ to end a chunk at.
+    struct Split {
+        std::size_t offset;
+        std::size_t words; // Words of text in pending_ before it
+        std::vector<Element> open; // Elements open there
+        std::vector<Element> closed; // Elements the tag there closes without a closing tag
+    };
+
+    ChunkReader &reader_;
+    bool eof_;
+
+    std::string pending_; // Input read but not yet returned
+    std::vector<Element> context_; // Elements open at the start of pending_
+
+    // How far pending_ has been scanned, and what we know up to there.
+    std::size_t scanned_;
+    std::size_t words_;
+    bool inWord_;
+    std::vector<Element> stack_;
+    std::deque<Split> splits_;
+
+    std::size_t opened_;
+    std::size_t closed_;
+
+    // Scans as much of pending_ as holds complete tokens.
+    void scan();
+
+    // End of the markup token at `pos`, std::string::npos if that's not all
+    // in pending_ yet, or `pos` if the '<' there is just text.
+    std::size_t tokenEnd(std::size_t pos) const;
+
+    void handleTag(std::size_t begin, std::size_t end);
+
+    // Pops the elements an opening tag of `name` closes without them having
+    // a closing tag, like a <p> does an open p, and returns them.
+    std::vector<Element> closeImplied(std::string const &name);
+
+    void addSplit(std::size_t offset, std::vector<Element> closed = {});
+};
@@ -1,5 +1,11 @@
 #include "NativeMsgIface.h"
+#include "Instrumentation.h"
+#include "MemoryUsage.h"
+#include "WordCount.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <QJsonDocument>
 #include <QJsonArray>
 #include <QSet>
@@ -8,6 +14,7 @@
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <vector>
 #include <QNetworkReply>
 
 // bergamot-translator
@@ -32,16 +39,6 @@ template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 // Explicit deduction guide (not needed as of C++20)
 template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
-std::shared_ptr<marian::Options> makeOptions(const std::string &path_to_model_dir, const translateLocally::marianSettings &settings) {
-    std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(path_to_model_dir + "/config.intgemm8bitalpha.yml"));
-    options->set("cpu-threads", settings.cpu_threads,
-                 "workspace", settings.workspace,
-                 "mini-batch-words", 1000,
-                 "alignment", "soft",
-                 "quiet", true);
-    return options;
-}
-
 // Little helper function that sets up a SingleShot connection in both Qt 5 and 6
 template <typename Sender, typename Emitter, typename Slot, typename... Args>
 QMetaObject::Connection connectSingleShot(Sender *sender, void (Emitter::*signal)(Args ...args), const QObject *context, Slot slot) {
@@ -56,6 +53,160 @@ QMetaObject::Connection connectSingleShot(Sender *sender, void (Emitter::*signal
 #endif
 }
 
+// Number of mini-batches per translation thread we allow to be in flight in
+// the service. Enough for the workers to never run dry, but without queueing
+// so much in the service that priorities and cancellation don't matter anymore.
+constexpr std::size_t kInFlightBatchesPerThread = 2;
+
+// How much memory the first legs of pivoted translations may take up.
+constexpr std::size_t kFirstLegCacheSize = 16 * 1024 * 1024;
+
+// Splits text into paragraphs, and the runs of blank lines between them, so
+// that joining the pieces gives back the text.
+std::vector<std::string> splitParagraphs(std::string const &text) {
+    std::vector<std::string> pieces;
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t blank = text.find("\n\n", start);
+        if (blank == std::string::npos)
+            break;
+
+        std::size_t end = text.find_first_not_of('\n', blank);
+        if (end == std::string::npos)
+            end = text.size();
+
+        if (blank > start)
+            pieces.push_back(text.substr(start, blank - start));
+        pieces.push_back(text.substr(blank, end - blank));
+        start = end;
+    }
+
+    if (start < text.size())
+        pieces.push_back(text.substr(start));
+
+    return pieces;
+}
+
+// Alignments with a lower probability are left out of responses, like in
+// the GUI's highlighting.
+constexpr float kMinAlignment = 0.1f;
+
+// UTF-16 position, as used by JavaScript and QString, of every byte offset
+// into UTF-8 `text`, up to and including its end.
+std::vector<int> utf16Positions(std::string const &text) {
+    std::vector<int> positions(text.size() + 1);
+    int position = 0;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        positions[i] = position;
+        unsigned char c = text[i];
+        if ((c & 0xc0) != 0x80) // not a utf-8 continuation character
+            position += (c & 0xf8) == 0xf0 ? 2 : 1; // four byte characters take two
+    }
+    positions[text.size()] = position;
+    return positions;
+}
+
+// Sentences and words of `text` as flat arrays of UTF-16 [begin, end) pairs.
+// With `firstWords`, the index in `words` of the first word of every sentence.
+void describeText(marian::bergamot::AnnotatedText const &text, QJsonObject &out, std::vector<std::size_t> *firstWords = nullptr) {
+    std::vector<int> positions = utf16Positions(text.text);
+    QJsonArray sentences, words;
+
+    for (std::size_t sentenceIdx = 0; sentenceIdx < text.annotation.numSentences(); ++sentenceIdx) {
+        marian::bergamot::ByteRange sentence = text.annotation.sentence(sentenceIdx);
+        sentences.append(positions[sentence.begin]);
+        sentences.append(positions[sentence.end]);
+
+        if (!firstWords)
+            continue;
+
+        firstWords->push_back(words.size() / 2);
+        for (std::size_t wordIdx = 0; wordIdx < text.annotation.numWords(sentenceIdx); ++wordIdx) {
+            marian::bergamot::ByteRange word = text.annotation.word(sentenceIdx, wordIdx);
+            words.append(positions[word.begin]);
+            words.append(positions[word.end]);
+        }
+    }
+
+    out["sentences"] = sentences;
+    if (firstWords) {
+        firstWords->push_back(words.size() / 2);
+        out["words"] = words;
+    }
+}
+
+/**
+ * The parts of a Translate response that go beyond the translated text, see
+ * TranslationRequest. Everything is in flat arrays of numbers, as a JSON
+ * object per word or link would take more time to build and to parse than
+ * the translation itself.
+ */
+void describeResponse(marian::bergamot::Response const &response, bool alignments, bool quality, QJsonObject &data) {
+    QJsonObject target = data["target"].toObject();
+
+    std::vector<std::size_t> sourceWords, targetWords;
+    describeText(response.target, target, alignments ? &targetWords : nullptr);
+
+    if (alignments) {
+        QJsonObject source;
+        describeText(response.source, source, &sourceWords);
+        data["source"] = source;
+
+        // Triplets of target word, source word (both indices into the words
+        // arrays) and probability in thousandths.
+        QJsonArray links;
+        for (std::size_t sentenceIdx = 0; sentenceIdx < response.alignments.size() && sentenceIdx + 1 < targetWords.size() && sentenceIdx + 1 < sourceWords.size(); ++sentenceIdx) {
+            auto const &matrix = response.alignments[sentenceIdx];
+            std::size_t targetCount = targetWords[sentenceIdx + 1] - targetWords[sentenceIdx];
+            std::size_t sourceCount = sourceWords[sentenceIdx + 1] - sourceWords[sentenceIdx];
+            for (std::size_t t = 0; t < matrix.size() && t < targetCount; ++t) {
+                for (std::size_t s = 0; s < matrix[t].size() && s < sourceCount; ++s) {
+                    if (matrix[t][s] < kMinAlignment)
+                        continue;
+                    links.append(static_cast<int>(targetWords[sentenceIdx] + t));
+                    links.append(static_cast<int>(sourceWords[sentenceIdx] + s));
+                    links.append(static_cast<int>(std::lround(matrix[t][s] * 1000)));
+                }
+            }
+        }
+        data["alignments"] = links;
+    }
+
+    if (quality) {
+        // Scores are per sentence, and per word as the quality estimator sees
+        // words, which is why those come with their own ranges.
+        std::vector<int> positions = utf16Positions(response.target.text);
+        QJsonArray sentences, words, wordRanges;
+        for (marian::bergamot::Response::SentenceQualityScore const &score : response.qualityScores) {
+            sentences.append(score.sentenceScore);
+            for (float word : score.wordScores)
+                words.append(word);
+            for (marian::bergamot::ByteRange const &range : score.wordByteRanges) {
+                wordRanges.append(positions[std::min(range.begin, response.target.text.size())]);
+                wordRanges.append(positions[std::min(range.end, response.target.text.size())]);
+            }
+        }
+        data["quality"] = QJsonObject{
+            {"sentences", sentences},
+            {"words", words},
+            {"wordRanges", wordRanges}
+        };
+    }
+
+    data["target"] = target;
+}
+
+// Key for the persistent cache for whatever else besides model and text
+// affects the translation.
+std::string cacheOptions(bool html) {
+    return html ? "html" : "text";
+}
+
+// Key of the model(s) in the persistent cache
+std::string const &cacheKey(ModelInstance const &instance) {
+    return std::visit([](auto const &model) -> std::string const & { return model.cacheKey; }, instance);
+}
+
 // Little helper to print QSet<QString> and QList<QString> without the need to
 // convert them into a QStringList.
 template <typename T>
@@ -71,12 +222,19 @@ QString join(QString glue, T const &list) {
 
 }
 
-NativeMsgIface::NativeMsgIface(QObject * parent) :
+NativeMsgIface::NativeMsgIface(QObject * parent, Output output) :
       QObject(parent)
       , network_(this)
       , settings_(this)
       , models_(this, &settings_)
+      , modelPool_(static_cast<std::size_t>(settings_.modelPoolMemory()) * 1024 * 1024)
+      , firstLegs_(kFirstLegCacheSize)
+      , memoryBudget_(static_cast<std::size_t>(settings_.memoryBudget()) * 1024 * 1024)
       , operations_(0)
+      , writerShutdown_(false)
+      , output_(std::move(output))
+      , loaderShutdown_(false)
+      , queue_(kInFlightBatchesPerThread * settings_.marianSettings().cpu_threads * settings_.marianSettings().mini_batch_words)
     {    
     // Disable synchronisation with C style streams. That should make IO faster
     std::ios_base::sync_with_stdio(false);
@@ -86,10 +244,17 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
     std::cin.tie(NULL);
 
     // Init the marian translation service:
-    marian::bergamot::AsyncService::Config serviceConfig;
-    serviceConfig.numWorkers = settings_.marianSettings().cpu_threads;
-    serviceConfig.cacheSize = settings_.marianSettings().translation_cache ? kTranslationCacheSize : 0;
-    service_ = std::make_shared<marian::bergamot::AsyncService>(serviceConfig);
+    service_ = std::make_shared<ShardedService>(ShardedService::Config{
+        settings_.marianSettings().cpu_threads,
+        settings_.marianSettings().translation_cache ? settings_.marianSettings().translation_cache_size : 0,
+        settings_.numaShards()
+    });
+
+    if (settings_.persistentCache()) {
+        cache_ = std::make_shared<PersistentCache>(PersistentCache::defaultPath(), static_cast<qint64>(settings_.persistentCacheSize()) * 1024 * 1024);
+        if (!cache_->isOpen())
+            cache_.reset();
+    }
 
     // Pick up on network errors: Right now these are only caused by DownloadRequest
     // because of how Network.h is implemented. But in the future it might be that
@@ -102,13 +267,10 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
             qDebug() << "Network error without request data:" << err;
     });
 
-    connect(&network_, &Network::downloadComplete, this, [this](QFile *file, QString filename, QVariant data) {
+    connect(&models_, &ModelManager::modelDownloaded, this, [this](Model model, QVariant data) {
         ABORT_UNLESS(data.canConvert<DownloadRequest>(), "Model download completed without DownloadRequest data");
-        auto model = models_.writeModel(file, ModelMeta{}, filename); // TODO get modelmeta from data
-        if (model) {
-            DownloadRequest request = data.value<DownloadRequest>();
-            writeResponse(request, model->toJson());
-        }
+        DownloadRequest request = data.value<DownloadRequest>();
+        writeResponse(request, model.toJson());
     });
 
     // Model manager errors are not always 1-on-1 mappable to requests. For now
@@ -118,6 +280,24 @@ NativeMsgIface::NativeMsgIface(QObject * parent) :
     });
 
     connect(this, &NativeMsgIface::emitJson, this, &NativeMsgIface::processJson);
+
+    // The models alone shouldn't take up the whole budget.
+    if (memoryBudget_ > 0)
+        modelPool_.setBudget(std::min(static_cast<std::size_t>(settings_.modelPoolMemory()) * 1024 * 1024, memoryBudget_));
+
+    // 0 means keep models loaded for as long as we run.
+    if (settings_.idleUnloadTimeout() > 0) {
+        idleTimer_.setSingleShot(true);
+        idleTimer_.setInterval(static_cast<int>(settings_.idleUnloadTimeout()) * 60 * 1000);
+        connect(&idleTimer_, &QTimer::timeout, this, &NativeMsgIface::onIdle);
+    }
+
+    // Emitted from the loader thread, so this ends up as a queued connection
+    // and onModelLoaded runs on the main thread.
+    connect(this, &NativeMsgIface::modelLoaded, this, &NativeMsgIface::onModelLoaded);
+
+    loaderThread_ = std::thread(&NativeMsgIface::loaderLoop, this);
+    writerThread_ = std::thread(&NativeMsgIface::writerLoop, this);
 }
 
 void NativeMsgIface::run() {
@@ -167,40 +347,432 @@ void NativeMsgIface::run() {
 }
 
 void NativeMsgIface::handleRequest(TranslationRequest request) {
+    RepliedFlag replied = trackRequest(request.id);
+
     // Initialise models based on the request.
     if (!findModels(request))
         return writeError(request, "Could not find the necessary translation models.");
 
-    if (!loadModels(request))
-        return writeError(request, "Failed to load the necessary translation models.");
+    // Loading the models can take a while, during which we keep handling other
+    // requests. Once they're loaded, this request continues in translate().
+    loadModels(request, [this, request, replied](std::optional<ModelInstance> instance, QString error) mutable {
+        if (!instance) {
+            if (!replied->exchange(true))
+                writeError(request, std::move(error));
+            return;
+        }
 
-    // Initialise translator settings options
-    marian::bergamot::ResponseOptions options;
-    options.HTML = request.html;
-    std::function<void(marian::bergamot::Response&&)> callback = [this,request](marian::bergamot::Response&& val) {
-        QJsonObject data = {
-            {"target", QJsonObject{
-                {"text", QString::fromStdString(std::move(val.target.text))}
-            }}
+        translate(request, *instance, replied);
+    });
+}
+
+void NativeMsgIface::translate(TranslationRequest &request, ModelInstance &instance, RepliedFlag replied) {
+    std::string source = request.text.toStdString();
+
+    // The cache only has the translated text, so it's of no use if the client
+    // wants anything else.
+    bool useCache = cache_ && !request.quality && !request.alignments;
+    if (useCache) {
+        if (std::optional<std::string> translation = cache_->find(cacheKey(instance), cacheOptions(request.html), source)) {
+            if (!replied->exchange(true)) {
+                writeResponse(request, QJsonObject{
+                    {"target", QJsonObject{
+                        {"text", QString::fromStdString(*translation)}
+                    }}
+                });
+            }
+            return;
+        }
+    }
+
+    std::size_t words = countWords(request.text);
+    auto queued = instrumentation::Clock::now();
+
+    queue_.push(request.priority, words, [this, request, instance, replied, words, useCache, queued, source = std::move(source)]() mutable {
+        // Cancelled while it was waiting in the queue
+        if (*replied)
+            return false;
+
+        auto started = instrumentation::Clock::now();
+        instrumentation::record(instrumentation::Stage::QueueWait, queued, started, request.id);
+
+        // Initialise translator settings options
+        marian::bergamot::ResponseOptions options;
+        options.HTML = request.html;
+        options.alignment = request.alignments;
+        options.qualityScores = request.quality;
+        std::function<void(marian::bergamot::Response&&)> callback = [this, request, replied, words, useCache, started, key = cacheKey(instance), source](marian::bergamot::Response&& val) {
+            auto translated = instrumentation::Clock::now();
+            instrumentation::record(instrumentation::Stage::Translate, started, translated, request.id);
+
+            queue_.done(words);
+
+            if (useCache)
+                cache_->insert(key, cacheOptions(request.html), source, val.target.text);
+
+            // Cancelled while it was being translated
+            if (replied->exchange(true))
+                return;
+
+            QJsonObject data = {
+                {"target", QJsonObject{
+                    {"text", QString::fromStdString(val.target.text)}
+                }}
+            };
+            if (request.alignments || request.quality)
+                describeResponse(val, request.alignments, request.quality, data);
+            instrumentation::record(instrumentation::Stage::Postprocess, translated, instrumentation::Clock::now(), request.id);
+            writeResponse(request, std::move(data));
         };
-        writeResponse(request, std::move(data));
+
+        // For a second leg of a pivot that fails on a worker. Then callback
+        // is never called, but when streaming there can be a failure for each
+        // paragraph.
+        auto failed = std::make_shared<std::atomic<bool>>(false);
+        std::function<void(QString)> fail = [this, request, replied, words, failed](QString error) {
+            if (failed->exchange(true))
+                return;
+
+            queue_.done(words);
+            if (!replied->exchange(true))
+                writeError(request, std::move(error));
+        };
+
+        auto submit = [&](std::string &&text, std::function<void(marian::bergamot::Response&&)> done) {
+            std::visit(overloaded {
+                [&](DirectModelInstance &model) {
+                    service_->translate(model.model, std::move(text), done, options);
+                },
+                [&](PivotModelInstance &model) {
+                    pivot(model, std::move(text), done, fail, options);
+                }
+            }, instance);
+        };
+
+        // Attempt translation. Beware of runtime errors
+        try {
+            // Positions and scores are for the response as a whole, and HTML
+            // can't be split up, so those aren't streamed.
+            if (request.stream && !request.html && !request.alignments && !request.quality)
+                stream(request, replied, std::move(source), submit, callback);
+            else
+                submit(std::move(source), callback);
+        } catch (const std::runtime_error &e) {
+            if (!replied->exchange(true))
+                writeError(request, QString::fromStdString(std::move(e.what())));
+            return false;
+        }
+
+        return true;
+    });
+}
+
+void NativeMsgIface::stream(TranslationRequest const &request, RepliedFlag replied, std::string &&source, Submit const &submit, std::function<void(marian::bergamot::Response&&)> callback) {
+    std::vector<std::string> pieces = splitParagraphs(source);
+    if (pieces.empty())
+        pieces.push_back(std::move(source));
+
+    // Paragraphs are passed on in order, so each update waits for the
+    // paragraphs before it.
+    struct StreamState {
+        std::mutex mutex;
+        std::vector<std::optional<std::string>> targets;
+        std::size_t written{0}; // Paragraphs sent as updates
+    };
+
+    auto state = std::make_shared<StreamState>();
+    state->targets.resize(pieces.size());
+
+    auto done = [this, state, request, replied, callback](std::size_t i, std::string &&target) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->targets[i] = std::move(target);
+
+        std::size_t before = state->written;
+        QString text;
+        while (state->written < state->targets.size() && state->targets[state->written])
+            text += QString::fromStdString(*state->targets[state->written++]);
+
+        if (state->written == before)
+            return;
+
+        if (!*replied) {
+            writeUpdate(request, QJsonObject{
+                {"target", QJsonObject{
+                    {"text", text}
+                }}
+            });
+        }
+
+        // The response has the whole translation, like without streaming.
+        if (state->written == state->targets.size()) {
+            marian::bergamot::Response response;
+            for (std::optional<std::string> &target : state->targets)
+                response.target.text += *target;
+            callback(std::move(response));
+        }
+    };
+
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        // Blank lines in between paragraphs stay as they are.
+        if (pieces[i].find_first_not_of(" \t\r\n") == std::string::npos) {
+            done(i, std::move(pieces[i]));
+            continue;
+        }
+
+        submit(std::move(pieces[i]), [done, i](marian::bergamot::Response &&response) {
+            done(i, std::move(response.target.text));
+        });
+    }
+}
+
+void NativeMsgIface::pivot(PivotModelInstance const &model, std::string &&source, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(QString)> fail, marian::bergamot::ResponseOptions const &options) {
+    // HTML too: the service restores the markup of the source in the final
+    // translation. Feeding it the markup of the first leg's translation
+    // instead would align the second leg's markup to that.
+    if (options.alignment || options.qualityScores || options.HTML)
+        return service_->pivot(model.model, model.pivot, std::move(source), callback, options);
+
+    std::vector<std::string> pieces = splitParagraphs(source);
+    if (pieces.empty())
+        pieces.push_back(std::move(source));
+
+    // Whoever finishes the last piece assembles the translation. If one
+    // fails, the translation does, and the others don't matter anymore.
+    struct PivotState {
+        std::vector<std::string> targets;
+        std::atomic<std::size_t> remaining;
+        std::atomic<bool> failed{false};
+    };
+
+    auto state = std::make_shared<PivotState>();
+    state->targets.resize(pieces.size());
+    state->remaining = pieces.size();
+
+    auto done = [state, callback](std::size_t i, std::string &&target) {
+        state->targets[i] = std::move(target);
+        if (--state->remaining > 0 || state->failed)
+            return;
+
+        marian::bergamot::Response response;
+        for (std::string &piece : state->targets)
+            response.target.text += piece;
+        callback(std::move(response));
+    };
+
+    auto second = [this, done, state, fail, model, options](std::size_t i, std::string &&intermediate) {
+        auto finished = [done, i](marian::bergamot::Response &&response) {
+            done(i, std::move(response.target.text));
+        };
+
+        // This may run on a worker, where nobody would catch what the service
+        // throws.
+        try {
+            service_->translate(model.pivot, std::move(intermediate), finished, options);
+        } catch (const std::exception &e) {
+            if (!state->failed.exchange(true))
+                fail(QString::fromStdString(e.what()));
+        }
+    };
+
+    std::string cacheOpts = cacheOptions(options.HTML);
+    for (std::size_t i = 0; i < pieces.size(); ++i) {
+        std::string &piece = pieces[i];
+
+        // Blank lines in between paragraphs stay as they are.
+        if (piece.find_first_not_of(" \t\r\n") == std::string::npos) {
+            done(i, std::move(piece));
+            continue;
+        }
+
+        std::optional<std::string> intermediate = firstLegs_.find(model.firstKey, cacheOpts, piece);
+        if (!intermediate && cache_)
+            intermediate = cache_->find(model.firstKey, cacheOpts, piece);
+
+        if (intermediate) {
+            second(i, std::move(*intermediate));
+            continue;
+        }
+
+        // Only HTML makes the service throw here, and HTML doesn't come this
+        // way, so this can't leave some pieces submitted and others not.
+        std::string text = piece;
+        service_->translate(model.model, std::move(text), [this, second, i, key = model.firstKey, cacheOpts, piece = std::move(piece)](marian::bergamot::Response &&response) {
+            firstLegs_.insert(key, cacheOpts, piece, response.target.text);
+            if (cache_)
+                cache_->insert(key, cacheOpts, piece, response.target.text);
+            second(i, std::move(response.target.text));
+        }, options);
+    }
+}
+
+void NativeMsgIface::handleRequest(TranslationBatchRequest request) {
+    RepliedFlag replied = trackRequest(request.id);
+
+    // Initialise models based on the request.
+    if (!findModels(request))
+        return writeError(request, "Could not find the necessary translation models.");
+
+    loadModels(request, [this, request, replied](std::optional<ModelInstance> instance, QString error) mutable {
+        if (!instance) {
+            if (!replied->exchange(true))
+                writeError(request, std::move(error));
+            return;
+        }
+
+        translate(request, *instance, replied);
+    });
+}
+
+void NativeMsgIface::translate(TranslationBatchRequest &request, ModelInstance &instance, RepliedFlag replied) {
+    // Nothing to translate, nothing to wait for.
+    if (request.texts.isEmpty()) {
+        if (!replied->exchange(true))
+            writeResponse(request, QJsonObject{{"target", QJsonArray()}});
+        return;
+    }
+
+    // Each text is its own job and its own call to the service, but they all
+    // end up in the same batching pool so the workers batch sentences across
+    // texts. The callbacks each fill in their own slot in `translations`, and
+    // whoever finishes last writes the response.
+    struct BatchState {
+        std::vector<QString> translations;
+        std::atomic<int> remaining;
+        std::atomic<bool> failed;
+        QString error;
     };
 
-    // Attempt translation. Beware of runtime errors
-    try {
-        std::visit(overloaded {
-            [&](DirectModelInstance &model) {
-                service_->translate(model.model, std::move(request.text.toStdString()), callback, options);
-            },
-            [&](PivotModelInstance &model) {
-                service_->pivot(model.model, model.pivot, std::move(request.text.toStdString()), callback, options);
+    int size = request.texts.size();
+    auto state = std::make_shared<BatchState>();
+    state->translations.resize(size);
+    state->remaining = size;
+    state->failed = false;
+
+    // Only the id is needed to reply, no need to copy all texts into every
+    // callback.
+    Request reply{request.id};
+    auto finish = [this, reply, state, replied]() {
+        if (replied->exchange(true))
+            return;
+
+        if (state->failed)
+            return writeError(reply, std::move(state->error));
+
+        QJsonArray target;
+        for (QString &translation : state->translations)
+            target.append(QJsonObject{{"text", std::move(translation)}});
+        writeResponse(reply, QJsonObject{{"target", std::move(target)}});
+    };
+
+    marian::bergamot::ResponseOptions options;
+    options.HTML = request.html;
+
+    std::string key = cacheKey(instance);
+
+    for (int i = 0; i < size; ++i) {
+        std::string text = request.texts[i].toStdString();
+
+        if (cache_) {
+            if (std::optional<std::string> translation = cache_->find(key, cacheOptions(request.html), text)) {
+                state->translations[i] = QString::fromStdString(*translation);
+                if (--state->remaining == 0)
+                    finish();
+                continue;
+            }
+        }
+
+        std::size_t words = countWords(request.texts[i]);
+        auto queued = instrumentation::Clock::now();
+
+        queue_.push(request.priority, words, [this, state, finish, replied, instance, options, i, words, key, queued, id = request.id, text = std::move(text)]() mutable {
+            // Cancelled, or another text of this batch already failed. Nothing
+            // left to do but to count it as done.
+            if (*replied || state->failed) {
+                if (--state->remaining == 0)
+                    finish();
+                return false;
             }
-        }, *model_);
-    } catch (const std::runtime_error &e) {
-        writeError(request, QString::fromStdString(std::move(e.what())));
+
+            auto started = instrumentation::Clock::now();
+            instrumentation::record(instrumentation::Stage::QueueWait, queued, started, id);
+
+            std::function<void(marian::bergamot::Response&&)> callback = [this, state, finish, i, words, key, options, started, id, source = cache_ ? text : std::string()](marian::bergamot::Response&& val) {
+                instrumentation::record(instrumentation::Stage::Translate, started, instrumentation::Clock::now(), id);
+                queue_.done(words);
+                if (cache_)
+                    cache_->insert(key, cacheOptions(options.HTML), source, val.target.text);
+                state->translations[i] = QString::fromStdString(std::move(val.target.text));
+                if (--state->remaining == 0)
+                    finish();
+            };
+
+            // The whole batch fails with the first text that does.
+            std::function<void(QString)> fail = [state, finish, i](QString error) {
+                if (!state->failed.exchange(true))
+                    state->error = QString("Could not translate text %1: %2").arg(i).arg(error);
+                if (--state->remaining == 0)
+                    finish();
+            };
+
+            // Attempt translation. Beware of runtime errors. If one of the
+            // texts fails (e.g. bad HTML) the whole batch fails, but we still
+            // have to wait for the texts already submitted before we can
+            // reply.
+            try {
+                std::visit(overloaded {
+                    [&](DirectModelInstance &model) {
+                        service_->translate(model.model, std::move(text), callback, options);
+                    },
+                    [&](PivotModelInstance &model) {
+                        pivot(model, std::move(text), callback, [this, fail, words](QString error) {
+                            queue_.done(words);
+                            fail(std::move(error));
+                        }, options);
+                    }
+                }, instance);
+            } catch (const std::runtime_error &e) {
+                fail(QString::fromStdString(e.what()));
+                return false;
+            }
+
+            return true;
+        });
     }
 }
 
+NativeMsgIface::RepliedFlag NativeMsgIface::trackRequest(int requestID) {
+    // Forget about requests that have been answered and are done.
+    for (auto it = activeRequests_.begin(); it != activeRequests_.end();) {
+        if (it->expired())
+            it = activeRequests_.erase(it);
+        else
+            ++it;
+    }
+
+    RepliedFlag replied = std::make_shared<std::atomic<bool>>(false);
+    activeRequests_.insert(requestID, replied);
+    return replied;
+}
+
+void NativeMsgIface::handleRequest(CancelRequest request) {
+    bool cancelled = false;
+
+    auto it = activeRequests_.find(request.requestID);
+    if (it != activeRequests_.end()) {
+        // Answer the cancelled request now, unless its translation beat us
+        // to it. Its jobs will see the flag and skip the work.
+        if (RepliedFlag replied = it->lock()) {
+            if (!replied->exchange(true)) {
+                writeError(Request{request.requestID}, "Request cancelled");
+                cancelled = true;
+            }
+        }
+        activeRequests_.erase(it);
+    }
+
+    writeResponse(request, QJsonObject{{"cancelled", cancelled}});
+}
+
 void NativeMsgIface::handleRequest(ListRequest request)  {
     // Fetch remote models if necessary.
     if (request.includeRemote && models_.getRemoteModels().isEmpty()) {
@@ -265,16 +837,17 @@ void NativeMsgIface::handleRequest(DownloadRequest request)  {
     }
 
     // Download new model
-    QNetworkReply *reply = network_.downloadFile(model->url, QCryptographicHash::Sha256, model->checksum, QVariant::fromValue(request));
+    Download *download = models_.downloadModel(&network_, *model, QVariant::fromValue(request));
 
-    // downloadFile can return nullptr if it can't open the temp file. In
+    // downloadModel can return nullptr if it can't create a temp dir. In
     // that case it will also emit an Network::error(QString) signal which
     // we already handle above.
-    if (!reply)
+    if (!download)
         return;
 
-    // Pass any download progress updates along to the client.
-    connect(reply, &QNetworkReply::downloadProgress, this, [=](qint64 ist, qint64 max) {
+    // Pass any download progress updates along to the client. For segmented
+    // downloads this is the total over all segments.
+    connect(download, &Download::progress, this, [=](qint64 ist, qint64 max) {
          QJsonObject update {
             {"read", ist},
             {"size", max},
@@ -284,20 +857,53 @@ void NativeMsgIface::handleRequest(DownloadRequest request)  {
         writeUpdate(request, update);
     });
 
-    // Network::downloadComplete() or Network::error() will trigger the writeResponse or writeError for this request.
+    // ModelManager::modelDownloaded() or Network::error() will trigger the writeResponse or writeError for this request.
+}
+
+void NativeMsgIface::handleRequest(StatsRequest request) {
+    QJsonObject translationCache{{"enabled", false}};
+    if (std::size_t capacity = settings_.marianSettings().translation_cache ? settings_.marianSettings().translation_cache_size : 0) {
+        auto stats = service_->cacheStats();
+        translationCache = QJsonObject{
+            {"enabled", true},
+            {"capacity", static_cast<qint64>(capacity * service_->shards())}, // Each shard has its own
+            {"hits", static_cast<qint64>(stats.hits)},
+            {"misses", static_cast<qint64>(stats.misses)}
+        };
+    }
+
+    QJsonObject persistentCache{{"enabled", false}};
+    if (cache_) {
+        auto stats = cache_->stats();
+        persistentCache = QJsonObject{
+            {"enabled", true},
+            {"hits", static_cast<qint64>(stats.hits)},
+            {"misses", static_cast<qint64>(stats.misses)},
+            {"inserts", static_cast<qint64>(stats.inserts)},
+            {"evictions", static_cast<qint64>(stats.evictions)},
+            {"entries", static_cast<qint64>(stats.entries)},
+            {"bytes", stats.bytes}
+        };
+    }
+
+    QJsonObject timings = instrumentation::stats();
+
+    writeResponse(request, QJsonObject{
+        {"translationCache", translationCache},
+        {"persistentCache", persistentCache},
+        {"stages", timings.value("stages")},
+        {"gauges", timings.value("gauges")}
+    });
 }
 
 void NativeMsgIface::handleRequest(MalformedRequest request)  {
     writeError(request, std::move(request.error));
 }
 
-request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
-    QJsonDocument inputJson = QJsonDocument::fromJson(input);
-    QJsonObject jsonObj = inputJson.object();
-
+request_variant NativeMsgIface::parseJsonInput(QJsonObject jsonObj) {
     // Define what are mandatory and what are optional request keys
     static const QStringList mandatoryKeys({"command", "id", "data"}); // Expected in every message
-    static const QSet<QString> commandTypes({"ListModels", "DownloadModel", "Translate"});
+    static const QSet<QString> commandTypes({"ListModels", "DownloadModel", "Translate", "TranslateBatch", "Cancel", "Stats"});
     // Json doesn't have schema validation, so validate here, in place:
     QString command;
     int id;
@@ -332,7 +938,7 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
     if (command == "Translate") {
         // Keys expected in a translation request
         static const QStringList mandatoryKeysTranslate({"text"});
-        static const QStringList optionalKeysTranslate({"html", "quality", "alignments", "src", "trg", "model", "pivot"});
+        static const QStringList optionalKeysTranslate({"html", "quality", "alignments", "priority", "stream", "src", "trg", "model", "pivot"});
         TranslationRequest ret;
         ret.set("id", id);
         for (auto&& key : mandatoryKeysTranslate) {
@@ -353,6 +959,48 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
             return MalformedRequest{id, QString("either the data fields src and trg, or the field model has to be specified")};
         }
         return ret;
+    } else if (command == "TranslateBatch") {
+        // Keys expected in a batch translation request
+        static const QStringList mandatoryKeysTranslateBatch({"texts"});
+        static const QStringList optionalKeysTranslateBatch({"html", "priority", "src", "trg", "model", "pivot"});
+        TranslationBatchRequest ret;
+        ret.id = id;
+        for (auto&& key : mandatoryKeysTranslateBatch) {
+            QJsonValueRef val = data[key];
+            if (!val.isArray()) {
+                return MalformedRequest{id, QString("data field key %1 has to be an array!").arg(key)};
+            } else {
+                ret.set(key, val);
+            }
+        }
+        for (auto&& key : optionalKeysTranslateBatch) {
+            QJsonValueRef val = data[key];
+            if (!val.isNull()) {
+                ret.set(key, val);
+            }
+        }
+        if ((!ret.src.isEmpty() && !ret.trg.isEmpty()) == (!ret.model.isEmpty())) {
+            return MalformedRequest{id, QString("either the data fields src and trg, or the field model has to be specified")};
+        }
+        return ret;
+    } else if (command == "Cancel") {
+        // Keys expected in a cancel request:
+        static const QStringList mandatoryKeysCancel({"requestID"});
+        CancelRequest ret;
+        ret.id = id;
+        for (auto&& key : mandatoryKeysCancel) {
+            QJsonValueRef val = data[key];
+            if (val.isNull()) {
+                return MalformedRequest{id, QString("data field key %1 cannot be null!").arg(key)};
+            } else {
+                ret.requestID = val.toInt();
+            }
+        }
+        return ret;
+    } else if (command == "Stats") {
+        StatsRequest ret;
+        ret.id = id;
+        return ret;
     } else if (command == "ListModels") {
         // Keys expected in a list requested
         static const QStringList optionalKeysList({"includeRemote"});
@@ -387,19 +1035,70 @@ request_variant NativeMsgIface::parseJsonInput(QByteArray input) {
 
 }
 
-void NativeMsgIface::lockAndWriteJsonHelper(QJsonDocument&& document) {
-    QByteArray arr = document.toJson();
-    std::lock_guard<std::mutex> lock(coutmutex_);
-    size_t outputSize = arr.size();
-    std::cout.write(reinterpret_cast<char*>(&outputSize), 4);
-    std::cout.write(arr.data(), outputSize);
-    std::cout.flush();
+void NativeMsgIface::queueJsonHelper(QJsonDocument&& document) {
+    {
+        std::lock_guard<std::mutex> lock(writerMutex_);
+        writeQueue_.push_back(std::move(document));
+    }
+    writerCV_.notify_one();
+}
+
+void NativeMsgIface::writerLoop() {
+    std::vector<QJsonDocument> batch;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(writerMutex_);
+            writerCV_.wait(lock, [this]{ return writerShutdown_ || !writeQueue_.empty(); });
+            if (writeQueue_.empty()) // and thus writerShutdown_
+                return;
+            // Take everything that's queued so we hold the lock only briefly
+            std::swap(batch, writeQueue_);
+        }
+
+        auto begin = instrumentation::Clock::now();
+
+        if (output_) {
+            output_(batch);
+        } else {
+            for (QJsonDocument const &document : batch) {
+                QByteArray arr = document.toJson(QJsonDocument::Compact);
+                size_t outputSize = arr.size();
+                std::cout.write(reinterpret_cast<char*>(&outputSize), 4);
+                std::cout.write(arr.data(), outputSize);
+            }
+
+            // One flush for all messages that were ready
+            std::cout.flush();
+        }
+
+        instrumentation::record(instrumentation::Stage::Serialise, begin, instrumentation::Clock::now());
+        batch.clear();
+    }
+}
+
+template <typename T>
+bool NativeMsgIface::findModels(T &request) {
+    if (findInstalledModels(request))
+        return true;
+
+    models_.reloadLocalModels();
+    return findInstalledModels(request);
 }
 
 // Fills in the TranslationRequest.{model,pivot} parameters if src + trg are specified.
-bool NativeMsgIface::findModels(TranslationRequest &request) const {
-    if (!request.model.isEmpty())
+template <typename T>
+bool NativeMsgIface::findInstalledModels(T &request) const {
+    if (!request.model.isEmpty()) {
+        for (QString const &id : {request.model, request.pivot}) {
+            if (id.isEmpty())
+                continue;
+            std::optional<Model> model = models_.getModel(id);
+            if (!model || !model->isLocal())
+                return false;
+        }
         return true;
+    }
 
     if (std::optional<Model> directModel = models_.getModelForLanguagePair(request.src, request.trg)) {
         request.model = directModel->id();
@@ -415,46 +1114,165 @@ bool NativeMsgIface::findModels(TranslationRequest &request) const {
     return false;
 }
 
-bool NativeMsgIface::loadModels(TranslationRequest const &request) {
-    // First, check if we have everything required already loaded:
-    if (model_ && std::visit(overloaded {
-        [&](DirectModelInstance const &instance) { return instance.modelID == request.model && request.pivot.isEmpty(); },
-        [&](PivotModelInstance const &instance) { return instance.modelID == request.model && instance.pivotID == request.pivot; }
-    }, *model_))
-        return true;
+template <typename T>
+void NativeMsgIface::loadModels(T const &request, std::function<void(std::optional<ModelInstance>, QString)> callback) {
+    static const QString notFound("Failed to load the necessary translation models.");
 
     if (!request.model.isEmpty() && !request.pivot.isEmpty()) {
         auto model = models_.getModel(request.model);
         auto pivot = models_.getModel(request.pivot);
 
         if (!model || !pivot || !model->isLocal() || !pivot->isLocal())
-            return false;
+            return callback(std::nullopt, notFound);
 
-        model_ = PivotModelInstance{model->id(), pivot->id(), makeModel(*model), makeModel(*pivot)};
-        return true;
+        // Model loads happen one at a time anyway, so we might as well only
+        // start on the pivot model once the first one is done.
+        QString modelID = model->id();
+        Model pivotModel = *pivot;
+        std::string firstKey = PersistentCache::modelKey(model->path);
+        std::string cacheKey = firstKey + "|" + PersistentCache::modelKey(pivot->path);
+        loadModel(*model, [this, callback, modelID, pivotModel, cacheKey, firstKey](std::shared_ptr<marian::bergamot::TranslationModel> loadedModel, QString error) {
+            if (!loadedModel)
+                return callback(std::nullopt, std::move(error));
+
+            loadModel(pivotModel, [callback, modelID, loadedModel, pivotModel, cacheKey, firstKey](std::shared_ptr<marian::bergamot::TranslationModel> loadedPivot, QString error) {
+                if (!loadedPivot)
+                    return callback(std::nullopt, std::move(error));
+
+                callback(PivotModelInstance{modelID, pivotModel.id(), loadedModel, loadedPivot, cacheKey, firstKey}, QString());
+            });
+        });
+        return;
     } else if (!request.model.isEmpty()) {
         auto model = models_.getModel(request.model);
         if (!model || !model->isLocal())
-            return false;
-        
-        model_ = DirectModelInstance{model->id(), makeModel(*model)};
-        return true;
+            return callback(std::nullopt, notFound);
+
+        QString modelID = model->id();
+        std::string cacheKey = PersistentCache::modelKey(model->path);
+        loadModel(*model, [callback, modelID, cacheKey](std::shared_ptr<marian::bergamot::TranslationModel> loadedModel, QString error) {
+            if (!loadedModel)
+                return callback(std::nullopt, std::move(error));
+
+            callback(DirectModelInstance{modelID, loadedModel, cacheKey}, QString());
+        });
+        return;
+    }
+
+    callback(std::nullopt, notFound); // Should not happen, because we called findModels first, right?
+}
+
+void NativeMsgIface::loadModel(Model const &model, ModelCallback callback) {
+    if (auto loaded = modelPool_.get(model.id()))
+        return callback(loaded, QString());
+
+    // If someone else is already waiting for this model, wait along.
+    QList<ModelCallback> &pending = pendingLoads_[model.id()];
+    pending.append(std::move(callback));
+    if (pending.size() > 1)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex_);
+        // The service, and with it the number of threads, is shared by all
+        // models. Only the rest of the tuned settings can differ per model.
+        translateLocally::marianSettings settings = settings_.marianSettings(model.path);
+        settings.cpu_threads = settings_.marianSettings().cpu_threads;
+        loadQueue_.push_back(ModelLoadJob{model.id(), model.path, settings});
+    }
+    loaderCV_.notify_one();
+}
+
+void NativeMsgIface::loaderLoop() {
+    for (;;) {
+        ModelLoadJob job;
+        {
+            std::unique_lock<std::mutex> lock(loaderMutex_);
+            loaderCV_.wait(lock, [this]{ return loaderShutdown_ || !loadQueue_.empty(); });
+            if (loaderShutdown_)
+                return;
+            job = std::move(loadQueue_.front());
+            loadQueue_.pop_front();
+        }
+
+        ModelLoadResult result;
+        try {
+            result.model = service_->loadModel(makeOptions(job.path.toStdString(), job.settings));
+            result.size = ModelPool::estimateSize(job.path) * service_->shards(); // A copy per shard
+        } catch (const std::runtime_error &e) {
+            result.error = QString("Failed to load model %1: %2").arg(job.modelID, QString::fromStdString(e.what()));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(loaderMutex_);
+            loadResults_.insert(job.modelID, std::move(result));
+        }
+
+        emit modelLoaded(job.modelID);
+    }
+}
+
+void NativeMsgIface::onModelLoaded(QString modelID) {
+    ModelLoadResult result;
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex_);
+        result = loadResults_.take(modelID);
+    }
+
+    if (result.model)
+        modelPool_.insert(modelID, result.model, result.size);
+
+    for (ModelCallback &callback : pendingLoads_.take(modelID))
+        callback(result.model, result.error);
+
+    checkMemory();
+}
+
+void NativeMsgIface::onIdle() {
+    // Still translating, or loading a model. The translations hold on to
+    // their models anyway, so wait until they're done.
+    if (operations_ > 0 || !pendingLoads_.isEmpty()) {
+        idleTimer_.start();
+        return;
     }
 
-    return false; // Should not happen, because we called findModels first, right?
+    // The workspaces of the workers belong to the models' replicas, so they
+    // go together with the models.
+    modelPool_.clear();
+    firstLegs_.clear();
+    memory::release();
 }
 
-std::shared_ptr<marian::bergamot::TranslationModel> NativeMsgIface::makeModel(Model const &model) {
-    // TODO: Maybe cache these shared ptrs? With a weakptr? They might still be around in the
-    // translation queue even when we switched. No need to load them again.
-    return std::make_shared<marian::bergamot::TranslationModel>(
-        makeOptions(model.path.toStdString(), settings_.marianSettings()),
-        settings_.marianSettings().cpu_threads
-    );
+void NativeMsgIface::checkMemory() {
+    if (memoryBudget_ == 0)
+        return;
+
+    qint64 resident = memory::residentSize();
+    if (resident < 0 || static_cast<std::size_t>(resident) <= memoryBudget_)
+        return;
+
+    modelPool_.trim();
+    firstLegs_.clear();
+    memory::release();
 }
 
 void NativeMsgIface::processJson(QByteArray input) {
-    auto myJsonInputVariant = parseJsonInput(input);
+    if (idleTimer_.interval() > 0)
+        idleTimer_.start();
+
+    auto myJsonInputVariant = parseJsonInput(QJsonDocument::fromJson(input).object());
+    std::visit([&](auto&& req){handleRequest(req);}, myJsonInputVariant);
+}
+
+void NativeMsgIface::submit(QJsonObject message) {
+    // Unlike messages from stdin nobody waits for these to finish, but
+    // writeResponse() and writeError() count them down regardless.
+    operations_++;
+
+    if (idleTimer_.interval() > 0)
+        idleTimer_.start();
+
+    auto myJsonInputVariant = parseJsonInput(std::move(message));
     std::visit([&](auto&& req){handleRequest(req);}, myJsonInputVariant);
 }
 
@@ -462,4 +1280,31 @@ NativeMsgIface::~NativeMsgIface() {
     if (iothread_.joinable()) {
         iothread_.join();
     }
+
+    // The loader uses the service, so stop it first.
+    {
+        std::lock_guard<std::mutex> lock(loaderMutex_);
+        loaderShutdown_ = true;
+    }
+    loaderCV_.notify_one();
+
+    if (loaderThread_.joinable()) {
+        loaderThread_.join();
+    }
+
+    // All requests are answered, but work of cancelled requests may still be
+    // running. Its callbacks use queue_, so stop the service before queue_
+    // goes away.
+    service_.reset();
+
+    // Last, make sure every response made it out before we exit.
+    {
+        std::lock_guard<std::mutex> lock(writerMutex_);
+        writerShutdown_ = true;
+    }
+    writerCV_.notify_one();
+
+    if (writerThread_.joinable()) {
+        writerThread_.join();
+    }
 }
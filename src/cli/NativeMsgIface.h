@@ -2,14 +2,25 @@
 #include <iostream>
 
 #include <QPair>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include <mutex>
 #include <optional>
 #include <type_traits>
 #include <QEventLoop>
+#include <QJsonArray>
 #include <QJsonDocument>
+#include <QTimer>
 #include "inventory/ModelManager.h"
 #include "settings/Settings.h"
 #include "MarianInterface.h"
+#include "MemoryCache.h"
+#include "ModelPool.h"
+#include "PersistentCache.h"
+#include "RequestQueue.h"
+#include "ShardedService.h"
 #include "Translation.h"
 #include "Network.h"
 #include <memory>
@@ -18,9 +29,9 @@
 // If we include the actual header, we break QT compilation.
 namespace marian {
     namespace bergamot {
-    class AsyncService;
     class TranslationModel;
     class Response;
+    struct ResponseOptions;
     }
 }
 
@@ -90,7 +101,25 @@ Q_DECLARE_METATYPE(Request);
  *     OPTIONAL
  *      "html": bool the input is HTML
  *      "quality": bool return quality scores
- *      "alignments" return token alignments
+ *      "alignments": bool return word alignments
+ *      "priority": int requests with a higher priority are translated first,
+ *                  e.g. what's in the viewport before the rest of the page.
+ *                  Defaults to 0.
+ *      "stream": bool send the translation of each paragraph as an update as
+ *                soon as it is done. Not for html, quality or alignments.
+ *   }
+ * }
+ *
+ * Update, WITH stream, once or more, in order:
+ * {
+ *   "id": int,
+ *   "update": true,
+ *   "data": {
+ *     "target": {
+ *       "text": str translation of the next paragraph(s), with the blank
+ *               lines in between. All updates together make up the text of
+ *               the response.
+ *     }
  *   }
  * }
  * 
@@ -101,9 +130,30 @@ Q_DECLARE_METATYPE(Request);
  *   "data": {
  *     "target": {
  *       "text": str
- *     } 
+ *       WITH quality OR alignments
+ *       "sentences": [int] begin and end of each sentence, flattened
+ *       WITH alignments
+ *       "words": [int] begin and end of each word of all sentences, flattened
+ *     },
+ *     WITH alignments
+ *     "source": {
+ *       "sentences": [int] like target.sentences, in the source text
+ *       "words": [int] like target.words, in the source text
+ *     },
+ *     "alignments": [int] triplets of target word index, source word index
+ *                   and probability in thousandths, for every pair of words
+ *                   aligned with a probability of at least 0.1
+ *     WITH quality
+ *     "quality": {
+ *       "sentences": [float] log probability score of each sentence
+ *       "words": [float] score of each word, of all sentences
+ *       "wordRanges": [int] begin and end of each of those words, flattened
+ *     }
  *   }
  * }
+ *
+ * Positions are in UTF-16 code units, like JavaScript string indices. Word
+ * indices are into the words array, which has two numbers per word.
  */
 struct TranslationRequest : public Request {
     QString src;
@@ -115,6 +165,8 @@ struct TranslationRequest : public Request {
     bool html{false};
     bool quality{false};
     bool alignments{false};
+    int priority{0};
+    bool stream{false};
 
 
     inline void set(QString key, QJsonValueRef& val) {
@@ -132,12 +184,16 @@ struct TranslationRequest : public Request {
             command = val.toString();
         } else if (key == "id") { // Int keys
             id = val.toInt();
+        } else if (key == "priority") {
+            priority = val.toInt();
         } else if (key == "html") { // Bool keys
             html = val.toBool();
         } else if (key == "quality") {
             quality = val.toBool();
         } else if (key == "alignments") {
             alignments = val.toBool();
+        } else if (key == "stream") {
+            stream = val.toBool();
         } else {
             std::cerr << "Unknown key type. " << key.toStdString() << " Something is very wrong!" << std::endl;
         }
@@ -155,6 +211,78 @@ struct TranslationRequest : public Request {
 
 Q_DECLARE_METATYPE(TranslationRequest);
 
+/**
+ * Translate many texts (e.g. all text nodes on a web page) with the same
+ * model in one go. All texts are submitted to the service together, so they
+ * are batched together, and there is a single response once all of them are
+ * translated.
+ *
+ * Request:
+ * {
+ *   "id": int
+ *   "command": "TranslateBatch",
+ *   "data": {
+ *     EIHER
+ *      "src": str BCP-47 language code,
+ *      "trg": str BCP-47 language code,
+ *     OR
+ *      "model": str model id,
+ *      "pivot": str model id
+ *     REQUIRED
+ *      "texts": [str] texts to translate
+ *     OPTIONAL
+ *      "html": bool the texts are HTML
+ *      "priority": int see Translate request
+ *   }
+ * }
+ *
+ * Success response:
+ * {
+ *   "id": int,
+ *   "success": true,
+ *   "data": {
+ *     "target": [
+ *       {
+ *         "text": str
+ *       }
+ *       ... one for each of the texts, in the same order
+ *     ]
+ *   }
+ * }
+ */
+struct TranslationBatchRequest : public Request {
+    QString src;
+    QString trg;
+    QString model;
+    QString pivot;
+    QStringList texts;
+    bool html{false};
+    int priority{0};
+
+    inline void set(QString key, QJsonValueRef& val) {
+        if (key == "src") { // String keys
+            src = val.toString();
+        } else if (key == "trg") {
+            trg = val.toString();
+        } else if (key == "model") {
+            model = val.toString();
+        } else if (key == "pivot") {
+            pivot = val.toString();
+        } else if (key == "texts") { // Array keys
+            for (auto&& text : val.toArray())
+                texts.append(text.toString());
+        } else if (key == "priority") { // Int keys
+            priority = val.toInt();
+        } else if (key == "html") { // Bool keys
+            html = val.toBool();
+        } else {
+            std::cerr << "Unknown key type. " << key.toStdString() << " Something is very wrong!" << std::endl;
+        }
+    }
+};
+
+Q_DECLARE_METATYPE(TranslationBatchRequest);
+
 /**
  * List of available models.
  * 
@@ -236,6 +364,89 @@ struct DownloadRequest : Request {
 
 Q_DECLARE_METATYPE(DownloadRequest);
 
+/**
+ * Cancel a Translate or TranslateBatch request that the client no longer
+ * needs, e.g. because the user navigated away. If the request has not been
+ * answered yet, it will be answered with an error right away, and if its work
+ * has not started yet, it never will. Work that is already being translated
+ * still finishes, but its result is dropped.
+ *
+ * Request:
+ * {
+ *   "id": int,
+ *   "command": "Cancel",
+ *   "data": {
+ *     "requestID": int id of the request to cancel
+ *   }
+ * }
+ *
+ * Successful response:
+ * {
+ *   "id": int,
+ *   "success": true,
+ *   "data": {
+ *     "cancelled": bool false if the request was already answered or unknown
+ *   }
+ * }
+ *
+ * The cancelled request itself gets an error response:
+ * {
+ *   "id": int requestID,
+ *   "success": false,
+ *   "error": "Request cancelled"
+ * }
+ */
+struct CancelRequest : Request {
+    int requestID;
+};
+
+Q_DECLARE_METATYPE(CancelRequest);
+
+/**
+ * Statistics of the translation caches, and where the time goes.
+ *
+ * Request:
+ * {
+ *   "id": int,
+ *   "command": "Stats",
+ *   "data": {}
+ * }
+ *
+ * Successful response:
+ * {
+ *   "id": int,
+ *   "success": true,
+ *   "data": {
+ *     "translationCache": { in-memory cache of translated sentences
+ *       "enabled": bool
+ *       "capacity": int number of entries
+ *       "hits": int
+ *       "misses": int
+ *     },
+ *     "persistentCache": { on-disk cache of translated texts
+ *       "enabled": bool
+ *       "hits": int
+ *       "misses": int
+ *       "inserts": int
+ *       "evictions": int
+ *       "entries": int number of translations in the cache
+ *       "bytes": int size of the cache on disk
+ *     },
+ *     "stages": { time spent in each stage since start up, see Instrumentation.h
+ *       "modelLoad": {"count": int, "totalMs": float, "meanMs": float, "maxMs": float, "p50Ms": float, "p99Ms": float},
+ *       ... same for "queueWait", "translate", "postprocess" and "serialise"
+ *     },
+ *     "gauges": {
+ *       "queueDepth": {"last": float, "max": float, "mean": float} texts waiting to be translated
+ *       "batchFill": ... same, words in the service as fraction of what we allow in flight
+ *     }
+ *   }
+ * }
+ */
+struct StatsRequest : Request {};
+
+Q_DECLARE_METATYPE(StatsRequest);
+
 /**
  * Internal structure to handle a request that is missing a required field.
  */
@@ -243,7 +454,7 @@ struct MalformedRequest : Request {
     QString error;
 };
 
-using request_variant = std::variant<TranslationRequest, ListRequest, DownloadRequest, MalformedRequest>;
+using request_variant = std::variant<TranslationRequest, TranslationBatchRequest, ListRequest, DownloadRequest, CancelRequest, StatsRequest, MalformedRequest>;
 
 /**
  * Internal structure to cache a loaded direct model (i.e. no pivoting)
@@ -251,6 +462,7 @@ using request_variant = std::variant<TranslationRequest, ListRequest, DownloadRe
 struct DirectModelInstance {
     QString modelID;
     std::shared_ptr<marian::bergamot::TranslationModel> model;
+    std::string cacheKey; // See PersistentCache::modelKey()
 };
 
 /**
@@ -261,6 +473,8 @@ struct PivotModelInstance {
     QString pivotID;
     std::shared_ptr<marian::bergamot::TranslationModel> model;
     std::shared_ptr<marian::bergamot::TranslationModel> pivot;
+    std::string cacheKey; // Of both models, see PersistentCache::modelKey()
+    std::string firstKey; // Of just the first model, for its translations to the pivot language
 };
 
 /**
@@ -268,13 +482,53 @@ struct PivotModelInstance {
  */
 using ModelInstance = std::variant<DirectModelInstance,PivotModelInstance>;
 
+/**
+ * Internal structure describing a model for the loader thread to load. Contains
+ * copies of everything it needs so it doesn't have to touch Settings or
+ * ModelManager off the main thread.
+ */
+struct ModelLoadJob {
+    QString modelID;
+    QString path;
+    translateLocally::marianSettings settings;
+};
+
+/**
+ * Internal structure for the loader thread to hand back a loaded model. If
+ * loading failed, `model` is nullptr and `error` says why.
+ */
+struct ModelLoadResult {
+    std::shared_ptr<marian::bergamot::TranslationModel> model;
+    std::size_t size{0};
+    QString error;
+};
+
 class NativeMsgIface : public QObject {
     Q_OBJECT
 
 public:
-    explicit NativeMsgIface(QObject * parent=nullptr);
+    /**
+     * @brief Where replies go. Called on the writer thread with every bunch of
+     * messages that are ready, in the order they were written.
+     */
+    using Output = std::function<void(std::vector<QJsonDocument> &messages)>;
+
+    /**
+     * @brief NativeMsgIface
+     * @param parent
+     * @param output receives all replies. If empty, replies are written to
+     * stdout using the native messaging framing.
+     */
+    explicit NativeMsgIface(QObject * parent=nullptr, Output output=Output());
     ~NativeMsgIface();
 
+    /**
+     * @brief Handles a message that didn't come from stdin, e.g. from a client
+     * of the daemon. Main thread only.
+     * @param message request in the same format as described above.
+     */
+    void submit(QJsonObject message);
+
 public slots:
     void run();
 
@@ -287,19 +541,60 @@ private slots:
      */
     void processJson(QByteArray input);
 
+    /**
+     * @brief hooked to modelLoaded, adds the model to the model pool and calls
+     * everyone that was waiting for it.
+     * @param modelID id of the model that was loaded
+     */
+    void onModelLoaded(QString modelID);
+
+    /**
+     * @brief hooked to idleTimer_. Unloads all models and hands the memory they
+     * took back to the operating system, unless there is still work going on.
+     */
+    void onIdle();
+
 private:
     // Threading
     std::thread iothread_;
     //QEventLoop eventLoop_;
-    std::mutex coutmutex_;
+
+    // All writing to stdout happens on writerThread_, so translation workers
+    // never wait for a slow browser to read its pipe. Messages are queued in
+    // writeQueue_, which together with writerShutdown_ is guarded by
+    // writerMutex_.
+    std::thread writerThread_;
+    std::mutex writerMutex_;
+    std::condition_variable writerCV_;
+    std::vector<QJsonDocument> writeQueue_;
+    bool writerShutdown_;
+    Output output_;
     
     // Sadly we don't have C++20 on ubuntu 18.04, otherwise could use std::atomic<T>::wait
     std::atomic<int> operations_; // Keeps track of all operations. So that we know when to quit
     std::mutex pendingOpsMutex_;
     std::condition_variable pendingOpsCV_;
 
+    // Model loading happens on loaderThread_ so the main thread can keep
+    // handling other messages while a model is being deserialised. The queue,
+    // results and shutdown flag are guarded by loaderMutex_.
+    std::thread loaderThread_;
+    std::mutex loaderMutex_;
+    std::condition_variable loaderCV_;
+    std::deque<ModelLoadJob> loadQueue_;
+    QMap<QString, ModelLoadResult> loadResults_;
+    bool loaderShutdown_;
+
+    // Callbacks waiting for a model that is being loaded, keyed by model id.
+    // Main thread only. Having an entry here means a load is in progress, so
+    // requests for the same model wait for that load instead of starting one.
+    using ModelCallback = std::function<void(std::shared_ptr<marian::bergamot::TranslationModel>, QString)>;
+    QMap<QString, QList<ModelCallback>> pendingLoads_;
+
     // Marian shared ptr. We should be using a unique ptr but including the actual header breaks QT compilation. Sue me.
-    std::shared_ptr<marian::bergamot::AsyncService> service_;
+    // One or more services, see ShardedService. Also used by the loader
+    // thread to load models on every shard.
+    std::shared_ptr<ShardedService> service_;
 
     // TranslateLocally bits
     Settings settings_;
@@ -307,45 +602,163 @@ private:
     ModelManager models_;
     QMap<QString, QMap<QString, QList<Model>>> modelMap_;
 
-    std::optional<ModelInstance> model_;
+    // Loaded models, so switching between language pairs doesn't mean
+    // loading them from disk again.
+    ModelPool modelPool_;
+
+    // Translations on disk, shared with earlier runs and other processes.
+    // nullptr if disabled.
+    std::shared_ptr<PersistentCache> cache_;
+
+    // First halves of pivoted translations, so translating the same text into
+    // several languages through the same pivot only does that half once.
+    MemoryCache firstLegs_;
+
+    // Unloads all models once no request came in for the idle_unload_timeout
+    // setting, so a browser that keeps us running but doesn't translate
+    // anything doesn't keep hundreds of MB of models alive. They're loaded
+    // again on the next request that needs them.
+    QTimer idleTimer_;
+
+    // The memory_budget setting in bytes, 0 for no limit. See checkMemory().
+    std::size_t memoryBudget_;
+
+    // Translation work that hasn't been handed to the service yet, so it can
+    // be reordered by priority and dropped when cancelled.
+    RequestQueue queue_;
+
+    // Translation requests that haven't been answered yet, so Cancel can find
+    // them. Main thread only. Each flag is set by whoever answers the request
+    // first: its translation finishing, or it being cancelled. The flag is
+    // owned by the request's callbacks, so once those are done the entry here
+    // expires.
+    using RepliedFlag = std::shared_ptr<std::atomic<bool>>;
+    QMap<int, std::weak_ptr<std::atomic<bool>>> activeRequests_;
 
     // Methods
-    request_variant parseJsonInput(QByteArray bytes);
+    request_variant parseJsonInput(QJsonObject jsonObj);
+
+    /**
+     * @brief Pivots `source` through `model`, like ShardedService::pivot().
+     * Unless alignments or quality scores are asked for, which need both legs
+     * combined, plain text is split into paragraphs that go through both legs
+     * independently. The second leg of a paragraph then starts as soon as its
+     * first leg is done, instead of when all of them are. First legs are
+     * remembered in firstLegs_ (and cache_, as they are translations by the
+     * first model like any other.) `callback` is called once, with only the
+     * target text filled in on this path. If a second leg fails to go in, on
+     * a worker thread where nothing would catch it, `fail` is called once
+     * with the error instead, and `callback` never.
+     */
+    void pivot(PivotModelInstance const &model, std::string &&source, std::function<void(marian::bergamot::Response&&)> callback, std::function<void(QString)> fail, marian::bergamot::ResponseOptions const &options);
+
+    // Hands a text to the service with the model(s) of a request.
+    using Submit = std::function<void(std::string&&, std::function<void(marian::bergamot::Response&&)>)>;
+
+    /**
+     * @brief Translates `source` paragraph by paragraph with `submit`, for a
+     * request with "stream" set. The translation of each paragraph is written
+     * as an update as soon as it and the paragraphs before it are done. Once
+     * all are, `callback` gets the whole translation, with only the target
+     * text filled in.
+     */
+    void stream(TranslationRequest const &request, RepliedFlag replied, std::string &&source, Submit const &submit, std::function<void(marian::bergamot::Response&&)> callback);
     QByteArray converTranslationTo(marian::bergamot::Response&& response, int myID);
     
     /**
      * @brief This function tries its best to identify an appropriate model for
      * the target language/languages. The id of the found model (and possibly
      * pivot model) will be filled in in the `request` and the function will
-     * return `true`.
-     * @param TranslationRequest request
+     * return `true`. If the request asks for a model that isn't installed, the
+     * model directories are scanned again first, to find models installed
+     * since we started, e.g. through the GUI while we run as the daemon.
+     * @param T request, either TranslationRequest or TranslationBatchRequest
      * @return whether we succeeded or not.
      */
-    bool findModels(TranslationRequest &request) const;
+    template <typename T>
+    bool findModels(T &request);
+
+    // findModels() without looking again.
+    template <typename T>
+    bool findInstalledModels(T &request) const;
+
+    /**
+     * @brief Loads the models specified in the request, or takes them from
+     * the model pool if they're already loaded. Assumes `request.model` and
+     * possibly `request.pivot` are filled in. Loading happens in the
+     * background, `callback` is called on the main thread once it's done,
+     * which may be before this function returns if the models were already
+     * loaded.
+     * @param T request with `model` (and optionally `pivot`) filled in. Either
+     * TranslationRequest or TranslationBatchRequest.
+     * @param callback receives the model instance, or std::nullopt and an
+     * error message if any of the necessary models is either not found, not
+     * downloaded or failed to load.
+     */
+    template <typename T>
+    void loadModels(T const &request, std::function<void(std::optional<ModelInstance>, QString)> callback);
+
+    /**
+     * @brief Takes a model from the pool, or queues it to be loaded by the
+     * loader thread if it isn't loaded yet. If the model is already being
+     * loaded, `callback` just waits for that load to finish.
+     * @param model the model to load
+     * @param callback receives the model that will work with the service, or
+     * nullptr and an error message.
+     */
+    void loadModel(Model const &model, ModelCallback callback);
+
+    /**
+     * @brief Queues a translation request with its models loaded for the
+     * service. The reply is written once the translation is done, unless
+     * `replied` was set in the mean time.
+     */
+    void translate(TranslationRequest &request, ModelInstance &instance, RepliedFlag replied);
 
     /**
-     * @brief Loads the models specified in the request. Assumes `request.model`
-     * and possibly `request.pivot` are filled in.
-     * @param TranslationRequest request with `model` (and optionally `pivot`)
-     * filled in.
-     * @return Returns false if any of the necessary models is either not found
-     * or not downloaded.
+     * @brief Queues all texts of a batch request for the service. The reply is
+     * written once the last of them is translated, unless `replied` was set in
+     * the mean time.
      */
-    bool loadModels(TranslationRequest const &request);
+    void translate(TranslationBatchRequest &request, ModelInstance &instance, RepliedFlag replied);
 
     /**
-     * @brief instantiates a model that will work with the service.
-     * @returns model instance.
+     * @brief Registers a translation request in activeRequests_ so it can be
+     * cancelled.
+     * @return flag to set when answering the request.
      */
-    std::shared_ptr<marian::bergamot::TranslationModel> makeModel(Model const &model);
+    RepliedFlag trackRequest(int requestID);
 
     /**
-     * @brief lockAndWriteJsonHelper This function locks input stream and then writes the size and a
-     *                               json message after. It would be called in many places so it
-     *                               makes sense to put the common bits here to avoid code duplication.
-     * @param json QJsonDocument that will be stringified and written to stdout in a blocking fashion.
+     * @brief If the process is over its memory budget, drops all models but
+     * the one used last, and the first legs of pivoted translations, and
+     * returns that memory to the operating system. Called after loading a
+     * model, as that's what makes us grow. Main thread only.
      */
-    void lockAndWriteJsonHelper(QJsonDocument&& json);
+    void checkMemory();
+
+    /**
+     * @brief Body of loaderThread_. Loads the models in loadQueue_ one by one,
+     * and emits modelLoaded() for each.
+     */
+    void loaderLoop();
+
+    /**
+     * @brief queueJsonHelper Hands a message to the writer thread, which writes the size and the
+     *                        json message after it to stdout. It would be called in many places so
+     *                        it makes sense to put the common bits here to avoid code duplication.
+     *                        Does not block on stdout.
+     * @param json QJsonDocument that will be stringified and written to stdout.
+     */
+    void queueJsonHelper(QJsonDocument&& json);
+
+    /**
+     * @brief Body of writerThread_. Writes out queued messages as compact
+     * json, flushing once for every bunch of messages it picks up, or hands
+     * them to output_ if set. Writes out whatever is left in the queue before
+     * it stops.
+     */
+    void writerLoop();
 
     template <typename T> // T can be QJsonValue, QJsonArray or QJsonObject
     void writeResponse(Request const &request, T &&data) {
@@ -358,7 +771,7 @@ private:
             {"id", request.id},
             {"data", std::move(data)}
         };
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        queueJsonHelper(QJsonDocument(std::move(response)));
     }
 
     template <typename T>
@@ -368,7 +781,7 @@ private:
             {"id", request.id},
             {"data", std::move(data)}
         };
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        queueJsonHelper(QJsonDocument(std::move(response)));
     }
 
     void writeError(Request const &request, QString &&err) {
@@ -389,7 +802,7 @@ private:
         if (request.id >= 0)
             response["id"] = request.id;
 
-        lockAndWriteJsonHelper(QJsonDocument(std::move(response)));
+        queueJsonHelper(QJsonDocument(std::move(response)));
     }
 
     /**
@@ -398,6 +811,12 @@ private:
      */
     void handleRequest(TranslationRequest myJsonInput);
 
+    /**
+     * @brief handleRequest handles a request type TranslationBatchRequest and writes to stdout
+     * @param myJsonInput TranslationBatchRequest
+     */
+    void handleRequest(TranslationBatchRequest myJsonInput);
+
     /**
      * @brief handleRequest handles a request type ListRequest and writes to stdout
      * @param myJsonInput ListRequest
@@ -416,6 +835,18 @@ private:
      */
     void handleRequest(MalformedRequest myJsonInput);
 
+    /**
+     * @brief handleRequest handles a request type CancelRequest and writes to stdout
+     * @param myJsonInput CancelRequest
+     */
+    void handleRequest(CancelRequest myJsonInput);
+
+    /**
+     * @brief handleRequest handles a request type StatsRequest and writes to stdout
+     * @param myJsonInput StatsRequest
+     */
+    void handleRequest(StatsRequest myJsonInput);
+
 signals:
     /**
      * @brief Emitted when input is closed and all the messages have been processed.
@@ -427,4 +858,11 @@ signals:
      * @param input QByteArray of the json message
      */
     void emitJson(QByteArray input);
+
+    /**
+     * @brief Internal signal that is emitted from the loader thread whenever it
+     * finished (or failed) loading a model. The result is in loadResults_.
+     * @param modelID id of the model
+     */
+    void modelLoaded(QString modelID);
 };
@@ -0,0 +1,59 @@
+#include "RequestQueue.h"
+#include "Instrumentation.h"
+
+RequestQueue::RequestQueue(std::size_t wordBudget, QObject *parent)
+: QObject(parent)
+, serial_(0)
+, inFlight_(0)
+, wordBudget_(wordBudget) {
+    //
+}
+
+void RequestQueue::push(int priority, std::size_t words, Job job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.emplace(Key{-priority, serial_++}, Entry{words, std::move(job)});
+    }
+    pump();
+}
+
+void RequestQueue::done(std::size_t words) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inFlight_ -= words;
+    }
+
+    // Called on a worker thread. Queued, so the jobs run on our own thread.
+#if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
+    QMetaObject::invokeMethod(this, "pump", Qt::QueuedConnection);
+#else
+    QMetaObject::invokeMethod(this, &RequestQueue::pump, Qt::QueuedConnection);
+#endif
+}
+
+void RequestQueue::pump() {
+    for (;;) {
+        Entry entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.empty() || (inFlight_ > 0 && inFlight_ + queue_.begin()->second.words > wordBudget_)) {
+                // Nothing more we can start now, so this is how busy we are.
+                instrumentation::set(instrumentation::Gauge::QueueDepth, queue_.size());
+                instrumentation::set(instrumentation::Gauge::BatchFill, static_cast<double>(inFlight_) / wordBudget_);
+                return;
+            }
+
+            auto next = queue_.begin();
+            entry = std::move(next->second);
+            queue_.erase(next);
+            inFlight_ += entry.words;
+        }
+
+        // Jobs are run without holding the lock, since they may finish (and
+        // call done()) before they even return.
+        if (!entry.job()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inFlight_ -= entry.words;
+        }
+    }
+}
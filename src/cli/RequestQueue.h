@@ -0,0 +1,76 @@
+#pragma once
+#include <QObject>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+
+/**
+ * Holds back translation work that hasn't been handed to the service yet, so
+ * that we can still reorder it by priority, or drop it when it is cancelled.
+ * Only a limited number of words is in flight in the service at any time:
+ * enough to keep its batching pool filled, but not so much that a change in
+ * priorities takes long to have an effect.
+ *
+ * Work is pushed from the thread the queue lives in, typically the main
+ * thread, and finishes (calling done()) on one of the service's worker
+ * threads. Jobs are only ever started on the queue's own thread: done()
+ * leaves starting the next ones to its event loop, so a worker thread never
+ * runs a job, nor hands work to the service it is working for itself.
+ */
+class RequestQueue : public QObject {
+    Q_OBJECT
+
+public:
+    /**
+     * Submits the work to the service. Returns false if it didn't, e.g.
+     * because the request was cancelled in the mean time, in which case
+     * done() should not be called for it.
+     */
+    using Job = std::function<bool()>;
+
+    /**
+     * @brief RequestQueue
+     * @param wordBudget number of words we allow to be in flight in the
+     * service at the same time.
+     */
+    explicit RequestQueue(std::size_t wordBudget, QObject *parent = nullptr);
+
+    /**
+     * @brief push queues a job, and starts it right away if there is room.
+     * Higher priority jobs are started first, jobs with the same priority in
+     * the order they were pushed. A job larger than the budget still runs,
+     * but only once nothing else is in flight.
+     * @param priority higher goes first
+     * @param words (estimated) number of words this job will translate
+     * @param job function that submits the work
+     */
+    void push(int priority, std::size_t words, Job job);
+
+    /**
+     * @brief done marks `words` as no longer in flight, and has more jobs
+     * started on the queue's thread. Call from the translation callback of
+     * each job that returned true, from any thread.
+     */
+    void done(std::size_t words);
+
+private:
+    struct Entry {
+        std::size_t words;
+        Job job;
+    };
+
+    // Ordered by priority (highest first) and then by arrival.
+    using Key = std::pair<int, std::uint64_t>;
+
+    std::mutex mutex_;
+    std::map<Key, Entry> queue_;
+    std::uint64_t serial_;
+    std::size_t inFlight_;
+    std::size_t wordBudget_;
+
+private slots:
+    void pump();
+};
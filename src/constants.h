@@ -6,4 +6,8 @@ constexpr const char* kDefaultRepositoryName = "Bergamot";
 
 constexpr const char* kDefaultRepositoryURL = "https://translatelocally.com/models.json";
 
+// Capacity (in entries) of the in-memory translation cache, unless overridden
+// by the translation_cache_size setting.
+constexpr unsigned int kDefaultTranslationCacheSize = 1 << 16;
+
 }
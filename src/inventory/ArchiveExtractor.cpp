@@ -0,0 +1,219 @@
+#include "ArchiveExtractor.h"
+#include <QObject>
+// libarchive
+#include <archive.h>
+#include <archive_entry.h>
+
+namespace {
+    // How much data may be waiting for the extraction thread before write()
+    // blocks. Keeps a slow extraction from buffering the whole download.
+    constexpr int kMaxQueuedBytes = 16 << 20;
+}
+
+struct ArchiveCallbacks {
+    static la_ssize_t read(struct archive *, void *self, const void **buffer) {
+        return static_cast<ArchiveExtractor *>(self)->next(buffer);
+    }
+};
+
+ArchiveExtractor::ArchiveExtractor(QString const &templatePath)
+: dir_(templatePath)
+, queued_(0)
+, eof_(false)
+, abort_(false)
+, done_(false)
+, failed_(false) {
+    if (dir_.isValid())
+        thread_ = std::thread(&ArchiveExtractor::run, this);
+}
+
+ArchiveExtractor::~ArchiveExtractor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        abort_ = true;
+    }
+    cv_.notify_all();
+
+    if (thread_.joinable())
+        thread_.join();
+}
+
+bool ArchiveExtractor::isValid() const {
+    return dir_.isValid();
+}
+
+QString ArchiveExtractor::path() const {
+    return dir_.path();
+}
+
+bool ArchiveExtractor::write(QByteArray data) {
+    if (!dir_.isValid())
+        return false;
+
+    // Wait for the extraction thread to catch up if it is falling behind.
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return done_ || queued_ < kMaxQueuedBytes; });
+
+    if (done_)
+        return !failed_;
+
+    queued_ += data.size();
+    chunks_.push_back(std::move(data));
+    cv_.notify_all();
+    return true;
+}
+
+bool ArchiveExtractor::finish() {
+    if (!dir_.isValid())
+        return false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    eof_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return done_; });
+    return !failed_;
+}
+
+QStringList ArchiveExtractor::files() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_ ? files_ : QStringList();
+}
+
+QString ArchiveExtractor::errorString() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+void ArchiveExtractor::setAutoRemove(bool autoRemove) {
+    dir_.setAutoRemove(autoRemove);
+}
+
+long long ArchiveExtractor::next(const void **buffer) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return abort_ || eof_ || !chunks_.empty(); });
+
+    if (abort_)
+        return -1;
+
+    // Either there is data, or we're at the end of the archive.
+    if (chunks_.empty())
+        return 0;
+
+    current_ = std::move(chunks_.front());
+    chunks_.pop_front();
+    queued_ -= current_.size();
+    cv_.notify_all(); // There's room for write() again
+    *buffer = current_.constData();
+    return current_.size();
+}
+
+// Adapted from https://github.com/libarchive/libarchive/blob/master/examples/untar.c#L136
+void ArchiveExtractor::run() {
+    QString error;
+    QStringList files;
+
+    auto fail = [&](const char *function, const char *message) {
+        error = QObject::tr("Trouble while extracting language model after call to %1: %2").arg(function, message ? message : "aborted");
+    };
+
+    auto copyData = [&](struct archive *in, struct archive *out) {
+        const void *buff;
+        size_t size;
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+        int64_t offset;
+#else
+        off_t offset;
+#endif
+
+        for (;;) {
+            int retval = archive_read_data_block(in, &buff, &size, &offset);
+            // End of archive: good!
+            if (retval == ARCHIVE_EOF)
+                return ARCHIVE_OK;
+
+            // Not end of archive: bad.
+            if (retval != ARCHIVE_OK) {
+                fail("archive_read_data_block()", archive_error_string(in));
+                return retval;
+            }
+
+            retval = archive_write_data_block(out, buff, size, offset);
+            if (retval != ARCHIVE_OK) {
+                fail("archive_write_data_block()", archive_error_string(out));
+                return retval;
+            }
+        }
+    };
+
+    // Entries are written to paths prefixed with our directory instead of
+    // changing the working directory, which is shared by all threads. The
+    // secure options stop entries from escaping it through .. or symlinks.
+    QByteArray prefix = dir_.path().toUtf8() + '/';
+
+    archive *in = archive_read_new();
+    archive *out = archive_write_disk_new();
+    archive_write_disk_set_options(out, ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS);
+
+    archive_read_support_format_tar(in);
+    archive_read_support_filter_gzip(in);
+
+    if (archive_read_open(in, this, nullptr, &ArchiveCallbacks::read, nullptr) != ARCHIVE_OK) {
+        fail("archive_read_open()", archive_error_string(in));
+    } else {
+        // Read (and extract) all archive entries
+        for (;;) {
+            archive_entry *entry;
+
+            int retval = archive_read_next_header(in, &entry);
+
+            // Stop when we read past the last entry
+            if (retval == ARCHIVE_EOF)
+                break;
+
+            if (retval < ARCHIVE_WARN) {
+                fail("archive_read_next_header()", archive_error_string(in));
+                break;
+            }
+
+            QByteArray pathname = prefix + archive_entry_pathname(entry);
+            archive_entry_set_pathname(entry, pathname.constData());
+            if (const char *hardlink = archive_entry_hardlink(entry)) {
+                QByteArray target = prefix + hardlink;
+                archive_entry_set_hardlink(entry, target.constData());
+            }
+
+            // Skipping an entry would leave us with an incomplete model.
+            retval = archive_write_header(out, entry);
+            if (retval < ARCHIVE_WARN) {
+                fail("archive_write_header()", archive_error_string(out));
+                break;
+            }
+
+            files << QString::fromUtf8(pathname);
+
+            if (archive_entry_size(entry) > 0 && copyData(in, out) < ARCHIVE_WARN)
+                break;
+
+            retval = archive_write_finish_entry(out);
+            if (retval < ARCHIVE_WARN) {
+                fail("archive_write_finish_entry()", archive_error_string(out));
+                break;
+            }
+        }
+    }
+
+    archive_read_close(in);
+    archive_read_free(in);
+
+    archive_write_close(out);
+    archive_write_free(out);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_ = std::move(files);
+    error_ = std::move(error);
+    failed_ = !error_.isEmpty();
+    done_ = true;
+    chunks_.clear();
+    queued_ = 0;
+    cv_.notify_all();
+}
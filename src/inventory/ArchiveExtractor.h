@@ -0,0 +1,96 @@
+#pragma once
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/**
+ * Extracts a .tar.gz archive into a temporary directory while it is still
+ * being written to it, e.g. chunk by chunk as it is being downloaded. The
+ * extraction runs on its own thread, so the caller only has to hand over the
+ * data as it comes in. Nothing is written anywhere but in the temporary
+ * directory, which is removed again when this is destroyed unless told not
+ * to with setAutoRemove(). Not thread-safe: write() and finish() are meant to
+ * be called from one thread.
+ */
+class ArchiveExtractor {
+public:
+    /**
+     * @brief Creates the temporary directory from `templatePath` (see
+     * QTemporaryDir) and starts extracting into it.
+     */
+    explicit ArchiveExtractor(QString const &templatePath);
+
+    /**
+     * @brief Stops extracting if it hasn't finished yet, and removes the
+     * temporary directory if auto-remove is on.
+     */
+    ~ArchiveExtractor();
+
+    /**
+     * @brief Whether the temporary directory could be created.
+     */
+    bool isValid() const;
+
+    /**
+     * @brief Path of the temporary directory.
+     */
+    QString path() const;
+
+    /**
+     * @brief Hands the next part of the archive to the extraction thread.
+     * Blocks while too much data is still waiting to be extracted, so the
+     * caller can't get too far ahead of the extraction.
+     * @return false if extraction has already failed, in which case there's
+     * no point in writing more.
+     */
+    bool write(QByteArray data);
+
+    /**
+     * @brief Marks the end of the archive, and waits until everything is
+     * extracted.
+     * @return whether the whole archive was extracted. If not, see
+     * errorString().
+     */
+    bool finish();
+
+    /**
+     * @brief Absolute paths of everything extracted. Only complete once
+     * finish() returned true.
+     */
+    QStringList files() const;
+
+    QString errorString() const;
+
+    void setAutoRemove(bool autoRemove);
+
+private:
+    QTemporaryDir dir_;
+    std::thread thread_;
+
+    // Data waiting to be extracted, guarded by mutex_.
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<QByteArray> chunks_;
+    int queued_; // Total size of chunks_
+    bool eof_; // No more data will be written
+    bool abort_; // Stop extracting, we're being destroyed
+    bool done_; // Extraction thread is done, successfully or not
+    bool failed_;
+    QString error_;
+
+    // Owned by the extraction thread until done_.
+    QByteArray current_; // Chunk libarchive is reading from
+    QStringList files_;
+
+    void run();
+
+    // Waits for the next chunk, and points `buffer` to it. Returns its size,
+    // 0 at the end of the archive or -1 when aborted. For libarchive.
+    long long next(const void **buffer);
+    friend struct ArchiveCallbacks;
+};
@@ -1,4 +1,6 @@
 #include "ModelManager.h"
+#include "ArchiveExtractor.h"
+#include "PrepackedModel.h"
 #include "Network.h"
 #include "types.h"
 #include <QApplication>
@@ -8,25 +10,33 @@
 #include <QFile>
 #include <QSaveFile>
 #include <QStandardPaths>
+#include <QTimer>
 #include <QFileInfo>
+#include <QHash>
 #include <QDirIterator>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QNetworkReply>
-#include <QTemporaryDir>
 #include <QtGui>
 #include <QColor>
 #include <QStyle>
 #include <iostream>
-// libarchive
-#include <archive.h>
-#include <archive_entry.h>
 #include <algorithm>
+#include <memory>
 #include <optional>
 #include <variant>
 
 namespace {
+    // How much of an archive file writeModel() hands to the extractor at once
+    constexpr qint64 kExtractChunkSize = 1 << 20;
+
+    // Bump when the format of model_index.json changes, to ignore old ones.
+    constexpr int kModelIndexVersion = 1;
+
+    // How long a fetched repository listing is used without asking again.
+    constexpr qint64 kRepositoryCacheTTL = 60 * 60 * 1000;
+
     /**
      * Give it a QStringList with multiple paths, and this will return the
      * path prefix (i.e. the path to the shared root directory). Note: if only
@@ -78,6 +88,8 @@ ModelManager::ModelManager(QObject *parent, Settings * settings)
     , network_(new Network(this))
     , settings_(settings)
     , isFetchingRemoteModels_(false)
+    , prepacking_(false)
+    , prepackCancel_(false)
 {
     appDataDir_.setPath(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation));
     if (!QDir(appDataDir_).exists()) {
@@ -110,13 +122,58 @@ ModelManager::ModelManager(QObject *parent, Settings * settings)
         // We do clear the remoteModels list so that it is clear that it is
         // outdated and/or incomplete. Now users can click the "download model
         // list" again and make an informed decision to access the internet.
-        remoteModels_.clear();
-        updateAvailableModels();
+        setRemoteModels(QList<Model>());
     });
 
     startupLoad();
 }
 
+ModelManager::~ModelManager() {
+    // Whatever is half done is picked up again next time.
+    prepackCancel_ = true;
+    {
+        std::unique_lock<std::mutex> lock(prepackMutex_);
+        prepackQueue_.clear();
+    }
+    if (prepackThread_.joinable())
+        prepackThread_.join();
+}
+
+void ModelManager::prepackModel(QString dir) {
+    std::unique_lock<std::mutex> lock(prepackMutex_);
+    prepackQueue_.push_back(dir);
+    if (prepacking_)
+        return;
+
+    // The previous thread is done, but might not have quite returned yet.
+    if (prepackThread_.joinable())
+        prepackThread_.join();
+
+    prepacking_ = true;
+    prepackThread_ = std::thread(&ModelManager::prepackLoop, this);
+}
+
+void ModelManager::prepackLoop() {
+    while (true) {
+        QString dir;
+        {
+            std::unique_lock<std::mutex> lock(prepackMutex_);
+            if (prepackQueue_.empty() || prepackCancel_) {
+                prepacking_ = false;
+                return;
+            }
+            dir = prepackQueue_.front();
+            prepackQueue_.pop_front();
+        }
+
+        // Not being able to prepack a model isn't a problem, it's then loaded
+        // from its own files, so this is only worth a debug message.
+        QString message;
+        if (!prepacked::write(dir, prepackCancel_, &message))
+            qDebug() << message;
+    }
+}
+
 std::optional<Model> ModelManager::findModelForUpdate(Model const& model) {
     for (auto&& newmodel : getUpdatedModels()) {
         if (newmodel.id() == model.id()) {
@@ -153,9 +210,9 @@ std::optional<Model> ModelManager::getModel(QString const &id) const {
         if (model.id() == id)
             return model;
 
-    for (auto &&model : getRemoteModels())
-        if (model.id() == id)
-            return model;
+    auto it = remoteIndex_.constFind(id);
+    if (it != remoteIndex_.constEnd())
+        return remoteModels_.at(*it);
 
     return std::nullopt;
 }
@@ -193,16 +250,84 @@ std::optional<Model> ModelManager::writeModel(QFile *file, ModelMeta meta, QStri
     // inside the target directory to make sure we're on the same filesystem.
     // Otherwise `QDir::rename()` might fail. Note that directories starting
     // with "extracting-" are explicitly skipped `scanForModels()`.
-    QTemporaryDir tempDir(appDataDir_.filePath("extracting-XXXXXXX"));
-    if (!tempDir.isValid()) {
+    ArchiveExtractor extractor(appDataDir_.filePath("extracting-XXXXXXX"));
+    if (!extractor.isValid()) {
         emit error(tr("Could not create temporary directory in %1 to extract the model archive to.").arg(appDataDir_.path()));
         return std::nullopt;
     }
 
-    // Try to extract the archive to the temporary directory
-    QStringList extracted;
-    if (!extractTarGz(file, tempDir.path(), extracted))
+    if (!file->isOpen() && !file->open(QIODevice::ReadOnly)) {
+        emit error(tr("Trouble while extracting language model after call to %1: %2").arg("QIODevice::open()", file->errorString()));
+        return std::nullopt;
+    }
+
+    while (!file->atEnd()) {
+        QByteArray chunk = file->read(kExtractChunkSize);
+        if (chunk.isEmpty() || !extractor.write(chunk))
+            break;
+    }
+
+    return installModel(extractor, meta, filename);
+}
+
+Download *ModelManager::downloadModel(Network *network, Model const &model, QVariant extradata) {
+    // Extract to a temporary directory while downloading, see writeModel().
+    // Shared because the callbacks passed to the network own it: it is removed
+    // together with them when the download fails.
+    auto extractor = std::make_shared<ArchiveExtractor>(appDataDir_.filePath("extracting-XXXXXXX"));
+    if (!extractor->isValid()) {
+        emit network->error(tr("Could not create temporary directory in %1 to extract the model archive to.").arg(appDataDir_.path()), extradata);
+        return nullptr;
+    }
+
+    // Pass on meta info about the model so we remember once we've downloaded it
+    ModelMeta meta;
+    meta.modelUrl = model.url;
+    meta.repositoryUrl = model.repositoryUrl;
+
+    auto write = [=](QByteArray const &data) {
+        if (!extractor->write(data))
+            return extractor->errorString();
+        return QString();
+    };
+
+    // Only called once the checksum matched, so nothing of the download
+    // escapes the temporary directory before then.
+    auto complete = [=](QString filename) {
+        ModelMeta installed = meta;
+        installed.installedOn = QDateTime::currentDateTimeUtc();
+        auto installedModel = installModel(*extractor, installed, filename);
+        if (!installedModel)
+            return tr("Could not install the model downloaded from %1.").arg(model.url);
+        emit modelDownloaded(*installedModel, extradata);
+        return QString();
+    };
+
+    // Keep the partial download next to the models so it can be resumed, but
+    // only by one download at a time.
+    QString partialPath = appDataDir_.filePath(QString("%1.part").arg(QUrl(model.url).fileName()));
+    if (downloading_.contains(partialPath))
+        partialPath.clear();
+
+    Download *download = network->download(model.url, write, complete, QCryptographicHash::Sha256, model.checksum, extradata, partialPath);
+
+    if (!partialPath.isEmpty()) {
+        downloading_.insert(partialPath);
+        connect(download, &Download::finished, this, [this, partialPath] {
+            downloading_.remove(partialPath);
+        });
+    }
+
+    return download;
+}
+
+std::optional<Model> ModelManager::installModel(ArchiveExtractor &extractor, ModelMeta meta, QString filename) {
+    if (!extractor.finish()) {
+        emit error(extractor.errorString());
         return std::nullopt;
+    }
+
+    QStringList extracted = extractor.files();
 
     // Assert we extracted at least something.
     if (extracted.isEmpty()) {
@@ -211,16 +336,16 @@ std::optional<Model> ModelManager::writeModel(QFile *file, ModelMeta meta, QStri
     }
 
     // Get the common prefix of all files. In the ideal case, it's the same as
-    // tempDir, but the archive might have had it's own sub folder.
+    // the temporary directory, but the archive might have had it's own sub folder.
     QString prefix = getCommonPrefixPath(extracted);
     if (prefix.isEmpty()) {
         emit error(tr("Could not determine prefix path of extracted model."));
         return std::nullopt;
     }
 
-    // Assume the prefix is at least tempDir. If not, something shady is
-    // happening, like the tar.gz file writing to an absolute path?
-    Q_ASSERT(prefix.startsWith(tempDir.path()));
+    // Assume the prefix is at least the temporary directory. If not, something
+    // shady is happening, like the tar.gz file writing to an absolute path?
+    Q_ASSERT(prefix.startsWith(extractor.path()));
 
     // Try determining whether the model is any good before we continue to safe
     // it to a permanent destination
@@ -231,13 +356,13 @@ std::optional<Model> ModelManager::writeModel(QFile *file, ModelMeta meta, QStri
     QString newModelDirPath = appDataDir_.absoluteFilePath(newModelDirName);
 
     if (!QDir().rename(prefix, newModelDirPath)) {
-        emit error(tr("Could not move extracted model from %1 to %2.").arg(tempDir.path(), newModelDirPath));
+        emit error(tr("Could not move extracted model from %1 to %2.").arg(extractor.path(), newModelDirPath));
         return std::nullopt;
     }
 
     // Only remove the temp directory if we moved a directory within it. Don't 
     // attempt anything if we moved the whole directory itself.
-    tempDir.setAutoRemove(prefix != tempDir.path());
+    extractor.setAutoRemove(prefix != extractor.path());
 
     auto obj = getModelInfoJsonFromDir(newModelDirPath);
     if (obj.isEmpty()) return std::nullopt; // validateModel() has already emitted an error in this case
@@ -266,6 +391,9 @@ std::optional<Model> ModelManager::writeModel(QFile *file, ModelMeta meta, QStri
 
     insertLocalModel(*model);
     updateAvailableModels();
+
+    // So it loads without converting anything from the first time it's used.
+    prepackModel(model->path);
     
     return model;
 }
@@ -325,6 +453,27 @@ bool ModelManager::insertLocalModel(Model model) {
     return true;
 }
 
+void ModelManager::insertLocalModels(QList<Model> const &models) {
+    // Same as calling insertLocalModel() for all of them, but without
+    // searching the list for every single one.
+    QHash<QString, int> positions;
+    for (int i = 0; i < localModels_.size(); ++i)
+        positions.insert(localModels_[i].id(), i);
+
+    beginResetModel();
+    for (Model const &model : models) {
+        auto it = positions.constFind(model.id());
+        if (it != positions.constEnd()) {
+            localModels_[*it] = model;
+        } else {
+            positions.insert(model.id(), localModels_.size());
+            localModels_.append(model);
+        }
+    }
+    std::stable_sort(localModels_.begin(), localModels_.end());
+    endResetModel();
+}
+
 QJsonObject ModelManager::getModelInfoJsonFromDir(QString dir, QString *error) {
     // Check if we can find a model_info.json in the directory. If so, record it as part of the model
     QFileInfo modelInfo(dir + "/model_info.json");
@@ -423,7 +572,7 @@ std::optional<Model> ModelManager::parseModelInfo(QJsonObject& obj, translateLoc
     return std::make_optional(model);
 }
 
-void ModelManager::scanForModels(QString path) {
+void ModelManager::scanForModels(QString path, QJsonObject const &cached, QJsonObject &index, QList<Model> &found, QStringList &archives) {
     //Iterate over all files in the folder and take note of available models and archives
     //@TODO currently, archives can only be extracted from the config dir
     QDirIterator it(path, QDir::NoFilter);
@@ -435,15 +584,30 @@ void ModelManager::scanForModels(QString path) {
             if (f.baseName().startsWith("extracting-"))
                 continue;
 
-            // Possible parse error, useful for debugging
-            QString errorMsg;
+            // Only read the json files again if anything about them changed
+            // since the last time we looked. Directories without a model are
+            // remembered as well, so they're skipped just as quickly.
+            QString stamp = getModelDirStamp(current);
+            QJsonObject entry = cached.value(current).toObject();
+            if (entry.value("stamp").toString() != stamp) {
+                QJsonObject info = getModelInfoJsonFromDir(current);
+                entry = QJsonObject{
+                    {"stamp", stamp},
+                    {"info", info},
+                    {"meta", info.isEmpty() ? QJsonObject() : getModelMetaJsonFromDir(current)}
+                };
+            }
+            index.insert(current, entry);
+
+            QJsonObject obj = entry.value("info").toObject();
 
-            QJsonObject obj = getModelInfoJsonFromDir(current, &errorMsg);
-            
             // We have a folder in our models directory that doesn't contain a model. This is ok.
             if (obj.empty())
                 continue;
 
+            // Possible parse error, useful for debugging
+            QString errorMsg;
+
             auto model = parseModelInfo(obj, translateLocally::models::Local, &errorMsg);
             if (!model) {
                 emit error(tr("Invalid json file: %1/model_info.json: %2").arg(current, errorMsg));
@@ -452,26 +616,37 @@ void ModelManager::scanForModels(QString path) {
 
             model->path = current;
 
-            readModelMetaFromDir(*model, current);
-            
-            insertLocalModel(*model);
+            QJsonObject meta = entry.value("meta").toObject();
+            if (!meta.isEmpty())
+                parseModelMeta(*model, meta);
+
+            found.append(*model);
         } else {
             // Check if this an existing archive
             if (f.completeSuffix() == QString("tar.gz")) {
-                archives_.append(f.fileName());
+                archives.append(f.fileName());
             }
         }
     }
+}
 
-    updateAvailableModels();
+QString ModelManager::getModelDirStamp(QString dir) const {
+    // Editing a file in place doesn't change the directory's modification
+    // time, so look at the files we read as well.
+    QStringList parts;
+    for (QString const &path : {dir, dir + "/model_info.json", dir + "/modelMeta.json"}) {
+        QFileInfo info(path);
+        parts << (info.exists() ? QString("%1:%2").arg(info.lastModified().toMSecsSinceEpoch()).arg(info.size()) : QString("-"));
+    }
+    return parts.join(' ');
 }
 
-bool ModelManager::readModelMetaFromDir(ModelMeta &model, QString dir) const {
+QJsonObject ModelManager::getModelMetaJsonFromDir(QString dir) const {
     QFile metaFile(dir + "/modelMeta.json");
     if (!metaFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
         qDebug() << "Could not parse model meta file" << metaFile.fileName() << ": file cannot be opened for reading.\n"
                  << "The model is either in the current working directory or downloaded before metadata was added to translateLocally.";
-        return false; // Cannot open file, might not exist
+        return QJsonObject(); // Cannot open file, might not exist
     }
     
     QByteArray bytes = metaFile.readAll();
@@ -482,13 +657,24 @@ bool ModelManager::readModelMetaFromDir(ModelMeta &model, QString dir) const {
     QJsonDocument json = QJsonDocument::fromJson(bytes, &error);
     if (json.isNull()) {
         qDebug() << "Could not parse model meta file" << metaFile.fileName() << ":" << error.errorString();
-        return false; // Broken meta file, probably 
+        return QJsonObject(); // Broken meta file, probably 
     }
     
-    QJsonObject obj = json.object();
+    return json.object();
+}
+
+void ModelManager::parseModelMeta(ModelMeta &model, QJsonObject const &obj) const {
     model.modelUrl = obj.value("modelUrl").toString();
     model.repositoryUrl = obj.value("repositoryUrl").toString();
     model.installedOn = QDateTime::fromString(obj.value("installedOn").toString(), Qt::ISODate);
+}
+
+bool ModelManager::readModelMetaFromDir(ModelMeta &model, QString dir) const {
+    QJsonObject obj = getModelMetaJsonFromDir(dir);
+    if (obj.isEmpty())
+        return false;
+
+    parseModelMeta(model, obj);
     return true;
 }
 
@@ -511,132 +697,119 @@ bool ModelManager::writeModelMetaToDir(ModelMeta const &model, QString dir) cons
     return true;
 }
 
-void ModelManager::startupLoad() {
-    // Scan for shared models installed through the system package manager.
-    // Those paths should only contain already-extracted models.
-    // They should be considered read-only.
-    for (const auto &sharedDir : QStandardPaths::locateAll(QStandardPaths::AppDataLocation, QString("models"), QStandardPaths::LocateDirectory)) {
-        scanForModels(sharedDir);
-    }
-
-    // Iterate over all files in the app's data folder and take note of available models and archives
-    scanForModels(appDataDir_.absolutePath());
-    // Also scan for models located in the app's config directory in previous versions
-    scanForModels(QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation));
-    scanForModels(QDir::current().path()); // Scan the current directory for models. @TODO archives found in this folder would not be used
-}
-
-// Adapted from https://github.com/libarchive/libarchive/blob/master/examples/untar.c#L136
-bool ModelManager::extractTarGz(QFile *file, QDir const &destination, QStringList &files) {
-    // Change current working directory while extracting
-    QString currentPath = QDir::currentPath();
+QStringList ModelManager::modelDirs() const {
+    QStringList dirs;
 
-    if (!QDir::setCurrent(destination.absolutePath())) {
-        emit error(tr("Failed to change path to the configuration directory %1. %2 won't be extracted.").arg(destination.absolutePath(), file->fileName()));
-        return false;
-    }
-
-    QStringList extracted;
-    bool success = extractTarGzInCurrentPath(file, extracted);
+    // Shared models installed through the system package manager. Those paths
+    // should only contain already-extracted models. They should be considered
+    // read-only.
+    dirs << QStandardPaths::locateAll(QStandardPaths::AppDataLocation, QString("models"), QStandardPaths::LocateDirectory);
 
-    for (QString const &file : qAsConst(extracted))
-        files << destination.filePath(file);
+    // The app's data folder, with the models and archives we manage
+    dirs << appDataDir_.absolutePath();
+    // Also models located in the app's config directory in previous versions
+    dirs << QStandardPaths::writableLocation(QStandardPaths::AppConfigLocation);
+    dirs << QDir::current().path(); // The current directory. @TODO archives found in this folder would not be used
 
-    QDir::setCurrent(currentPath);
-    return success;
+    return dirs;
 }
 
-bool ModelManager::extractTarGzInCurrentPath(QFile *file, QStringList &files) {
-    auto warn = [&](const char *f, const char *m) {
-        emit error(tr("Trouble while extracting language model after call to %1: %2").arg(f, m));
-    };
+QString ModelManager::getModelDirsStamp() const {
+    QStringList stamps;
+    for (QString const &dir : modelDirs())
+        stamps << getModelDirStamp(dir);
+    return stamps.join('|');
+}
 
-    auto copy_data = [=](struct archive *a_in, struct archive *a_out) {
-        const void *buff;
-        size_t size;
-#if ARCHIVE_VERSION_NUMBER >= 3000000
-        int64_t offset;
-#else
-        off_t offset;
-#endif
-
-        for (;;) {
-            int retval = archive_read_data_block(a_in, &buff, &size, &offset);
-            // End of archive: good!
-            if (retval == ARCHIVE_EOF)
-                return ARCHIVE_OK;
-            
-            // Not end of archive: bad.
-            if (retval != ARCHIVE_OK) {
-                warn("archive_read_data_block()", archive_error_string(a_in));
-                return retval;
-            }
-            
-            retval = archive_write_data_block(a_out, buff, size, offset);
-            if (retval != ARCHIVE_OK) {
-                warn("archive_write_data_block()", archive_error_string(a_out));
-                return retval;
-            }
+QList<Model> ModelManager::scanModelDirs(QStringList &archives) {
+    QJsonObject index;
+    QList<Model> found;
+    for (QString const &dir : modelDirs())
+        scanForModels(dir, modelIndex_, index, found, archives);
+
+    // Only directories we've seen this time are kept, so models that were
+    // removed in the meantime drop out of the index.
+    if (index != modelIndex_) {
+        modelIndex_ = index;
+        QSaveFile saveFile(appDataDir_.filePath("model_index.json"));
+        if (saveFile.open(QIODevice::WriteOnly)) {
+            saveFile.write(QJsonDocument(QJsonObject{{"version", kModelIndexVersion}, {"dirs", index}}).toJson(QJsonDocument::Compact));
+            saveFile.commit();
         }
-    };
-
-    archive *a_in = archive_read_new();
-    archive *a_out = archive_write_disk_new();
-    archive_write_disk_set_options(a_out, ARCHIVE_EXTRACT_TIME);
-    
-    archive_read_support_format_tar(a_in);
-    archive_read_support_filter_gzip(a_in);
-    
-    if (!file->open(QIODevice::ReadOnly)) {
-        emit error(tr("Trouble while extracting language model after call to %1: %2").arg("QIODevice::open()", file->errorString()));
-        return false;
-    }
-    
-    if (archive_read_open_fd(a_in, file->handle(), 10240)) {
-        warn("archive_read_open_filename()", archive_error_string(a_in));
-        return false;
     }
 
-    // Read (and extract) all archive entries
-    for (;;) {
-        archive_entry *entry;
-        
-        int retval = archive_read_next_header(a_in, &entry);
+    // After writing the index, which is in one of these directories itself.
+    modelDirsStamp_ = getModelDirsStamp();
+    return found;
+}
 
-        // Stop when we read past the last entry
-        if (retval == ARCHIVE_EOF)
-            break;
+void ModelManager::startupLoad() {
+    // What we found the last time. Directories that haven't changed since
+    // don't need their json files read again.
+    QFile indexFile(appDataDir_.filePath("model_index.json"));
+    if (indexFile.open(QIODevice::ReadOnly)) {
+        QJsonObject obj = QJsonDocument::fromJson(indexFile.readAll()).object();
+        if (obj.value("version").toInt() == kModelIndexVersion)
+            modelIndex_ = obj.value("dirs").toObject();
+        indexFile.close();
+    }
 
-        if (retval < ARCHIVE_OK)
-            warn("archive_read_next_header()", archive_error_string(a_in));
-        if (retval < ARCHIVE_WARN)
-            return false;
+    insertLocalModels(scanModelDirs(archives_));
+    updateAvailableModels();
 
-        retval = archive_write_header(a_out, entry);
-        if (retval < ARCHIVE_OK)
-            warn("archive_write_header()", archive_error_string(a_out));
-        else {
-            files << QString(archive_entry_pathname(entry));
+    // Models installed before they were prepacked on installation get their
+    // prepacked files now. Only ours, those elsewhere may be read-only.
+    for (Model const &model : localModels_)
+        if (isManagedModel(model) && !prepacked::isValid(model.path))
+            prepackModel(model.path);
+}
 
-            if(archive_entry_size(entry) > 0)
-                if (copy_data(a_in, a_out) < ARCHIVE_WARN)
-                    return false;
-        }
+void ModelManager::reloadLocalModels() {
+    // Installing or removing a model adds or removes a directory in one of
+    // these, so as long as none of them changed, neither did the models.
+    if (getModelDirsStamp() == modelDirsStamp_)
+        return;
 
-        retval = archive_write_finish_entry(a_out);
-        if (retval < ARCHIVE_OK)
-            warn("archive_write_finish_entry()", archive_error_string(a_out));
-        if (retval < ARCHIVE_WARN)
-            return false;
+    QStringList archives;
+    QList<Model> found = scanModelDirs(archives);
+    archives_ = archives;
+
+    // Same as insertLocalModels() into an empty list: a model found in more
+    // than one place is listed once.
+    QList<Model> models;
+    QHash<QString, int> positions;
+    for (Model const &model : found) {
+        auto it = positions.constFind(model.id());
+        if (it != positions.constEnd()) {
+            models[*it] = model;
+        } else {
+            positions.insert(model.id(), models.size());
+            models.append(model);
+        }
     }
+    std::stable_sort(models.begin(), models.end());
 
-    archive_read_close(a_in);
-    archive_read_free(a_in);
+    if (models == localModels_)
+        return;
 
-    archive_write_close(a_out);
-    archive_write_free(a_out);
+    QList<Model> previous = localModels_;
 
-    return true;
+    beginResetModel();
+    localModels_ = models;
+    endResetModel();
+    updateAvailableModels();
+
+    // Models that are new since the last scan are prepacked like at startup.
+    // Not the others again: if that failed once, it will again.
+    for (Model const &model : localModels_)
+        if (!previous.contains(model) && isManagedModel(model) && !prepacked::isValid(model.path))
+            prepackModel(model.path);
+}
+
+QString ModelManager::getRepositoryCachePath(QString url) const {
+    QDir cacheDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+    QString name = QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return cacheDir.filePath(QString("repositories/%1.json").arg(name));
 }
 
 void ModelManager::fetchRemoteModels(QVariant extradata) {
@@ -644,60 +817,156 @@ void ModelManager::fetchRemoteModels(QVariant extradata) {
         return;
 
     auto repos = settings_->repos();
-    QSharedPointer<int> num_repos(new int(repos.size())); // Keep track of how many repos have been fetched
+    if (repos.isEmpty())
+        return;
+
+    isFetchingRemoteModels_ = true;
+    emit fetchingRemoteModels();
+
+    // Listings per repository, merged once all of them are in. Keep track of
+    // how many repos still have to be fetched.
+    auto listings = QSharedPointer<QMap<QString, QJsonObject>>::create();
+    auto pending = QSharedPointer<int>::create(repos.size());
+
+    auto done = [=](QString url, QJsonObject listing) {
+        listings->insert(url, listing);
+        if (--(*pending) == 0) { // Once we have fetched all repositories, re-enable fetch.
+            parseRemoteModels(*listings);
+            isFetchingRemoteModels_ = false;
+            emit fetchedRemoteModels(extradata);
+        }
+    };
+
     for (QString url : repos.keys()) {
-        isFetchingRemoteModels_ = true;
-        emit fetchingRemoteModels();
+        QString cachePath = getRepositoryCachePath(url);
+
+        QJsonObject cached;
+        QFile cacheFile(cachePath);
+        if (cacheFile.open(QIODevice::ReadOnly)) {
+            cached = QJsonDocument::fromJson(cacheFile.readAll()).object();
+            cacheFile.close();
+        }
+
+        // Fresh enough: no need to ask at all. Still finish from the event
+        // loop, callers expect fetchedRemoteModels() after this returns.
+        qint64 age = QDateTime::currentMSecsSinceEpoch() - static_cast<qint64>(cached.value("fetchedAt").toDouble());
+        if (cached.value("url").toString() == url && age >= 0 && age < kRepositoryCacheTTL) {
+            QTimer::singleShot(0, this, [=] {
+                done(url, cached.value("listing").toObject());
+            });
+            continue;
+        }
 
+        // Otherwise ask whether what we have is still current.
         QNetworkRequest request(url);
+        if (cached.value("url").toString() == url) {
+            if (cached.contains("etag"))
+                request.setRawHeader("If-None-Match", cached.value("etag").toString().toUtf8());
+            if (cached.contains("lastModified"))
+                request.setRawHeader("If-Modified-Since", cached.value("lastModified").toString().toUtf8());
+        }
+
         QNetworkReply *reply = network_->get(request);
         connect(reply, &QNetworkReply::finished, this, [=] {
+            QJsonObject listing;
+            int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
             switch (reply->error()) {
-                case QNetworkReply::NoError:
-                    parseRemoteModels(QJsonDocument::fromJson(reply->readAll()).object(), url);
+                case QNetworkReply::NoError: {
+                    QJsonObject entry = cached;
+                    if (status == 304) { // Not Modified
+                        listing = cached.value("listing").toObject();
+                    } else {
+                        listing = QJsonDocument::fromJson(reply->readAll()).object();
+                        entry = QJsonObject{{"url", url}, {"listing", listing}};
+                        if (reply->hasRawHeader("ETag"))
+                            entry["etag"] = QString::fromUtf8(reply->rawHeader("ETag"));
+                        if (reply->hasRawHeader("Last-Modified"))
+                            entry["lastModified"] = QString::fromUtf8(reply->rawHeader("Last-Modified"));
+                    }
+
+                    entry["fetchedAt"] = static_cast<double>(QDateTime::currentMSecsSinceEpoch());
+
+                    QDir().mkpath(QFileInfo(cachePath).path());
+                    QSaveFile saveFile(cachePath);
+                    if (saveFile.open(QIODevice::WriteOnly)) {
+                        saveFile.write(QJsonDocument(entry).toJson(QJsonDocument::Compact));
+                        saveFile.commit();
+                    }
                     break;
+                }
                 default:
+                    // Offline or the like: what we had before is better than nothing.
+                    if (cached.value("url").toString() == url) {
+                        qDebug() << "Using cached listing of repository" << url << "after:" << reply->errorString();
+                        listing = cached.value("listing").toObject();
+                        break;
+                    }
+
                     QString errstr = QString("Error fetching remote repository: ") + url +
                             QString("\nError code: ") + reply->errorString() +
                             QString("\nPlease double check that the address is reachable.");
                     emit error(errstr);
                     break;
             }
-            if (--(*num_repos) == 0) { // Once we have fetched all repositories, re-enable fetch.
-                isFetchingRemoteModels_ = false;
-                emit fetchedRemoteModels(extradata);
-            }
 
+            done(url, listing);
             reply->deleteLater();
         });
     }
 }
 
-void ModelManager::parseRemoteModels(QJsonObject obj, QString repositoryUrl) {
+void ModelManager::parseRemoteModels(QMap<QString, QJsonObject> const &listings) {
     using namespace translateLocally::models;
     
-    QString errorMsg;
-    bool empty = true;
-    size_t i = 0;
-    for (auto&& arrobj : obj["models"].toArray()) {
-        ++i;
-        empty = false;
-        QJsonObject obj = arrobj.toObject();
-        auto remoteModel = parseModelInfo(obj, Remote, &errorMsg);
-        if (!remoteModel) {
-            qDebug() << QString("Error while parsing model %1 of %2: %3").arg(i).arg(repositoryUrl, errorMsg);
+    QList<Model> models;
+    QSet<QString> seen;
+
+    for (auto it = listings.constBegin(); it != listings.constEnd(); ++it) {
+        QString const &repositoryUrl = it.key();
+
+        // Repositories that could not be fetched at all have nothing to add.
+        if (it.value().isEmpty())
             continue;
+
+        QString errorMsg;
+        bool empty = true;
+        size_t i = 0;
+        for (auto&& arrobj : it.value()["models"].toArray()) {
+            ++i;
+            empty = false;
+            QJsonObject obj = arrobj.toObject();
+            auto remoteModel = parseModelInfo(obj, Remote, &errorMsg);
+            if (!remoteModel) {
+                qDebug() << QString("Error while parsing model %1 of %2: %3").arg(i).arg(repositoryUrl, errorMsg);
+                continue;
+            }
+            remoteModel->repositoryUrl = repositoryUrl;
+
+            // Same as operator== on remote models
+            QString key = remoteModel->id() + "\n" + remoteModel->url;
+            if (!seen.contains(key)) {
+                seen.insert(key);
+                models.append(std::move(*remoteModel));
+            }
         }
-        remoteModel->repositoryUrl = repositoryUrl;
-        if (!remoteModels_.contains(*remoteModel)) { // This costs O(n). Not happy, is there a better way?
-            remoteModels_.append(std::move(*remoteModel));
+        if (empty) {
+            emit error(tr("No models found in the repository at %1. Please double check that the repository address is correct.").arg(repositoryUrl));
         }
     }
-    if (empty) {
-        emit error(tr("No models found in the repository at %1. Please double check that the repository address is correct.").arg(repositoryUrl));
-    }
 
-    std::sort(remoteModels_.begin(), remoteModels_.end());
+    std::sort(models.begin(), models.end());
+    setRemoteModels(models);
+}
+
+void ModelManager::setRemoteModels(QList<Model> models) {
+    remoteModels_ = std::move(models);
+
+    // The first of several with the same id wins, like a linear search would.
+    remoteIndex_.clear();
+    for (int i = remoteModels_.size() - 1; i >= 0; --i)
+        remoteIndex_.insert(remoteModels_[i].id(), i);
+
     updateAvailableModels();
 }
 
@@ -740,18 +1009,22 @@ void ModelManager::updateAvailableModels() {
     endRemoveRows();
     updatedModels_.clear();
 
+    // Look up local models by id, instead of searching for every remote one.
+    QHash<QString, int> local;
+    for (int i = localModels_.size() - 1; i >= 0; --i)
+        local.insert(localModels_[i].id(), i);
+
     for (auto &&model : remoteModels_) {
         bool installed = false;
         bool outdated = false;
-        for (int i = 0; i < localModels_.size(); ++i) {
-            if (localModels_[i].isSameModel(model)) {
-                localModels_[i].remoteAPI = model.remoteAPI;
-                localModels_[i].remoteversion = model.remoteversion;
-                installed = true;
-                outdated = localModels_[i].outdated();
-                emit dataChanged(index(i, 0), index(i, columnCount()));
-                break;
-            }
+        auto it = local.constFind(model.id());
+        if (it != local.constEnd()) {
+            int i = *it;
+            localModels_[i].remoteAPI = model.remoteAPI;
+            localModels_[i].remoteversion = model.remoteversion;
+            installed = true;
+            outdated = localModels_[i].outdated();
+            emit dataChanged(index(i, 0), index(i, columnCount()));
         }
 
         if (!installed) {
@@ -1,19 +1,27 @@
 #ifndef MODELMANAGER_H
 #define MODELMANAGER_H
 #include <QDir>
+#include <QHash>
 #include <QMap>
+#include <QSet>
 #include <QList>
 #include <QJsonObject>
 #include <QFuture>
 #include <QAbstractTableModel>
+#include <atomic>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <type_traits>
 
 #include "Network.h"
 #include "types.h"
 #include "settings/Settings.h"
 
+class ArchiveExtractor;
+
 namespace translateLocally {
     namespace models {
         enum Location {
@@ -211,6 +219,7 @@ class ModelManager : public QAbstractTableModel {
         Q_OBJECT
 public:
     ModelManager(QObject *parent, Settings *settings);
+    ~ModelManager();
 
     /**
      * @Brief get model by its id
@@ -242,6 +251,18 @@ public:
      */
     std::optional<Model> writeModel(QFile *file, ModelMeta meta = ModelMeta(), QString filename = QString());
 
+    /**
+     * @Brief download a remote model and install it like writeModel() does.
+     * The archive is extracted while it downloads, but the model is only
+     * installed once the download has completed and its checksum matches. On
+     * success, modelDownloaded(Model,QVariant) is emitted with the installed
+     * model and `extradata`. Download errors are reported through `network`'s
+     * error(QString,QVariant) signal, also with `extradata`. An interrupted
+     * download is resumed the next time the same model is downloaded. See
+     * Network::download().
+     */
+    Download *downloadModel(Network *network, Model const &model, QVariant extradata = QVariant());
+
     /**
      * @Brief Tries to delete a model from the getInstalledModels() list. Also
      * removes the files. Only managed models can be deleted this way.
@@ -338,20 +359,83 @@ public slots:
      * @param extradata Optional argument that is indended if we want to pass extra data to the slot
      */
     void fetchRemoteModels(QVariant extradata = QVariant());
+
+    /**
+     * @Brief scans the model directories again, for models that another
+     * instance installed or removed since we last looked. E.g. the GUI while
+     * a daemon is running. Does nothing if none of the directories changed
+     * since then.
+     */
+    void reloadLocalModels();
     
 private:
     void startupLoad();
-    void scanForModels(QString path);
-    bool extractTarGz(QFile *file, QDir const &destination, QStringList &files);
-    bool extractTarGzInCurrentPath(QFile *file, QStringList &files);
+
+    /**
+     * @Brief finds the models in the directories in `path`, and appends them
+     * to `found`. The json files of a directory are only read if it changed
+     * since it was recorded in `cached`. Whatever is found is recorded in
+     * `index`. The names of model archives found are appended to `archives`.
+     */
+    void scanForModels(QString path, QJsonObject const &cached, QJsonObject &index, QList<Model> &found, QStringList &archives);
+
+    /**
+     * @Brief the directories scanForModels() looks in, in order.
+     */
+    QStringList modelDirs() const;
+
+    /**
+     * @Brief modification times of the modelDirs(), to tell whether models
+     * were added or removed.
+     */
+    QString getModelDirsStamp() const;
+
+    /**
+     * @Brief scans all modelDirs() with scanForModels(), and updates the
+     * model index on disk.
+     */
+    QList<Model> scanModelDirs(QStringList &archives);
+
+    /**
+     * @Brief modification times and sizes of a model directory and its json
+     * files, to tell whether the model index is still up to date.
+     */
+    QString getModelDirStamp(QString dir) const;
+
+    /**
+     * @Brief finishes the extraction, and moves the extracted model into the
+     * directory of models managed by this program. Shared by writeModel() and
+     * downloadModel().
+     */
+    std::optional<Model> installModel(ArchiveExtractor &extractor, ModelMeta meta, QString filename);
+
     std::optional<Model> parseModelInfo(QJsonObject& obj, translateLocally::models::Location type=translateLocally::models::Location::Local, QString *error = nullptr);
-    void parseRemoteModels(QJsonObject obj, QString repositoryUrl);
+
+    /**
+     * @Brief parses the listings of all repositories, keyed by repository
+     * url, into a new remoteModels_ list.
+     */
+    void parseRemoteModels(QMap<QString, QJsonObject> const &listings);
+
+    /**
+     * @Brief replaces remoteModels_ and its index, and updates the lists of
+     * new and updated models.
+     */
+    void setRemoteModels(QList<Model> models);
+
+    /**
+     * @Brief where the last listing fetched from a repository is kept, with
+     * its ETag and Last-Modified headers for revalidating it.
+     */
+    QString getRepositoryCachePath(QString url) const;
     QJsonObject getModelInfoJsonFromDir(QString dir, QString *error = nullptr);
 
     /**
      * @Brief gets model metadata from an installed model
      */
     bool readModelMetaFromDir(ModelMeta &model, QString dir) const;
+    QJsonObject getModelMetaJsonFromDir(QString dir) const;
+    void parseModelMeta(ModelMeta &model, QJsonObject const &obj) const;
 
     /**
      * @Brief writes a model's metadata to an installed model.
@@ -365,6 +449,12 @@ private:
      */
     bool insertLocalModel(Model model);
 
+    /**
+     * @Brief insert many models into the localModels_ list at once, e.g. at
+     * startup. Resets any views attached.
+     */
+    void insertLocalModels(QList<Model> const &models);
+
     /**
      * @Brief validate a model, currently by trying to parse the model_info.json
      * file with getModelInfoJsonFromDir(QString) and parseModelInfo(QJsonObject).
@@ -373,11 +463,32 @@ private:
      */
     bool validateModel(QString path);
 
+    /**
+     * @Brief queues writing the prepacked files of the model in `dir`, see
+     * PrepackedModel.h. They're written by a background thread, one model at
+     * a time, as converting a model can take a while.
+     */
+    void prepackModel(QString dir);
+    void prepackLoop();
+
     QDir appDataDir_;
 
+    // Models waiting for prepackModel(), and whether prepackThread_ is
+    // working on them. Guarded by prepackMutex_.
+    std::mutex prepackMutex_;
+    std::deque<QString> prepackQueue_;
+    bool prepacking_;
+    std::thread prepackThread_;
+    std::atomic<bool> prepackCancel_;
+
+    QSet<QString> downloading_; // Partial downloads in use, see downloadModel()
+
     QStringList archives_; // Only archive name, not full path
+    QJsonObject modelIndex_; // What scanForModels() found the last time, by directory
+    QString modelDirsStamp_; // getModelDirsStamp() when we last scanned
     QList<Model> localModels_;
     QList<Model> remoteModels_;
+    QHash<QString, int> remoteIndex_; // Model::id() to its position in remoteModels_
     QList<Model> newModels_;
     QList<Model> updatedModels_;
 
@@ -389,6 +500,7 @@ signals:
     void fetchingRemoteModels();
     void fetchedRemoteModels(QVariant extradata =  QVariant()); // when finished fetching (might be error)
     void localModelsChanged();
+    void modelDownloaded(Model model, QVariant extradata = QVariant());
     void error(QString);
 };
 
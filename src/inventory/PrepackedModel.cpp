@@ -0,0 +1,212 @@
+#include "PrepackedModel.h"
+#include "MarianInterface.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLockFile>
+#include <QSaveFile>
+#include <exception>
+#include <optional>
+#include <vector>
+
+// bergamot-translator
+#include "3rd_party/bergamot-translator/src/translator/parser.h"
+#include "common/io.h"
+#include "data/shortlist.h"
+#include "data/vocab.h"
+
+namespace {
+
+// Bump when what write() produces changes, so older files are made again.
+constexpr int kManifestVersion = 1;
+
+// Inside the model's directory.
+constexpr char kDirName[] = "prepacked";
+
+// Set in the options by apply(), for isPrepacked().
+constexpr char kOptionName[] = "translatelocally-prepacked";
+
+QJsonObject stamp(QString const &path) {
+    QFileInfo info(path);
+    return QJsonObject{
+        {"size", info.size()},
+        {"modified", info.lastModified().toMSecsSinceEpoch()}
+    };
+}
+
+// One manifest per config, as models can have a config per instruction set.
+QString manifestPath(QDir const &dir, QString const &config) {
+    return dir.filePath(QString("%1/%2.json").arg(kDirName, QFileInfo(config).completeBaseName()));
+}
+
+// Whether all files listed in `files` are still the way they were recorded.
+bool unchanged(QDir const &dir, QJsonObject const &files) {
+    for (QString const &name : files.keys())
+        if (!QFileInfo::exists(dir.filePath(name)) || stamp(dir.filePath(name)) != files.value(name).toObject())
+            return false;
+    return true;
+}
+
+// The manifest of the prepacked files made from `config`, if they're there
+// and both they and the files they were made from are unchanged.
+std::optional<QJsonObject> readManifest(QDir const &dir, QString const &config) {
+    QFile file(manifestPath(dir, config));
+    if (!file.open(QIODevice::ReadOnly))
+        return std::nullopt;
+
+    QJsonObject manifest = QJsonDocument::fromJson(file.readAll()).object();
+    if (manifest.value("version").toInt() != kManifestVersion
+        || !manifest.value("sources").toObject().contains(dir.relativeFilePath(config))
+        || !unchanged(dir, manifest.value("sources").toObject())
+        || !unchanged(dir, manifest.value("files").toObject()))
+        return std::nullopt;
+
+    return manifest;
+}
+
+// Moves a file that was written under a temporary name into place.
+bool replace(QString const &from, QString const &to) {
+    QFile::remove(to);
+    return QFile::rename(from, to);
+}
+
+} // Anonymous namespace
+
+namespace prepacked {
+
+bool write(QString const &modelDir, std::atomic<bool> const &cancel, QString *error) {
+    auto fail = [&](QString message) {
+        if (error)
+            *error = message;
+        return false;
+    };
+
+    QDir dir(modelDir);
+    QString config = QString::fromStdString(modelConfigPath(modelDir.toStdString()));
+    if (!QFileInfo::exists(config))
+        return fail(QString("Could not find the config of the model in %1").arg(modelDir));
+
+    if (readManifest(dir, config))
+        return true;
+
+    if (!dir.mkpath(kDirName))
+        return fail(QString("Could not create %1").arg(dir.filePath(kDirName)));
+
+    // Processes that find another one at it leave it to that one. A lock of a
+    // process that died is taken over.
+    QLockFile lock(dir.filePath(QString("%1/.lock").arg(kDirName)));
+    lock.setStaleLockTime(0);
+    if (!lock.tryLock(0))
+        return true;
+
+    try {
+        std::shared_ptr<marian::Options> options(marian::bergamot::parseOptionsFromFilePath(config.toStdString()));
+
+        QJsonObject manifest{{"version", kManifestVersion}};
+        QJsonObject sources{{dir.relativeFilePath(config), stamp(config)}};
+        QJsonObject files;
+
+        auto models = options->get<std::vector<std::string>>("models");
+        if (models.size() != 1)
+            return fail(QString("Can only prepack a single model, not an ensemble, in %1").arg(modelDir));
+
+        QString model = QString::fromStdString(models[0]);
+        sources.insert(dir.relativeFilePath(model), stamp(model));
+
+        if (model.endsWith(".bin")) {
+            // Already in the binary format, nothing to convert.
+            manifest.insert("model", dir.relativeFilePath(model));
+        } else if (model.endsWith(".npz")) {
+            QString target = dir.filePath(QString("%1/model.bin").arg(kDirName));
+            QString part = dir.filePath(QString("%1/model.part.bin").arg(kDirName)); // Has to end in .bin for saveItems()
+            marian::io::saveItems(part.toStdString(), marian::io::loadItems(model.toStdString()));
+            if (!replace(part, target))
+                return fail(QString("Could not write %1").arg(target));
+            manifest.insert("model", dir.relativeFilePath(target));
+            files.insert(dir.relativeFilePath(target), stamp(target));
+        } else {
+            return fail(QString("Don't know how to prepack %1").arg(model));
+        }
+
+        if (cancel)
+            return fail(QString("Cancelled prepacking %1").arg(modelDir));
+
+        if (options->hasAndNotEmpty("shortlist")) {
+            auto shortlist = options->get<std::vector<std::string>>("shortlist");
+            QString source = QString::fromStdString(shortlist[0]);
+            sources.insert(dir.relativeFilePath(source), stamp(source));
+
+            if (marian::data::isBinaryShortlist(shortlist[0])) {
+                manifest.insert("shortlist", dir.relativeFilePath(source));
+            } else {
+                auto vocabPaths = options->get<std::vector<std::string>>("vocabs");
+                if (vocabPaths.size() < 2)
+                    return fail(QString("Expected a source and a target vocabulary in %1").arg(config));
+
+                auto srcVocab = marian::New<marian::Vocab>(options, 0);
+                srcVocab->load(vocabPaths[0]);
+                auto trgVocab = marian::New<marian::Vocab>(options, 1);
+                trgVocab->load(vocabPaths[1]);
+
+                QString target = dir.filePath(QString("%1/shortlist.bin").arg(kDirName));
+                QString part = dir.filePath(QString("%1/shortlist.part.bin").arg(kDirName));
+                marian::data::BinaryShortlistGenerator generator(options, srcVocab, trgVocab, 0, 1, vocabPaths[0] == vocabPaths[1]);
+                generator.dump(part.toStdString());
+                if (!replace(part, target))
+                    return fail(QString("Could not write %1").arg(target));
+                manifest.insert("shortlist", dir.relativeFilePath(target));
+                files.insert(dir.relativeFilePath(target), stamp(target));
+            }
+        }
+
+        manifest.insert("sources", sources);
+        manifest.insert("files", files);
+
+        // Last, as it's what makes apply() use the files.
+        QSaveFile manifestFile(manifestPath(dir, config));
+        if (!manifestFile.open(QIODevice::WriteOnly)
+            || manifestFile.write(QJsonDocument(manifest).toJson()) < 0
+            || !manifestFile.commit())
+            return fail(QString("Could not write %1: %2").arg(manifestFile.fileName(), manifestFile.errorString()));
+    } catch (const std::exception &e) {
+        return fail(QString("Could not prepack %1: %2").arg(modelDir, QString::fromStdString(e.what())));
+    }
+
+    return true;
+}
+
+bool isValid(QString const &modelDir) {
+    QString config = QString::fromStdString(modelConfigPath(modelDir.toStdString()));
+    return readManifest(QDir(modelDir), config).has_value();
+}
+
+bool apply(std::string const &modelDir, marian::Options &options) {
+    QDir dir(QString::fromStdString(modelDir));
+    std::optional<QJsonObject> manifest = readManifest(dir, QString::fromStdString(modelConfigPath(modelDir)));
+    if (!manifest)
+        return false;
+
+    auto path = [&](QString const &key) {
+        return QDir::cleanPath(dir.absoluteFilePath(manifest->value(key).toString())).toStdString();
+    };
+
+    options.set("models", std::vector<std::string>{path("model")});
+
+    if (manifest->contains("shortlist") && options.hasAndNotEmpty("shortlist")) {
+        auto shortlist = options.get<std::vector<std::string>>("shortlist");
+        shortlist[0] = path("shortlist");
+        options.set("shortlist", shortlist);
+    }
+
+    options.set(kOptionName, true);
+    return true;
+}
+
+bool isPrepacked(marian::Options const &options) {
+    return options.get<bool>(kOptionName, false);
+}
+
+} // namespace prepacked
@@ -0,0 +1,54 @@
+#pragma once
+#include <QString>
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace marian {
+    class Options;
+}
+
+/**
+ * Models in a form that loads without any conversion: the weights in marian's
+ * binary format, in which every tensor is aligned so it can be used straight
+ * from the file's memory, and the shortlist in its binary format too. Models
+ * that ship with .npz weights or a text shortlist are converted once, when
+ * they're installed or by the upgrade pass at startup, into the `prepacked`
+ * directory inside the model's directory.
+ *
+ * A manifest next to the converted files records the size and modification
+ * time of the files they were made from, so they're only used while they
+ * still match. Otherwise the model is loaded from its own files as before.
+ */
+namespace prepacked {
+
+/**
+ * @brief Writes the prepacked files for the model variant modelConfigPath()
+ * picks for this CPU, unless they're there and up to date already. Does
+ * nothing if another process is busy doing the same. Files are written under
+ * a temporary name, and the manifest last, so a model is never loaded from
+ * half written files. Checks `cancel` in between the files.
+ * @return false, with `error` set, if the model couldn't be prepacked.
+ */
+bool write(QString const &modelDir, std::atomic<bool> const &cancel, QString *error = nullptr);
+
+/**
+ * @brief Whether the model in `modelDir` has up to date prepacked files.
+ */
+bool isValid(QString const &modelDir);
+
+/**
+ * @brief Points `options`, as read from the config of the model in
+ * `modelDir`, at the prepacked files, if they're up to date, and marks them
+ * as such for isPrepacked().
+ * @return whether it did.
+ */
+bool apply(std::string const &modelDir, marian::Options &options);
+
+/**
+ * @brief Whether apply() has pointed `options` at prepacked files. Only then
+ * can the model be loaded from memory, see makeTranslationModel().
+ */
+bool isPrepacked(marian::Options const &options);
+
+} // namespace prepacked
@@ -1,6 +1,8 @@
 #include "mainwindow.h"
 #include "version.h"
 #include "3rd_party/bergamot-translator/3rd_party/marian-dev/src/marian.h"
+#include "CpuFeatures.h"
+#include "Instrumentation.h"
 #include "Translation.h"
 
 #include <QApplication>
@@ -8,6 +10,7 @@
 #include <QTimer>
 #include "cli/CLIParsing.h"
 #include "cli/CommandLineIface.h"
+#include "cli/Daemon.h"
 #include "cli/NativeMsgIface.h"
 #include "types.h"
 
@@ -20,6 +23,7 @@ int main(int argc, char *argv[])
     qRegisterMetaType<Translation>("Translation");
     qRegisterMetaType<QVector<WordAlignment>>("QVector<WordAlignment>");
     qRegisterMetaType<Translation::Direction>("Translation::Direction");
+    qRegisterMetaType<translateLocally::marianSettings>("translateLocally::marianSettings");
 #if (QT_VERSION < QT_VERSION_CHECK(6, 0, 0)) // https://www.qt.io/blog/whats-new-in-qmetatype-qvariant
     qRegisterMetaTypeStreamOperators<translateLocally::Repository>("translateLocally::Repository");
     qRegisterMetaTypeStreamOperators<QMap<QString,translateLocally::Repository>>("QMap<QString,translateLocally::Repository>");
@@ -39,6 +43,14 @@ int main(int argc, char *argv[])
         if (!parser.isSet("debug"))
              QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
 
+        qDebug() << "Best instruction set supported by this CPU:" << cpu::name(cpu::detect());
+
+        // Browsers start the native messaging host without our arguments, so
+        // the trace can also be asked for through the environment.
+        QString trace = parser.isSet("trace") ? parser.value("trace") : QString::fromLocal8Bit(qgetenv("TRANSLATELOCALLY_TRACE"));
+        if (!trace.isEmpty() && !instrumentation::openTrace(trace))
+            qWarning() << "Could not open trace file" << trace;
+
         // Launch application unless we're supposed to be in CLI mode
         translateLocally::AppType runtime = translateLocally::runType(parser);
         switch (runtime) {
@@ -50,6 +62,13 @@ int main(int argc, char *argv[])
                 QObject::connect(nativeMSG, &NativeMsgIface::finished, &translateLocally, &QCoreApplication::quit);
                 QTimer::singleShot(0, nativeMSG, &NativeMsgIface::run);
                 return translateLocally.exec();
+        }
+            case translateLocally::AppType::Daemon:
+        {
+                Daemon daemon;
+                if (!daemon.listen())
+                    return 1;
+                return translateLocally.exec();
         }
             case translateLocally::AppType::GUI:
                 break; //Handled later outside this scope.
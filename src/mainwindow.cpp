@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <functional>
+#include "FileTranslator.h"
 #include "MarianInterface.h"
 
 #include <QtNetwork/QNetworkAccessManager>
@@ -13,6 +14,8 @@
 #include <QSettings>
 #include <QSaveFile>
 #include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
 #include <QMessageBox>
 #include <QFontDialog>
 #include <QSignalBlocker>
@@ -20,11 +23,14 @@
 #include <QStandardPaths>
 #include <QWindow>
 #include "Translation.h"
+#include "TranslationScheduler.h"
 #include "cli/NativeMsgManager.h"
 #include "logo/logo_svg.h"
 #include <iostream>
 #include <QScrollBar>
 #include <QMessageBox>
+#include <QProgressBar>
+#include <QPushButton>
 
 namespace {
     void addDisabledItem(QComboBox *combobox, QString label) {
@@ -47,6 +53,8 @@ MainWindow::MainWindow(QWidget *parent)
     , translatorSettingsDialog_(this, &settings_, &models_)
     , network_(this)
     , translator_(new MarianInterface(this))
+    , scheduler_(new TranslationScheduler(this))
+    , fileTranslator_(new FileTranslator(this))
     , alignmentWorker_(new AlignmentWorker(this))
 {
     ui_->setupUi(this);
@@ -59,6 +67,14 @@ MainWindow::MainWindow(QWidget *parent)
     ui_->statusbar->addPermanentWidget(ui_->pendingIndicator);
     ui_->pendingIndicator->hide();
 
+    // Progress of translating a file, with a way to stop it
+    fileProgress_ = new QProgressBar(this);
+    fileProgress_->setMaximumWidth(300);
+    cancelFileButton_ = new QPushButton(tr("Cancel"), this);
+    ui_->statusbar->addPermanentWidget(fileProgress_);
+    ui_->statusbar->addPermanentWidget(cancelFileButton_);
+    showFileProgress(false);
+
     // Hide download progress bar
     showDownloadPane(false);
 
@@ -110,7 +126,7 @@ MainWindow::MainWindow(QWidget *parent)
     // Network is only used for downloading models
     connect(&network_, &Network::error, this, &MainWindow::popupError); // All errors from the network class will be propagated to the GUI
     connect(&network_, &Network::progressBar, this, &MainWindow::downloadProgress);
-    connect(&network_, &Network::downloadComplete, this, &MainWindow::handleDownload);
+    connect(&models_, &ModelManager::modelDownloaded, this, &MainWindow::handleDownload);
 
     // Make downloading from the settings window.
     connect(&translatorSettingsDialog_, &TranslatorSettingsDialog::downloadModel, this, &MainWindow::downloadModelHelperSlot);
@@ -118,8 +134,13 @@ MainWindow::MainWindow(QWidget *parent)
     // Set up the connection to the translator
     connect(translator_, &MarianInterface::pendingChanged, ui_->pendingIndicator, &QProgressBar::setVisible);
     connect(translator_, &MarianInterface::error, this, &MainWindow::popupError);
+    connect(translator_, &MarianInterface::error, scheduler_, &TranslationScheduler::translationFinished);
+    connect(scheduler_, &TranslationScheduler::translate, this, [&](bool preempt) {
+        translate(ui_->inputBox->toPlainText(), preempt);
+    });
     connect(translator_, &MarianInterface::translationReady, this, [&](Translation translation) {
         translation_ = translation;
+        scheduler_->translationFinished();
         
         {   
             // setPlainText() triggers a scrollpos reset to 0. We don't want
@@ -143,14 +164,61 @@ MainWindow::MainWindow(QWidget *parent)
         ui_->translateAction->setEnabled(true); // Re-enable button after translation is done
         ui_->translateButton->setEnabled(true);
         if (translation_.wordsPerSecond() > 0) { // Display the translation speed only if it's > 0. This prevents the user seeing weird number if pressed translate with empty input
-            ui_->statusbar->showMessage(tr("Translation speed: %1 words per second.").arg(translation_.wordsPerSecond()));
+            Translation::Timings const &timings = translation_.timings();
+            ui_->statusbar->showMessage(tr("Translation speed: %1 words per second. Queued %2 ms, translated in %3 ms, postprocessed in %4 ms.")
+                .arg(translation_.wordsPerSecond())
+                .arg(qRound(timings.queue))
+                .arg(qRound(timings.translate))
+                .arg(qRound(timings.postprocess)));
         } else {
             ui_->statusbar->clearMessage();
         }
     });
 
+    // Show what's translated of a long text already. Only the text, the
+    // alignments wait for the whole translation in translationReady.
+    connect(translator_, &MarianInterface::translationUpdated, this, [&](Translation partial) {
+        // The last translation no longer matches the output, so alignments
+        // are off until translationReady: drop it, and its highlights.
+        translation_ = Translation();
+        if (highlighter_) {
+            QSignalBlocker inputBlocker(ui_->inputBox);
+            QSignalBlocker outputBlocker(ui_->outputBox);
+            highlighter_->highlight(QVector<WordAlignment>());
+        }
+
+        {
+            QSignalBlocker blocker(ui_->outputBox->verticalScrollBar());
+            ui_->outputBox->setPlainText(partial.translation() + QString("\n"));
+        }
+
+        if (settings_.syncScrolling())
+            ::copyScrollPosition(ui_->inputBox, ui_->outputBox);
+    });
+
+    connect(cancelFileButton_, &QPushButton::clicked, fileTranslator_, &FileTranslator::cancel);
+    connect(fileTranslator_, &FileTranslator::progress, this, [&](qint64 done, qint64 total, int wordsPerSecond) {
+        // Scaled down, as QProgressBar only does int.
+        fileProgress_->setMaximum(1000);
+        fileProgress_->setValue(total > 0 ? static_cast<int>(done * 1000 / total) : 0);
+        fileProgress_->setFormat(tr("%p% (%1 words per second)").arg(wordsPerSecond));
+    });
+    connect(fileTranslator_, &FileTranslator::finished, this, [&](QString output) {
+        showFileProgress(false);
+        ui_->statusbar->showMessage(tr("Translation written to %1.").arg(QDir::toNativeSeparators(output)));
+    });
+    connect(fileTranslator_, &FileTranslator::cancelled, this, [&] {
+        showFileProgress(false);
+        ui_->statusbar->showMessage(tr("Translation cancelled."));
+    });
+    connect(fileTranslator_, &FileTranslator::error, this, [&](QString message) {
+        showFileProgress(false);
+        popupError(message);
+    });
+
     connect(alignmentWorker_, &AlignmentWorker::ready, this, [&](QVector<WordAlignment> alignments, Translation::Direction direction) {
-        if (!highlighter_)
+        // Also when a partial translation came in since it was asked for.
+        if (!highlighter_ || !translation_)
             return;
 
         if (direction == Translation::source_to_translation) {
@@ -230,6 +298,15 @@ MainWindow::MainWindow(QWidget *parent)
     // Connect translator setting changes to reloading the model.
     connect(&settings_.cores, &Setting::valueChanged, this, &MainWindow::resetTranslator);
     connect(&settings_.workspace, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+    connect(&settings_.tunedSettings, &Setting::valueChanged, this, &MainWindow::resetTranslator);
+
+    // Unload the model when it's not used for a while, and stay within budget
+    bind(settings_.idleUnloadTimeout, [&](unsigned int minutes) {
+        translator_->setIdleTimeout(std::chrono::minutes(minutes));
+    });
+    bind(settings_.memoryBudget, [&](unsigned int megabytes) {
+        translator_->setMemoryBudget(static_cast<std::size_t>(megabytes) * 1024 * 1024);
+    });
 
     // Connect model changes to reloading model and trigger initial loading of model
     bind(settings_.translationModel, std::bind(&MainWindow::resetTranslator, this));
@@ -289,9 +366,59 @@ void MainWindow::on_translateButton_clicked() {
     translate();
 }
 
+void MainWindow::on_translateFileAction_triggered() {
+    if (fileTranslator_->isRunning())
+        return;
+
+    auto model = models_.getModelForPath(settings_.translationModel());
+    if (!model || !model->isLocal()) {
+        popupError(tr("Select a translation model first."));
+        return;
+    }
+
+    QString input = QFileDialog::getOpenFileName(this, tr("Translate File"), QString(), tr("Text files (*.txt);;HTML files (*.html *.htm);;All files (*)"));
+    if (input.isEmpty())
+        return;
+
+    // Suggest the same name, with the target language in it: notes.txt
+    // becomes notes.de.txt.
+    QFileInfo info(input);
+    QString suggestion = info.dir().filePath(info.completeBaseName() + "." + model->trgTag + (info.suffix().isEmpty() ? QString() : "." + info.suffix()));
+
+    QString output = QFileDialog::getSaveFileName(this, tr("Save Translation"), suggestion);
+    if (output.isEmpty())
+        return;
+
+    if (QFileInfo(output).canonicalFilePath() == info.canonicalFilePath()) {
+        popupError(tr("The translation can't overwrite the file being translated."));
+        return;
+    }
+
+    bool HTML = info.suffix().compare("html", Qt::CaseInsensitive) == 0 || info.suffix().compare("htm", Qt::CaseInsensitive) == 0;
+
+    fileTranslator_->start(FileTranslator::Job{
+        model->path,
+        settings_.marianSettings(model->path),
+        input,
+        output,
+        HTML,
+        settings_.persistentCache() ? static_cast<qint64>(settings_.persistentCacheSize()) * 1024 * 1024 : 0
+    });
+
+    fileProgress_->setMaximum(0); // Busy until the first chunk is done
+    fileProgress_->setFormat(tr("Loading model…"));
+    showFileProgress(true);
+}
+
+void MainWindow::showFileProgress(bool visible) {
+    fileProgress_->setVisible(visible);
+    cancelFileButton_->setVisible(visible);
+    ui_->translateFileAction->setEnabled(!visible);
+}
+
 void MainWindow::on_inputBox_textChanged() {
     if (settings_.translateImmediately())
-        translate();
+        scheduler_->inputChanged(ui_->inputBox->document()->characterCount());
 }
 
 void MainWindow::showDownloadPane(bool visible)
@@ -304,13 +431,8 @@ void MainWindow::showDownloadPane(bool visible)
     ui_->modelPane->setVisible(!visible);
 }
 
-void MainWindow::handleDownload(QFile *file, QString filename, QVariant extra) {
-    ModelMeta meta = extra.value<ModelMeta>();
-    meta.installedOn = QDateTime::currentDateTimeUtc();
-    auto model = models_.writeModel(file, meta, filename);
-    if (model) { // if writeModel didn't fail
-        settings_.translationModel.setValue(model->path, Setting::AlwaysEmit);
-    }
+void MainWindow::handleDownload(Model model) {
+    settings_.translationModel.setValue(model.path, Setting::AlwaysEmit);
 }
 
 void MainWindow::downloadProgress(qint64 ist, qint64 max) {
@@ -324,23 +446,18 @@ void MainWindow::downloadModel(Model model) {
     ui_->cancelDownloadButton->setEnabled(true);
     showDownloadPane(true);
 
-    // Pass on meta info about the model so we remember once we've downloaded it
-    ModelMeta meta;
-    meta.modelUrl = model.url;
-    meta.repositoryUrl = model.repositoryUrl;
-
     qDebug() << "Downloading:" << model;
 
-    QNetworkReply *reply = network_.downloadFile(model.url, QCryptographicHash::Sha256, model.checksum, QVariant::fromValue(meta));
-    // If downloadFile could not create a temporary file, abort. network_ will
-    // have emitted an error(QString) already so no need to notify.
-    if (reply == nullptr) {
+    Download *download = models_.downloadModel(&network_, model);
+    // If downloadModel could not create a temporary directory, abort. network_
+    // will have emitted an error(QString) already so no need to notify.
+    if (download == nullptr) {
         showDownloadPane(false);
         return;
     }
     
-    connect(ui_->cancelDownloadButton, &QPushButton::clicked, reply, &QNetworkReply::abort);
-    connect(reply, &QNetworkReply::finished, this, [&]() {
+    connect(ui_->cancelDownloadButton, &QPushButton::clicked, download, &Download::abort);
+    connect(download, &Download::finished, this, [&]() {
         showDownloadPane(false);
     });
 }
@@ -445,7 +562,10 @@ void MainWindow::translate() {
     translate(ui_->inputBox->toPlainText());
 }
 
-void MainWindow::translate(QString const &text) {
+void MainWindow::translate(QString const &text, bool preempt) {
+    // Whatever the scheduler was waiting for, we're translating now.
+    scheduler_->cancel();
+
     ui_->translateAction->setEnabled(false); //Disable the translate button before the translation finishes
     ui_->translateButton->setEnabled(false);
     if (translator_->model().isEmpty()) {
@@ -456,13 +576,13 @@ void MainWindow::translate(QString const &text) {
             ui_->localModels->showPopup(); // Makes it a bit more intuitive for the user to know what to do
         }
     } else {
-        translator_->translate(text);
+        translator_->translate(text, false, preempt);
     }    
 }
 
 void MainWindow::resetTranslator() {
     // Note: settings_.translationModel() can be empty string, meaning unload the current model
-    translator_->setModel(settings_.translationModel(), settings_.marianSettings());
+    translator_->setModel(settings_.translationModel(), settings_.marianSettings(settings_.translationModel()));
     
     // Schedule re-translation immediately if we're in automatic mode.
     if (!settings_.translationModel().isEmpty() && settings_.translateImmediately())
@@ -10,7 +10,11 @@
 #include "settings/TranslatorSettingsDialog.h"
 #include "settings/Settings.h"
 
+class FileTranslator;
 class MarianInterface;
+class QProgressBar;
+class QPushButton;
+class TranslationScheduler;
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -25,7 +29,7 @@ public:
     ~MainWindow();
     // Network temporaries until I figure out a better way
     void onResult(QJsonObject obj);
-    void handleDownload(QFile *file, QString filename, QVariant extra);
+    void handleDownload(Model model);
     void downloadProgress(qint64 ist, qint64 max);
     void updateModelSettings(size_t memory, size_t cores);
 
@@ -52,6 +56,8 @@ private slots:
 
     void on_translateButton_clicked();
 
+    void on_translateFileAction_triggered();
+
     void on_fontAction_triggered();
 
     void on_actionTranslator_Settings_triggered();
@@ -68,7 +74,7 @@ private slots:
 
     void translate();
 
-    void translate(QString const &input);
+    void translate(QString const &input, bool preempt = false);
 
     void updateLocalModels();
 
@@ -93,8 +99,16 @@ private:
 
     // Translator related settings
     QPointer<MarianInterface> translator_;
+    QPointer<TranslationScheduler> scheduler_;
     Translation translation_;
 
+    // Translating whole files in the background, see FileTranslator. Its
+    // progress is shown in the status bar.
+    QPointer<FileTranslator> fileTranslator_;
+    QPointer<QProgressBar> fileProgress_;
+    QPointer<QPushButton> cancelFileButton_;
+    void showFileProgress(bool visible);
+
     void resetTranslator();
     void showDownloadPane(bool visible);
     void downloadModel(Model model);
@@ -19,6 +19,15 @@ Settings::Settings(QObject *parent)
 , syncScrolling(backing_, "sync_scrolling", true)
 , windowGeometry(backing_, "window_geometry")
 , cacheTranslations(backing_, "cache_translations", true)
+, translationCacheSize(backing_, "translation_cache_size", translateLocally::kDefaultTranslationCacheSize)
+, miniBatchWords(backing_, "mini_batch_words", 1000)
+, modelPoolMemory(backing_, "model_pool_memory", 1024)
+, idleUnloadTimeout(backing_, "idle_unload_timeout", 15)
+, memoryBudget(backing_, "memory_budget", 0)
+, numaShards(backing_, "numa_shards", false)
+, tunedSettings(backing_, "tuned_settings")
+, persistentCache(backing_, "persistent_cache", true)
+, persistentCacheSize(backing_, "persistent_cache_size", 256)
 , repos(backing_, "newrepos", QMap<QString, translateLocally::Repository>{{translateLocally::kDefaultRepositoryURL, translateLocally::Repository{
                                                                                  translateLocally::kDefaultRepositoryName,
                                                                                  translateLocally::kDefaultRepositoryURL,
@@ -36,6 +45,32 @@ translateLocally::marianSettings Settings::marianSettings() const {
     return {
         cores.value(),
         workspace.value(),
-        cacheTranslations.value()
+        cacheTranslations.value(),
+        translationCacheSize.value(),
+        miniBatchWords.value()
     };
 }
+
+translateLocally::marianSettings Settings::marianSettings(QString const &modelPath) const {
+    translateLocally::marianSettings settings = marianSettings();
+
+    QVariantMap tuned = tunedSettings.value().value(modelPath).toMap();
+    if (tuned.contains("cpu_threads"))
+        settings.cpu_threads = tuned.value("cpu_threads").toUInt();
+    if (tuned.contains("workspace"))
+        settings.workspace = tuned.value("workspace").toUInt();
+    if (tuned.contains("mini_batch_words"))
+        settings.mini_batch_words = tuned.value("mini_batch_words").toUInt();
+
+    return settings;
+}
+
+void Settings::setTunedSettings(QString const &modelPath, translateLocally::marianSettings const &settings) {
+    QVariantMap tuned = tunedSettings.value();
+    tuned[modelPath] = QVariantMap{
+        {"cpu_threads", static_cast<unsigned int>(settings.cpu_threads)},
+        {"workspace", static_cast<unsigned int>(settings.workspace)},
+        {"mini_batch_words", static_cast<unsigned int>(settings.mini_batch_words)}
+    };
+    tunedSettings.setValue(tuned);
+}
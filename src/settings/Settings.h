@@ -96,6 +96,10 @@ public:
     // For easy passing through of marian-related settings
     translateLocally::marianSettings marianSettings() const;
 
+    // Same, but with the settings found by AutoTuner for this model, if any
+    translateLocally::marianSettings marianSettings(QString const &modelPath) const;
+    void setTunedSettings(QString const &modelPath, translateLocally::marianSettings const &settings);
+
     SettingImpl<bool> translateImmediately;
     SettingImpl<QString> translationModel;
     SettingImpl<unsigned int> cores;
@@ -106,6 +110,15 @@ public:
     SettingImpl<bool> syncScrolling;
     SettingImpl<QByteArray> windowGeometry;
     SettingImpl<bool> cacheTranslations;
+    SettingImpl<unsigned int> translationCacheSize; // Number of entries
+    SettingImpl<unsigned int> miniBatchWords;
+    SettingImpl<unsigned int> modelPoolMemory; // In MB
+    SettingImpl<unsigned int> idleUnloadTimeout; // In minutes, 0 keeps models loaded
+    SettingImpl<unsigned int> memoryBudget; // Resident set size in MB, 0 for no limit
+    SettingImpl<bool> numaShards; // A translation service per NUMA node, see ShardedService
+    SettingImpl<QVariantMap> tunedSettings; // By model path
+    SettingImpl<bool> persistentCache;
+    SettingImpl<unsigned int> persistentCacheSize; // In MB
     SettingImpl<QMap<QString, translateLocally::Repository>> repos;
     SettingImpl<QSet<QString>> nativeMessagingClients;
 };
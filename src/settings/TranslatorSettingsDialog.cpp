@@ -10,6 +10,7 @@
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QInputDialog>
+#include <QProgressDialog>
 
 
 TranslatorSettingsDialog::TranslatorSettingsDialog(QWidget *parent, Settings *settings, ModelManager *modelManager)
@@ -19,6 +20,7 @@ TranslatorSettingsDialog::TranslatorSettingsDialog(QWidget *parent, Settings *se
 , modelManager_(modelManager)
 , modelProxy_(this)
 , repositoryModel_(this)
+, autotuner_(this)
 {
     ui_->setupUi(this);
 
@@ -98,6 +100,8 @@ void TranslatorSettingsDialog::updateSettings()
 {
     ui_->coresBox->setCurrentIndex(ui_->coresBox->findData(settings_->cores()));
     ui_->memoryBox->setCurrentIndex(ui_->memoryBox->findData(settings_->workspace()));
+    shownCores_ = ui_->coresBox->currentData();
+    shownWorkspace_ = ui_->memoryBox->currentData();
     ui_->translateImmediatelyCheckbox->setChecked(settings_->translateImmediately());
     ui_->showAligmentsCheckbox->setChecked(settings_->showAlignment());
     ui_->alignmentColorButton->setColor(settings_->alignmentColor());
@@ -108,8 +112,19 @@ void TranslatorSettingsDialog::updateSettings()
 
 void TranslatorSettingsDialog::applySettings()
 {
-    settings_->cores.setValue(ui_->coresBox->currentData().toUInt());
-    settings_->workspace.setValue(ui_->memoryBox->currentData().toUInt());
+    // Picking threads or memory by hand overrides what was found for models
+    // by auto-tuning. Compared to what the boxes showed, as a setting that
+    // isn't one of the options shows as nothing selected.
+    bool coresChanged = ui_->coresBox->currentData() != shownCores_;
+    bool workspaceChanged = ui_->memoryBox->currentData() != shownWorkspace_;
+
+    if (coresChanged || workspaceChanged)
+        settings_->tunedSettings.setValue(QVariantMap());
+
+    if (coresChanged)
+        settings_->cores.setValue(ui_->coresBox->currentData().toUInt());
+    if (workspaceChanged)
+        settings_->workspace.setValue(ui_->memoryBox->currentData().toUInt());
     settings_->translateImmediately.setValue(ui_->translateImmediatelyCheckbox->isChecked());
     settings_->showAlignment.setValue(ui_->showAligmentsCheckbox->isChecked());
     settings_->alignmentColor.setValue(ui_->alignmentColorButton->color());
@@ -262,3 +277,52 @@ void TranslatorSettingsDialog::on_getMoreButton_clicked()
     modelManager_->fetchRemoteModels();
     ui_->getMoreButton->setEnabled(false);
 }
+
+
+void TranslatorSettingsDialog::on_autotuneButton_clicked()
+{
+    QString modelPath = settings_->translationModel();
+    if (modelPath.isEmpty()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Select a model to find the fastest settings for first."));
+        return;
+    }
+
+    QProgressDialog progress(tr("Measuring translation speed with different settings…"), tr("Cancel"), 0, 0, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(0);
+
+    // Stop right away, instead of only once the dialog is closed. Any signal
+    // that was already on its way is ignored below.
+    connect(&progress, &QProgressDialog::canceled, &autotuner_, &AutoTuner::cancel);
+
+    connect(&autotuner_, &AutoTuner::progress, &progress, [&](int done, int total) {
+        if (progress.wasCanceled())
+            return;
+        progress.setMaximum(total);
+        progress.setValue(done);
+    });
+
+    connect(&autotuner_, &AutoTuner::finished, &progress, [&](translateLocally::marianSettings settings, double wordsPerSecond) {
+        if (progress.wasCanceled())
+            return;
+        settings_->setTunedSettings(modelPath, settings);
+        progress.reset();
+        QMessageBox::information(this, tr("Fastest settings"),
+            tr("This model is fastest with %1 threads, %2 MB memory per thread and batches of %3 words, at %4 words per second. These settings will be used for it from now on.")
+                .arg(settings.cpu_threads).arg(settings.workspace).arg(settings.mini_batch_words).arg(static_cast<int>(wordsPerSecond)));
+    });
+
+    connect(&autotuner_, &AutoTuner::error, &progress, [&](QString message) {
+        if (progress.wasCanceled())
+            return;
+        progress.reset();
+        QMessageBox::warning(this, tr("Error"), message);
+    });
+
+    autotuner_.start(modelPath, settings_->marianSettings());
+    progress.exec();
+
+    // Cancelled, or done. Either way, stop listening: progress is gone.
+    autotuner_.cancel();
+    disconnect(&autotuner_, nullptr, &progress, nullptr);
+}
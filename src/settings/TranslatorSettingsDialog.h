@@ -5,6 +5,7 @@
 #include <QItemSelection>
 #include <QSortFilterProxyModel>
 #include "Settings.h"
+#include "AutoTuner.h"
 #include "inventory/ModelManager.h"
 #include "settings/RepositoryTableModel.h"
 
@@ -39,6 +40,8 @@ private slots:
 
     void on_getMoreButton_clicked();
 
+    void on_autotuneButton_clicked();
+
 signals:
     void downloadModel(Model model);
 
@@ -49,6 +52,11 @@ private:
     ModelManager *modelManager_;
     QSortFilterProxyModel modelProxy_;
     RepositoryTableModel repositoryModel_;
+    AutoTuner autotuner_;
+
+    // What the cores and memory boxes showed after updateSettings()
+    QVariant shownCores_;
+    QVariant shownWorkspace_;
 };
 
 #endif // TRANSLATORSETTINGS_H
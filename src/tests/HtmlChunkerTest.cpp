@@ -0,0 +1,204 @@
+/**
+ * translateLocally-tests: checks that HtmlChunker splits HTML into the
+ * expected number of chunks, only between block-level elements, that each
+ * chunk of a well-formed document is balanced on its own, and that stripping
+ * the tags it added from each chunk and joining them gives back the document
+ * it started with. Run with `make translateLocally-tests && ctest`.
+ */
+#include "cli/ChunkReader.h"
+#include "cli/HtmlChunker.h"
+
+#include <QTemporaryFile>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Never more tags reopened at the start of a chunk than the test documents nest.
+constexpr std::size_t kMaxDepth = 4;
+
+// The block-level elements in the test documents. A chunk may only end right
+// before one of their opening tags, or right after one of their closing tags.
+const char *const kBlockElements[] = {
+    "body", "dd", "div", "dl", "dt", "html", "li", "p", "table", "td", "tr", "ul",
+};
+
+const char *const kVoidElements[] = {
+    "br", "hr", "img", "input", "link", "meta",
+};
+
+const char *const kRawTextElements[] = {
+    "script", "style",
+};
+
+int failures = 0;
+
+void fail(const char *name, std::string const &message) {
+    std::fprintf(stderr, "FAIL %s: %s\n", name, message.c_str());
+    ++failures;
+}
+
+template <std::size_t N>
+bool contains(const char *const (&names)[N], std::string const &name) {
+    return std::any_of(std::begin(names), std::end(names), [&](const char *element) {
+        return name == element;
+    });
+}
+
+// Lower case name of the tag starting at `pos` (just after the '<' or '</').
+std::string tagName(std::string const &text, std::size_t pos) {
+    std::string name;
+    while (pos < text.size() && std::isalnum(static_cast<unsigned char>(text[pos])))
+        name.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(text[pos++]))));
+    return name;
+}
+
+// The '>' ending the tag at `pos`, skipping over quoted attribute values.
+std::size_t tagEnd(std::string const &text, std::size_t pos) {
+    char quote = 0;
+    for (; pos < text.size(); ++pos) {
+        if (quote) {
+            if (text[pos] == quote)
+                quote = 0;
+        } else if (text[pos] == '"' || text[pos] == '\'') {
+            quote = text[pos];
+        } else if (text[pos] == '>') {
+            return pos;
+        }
+    }
+    return std::string::npos;
+}
+
+// Whether a chunk may end at `pos` in `html`.
+bool isBoundary(std::string const &html, std::size_t pos) {
+    if (pos == 0 || pos == html.size())
+        return true;
+
+    if (html[pos] == '<' && html[pos + 1] != '/' && contains(kBlockElements, tagName(html, pos + 1)))
+        return true;
+
+    std::size_t close = html.rfind("</", pos - 1);
+    return close != std::string::npos
+        && tagEnd(html, close) == pos - 1
+        && contains(kBlockElements, tagName(html, close + 2));
+}
+
+// Whether every element opened in `chunk` is closed in it too, and the other
+// way around. Elements without a closing tag aren't, so this is only for
+// documents that have them all.
+bool isBalanced(std::string const &chunk, std::string &error) {
+    std::vector<std::string> open;
+    for (std::size_t pos = chunk.find('<'); pos != std::string::npos; pos = chunk.find('<', pos)) {
+        if (chunk.compare(pos, 4, "<!--") == 0) {
+            pos = chunk.find("-->", pos);
+            if (pos == std::string::npos)
+                return error = "unterminated comment", false;
+            continue;
+        }
+
+        bool closing = chunk.compare(pos, 2, "</") == 0;
+        std::string name = tagName(chunk, pos + (closing ? 2 : 1));
+        std::size_t end = tagEnd(chunk, pos);
+        if (name.empty() || end == std::string::npos) {
+            ++pos;
+            continue;
+        }
+
+        if (closing) {
+            if (open.empty() || open.back() != name)
+                return error = "</" + name + "> closes " + (open.empty() ? "nothing" : "<" + open.back() + ">"), false;
+            open.pop_back();
+        } else if (contains(kRawTextElements, name)) {
+            end = chunk.find('>', chunk.find("</" + name, end));
+            if (end == std::string::npos)
+                return error = "unterminated <" + name + ">", false;
+        } else if (chunk[end - 1] != '/' && !contains(kVoidElements, name)) {
+            open.push_back(name);
+        }
+        pos = end + 1;
+    }
+
+    if (!open.empty())
+        return error = "<" + open.back() + "> is never closed", false;
+    return true;
+}
+
+// Chunks `html` with `wordBudget` words per chunk, using each chunk as its own
+// translation, and checks that there are `expectedChunks` of them, that they
+// end where they may, and that putting them together again gives `html`.
+// With `wellFormed`, each chunk has to be balanced as well.
+void roundTrip(const char *name, std::string const &html, std::size_t wordBudget, std::size_t expectedChunks, bool wellFormed) {
+    QTemporaryFile file;
+    if (!file.open() || file.write(html.data(), html.size()) != static_cast<qint64>(html.size()) || !file.seek(0))
+        return fail(name, "could not write the input");
+
+    ChunkReader reader(file);
+    HtmlChunker chunker(reader);
+
+    std::string chunk, output;
+    std::size_t chunks = 0;
+    while (chunker.next(chunk, wordBudget)) {
+        ++chunks;
+
+        if (chunker.openedTags() > kMaxDepth)
+            return fail(name, "chunk reopens " + std::to_string(chunker.openedTags()) + " tags: " + chunk);
+
+        std::string error;
+        if (wellFormed && !isBalanced(chunk, error))
+            return fail(name, "chunk isn't balanced, " + error + ": " + chunk);
+
+        HtmlChunker::strip(chunk, chunker.openedTags(), chunker.closedTags());
+        output += chunk;
+
+        if (html.compare(0, output.size(), output) != 0)
+            return fail(name, "expected chunks of\n" + html + "got\n" + output);
+
+        if (!isBoundary(html, output.size()))
+            return fail(name, "chunk ends in the middle of a block: " + chunk);
+    }
+
+    if (output != html)
+        fail(name, "expected\n" + html + "got\n" + output);
+
+    if (chunks != expectedChunks)
+        fail(name, "expected " + std::to_string(expectedChunks) + " chunks, got " + std::to_string(chunks));
+}
+
+} // Anonymous namespace
+
+int main() {
+    roundTrip("nested",
+        "<html><body><div class=\"a>b\"><p>one two three</p>\n"
+        "<p>four <b>five</b> six</p>\n"
+        "<script>if (a<b) x='</p>';</script>\n"
+        "<ul><li>seven eight</li><li>nine ten</li></ul>\n"
+        "</div></body></html>\n", 3, 4, true);
+
+    // All of it fits, so there's nothing to split.
+    roundTrip("within budget",
+        "<p>one <i>two</i></p><p>three<br>four</p>\n", 100, 1, true);
+
+    // A block without a boundary inside it stays one chunk, however long. The
+    // line break after it is the rest of the document.
+    roundTrip("one long block",
+        "<p>one two three <b>four five</b> six seven eight nine ten</p>\n", 2, 2, true);
+
+    // A <p> closes the one before it, so they mustn't pile up.
+    roundTrip("paragraphs without end tags",
+        "<p>one two\n<p>three four\n<p>five six\n<p>seven\n", 2, 4, false);
+
+    roundTrip("lists and tables without end tags",
+        "<ul><li>one two\n<li>three four\n<li>five <b>six\n</ul>\n"
+        "<table><tr><td>seven eight\n<td>nine ten\n<tr><td>eleven\n</table>\n", 2, 6, false);
+
+    roundTrip("definition lists without end tags",
+        "<dl><dt>one\n<dd>two three\n<dt>four\n</dl><p>five<div>six seven</div>\n", 1, 6, false);
+
+    if (failures == 0)
+        std::printf("All tests passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -9,6 +9,8 @@ struct marianSettings {
     size_t cpu_threads;
     size_t workspace;
     bool translation_cache;
+    size_t translation_cache_size; // Number of entries
+    size_t mini_batch_words;
 };
 
 struct Repository {
@@ -36,3 +38,5 @@ struct Repository {
 };
 
 } // namespace translateLocally
+
+Q_DECLARE_METATYPE(translateLocally::marianSettings)